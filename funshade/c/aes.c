@@ -1,6 +1,20 @@
 #include "aes.h"
 
 const uint8_t iv_aes_128[AES_BLOCKLEN]  = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+// Expanded round keys of iv_aes_128, the fixed key of the first block of G.
+//  Precomputed so that G only expands the (seed-dependent) chained keys.
+static const uint8_t iv_aes_128_key_schedule[176] = {
+  0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+  0xa0, 0xfa, 0xfe, 0x17, 0x88, 0x54, 0x2c, 0xb1, 0x23, 0xa3, 0x39, 0x39, 0x2a, 0x6c, 0x76, 0x05,
+  0xf2, 0xc2, 0x95, 0xf2, 0x7a, 0x96, 0xb9, 0x43, 0x59, 0x35, 0x80, 0x7a, 0x73, 0x59, 0xf6, 0x7f,
+  0x3d, 0x80, 0x47, 0x7d, 0x47, 0x16, 0xfe, 0x3e, 0x1e, 0x23, 0x7e, 0x44, 0x6d, 0x7a, 0x88, 0x3b,
+  0xef, 0x44, 0xa5, 0x41, 0xa8, 0x52, 0x5b, 0x7f, 0xb6, 0x71, 0x25, 0x3b, 0xdb, 0x0b, 0xad, 0x00,
+  0xd4, 0xd1, 0xc6, 0xf8, 0x7c, 0x83, 0x9d, 0x87, 0xca, 0xf2, 0xb8, 0xbc, 0x11, 0xf9, 0x15, 0xbc,
+  0x6d, 0x88, 0xa3, 0x7a, 0x11, 0x0b, 0x3e, 0xfd, 0xdb, 0xf9, 0x86, 0x41, 0xca, 0x00, 0x93, 0xfd,
+  0x4e, 0x54, 0xf7, 0x0e, 0x5f, 0x5f, 0xc9, 0xf3, 0x84, 0xa6, 0x4f, 0xb2, 0x4e, 0xa6, 0xdc, 0x4f,
+  0xea, 0xd2, 0x73, 0x21, 0xb5, 0x8d, 0xba, 0xd2, 0x31, 0x2b, 0xf5, 0x60, 0x7f, 0x8d, 0x29, 0x2f,
+  0xac, 0x77, 0x66, 0xf3, 0x19, 0xfa, 0xdc, 0x21, 0x28, 0xd1, 0x29, 0x41, 0x57, 0x5c, 0x00, 0x6e,
+  0xd0, 0x14, 0xf9, 0xa8, 0xc9, 0xee, 0x25, 0x89, 0xe1, 0x3f, 0x0c, 0xc8, 0xb6, 0x63, 0x0c, 0xa6};
 
 //----------------------------------------------------------------------------//
 //--------------------------- PRIVATE - AES_TINY -----------------------------//
@@ -150,12 +164,19 @@ static void aes128_tiny_enc_ecb(const uint8_t *enc_key, const uint8_t *plainText
   AES_init_ctx(&ctx, enc_key);
   Cipher((state_t*)cipherText, ctx.RoundKey);}
 
+// Miyaguchi–Preneel with the fixed IV key, using its precomputed schedule
+static void MP_owf_aes128_tiny_iv(const uint8_t msg_in[AES_BLOCKLEN], uint8_t msg_out[AES_BLOCKLEN]){
+  size_t j;
+  memcpy(msg_out, msg_in, AES_BLOCKLEN);
+  Cipher((state_t*)msg_out, iv_aes_128_key_schedule);
+  for (j = 0; j < AES_BLOCKLEN; j++) {msg_out[j] ^= iv_aes_128[j] ^ msg_in[j];}}
+
 
 //----------------------------------------------------------------------------//
 //---------------------------- PRIVATE AES_NI --------------------------------//
 //----------------------------------------------------------------------------//
-#ifdef __AES__
-static __m128i aes_128_key_expansion(__m128i key, __m128i keygened){
+#ifdef AES_NI
+AES_NI_TARGET static __m128i aes_128_key_expansion(__m128i key, __m128i keygened){
     keygened = _mm_shuffle_epi32(keygened, _MM_SHUFFLE(3,3,3,3));
     key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
     key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
@@ -163,7 +184,7 @@ static __m128i aes_128_key_expansion(__m128i key, __m128i keygened){
     return _mm_xor_si128(key, keygened);
 }
 
-static void aes128_gen_key_schedule(const uint8_t *enc_key, __m128i *key_schedule){
+AES_NI_TARGET static void aes128_gen_key_schedule(const uint8_t *enc_key, __m128i *key_schedule){
     key_schedule[0] = _mm_loadu_si128((const __m128i*) enc_key);
     key_schedule[1]  = AES_128_key_exp(key_schedule[0], 0x01);
     key_schedule[2]  = AES_128_key_exp(key_schedule[1], 0x02);
@@ -177,7 +198,7 @@ static void aes128_gen_key_schedule(const uint8_t *enc_key, __m128i *key_schedul
     key_schedule[10] = AES_128_key_exp(key_schedule[9], 0x36);
 }
 
-static void aes128_enc(__m128i *key_schedule, const uint8_t *plainText,uint8_t *cipherText){
+AES_NI_TARGET static void aes128_enc(__m128i *key_schedule, const uint8_t *plainText,uint8_t *cipherText){
     __m128i m = _mm_loadu_si128((__m128i *) plainText);
     // DO_ENC_BLOCK(m,key_schedule);
     m = _mm_xor_si128       (m, key_schedule[ 0]);  m = _mm_aesenc_si128    (m, key_schedule[ 1]);
@@ -189,11 +210,24 @@ static void aes128_enc(__m128i *key_schedule, const uint8_t *plainText,uint8_t *
     _mm_storeu_si128((__m128i *) cipherText, m);
 }
 
-static void aes128_ni_enc_ecb(const uint8_t *enc_key, const uint8_t *plainText,uint8_t *cipherText){
+AES_NI_TARGET static void aes128_ni_enc_ecb(const uint8_t *enc_key, const uint8_t *plainText,uint8_t *cipherText){
     __m128i key_schedule[11];
     aes128_gen_key_schedule(enc_key, key_schedule);
     aes128_enc(key_schedule, plainText, cipherText);
 }
+
+// Miyaguchi–Preneel with the fixed IV key, using its precomputed schedule
+AES_NI_TARGET static void MP_owf_aes128_ni_iv(const uint8_t msg_in[AES_BLOCKLEN], uint8_t msg_out[AES_BLOCKLEN]){
+    __m128i key_schedule[11], m;
+    size_t r;
+    for (r = 0; r < 11; r++){
+        key_schedule[r] = _mm_loadu_si128((const __m128i*) &iv_aes_128_key_schedule[r*AES_BLOCKLEN]);
+    }
+    aes128_enc(key_schedule, msg_in, msg_out);
+    m = _mm_xor_si128(_mm_loadu_si128((const __m128i*) msg_out), key_schedule[0]);
+    m = _mm_xor_si128(m, _mm_loadu_si128((const __m128i*) msg_in));
+    _mm_storeu_si128((__m128i*) msg_out, m);
+}
 #endif
 
 //----------------------------------------------------------------------------//
@@ -210,8 +244,8 @@ void MP_owf_aes128_tiny(
         msg_out[j] = key_in[j] ^ msg_in[j] ^ msg_out[j];
     }
 }
-#ifdef __AES__
-void MP_owf_aes128_ni(
+#ifdef AES_NI
+AES_NI_TARGET void MP_owf_aes128_ni(
   const uint8_t key_in[AES_BLOCKLEN],
   const uint8_t msg_in[AES_BLOCKLEN],
   uint8_t msg_out[AES_BLOCKLEN])
@@ -228,26 +262,114 @@ void MP_owf_aes128_ni(
 void G_tiny(const uint8_t buffer_in[], uint8_t buffer_out[],
            size_t buffer_in_size, size_t buffer_out_size){
     size_t i;
+    (void)buffer_in_size;   // only checked by the assert
     assertm(buffer_in_size==AES_BLOCKLEN, "buffer_in must be of 16 bytes (128 bits)");
     assertm(buffer_out_size%AES_BLOCKLEN==0, "buffer_out must be a multiple of 16 bytes");
     // Process first block with IV as key
-    MP_owf_aes128_tiny(iv_aes_128, buffer_in, buffer_out);
+    MP_owf_aes128_tiny_iv(buffer_in, buffer_out);
     // Process remaining blocks, using previous block as key
     for (i = AES_BLOCKLEN; i < buffer_out_size; i+=AES_BLOCKLEN){
         MP_owf_aes128_tiny(&buffer_out[i-AES_BLOCKLEN],buffer_in,&buffer_out[i]);
     }
 }
-#ifdef __AES__
-void G_ni(const uint8_t buffer_in[], uint8_t buffer_out[],
+#ifdef AES_NI
+AES_NI_TARGET void G_ni(const uint8_t buffer_in[], uint8_t buffer_out[],
            size_t buffer_in_size, size_t buffer_out_size){
     size_t i;
+    (void)buffer_in_size;   // only checked by the assert
     assertm(buffer_in_size==AES_BLOCKLEN, "buffer_in must be of 16 bytes (128 bits)");
     assertm(buffer_out_size%AES_BLOCKLEN==0, "buffer_out must be a multiple of 16 bytes");
     // Process first block with IV as key
-    MP_owf_aes128_ni(iv_aes_128, buffer_in, buffer_out);
+    MP_owf_aes128_ni_iv(buffer_in, buffer_out);
     // Process remaining blocks, using previous block as key
     for (i = AES_BLOCKLEN; i < buffer_out_size; i+=AES_BLOCKLEN){
         MP_owf_aes128_ni(&buffer_out[i-AES_BLOCKLEN], buffer_in, &buffer_out[i]);
     }
 }
-#endif
\ No newline at end of file
+#endif
+
+void G_side_tiny(const uint8_t buffer_in[AES_BLOCKLEN], int side, uint8_t buffer_out[G_SIDE_LEN]){
+    uint8_t m[AES_BLOCKLEN];
+    size_t j;
+    memcpy(m, buffer_in, AES_BLOCKLEN);
+    for (j = 0; j < G_SIDE_LEN/AES_BLOCKLEN; j++){
+        m[0] = buffer_in[0] ^ (uint8_t)(2*side + j);        // Counter block
+        MP_owf_aes128_tiny_iv(m, &buffer_out[j*AES_BLOCKLEN]);
+    }
+}
+#ifdef AES_NI
+AES_NI_TARGET void G_side_ni(const uint8_t buffer_in[AES_BLOCKLEN], int side, uint8_t buffer_out[G_SIDE_LEN]){
+    __m128i key_schedule[11], s, m0, m1, c0, c1;
+    size_t r;
+    for (r = 0; r < 11; r++){
+        key_schedule[r] = _mm_loadu_si128((const __m128i*) &iv_aes_128_key_schedule[r*AES_BLOCKLEN]);
+    }
+    s  = _mm_loadu_si128((const __m128i*) buffer_in);
+    m0 = _mm_xor_si128(s, _mm_cvtsi32_si128(2*side));        // Counter blocks
+    m1 = _mm_xor_si128(s, _mm_cvtsi32_si128(2*side + 1));
+    // Both blocks interleaved, to overlap the latency of aesenc
+    c0 = _mm_xor_si128(m0, key_schedule[0]);    c1 = _mm_xor_si128(m1, key_schedule[0]);
+    for (r = 1; r < 10; r++){
+        c0 = _mm_aesenc_si128(c0, key_schedule[r]); c1 = _mm_aesenc_si128(c1, key_schedule[r]);
+    }
+    c0 = _mm_aesenclast_si128(c0, key_schedule[10]);    c1 = _mm_aesenclast_si128(c1, key_schedule[10]);
+    c0 = _mm_xor_si128(_mm_xor_si128(c0, key_schedule[0]), m0);
+    c1 = _mm_xor_si128(_mm_xor_si128(c1, key_schedule[0]), m1);
+    _mm_storeu_si128((__m128i*) buffer_out, c0);
+    _mm_storeu_si128((__m128i*) &buffer_out[AES_BLOCKLEN], c1);
+}
+#endif
+
+void G_ctr_tiny(size_t n, size_t n_ctr, const uint8_t buffer_in[], const uint32_t ctr[], uint8_t buffer_out[]){
+    uint8_t m[AES_BLOCKLEN];
+    size_t i, j;
+    for (i = 0; i < n*n_ctr; i++){
+        memcpy(m, &buffer_in[(i/n_ctr)*AES_BLOCKLEN], AES_BLOCKLEN);
+        for (j = 0; j < 4; j++){
+            m[j] ^= (uint8_t)(ctr[i] >> (8*j));                 // Counter block
+        }
+        MP_owf_aes128_tiny_iv(m, &buffer_out[i*AES_BLOCKLEN]);
+    }
+}
+#ifdef AES_NI
+#define G_CTR_WAYS 8    // Blocks in flight
+AES_NI_TARGET void G_ctr_ni(size_t n, size_t n_ctr, const uint8_t buffer_in[], const uint32_t ctr[], uint8_t buffer_out[]){
+    __m128i key_schedule[11], m[G_CTR_WAYS], c[G_CTR_WAYS], s;
+    size_t r, i, j, w, n_blk = n*n_ctr, seed = 0, used = 0;
+    for (r = 0; r < 11; r++){
+        key_schedule[r] = _mm_loadu_si128((const __m128i*) &iv_aes_128_key_schedule[r*AES_BLOCKLEN]);
+    }
+    s = _mm_loadu_si128((const __m128i*) buffer_in);
+    for (i = 0; i < n_blk; i += w){
+        w = (n_blk - i < G_CTR_WAYS) ? n_blk - i : G_CTR_WAYS;
+        for (j = 0; j < w; j++){
+            if (used == n_ctr){                                 // Next seed
+                s = _mm_loadu_si128((const __m128i*) &buffer_in[(++seed)*AES_BLOCKLEN]);
+                used = 0;
+            }
+            used++;
+            m[j] = _mm_xor_si128(s, _mm_cvtsi32_si128((int)ctr[i+j]));
+            c[j] = _mm_xor_si128(m[j], key_schedule[0]);
+        }
+        for (r = 1; r < 10; r++){
+            for (j = 0; j < w; j++)     c[j] = _mm_aesenc_si128(c[j], key_schedule[r]);
+        }
+        for (j = 0; j < w; j++){
+            c[j] = _mm_aesenclast_si128(c[j], key_schedule[10]);
+            c[j] = _mm_xor_si128(_mm_xor_si128(c[j], key_schedule[0]), m[j]);
+            _mm_storeu_si128((__m128i*) &buffer_out[(i+j)*AES_BLOCKLEN], c[j]);
+        }
+    }
+}
+#endif
+
+int aes_ni_available(void){
+#if defined(__AES__)
+    return 1;
+#elif defined(AES_NI)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") != 0;
+#else
+    return 0;
+#endif
+}
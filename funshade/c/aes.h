@@ -5,13 +5,18 @@
 //  - MP_owf_aes128_ni: Miyaguchi–Preneel one-way function with AES-NI.
 //  - G_tiny: G hash function with AES-128 standalone.
 //  - G_ni: G hash function with AES-128 (AES-NI).
+//  - G_side_tiny/G_side_ni: one side of a counter-style PRG, standalone/AES-NI.
+//  - G_ctr_tiny/G_ctr_ni: independent blocks of the same PRG, standalone/AES-NI.
 // 
 // Author: Alberto Ibarrondo
 //
 // AES-Tiny based on https://github.com/kokke/tiny-AES-c/blob/master/aes.h
 // AES-NI Adapted from: https://github.com/sebastien-riou/aes-brute-force/blob/master/include/aes_ni.h
 // If we ever need AES-NI 256 --> https://github.com/stong/bruteforce/blob/master/aes256_ecb.cpp
-// Compile using gcc and following arguments: -O3;-msse2;-msse;-march=native;-maes
+// Compile using gcc and following arguments: -O3;-msse2;-msse
+//  AES-NI is compiled in with -maes (required by the binary), or on x86 with
+//  GCC/Clang through target attributes, without -maes: the same binary then
+//  runs anywhere and aes_ni_available() tells whether the CPU has it.
 
 #ifndef __AES_H__
 #define __AES_H__
@@ -22,12 +27,19 @@
 #include <string.h>     //for memcmp
 #include <assert.h>     //for assert
 
-#ifdef __AES__
+#if defined(__AES__) || ((defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__))
+#define AES_NI                  // AES-NI code compiled in
 #include <wmmintrin.h>  //for intrinsics for AES-NI
 #endif
+#ifdef __AES__
+#define AES_NI_TARGET
+#else
+#define AES_NI_TARGET __attribute__((target("sse2,aes")))
+#endif
 
 // DEFINES
 #define AES_BLOCKLEN 16         //  The NI version is fixed at 128 bit keys
+#define G_SIDE_LEN (2*AES_BLOCKLEN)  //  Output of one side of G_side
 #define assertm(exp, msg) assert(((void)msg, exp))      // Assert with message
 //  -Tiny-
 #define AES_keyExpSize 176
@@ -37,6 +49,10 @@
 //  -NI-
 #define AES_128_key_exp(k, rcon) aes_128_key_expansion(k, _mm_aeskeygenassist_si128(k, rcon))
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 //----------------------------------------------------------------------------//
 //--------------------------------- PUBLIC -----------------------------------//
 //----------------------------------------------------------------------------//
@@ -50,7 +66,7 @@
 void MP_owf_aes128_tiny(const uint8_t key_in[AES_BLOCKLEN], 
                         const uint8_t msg_in[AES_BLOCKLEN],
                         uint8_t msg_out[AES_BLOCKLEN]);
-#ifdef __AES__
+#ifdef AES_NI
 void MP_owf_aes128_ni(const uint8_t key_in[AES_BLOCKLEN],
                       const uint8_t msg_in[AES_BLOCKLEN],
                       uint8_t msg_out[AES_BLOCKLEN]);
@@ -64,9 +80,42 @@ void MP_owf_aes128_ni(const uint8_t key_in[AES_BLOCKLEN],
 */
 void G_tiny(const uint8_t buffer_in[],   uint8_t buffer_out[],
                    size_t buffer_in_size, size_t buffer_out_size);
-#ifdef __AES__
+#ifdef AES_NI
 void G_ni(const uint8_t buffer_in[],   uint8_t buffer_out[],
                  size_t buffer_in_size, size_t buffer_out_size);
 #endif // AES-NI
 
+/*  G_side: one side (0: left, 1: right) of a counter-style PRG over the fixed
+       IV key: block j is MP(iv, s ^ c) with the counter block c = 2*side+j in
+       its first byte. Each side is computed on its own, so a tree evaluator
+       only pays for the branch it follows, and no key schedule is expanded.
+    Input:  buffer_in  (16 bytes), side (0 or 1)
+    Output: buffer_out (G_SIDE_LEN bytes)
+*/
+void G_side_tiny(const uint8_t buffer_in[AES_BLOCKLEN], int side, uint8_t buffer_out[G_SIDE_LEN]);
+#ifdef AES_NI
+void G_side_ni(const uint8_t buffer_in[AES_BLOCKLEN], int side, uint8_t buffer_out[G_SIDE_LEN]);
+#endif // AES-NI
+
+/*  G_ctr: blocks of the PRG of G_side for n seeds and n_ctr counters per seed:
+       block i*n_ctr+c is MP(iv, s_i ^ ctr[i*n_ctr+c]) with the 32-bit counter
+       in the first bytes, little endian (G_side(s, side) is G_ctr on s with
+       counters 2*side and 2*side+1). Blocks of several tree paths go in one
+       call, which AES-NI pipelines.
+    Input:  buffer_in  (n*16 bytes), ctr (n*n_ctr counters)
+    Output: buffer_out (n*n_ctr*16 bytes)
+*/
+void G_ctr_tiny(size_t n, size_t n_ctr, const uint8_t buffer_in[], const uint32_t ctr[], uint8_t buffer_out[]);
+#ifdef AES_NI
+void G_ctr_ni(size_t n, size_t n_ctr, const uint8_t buffer_in[], const uint32_t ctr[], uint8_t buffer_out[]);
+#endif // AES-NI
+
+/*  aes_ni_available: 1 if the _ni functions are compiled in and the CPU runs
+       them (always 1 with -maes), 0 otherwise.
+*/
+int aes_ni_available(void);
+
+#ifdef __cplusplus
+}
+#endif
 #endif // __AES_H__
\ No newline at end of file
@@ -0,0 +1,164 @@
+#include "dealer.h"
+#include "fd_io.h"
+
+#ifdef FUNSHADE_HAS_DEALER
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+#define DEAL_MAGIC      0x4C445346u     // "FSDL"
+#define DEAL_VERSION    1
+#define DEAL_PARTY0     0
+#define DEAL_PARTY1     1
+#define DEAL_CHAIN      2
+
+typedef struct {
+    uint32_t magic;     // DEAL_MAGIC
+    uint32_t version;   // DEAL_VERSION
+    uint32_t kind;      // DEAL_PARTY0, DEAL_PARTY1 or DEAL_CHAIN
+    uint32_t cw_inline; // party streams: 1 if the chain follows each record
+    uint64_t K;         // number of elements
+    uint64_t l;         // vector length
+    uint64_t chunk;     // elements per chunk
+    uint64_t key_len;   // KEY_LEN of the dealer's build
+} deal_hdr_t;
+
+// 0 once all len bytes are read, -1 on error or EOF
+static int read_full(int fd, void *buf, size_t len){
+    return fd_read_full(fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+static int write_hdr(int fd, uint32_t kind, bool cw_inline, size_t K, size_t l, size_t chunk){
+    deal_hdr_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = DEAL_MAGIC;   h.version = DEAL_VERSION;   h.kind = kind;  h.cw_inline = cw_inline;
+    h.K = K;    h.l = l;    h.chunk = chunk;    h.key_len = KEY_LEN;
+    return fd_write_full(fd, &h, sizeof(h));
+}
+static int read_hdr(int fd, deal_hdr_t *h){
+    if (read_full(fd, h, sizeof(*h)))                       return -1;
+    if (h->magic != DEAL_MAGIC || h->version != DEAL_VERSION || h->key_len != KEY_LEN ||
+        h->chunk == 0)                                      return -1;
+    return 0;
+}
+
+// Record of party j for n elements of a chunk, s_j and z_j packed into sz
+static int write_party(int fd, size_t n, size_t l, const R_t r_in_j[], const R_t d_xj[],
+    const R_t d_yj[], const R_t d_xyj[], const uint8_t k_j[], uint8_t sz[], const uint8_t cw[]){
+    size_t c;
+    for (c=0; c<n; c++)
+    {
+        memcpy(&sz[c*S_LEN], &k_j[c*KEY_LEN + S_PTR], S_LEN);
+        memcpy(&sz[n*S_LEN + c*V_LEN], &k_j[c*KEY_LEN + Z_PTR], V_LEN);
+    }
+    if (fd_write_full(fd, r_in_j, n*sizeof(R_t)))       return -1;
+    if (fd_write_full(fd, d_xj, n*l*sizeof(R_t)))       return -1;
+    if (fd_write_full(fd, d_yj, n*l*sizeof(R_t)))       return -1;
+    if (fd_write_full(fd, d_xyj, n*l*sizeof(R_t)))      return -1;
+    if (fd_write_full(fd, sz, n*(S_LEN+V_LEN)))         return -1;
+    if (cw && fd_write_full(fd, cw, n*CW_CHAIN_LEN))    return -1;
+    return 0;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+int funshade_deal_stream(size_t K, size_t l, R_t theta, size_t chunk, int fd0, int fd1, int fd_cw){
+    size_t v_size, k0, n, c;
+    R_t *d_x0, *d_x1, *d_y0, *d_y1, *d_xy0, *d_xy1, *r_in_0, *r_in_1;
+    uint8_t *key0, *key1, *cw, *sz;
+    bool cw_inline = (fd_cw < 0);
+    int rc = 0;
+
+    if (chunk == 0)     chunk = DEAL_DEFAULT_CHUNK;
+    if (chunk > K)      chunk = K ? K : 1;
+    v_size = chunk*l;
+    d_x0  = (R_t*)malloc(v_size*sizeof(R_t));   d_x1  = (R_t*)malloc(v_size*sizeof(R_t));
+    d_y0  = (R_t*)malloc(v_size*sizeof(R_t));   d_y1  = (R_t*)malloc(v_size*sizeof(R_t));
+    d_xy0 = (R_t*)malloc(v_size*sizeof(R_t));   d_xy1 = (R_t*)malloc(v_size*sizeof(R_t));
+    r_in_0= (R_t*)malloc(chunk*sizeof(R_t));    r_in_1= (R_t*)malloc(chunk*sizeof(R_t));
+    key0  = (uint8_t*)malloc(chunk*KEY_LEN);    key1  = (uint8_t*)malloc(chunk*KEY_LEN);
+    cw    = (uint8_t*)malloc(chunk*CW_CHAIN_LEN);
+    sz    = (uint8_t*)malloc(chunk*(S_LEN+V_LEN));
+    if (!d_x0 || !d_x1 || !d_y0 || !d_y1 || !d_xy0 || !d_xy1 || !r_in_0 || !r_in_1 ||
+        !key0 || !key1 || !cw || !sz)
+    {
+        rc = -1;    goto end;
+    }
+
+    if (write_hdr(fd0, DEAL_PARTY0, cw_inline, K, l, chunk) ||
+        write_hdr(fd1, DEAL_PARTY1, cw_inline, K, l, chunk) ||
+        (!cw_inline && write_hdr(fd_cw, DEAL_CHAIN, 0, K, l, chunk)))
+    {
+        rc = -1;    goto end;
+    }
+    for (k0=0; k0<K; k0+=chunk)
+    {
+        n = (K-k0 < chunk) ? K-k0 : chunk;
+        funshade_setup_batch(n, l, theta, d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in_0, r_in_1, key0, key1);
+        // Same chain in both keys: serialized once
+        for (c=0; c<n; c++)
+        {
+            memcpy(&cw[c*CW_CHAIN_LEN], &key0[c*KEY_LEN + CW_CHAIN_PTR], CW_CHAIN_LEN);
+        }
+        if (write_party(fd0, n, l, r_in_0, d_x0, d_y0, d_xy0, key0, sz, cw_inline ? cw : NULL) ||
+            write_party(fd1, n, l, r_in_1, d_x1, d_y1, d_xy1, key1, sz, cw_inline ? cw : NULL) ||
+            (!cw_inline && fd_write_full(fd_cw, cw, n*CW_CHAIN_LEN)))
+        {
+            rc = -1;    break;
+        }
+    }
+end:
+    free(d_x0); free(d_x1); free(d_y0); free(d_y1); free(d_xy0); free(d_xy1);
+    free(r_in_0); free(r_in_1); free(key0); free(key1); free(cw); free(sz);
+    return rc;
+}
+
+int funshade_deal_open(funshade_deal_reader *rd, int fd, int fd_cw){
+    deal_hdr_t h, hc;
+    rd->buf = NULL;
+    if (read_hdr(fd, &h) || h.kind > DEAL_PARTY1)       return -1;
+    rd->fd = fd;    rd->j = (h.kind == DEAL_PARTY1);
+    rd->K = h.K;    rd->l = h.l;    rd->chunk = h.chunk;    rd->done = 0;
+    rd->fd_cw = h.cw_inline ? -1 : fd_cw;
+    if (!h.cw_inline)
+    {
+        if (fd_cw < 0 || read_hdr(fd_cw, &hc))          return -1;
+        if (hc.kind != DEAL_CHAIN || hc.K != h.K || hc.chunk != h.chunk)   return -1;
+    }
+    rd->buf = (uint8_t*)malloc(rd->chunk*KEY_LEN);
+    return rd->buf ? 0 : -1;
+}
+
+int funshade_deal_read(funshade_deal_reader *rd, size_t *n,
+    R_t r_in_j[], R_t d_xj[], R_t d_yj[], R_t d_xyj[], uint8_t k_j[]){
+    size_t c, m = (rd->K - rd->done < rd->chunk) ? rd->K - rd->done : rd->chunk;
+    int cw_fd = (rd->fd_cw < 0) ? rd->fd : rd->fd_cw;
+    uint8_t *sz = rd->buf, *cw = rd->buf + m*(S_LEN+V_LEN);
+
+    *n = 0;
+    if (m == 0)     return 0;
+    if (read_full(rd->fd, r_in_j, m*sizeof(R_t)) || read_full(rd->fd, d_xj, m*rd->l*sizeof(R_t)) ||
+        read_full(rd->fd, d_yj, m*rd->l*sizeof(R_t)) || read_full(rd->fd, d_xyj, m*rd->l*sizeof(R_t)) ||
+        read_full(rd->fd, sz, m*(S_LEN+V_LEN)) || read_full(cw_fd, cw, m*CW_CHAIN_LEN))
+    {
+        return -1;
+    }
+    // Rebuild the keys: s_j | chain | z_j
+    for (c=0; c<m; c++)
+    {
+        memcpy(&k_j[c*KEY_LEN + S_PTR], &sz[c*S_LEN], S_LEN);
+        memcpy(&k_j[c*KEY_LEN + CW_CHAIN_PTR], &cw[c*CW_CHAIN_LEN], CW_CHAIN_LEN);
+        memcpy(&k_j[c*KEY_LEN + Z_PTR], &sz[m*S_LEN + c*V_LEN], V_LEN);
+    }
+    rd->done += m;
+    *n = m;
+    return 0;
+}
+
+void funshade_deal_close(funshade_deal_reader *rd){
+    free(rd->buf);
+    rd->buf = NULL;
+}
+
+#endif // FUNSHADE_HAS_DEALER
@@ -0,0 +1,71 @@
+// DEALER: Streaming generation of the offline material to the parties
+// -----------------------------------------------------------------------------
+// funshade_setup_batch fills K-sized arrays and two K*KEY_LEN key buffers, so
+//  the dealer holds every key of both parties before shipping them. The
+//  streaming dealer generates chunk elements at a time and writes them to one
+//  file descriptor (file, pipe or socket) per party, in constant memory.
+//
+// The correction-word chain of a key (CW_CHAIN_LEN bytes, all but the seed s
+//  and the value z) is the same in k0 and k1. It can go to a third sink, e.g.
+//  a file both parties read or a broadcast channel, in which case the party
+//  streams only carry the per-party records: r_in_j, the triple shares, s_j
+//  and z_j, i.e. S_LEN+V_LEN bytes of key per element instead of KEY_LEN.
+//  Otherwise (fd_cw < 0) each party stream carries its copy of the chain.
+//
+// Stream format, native endianness (dealer and parties run the same build):
+//  header | for each chunk of n <= chunk elements:
+//      party j: r_in_j[n] d_xj[n*l] d_yj[n*l] d_xyj[n*l] s_j[n*S_LEN] z_j[n] (cw[n*CW_CHAIN_LEN])
+//      chain:   cw[n*CW_CHAIN_LEN]
+//
+// POSIX only.
+
+#ifndef __DEALER_H__
+#define __DEALER_H__
+
+#include "fss.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FUNSHADE_HAS_DEALER
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+#define DEAL_DEFAULT_CHUNK  1024    // Elements per chunk
+
+/// @brief Reading end of a party stream (and of the chain stream, if separate).
+typedef struct {
+    int     fd;         // party stream
+    int     fd_cw;      // chain stream, -1 if the chain is inline
+    bool    j;          // party number (0 or 1)
+    size_t  K;          // number of elements in the stream
+    size_t  l;          // number of elements per vector
+    size_t  chunk;      // elements per chunk
+    size_t  done;       // elements read so far
+    uint8_t *buf;       // chunk*KEY_LEN bytes of staging for the key records
+} funshade_deal_reader;
+
+/// @brief Streaming funshade_setup_batch: generate the material of K elements
+///        in chunks and write party j's to fd_j. With fd_cw >= 0 the shared
+///        correction-word chains are written there once, and left out of the
+///        party streams. Memory use depends on chunk and l, not on K.
+/// @param[in] chunk    elements per chunk (0: DEAL_DEFAULT_CHUNK)
+/// @return 0 on success, -1 on allocation or I/O error
+int funshade_deal_stream(size_t K, size_t l, R_t theta, size_t chunk, int fd0, int fd1, int fd_cw);
+
+/// @brief Read the headers of a party stream and, if its chain is not inline,
+///        of the chain stream fd_cw (ignored otherwise).
+/// @return 0 on success, -1 on allocation or I/O error, bad header or missing chain stream
+int funshade_deal_open(funshade_deal_reader *rd, int fd, int fd_cw);
+
+/// @brief Read the next chunk into arrays sized for rd->chunk elements (or
+///        rd->chunk*l, rd->chunk*KEY_LEN), rebuilding the full keys k_j.
+/// @param[out] n   elements read, 0 once all K have been read
+/// @return 0 on success, -1 on I/O error or truncated stream
+int funshade_deal_read(funshade_deal_reader *rd, size_t *n,
+    R_t r_in_j[], R_t d_xj[], R_t d_yj[], R_t d_xyj[], uint8_t k_j[]);
+
+/// @brief Free the staging buffer of rd. The file descriptors stay open.
+void funshade_deal_close(funshade_deal_reader *rd);
+
+#endif // unix
+#endif // __DEALER_H__
@@ -0,0 +1,51 @@
+#define _DEFAULT_SOURCE         // send with -std=c90
+#include "fd_io.h"
+
+#ifdef FUNSHADE_HAS_FD_IO
+#include <errno.h>      // errno, EINTR, ENOTSOCK
+#include <unistd.h>     // read, write
+#include <sys/socket.h> // send
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+#ifdef MSG_NOSIGNAL
+    #define SEND_FLAGS MSG_NOSIGNAL     // a dead peer returns EPIPE, not SIGPIPE
+#else
+    #define SEND_FLAGS 0
+#endif
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+ssize_t fd_read_full(int fd, void *buf, size_t len){
+    size_t done = 0;
+    ssize_t n;
+    while (done < len)
+    {
+        n = read(fd, (uint8_t*)buf + done, len - done);
+        if (n < 0 && errno == EINTR)    continue;
+        if (n == 0 && done == 0)        return 0;
+        if (n <= 0)                     return -1;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+int fd_write_full(int fd, const void *buf, size_t len){
+    size_t done = 0;
+    ssize_t n;
+    bool sock = true;
+    while (done < len)
+    {
+        n = sock ? send(fd, (const uint8_t*)buf + done, len - done, SEND_FLAGS)
+                 : write(fd, (const uint8_t*)buf + done, len - done);
+        if (n < 0 && errno == ENOTSOCK && sock)     { sock = false;  continue; }
+        if (n < 0 && errno == EINTR)    continue;
+        if (n <= 0)                     return -1;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+#endif // FUNSHADE_HAS_FD_IO
@@ -0,0 +1,31 @@
+// FD_IO: Exact-length reads and writes on file descriptors
+// -----------------------------------------------------------------------------
+// Shared by the modules that stream arrays over sockets, pipes or files
+//  (shard.c, dealer.c). Internal: not part of the fss.h API.
+//
+// POSIX only.
+
+#ifndef __FD_IO_H__
+#define __FD_IO_H__
+
+#include "fss.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FUNSHADE_HAS_FD_IO
+
+#include <sys/types.h>  // ssize_t
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+/// @brief Read exactly len bytes, retrying on EINTR.
+/// @return len, 0 on EOF before any byte, -1 on error or EOF mid-buffer
+ssize_t fd_read_full(int fd, void *buf, size_t len);
+
+/// @brief Write exactly len bytes: send() without SIGPIPE on a socket (a dead
+///        peer returns -1), write() on anything else. Retries on EINTR.
+/// @return 0, or -1 on error
+int fd_write_full(int fd, const void *buf, size_t len);
+
+#endif // unix
+#endif // __FD_IO_H__
@@ -1,4 +1,122 @@
 #include "fss.h"
+#include "trace.h"
+#include <math.h>       // sqrt, exp, ldexp
+
+#define LM_CHUNK        64      // Keys evaluated in lock-step in level-major batches
+#define FLAT_ROWS       64      // Rows of a flat eval_dist block
+#define FLAT_MAX_L      64      // Largest l of the flat eval_dist kernel
+
+// Timing of the online stages (trace.h). t0 is 0 if tracing was off at the start.
+#define TRACE_BEGIN()           (funshade_trace_flags ? funshade_trace_now() : 0)
+#define TRACE_END(stage, t0) \
+    do { if (funshade_trace_flags && (t0)) funshade_trace_record(stage, t0, funshade_trace_now()); } while (0)
+// Same, for the calls logged with their sizes (FUNSHADE_TRACE_CALLS)
+#define TRACE_END_CALL(stage, t0, K, l) \
+    do { if (funshade_trace_flags && (t0)) funshade_trace_record_call(stage, K, l, t0, funshade_trace_now()); } while (0)
+
+// ------------------------------- TUNING ----------------------------------- //
+// PRGs of the DPF and DCF trees, and the one-way function of the keyed
+//  derivation. Both backends compute the same functions. Without -maes, AES-NI is switched on
+//  at load time if the CPU has it (funshade_cpu_dispatch).
+typedef void (*G_fn)(const uint8_t[], uint8_t[], size_t, size_t);
+typedef void (*G_side_fn)(const uint8_t[AES_BLOCKLEN], int, uint8_t[G_SIDE_LEN]);
+typedef void (*G_ctr_fn)(size_t, size_t, const uint8_t[], const uint32_t[], uint8_t[]);
+typedef void (*MP_fn)(const uint8_t[AES_BLOCKLEN], const uint8_t[AES_BLOCKLEN], uint8_t[AES_BLOCKLEN]);
+#ifdef __AES__
+static G_fn G_prg = G_ni;
+static G_side_fn G_side_prg = G_side_ni;
+static G_ctr_fn G_ctr_prg = G_ctr_ni;
+static MP_fn MP_prg = MP_owf_aes128_ni;
+static funshade_tuning tuning = {FUNSHADE_PRG_NI, 0, 0, 0, 0};
+#else
+static G_fn G_prg = G_tiny;
+static G_side_fn G_side_prg = G_side_tiny;
+static G_ctr_fn G_ctr_prg = G_ctr_tiny;
+static MP_fn MP_prg = MP_owf_aes128_tiny;
+static funshade_tuning tuning = {FUNSHADE_PRG_TINY, 0, 0, 0, 0};
+#endif
+
+// Kernels compiled for several ISA levels, the best one picked by the loader
+#if defined(__x86_64__) && defined(__ELF__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define DIST_CLONES             __attribute__((target_clones("avx512f", "avx2", "default")))
+#define DIST_CLONED
+#endif
+#endif
+#ifndef DIST_CLONES
+#define DIST_CLONES
+#endif
+
+#if defined(AES_NI) && !defined(__AES__)
+__attribute__((constructor)) static void funshade_cpu_dispatch(void){
+    if (aes_ni_available())
+    {
+        G_prg = G_ni;   G_side_prg = G_side_ni;     G_ctr_prg = G_ctr_ni;   MP_prg = MP_owf_aes128_ni;
+        tuning.prg = FUNSHADE_PRG_NI;
+    }
+}
+#endif
+
+const funshade_tuning *funshade_tuning_get(void){
+    return &tuning;
+}
+
+int funshade_tuning_set(const funshade_tuning *t){
+    if (t->prg == FUNSHADE_PRG_NI)
+    {
+#ifdef AES_NI
+        if (!aes_ni_available())    return -1;
+        G_prg = G_ni;   G_side_prg = G_side_ni;     G_ctr_prg = G_ctr_ni;   MP_prg = MP_owf_aes128_ni;
+#else
+        return -1;
+#endif
+    }
+    else
+    {
+        G_prg = G_tiny; G_side_prg = G_side_tiny;   G_ctr_prg = G_ctr_tiny; MP_prg = MP_owf_aes128_tiny;
+    }
+    tuning = *t;
+    return 0;
+}
+
+unsigned funshade_cpu_features(void){
+    unsigned f = aes_ni_available() ? FUNSHADE_CPU_AESNI : 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))     f |= FUNSHADE_CPU_AVX2;
+    if (__builtin_cpu_supports("avx512f"))  f |= FUNSHADE_CPU_AVX512F;
+#endif
+    return f;
+}
+
+const char *funshade_backend(void){
+    // Literals, not a formatted buffer, so concurrent callers never race
+    static const char *const names[2][3] = {
+        {"prg=tiny dist=default", "prg=tiny dist=avx2", "prg=tiny dist=avx512f"},
+        {"prg=ni dist=default",   "prg=ni dist=avx2",   "prg=ni dist=avx512f"}};
+    int dist = 0;
+#ifdef DIST_CLONED
+    unsigned f = funshade_cpu_features();
+    if (f & FUNSHADE_CPU_AVX512F)       dist = 2;               // Same order as the loader
+    else if (f & FUNSHADE_CPU_AVX2)     dist = 1;
+#elif defined(__AVX512F__)
+    dist = 2;
+#elif defined(__AVX2__)
+    dist = 1;
+#endif
+    return names[tuning.prg == FUNSHADE_PRG_NI][dist];
+}
+
+#if defined(_OPENMP)
+static int tune_threads(void){
+    return tuning.n_threads ? (int)tuning.n_threads : omp_get_max_threads();
+}
+// Static chunk of a loop of n iterations, at least 1
+static size_t tune_chunk(size_t n, size_t chunk, int n_threads){
+    if (chunk == 0)     chunk = (n + n_threads - 1) / n_threads;
+    return chunk ? chunk : 1;
+}
+#endif
 
 // ---------------------------- HELPER FUNCTIONS ---------------------------- //
 void xor(const uint8_t *a, const uint8_t *b, uint8_t *res, size_t s_len){
@@ -26,6 +144,54 @@ void xor_cond(const uint8_t *a, const uint8_t *b, uint8_t *res, size_t len, bool
     }
 }
 
+// Scatter/gather key k of a level-major batch of K keys to/from a single key
+static void key_scatter_lm(size_t K, size_t k, const uint8_t key[KEY_LEN], uint8_t k_lm[]){
+    size_t i;
+    memcpy(&k_lm[LM_S_PTR(K,k)], &key[S_PTR], S_LEN);
+    for (i = 0; i < N_BITS; i++)
+    {
+        memcpy(&k_lm[LM_S_CW_PTR(K,i,k)], &key[CW_CHAIN_PTR+S_CW_PTR(i)], S_LEN);
+        memcpy(&k_lm[LM_V_CW_PTR(K,i,k)], &key[CW_CHAIN_PTR+V_CW_PTR(i)], V_LEN);
+        k_lm[LM_T_CW_L_PTR(K,i,k)] = key[CW_CHAIN_PTR+T_CW_L_PTR(i)];
+        k_lm[LM_T_CW_R_PTR(K,i,k)] = key[CW_CHAIN_PTR+T_CW_R_PTR(i)];
+    }
+    memcpy(&k_lm[LM_LAST_CW_PTR(K,k)], &key[CW_CHAIN_PTR+LAST_CW_PTR], V_LEN);
+    memcpy(&k_lm[LM_Z_PTR(K,k)], &key[Z_PTR], V_LEN);
+}
+static void key_gather_lm(size_t K, size_t k, const uint8_t k_lm[], uint8_t key[KEY_LEN]){
+    size_t i;
+    memcpy(&key[S_PTR], &k_lm[LM_S_PTR(K,k)], S_LEN);
+    for (i = 0; i < N_BITS; i++)
+    {
+        memcpy(&key[CW_CHAIN_PTR+S_CW_PTR(i)], &k_lm[LM_S_CW_PTR(K,i,k)], S_LEN);
+        memcpy(&key[CW_CHAIN_PTR+V_CW_PTR(i)], &k_lm[LM_V_CW_PTR(K,i,k)], V_LEN);
+        key[CW_CHAIN_PTR+T_CW_L_PTR(i)] = k_lm[LM_T_CW_L_PTR(K,i,k)];
+        key[CW_CHAIN_PTR+T_CW_R_PTR(i)] = k_lm[LM_T_CW_R_PTR(K,i,k)];
+    }
+    memcpy(&key[CW_CHAIN_PTR+LAST_CW_PTR], &k_lm[LM_LAST_CW_PTR(K,k)], V_LEN);
+    memcpy(&key[Z_PTR], &k_lm[LM_Z_PTR(K,k)], V_LEN);
+}
+void FSS_keys_to_level_major(size_t K, const uint8_t k[], uint8_t k_lm[]){
+    size_t j;
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (j=0; j<K; j++)
+    {
+        key_scatter_lm(K, j, &k[j*KEY_LEN], k_lm);
+    }
+}
+void FSS_keys_from_level_major(size_t K, const uint8_t k_lm[], uint8_t k[]){
+    size_t j;
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (j=0; j<K; j++)
+    {
+        key_gather_lm(K, j, k_lm, &k[j*KEY_LEN]);
+    }
+}
+
 // -------------------------------------------------------------------------- //
 // --------------------------- RANDOMNESS SAMPLING -------------------------- //
 // -------------------------------------------------------------------------- //
@@ -106,31 +272,56 @@ R_t random_dtype(){
     return random_dtype_seeded(NULL);
 }
 
+// Block ctr of the stream (k, domain): MP-AES keyed by the master seed, on a
+//  little-endian [k | domain | ctr] block, so that it is the same on any host.
+void random_buffer_derived(uint8_t buffer[], size_t buffer_len, const uint8_t master[MASTER_SEED_LEN],
+    uint64_t k, uint32_t domain){
+    uint8_t msg[AES_BLOCKLEN], block[AES_BLOCKLEN];
+    uint32_t ctr = 0;
+    size_t i, n;
+    for (i = 0; i < 8; i++)     msg[i]   = (uint8_t)(k >> (8*i));
+    for (i = 0; i < 4; i++)     msg[8+i] = (uint8_t)(domain >> (8*i));
+    for (i = 0; i < buffer_len; i += AES_BLOCKLEN, ctr++)
+    {
+        msg[12] = (uint8_t)ctr;         msg[13] = (uint8_t)(ctr >> 8);
+        msg[14] = (uint8_t)(ctr >> 16); msg[15] = (uint8_t)(ctr >> 24);
+        MP_prg(master, msg, block);
+        n = (buffer_len - i < AES_BLOCKLEN) ? buffer_len - i : AES_BLOCKLEN;
+        memcpy(&buffer[i], block, n);
+    }
+}
+
 // -------------------------------------------------------------------------- //
 // ----------------- DISTRIBUTED COMPARISON FUNCTION (DCF) ------------------ //
 // -------------------------------------------------------------------------- //
-void DCF_gen_seeded(R_t alpha, uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN], uint8_t s0[S_LEN], uint8_t s1[S_LEN]){
-    // Inputs and outputs to G
-    uint8_t s0_i[S_LEN],  g_out_0[G_OUT_LEN],
-            s1_i[S_LEN],  g_out_1[G_OUT_LEN];
-    // Pointers to the various parts of the output of G
-    uint8_t *s0_keep, *s0_lose, *v0_keep, *v0_lose, *t0_keep,
-            *s1_keep, *s1_lose, *v1_keep, *v1_lose, *t1_keep;
+// DCF keys on the n_bits lowest bits of the inputs (KEY_LEN_N(n_bits) bytes),
+//  the tree of DCF_gen_seeded for n_bits == N_BITS.
+static void DCF_gen_core(size_t n_bits, R_t alpha, uint8_t k0[], uint8_t k1[], const uint8_t s0[S_LEN], const uint8_t s1[S_LEN]){
+    // Inputs and outputs to G_side, both sides: left | right
+    uint8_t s0_i[S_LEN],  g_out_0[2*G_SIDE_LEN],
+            s1_i[S_LEN],  g_out_1[2*G_SIDE_LEN];
+    // Pointers to the kept and lost sides of the output of G
+    uint8_t *g0_keep, *g0_lose, *g1_keep, *g1_lose;
     // Temporary variables
     uint8_t s_cw[S_LEN] = {0};
     R_t V_cw, V_alpha=0;    bool t0=0, t1=1;                                    // L3
     bool t_cw_L, t_cw_R, t0_L, t0_R, t1_L, t1_R;
     size_t i;
 
-    // Decompose alpha into an array of bits                                    // L1
+    // Decompose alpha into an array of bits (n_bits lowest, MSB first)         // L1
     bool alpha_bits[N_BITS] = {0};
-    bit_decomposition(alpha, alpha_bits);
+    for (i = 0; i < n_bits; i++)
+    {
+        alpha_bits[i] = ((uint64_t)alpha >> (n_bits-i-1)) & 1;
+    }
 
     // Initialize s0 and s1 randomly if they are NULL                           // L2
-    if (s0==NULL || s1==NULL)
+    if (s0==NULL || s1==NULL)   // One draw: s0 != s1 even with the time-seeded rand()
     {
-        random_buffer(s0_i, S_LEN);
-        random_buffer(s1_i, S_LEN);
+        uint8_t s01[2*S_LEN];
+        random_buffer(s01, 2*S_LEN);
+        memcpy(s0_i, s01, S_LEN);
+        memcpy(s1_i, s01 + S_LEN, S_LEN);
     }
     else
     {
@@ -141,40 +332,20 @@ void DCF_gen_seeded(R_t alpha, uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN], uint8_t
     memcpy(&k1[S_PTR], s1_i, S_LEN);
     
     // Main loop
-    for (i = 0; i < N_BITS; i++)                                         // L4
-    {
-        #ifdef __AES__
-            G_ni(s0_i, g_out_0, G_IN_LEN, G_OUT_LEN);                           // L5
-            G_ni(s1_i, g_out_1, G_IN_LEN, G_OUT_LEN);                           // L6
-        #else
-            G_tiny(s0_i, g_out_0, G_IN_LEN, G_OUT_LEN);                         // L5
-            G_tiny(s1_i, g_out_1, G_IN_LEN, G_OUT_LEN);                         // L6
-        #endif
-        t0_L = TO_BOOL(g_out_0 + T_L_PTR);   t0_R = TO_BOOL(g_out_0 + T_R_PTR);
-        t1_L = TO_BOOL(g_out_1 + T_L_PTR);   t1_R = TO_BOOL(g_out_1 + T_R_PTR);
-        if (alpha_bits[i])  // keep = R; lose = L;                              // L8
-        {
-            s0_keep = g_out_0 + S_R_PTR;    s0_lose = g_out_0 + S_L_PTR;
-            v0_keep = g_out_0 + V_R_PTR;    v0_lose = g_out_0 + V_L_PTR;
-            t0_keep = g_out_0 + T_R_PTR;  //t0_lose = g_out_0 + T_L_PTR;
-            s1_keep = g_out_1 + S_R_PTR;    s1_lose = g_out_1 + S_L_PTR;
-            v1_keep = g_out_1 + V_R_PTR;    v1_lose = g_out_1 + V_L_PTR;
-            t1_keep = g_out_1 + T_R_PTR;  //t1_lose = g_out_1 + T_L_PTR;
-        }
-        else                // keep = L; lose = R;                              // L7
-        {
-            s0_keep = g_out_0 + S_L_PTR;    s0_lose = g_out_0 + S_R_PTR;
-            v0_keep = g_out_0 + V_L_PTR;    v0_lose = g_out_0 + V_R_PTR;
-            t0_keep = g_out_0 + T_L_PTR;  //t0_lose = g_out_0 + T_R_PTR;
-            s1_keep = g_out_1 + S_L_PTR;    s1_lose = g_out_1 + S_R_PTR;
-            v1_keep = g_out_1 + V_L_PTR;    v1_lose = g_out_1 + V_R_PTR;
-            t1_keep = g_out_1 + T_L_PTR;  //t1_lose = g_out_1 + T_R_PTR;
-        }
-        xor(s0_lose, s1_lose, s_cw, S_LEN);                                     // L10
-        V_cw = (t1?-1:1) * (TO_R_t(v1_lose) - TO_R_t(v0_lose) - V_alpha);       // L11
+    for (i = 0; i < n_bits; i++)                                                // L4
+    {
+        G_side_prg(s0_i, 0, g_out_0);   G_side_prg(s0_i, 1, g_out_0 + G_SIDE_LEN);  // L5
+        G_side_prg(s1_i, 0, g_out_1);   G_side_prg(s1_i, 1, g_out_1 + G_SIDE_LEN);  // L6
+        t0_L = TO_BOOL(g_out_0 + GS_T_PTR); t0_R = TO_BOOL(g_out_0 + G_SIDE_LEN + GS_T_PTR);
+        t1_L = TO_BOOL(g_out_1 + GS_T_PTR); t1_R = TO_BOOL(g_out_1 + G_SIDE_LEN + GS_T_PTR);
+        // keep = R, lose = L if alpha_bits[i]; keep = L, lose = R otherwise     // L7-L8
+        g0_keep = g_out_0 + alpha_bits[i]*G_SIDE_LEN;   g0_lose = g_out_0 + (!alpha_bits[i])*G_SIDE_LEN;
+        g1_keep = g_out_1 + alpha_bits[i]*G_SIDE_LEN;   g1_lose = g_out_1 + (!alpha_bits[i])*G_SIDE_LEN;
+        xor(g0_lose + GS_S_PTR, g1_lose + GS_S_PTR, s_cw, S_LEN);               // L10
+        V_cw = (t1?-1:1) * (TO_R_t(g1_lose+GS_V_PTR) - TO_R_t(g0_lose+GS_V_PTR) - V_alpha); // L11
         V_cw += alpha_bits[i] * (t1?-1:1) * BETA; // Lose=L --> alpha_bits[i]=1 // L12
 
-        V_alpha += TO_R_t(v0_keep) - TO_R_t(v1_keep) + (t1?-1:1)*V_cw;          // L14
+        V_alpha += TO_R_t(g0_keep+GS_V_PTR) - TO_R_t(g1_keep+GS_V_PTR) + (t1?-1:1)*V_cw;  // L14
         t_cw_L = t0_L ^ t1_L ^ alpha_bits[i] ^ 1;                               // L15
         t_cw_R = t0_R ^ t1_R ^ alpha_bits[i];
 
@@ -183,248 +354,1681 @@ void DCF_gen_seeded(R_t alpha, uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN], uint8_t
         memcpy(&k0[CW_CHAIN_PTR + T_CW_L_PTR(i)], &t_cw_L, sizeof(bool));
         memcpy(&k0[CW_CHAIN_PTR + T_CW_R_PTR(i)], &t_cw_R, sizeof(bool));
         
-        xor_cond(s0_keep, s_cw, s0_i, S_LEN, t0);                               // L18
-        t0 = TO_BOOL(t0_keep) ^ (t0 & (alpha_bits[i]?t_cw_R:t_cw_L));           // L19
-        xor_cond(s1_keep, s_cw, s1_i, S_LEN, t1);                                    
-        t1 = TO_BOOL(t1_keep) ^ (t1 & (alpha_bits[i]?t_cw_R:t_cw_L));              
+        xor_cond(g0_keep + GS_S_PTR, s_cw, s0_i, S_LEN, t0);                    // L18
+        t0 = TO_BOOL(g0_keep + GS_T_PTR) ^ (t0 & (alpha_bits[i]?t_cw_R:t_cw_L));  // L19
+        xor_cond(g1_keep + GS_S_PTR, s_cw, s1_i, S_LEN, t1);
+        t1 = TO_BOOL(g1_keep + GS_T_PTR) ^ (t1 & (alpha_bits[i]?t_cw_R:t_cw_L));              
     }
     V_alpha = (t1?-1:1) * (TO_R_t(s1_i) - TO_R_t(s0_i) - V_alpha);              // L20
-    memcpy(&k0[CW_CHAIN_PTR]+LAST_CW_PTR, &V_alpha,  sizeof(R_t));
+    memcpy(&k0[CW_CHAIN_PTR]+LAST_CW_PTR_N(n_bits), &V_alpha,  sizeof(R_t));
     // Copy the resulting CW_chain                                              // L21
-    memcpy(&k1[CW_CHAIN_PTR], &k0[CW_CHAIN_PTR], CW_CHAIN_LEN);
+    memcpy(&k1[CW_CHAIN_PTR], &k0[CW_CHAIN_PTR], CW_CHAIN_LEN_N(n_bits));
+}
+void DCF_gen_seeded(R_t alpha, uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN], uint8_t s0[S_LEN], uint8_t s1[S_LEN]){
+    DCF_gen_core(N_BITS, alpha, k0, k1, s0, s1);
 }
 void DCF_gen(R_t alpha, uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN]){
-    DCF_gen_seeded(alpha, k0, k1, NULL, NULL);
+    DCF_gen_core(N_BITS, alpha, k0, k1, NULL, NULL);
 }
 
-R_t DCF_eval(bool b, const uint8_t kb[KEY_LEN], R_t x_hat){
-    R_t V = 0;     bool t = b, x_bits[N_BITS];                                  // L1
-    uint8_t s[S_LEN], g_out[G_OUT_LEN];     
+R_t DCF_eval_n(size_t n_bits, bool b, const uint8_t kb[], R_t x_hat){
+    R_t V = 0;     bool t = b, bit;                                             // L1
+    uint8_t s[S_LEN], g_out[G_SIDE_LEN];
     size_t i;
     // Copy the initial state to avoid modifying the original key
     memcpy(s, &kb[S_PTR], S_LEN);
-    // Decompose x into an array of bits
-    bit_decomposition(x_hat, x_bits);
 
-    // Main loop
-    for (i = 0; i < N_BITS; i++)                                         // L2
+    // Main loop, over the n_bits lowest bits of x_hat (MSB first)
+    for (i = 0; i < n_bits; i++)                                                // L2
     {
-        #ifdef __AES__
-            G_ni(s, g_out, G_IN_LEN, G_OUT_LEN);                                // L4
-        #else
-            G_tiny(s, g_out, G_IN_LEN, G_OUT_LEN);
-        #endif
-        if (x_bits[i]==0)  // Pick the Left branch
-        {
-           V += (b?-1:1) * (  TO_R_t(&g_out[V_L_PTR]) +                         // L7
-                            t*TO_R_t(&kb[CW_CHAIN_PTR+V_CW_PTR(i)]));
-           xor_cond(g_out+S_L_PTR, &kb[CW_CHAIN_PTR+S_CW_PTR(i)], s, S_LEN, t); // L8
-           t = TO_BOOL(g_out+T_L_PTR) ^ (t&TO_BOOL(&kb[CW_CHAIN_PTR+T_CW_L_PTR(i)]));
-        }
-        else               // Pick the Right branch
-        {
-           V += (b?-1:1) * (  TO_R_t(&g_out[V_R_PTR]) +                         // L9
-                            t*TO_R_t(&kb[CW_CHAIN_PTR+V_CW_PTR(i)]));
-           xor_cond(g_out + S_R_PTR, &kb[CW_CHAIN_PTR+S_CW_PTR(i)], s, S_LEN, t);// L10  
-           t = TO_BOOL(g_out+T_R_PTR) ^ (t&TO_BOOL(&kb[CW_CHAIN_PTR+T_CW_R_PTR(i)]));                    
-        }
+        // Expand only the branch taken: Left if bit is 0, Right otherwise      // L4
+        bit = ((uint64_t)x_hat >> (n_bits-i-1)) & 1;
+        G_side_prg(s, bit, g_out);
+        V += (b?-1:1) * (  TO_R_t(&g_out[GS_V_PTR]) +                           // L7, L9
+                         t*TO_R_t(&kb[CW_CHAIN_PTR+V_CW_PTR(i)]));
+        xor_cond(g_out + GS_S_PTR, &kb[CW_CHAIN_PTR+S_CW_PTR(i)], s, S_LEN, t); // L8, L10
+        t = TO_BOOL(g_out + GS_T_PTR) ^
+            (t&TO_BOOL(&kb[CW_CHAIN_PTR+(bit?T_CW_R_PTR(i):T_CW_L_PTR(i))]));
     }
-    V += (b?-1:1) * (TO_R_t(s) + t*TO_R_t(&kb[CW_CHAIN_PTR+LAST_CW_PTR]));      // L13
+    V += (b?-1:1) * (TO_R_t(s) + t*TO_R_t(&kb[CW_CHAIN_PTR+LAST_CW_PTR_N(n_bits)])); // L13
     return V;
 }
+R_t DCF_eval(bool b, const uint8_t kb[KEY_LEN], R_t x_hat){
+    return DCF_eval_n(N_BITS, b, kb, x_hat);
+}
+void DCF_gen_n(size_t n_bits, R_t alpha, uint8_t k0[], uint8_t k1[]){
+    DCF_gen_core(n_bits, alpha, k0, k1, NULL, NULL);
+}
+// Seeds s0 | s1 of K keys (and extra_len more bytes), in one serial draw: the
+//  rand() fallback of random_buffer is neither thread-safe nor distinct across
+//  calls within a second. Free with free().
+static uint8_t *random_seeds_batch(size_t K, size_t extra_len){
+    uint8_t *seeds = (uint8_t*)malloc(K*2*S_LEN + extra_len + 1);    // +1: not NULL for K = 0
+    if (seeds == NULL)
+    {
+        printf("<Funshade Error>: out of memory for the key seeds\n");
+        exit(EXIT_FAILURE);
+    }
+    random_buffer(seeds, K*2*S_LEN + extra_len);
+    return seeds;
+}
+void DCF_gen_batch(size_t K, const R_t alpha[], uint8_t k0[], uint8_t k1[]){
+    uint8_t *seeds = random_seeds_batch(K, 0);
+    size_t k;
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (k=0; k<K; k++)
+    {
+        DCF_gen_seeded(alpha[k], &k0[k*KEY_LEN], &k1[k*KEY_LEN], &seeds[2*k*S_LEN], &seeds[(2*k+1)*S_LEN]);
+    }
+    free(seeds);
+}
+void DCF_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]){
+    size_t k;
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.sign_chunk, n_threads);
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
+    for (k=0; k<K; k++)
+    {
+        ob[k] = DCF_eval(b, &kb[k*KEY_LEN], x_hat[k]);
+    }
+}
 
 // -------------------------------------------------------------------------- //
 // ------------------------- INTERVAL CONTAINMENT --------------------------- //
 // -------------------------------------------------------------------------- //
+// z0 + z1 - r_out of the IC gate of [p, q] under mask r_in, on n_bits-bit inputs.
+//  Comparisons over the whole ring, in unsigned arithmetic: q is often the
+//  largest R_t, and a signed overflow would let the compiler fold them
+static R_t IC_corr(size_t n_bits, R_t r_in, R_t p, R_t q){
+    return (R_t)( (MOD_N(UR(p)+UR(r_in), n_bits)   > MOD_N(UR(q)+UR(r_in), n_bits))  // alpha_p > alpha_q
+                - (MOD_N(UR(p)+UR(r_in), n_bits)   > MOD_N(p, n_bits))               // alpha_p > p
+                + (MOD_N(UR(q)+UR(r_in)+1, n_bits) > MOD_N(UR(q)+1, n_bits))         // alpha_q_prime > q_prime
+                + (MOD_N(UR(q)+UR(r_in)+1, n_bits)== 0));                            // alpha_q_prime = -1
+}
 void IC_gen(R_t r_in, R_t r_out, R_t p, R_t q, uint8_t k0_ic[KEY_LEN], uint8_t k1_ic[KEY_LEN]){
-    DCF_gen((r_in-1), k0_ic, k1_ic);
-    TO_R_t(&k0_ic[Z_PTR]) = random_dtype();
-    TO_R_t(&k1_ic[Z_PTR]) = - TO_R_t(&k0_ic[Z_PTR]) + r_out 
-                                + (U(p+r_in)  > U(q+r_in))  // alpha_p > alpha_q
-                                - (U(p+r_in)  > U(p))       // alpha_p > p
-                                + (U(q+r_in+1)> U(q+1))     // alpha_q_prime > q_prime
-                                + (U(q+r_in+1)==U(0));      // alpha_q_prime = -1
+    IC_gen_seeded(r_in, r_out, p, q, NULL, NULL, random_dtype(), k0_ic, k1_ic);
+}
+void IC_gen_seeded(R_t r_in, R_t r_out, R_t p, R_t q, uint8_t s0[S_LEN], uint8_t s1[S_LEN], R_t z0,
+    uint8_t k0_ic[KEY_LEN], uint8_t k1_ic[KEY_LEN]){
+    DCF_gen_seeded((R_t)(UR(r_in)-1), k0_ic, k1_ic, s0, s1);
+    TO_R_t(&k0_ic[Z_PTR]) = z0;
+    TO_R_t(&k1_ic[Z_PTR]) = - TO_R_t(&k0_ic[Z_PTR]) + r_out + IC_corr(N_BITS, r_in, p, q);
 }
 
 R_t IC_eval(bool b, R_t p, R_t q, const uint8_t kb_ic[KEY_LEN], R_t x_hat){
-    R_t output_1 = DCF_eval(b, kb_ic, (x_hat-p-1));
-    R_t output_2 = DCF_eval(b, kb_ic, (x_hat-q-2));
-    R_t output = b*((U(x_hat)>U(p))-(U(x_hat)>U(q+1))) - output_1 + output_2 + TO_R_t(&kb_ic[Z_PTR]);
+    R_t output_1 = DCF_eval(b, kb_ic, (R_t)(UR(x_hat)-UR(p)-1));
+    R_t output_2 = DCF_eval(b, kb_ic, (R_t)(UR(x_hat)-UR(q)-2));
+    R_t output = b*((MOD_N(x_hat, N_BITS)>MOD_N(p, N_BITS))-(MOD_N(x_hat, N_BITS)>MOD_N(UR(q)+1, N_BITS)))
+                 - output_1 + output_2 + TO_R_t(&kb_ic[Z_PTR]);
     return output;
 }
 
+// Same gate on n_bits-bit inputs: all comparisons are modulo 2^n_bits
+void IC_gen_n(size_t n_bits, R_t r_in, R_t r_out, R_t p, R_t q, uint8_t k0_ic[], uint8_t k1_ic[]){
+    DCF_gen_n(n_bits, (R_t)(UR(r_in)-1), k0_ic, k1_ic);
+    TO_R_t(&k0_ic[Z_PTR_N(n_bits)]) = random_dtype();
+    TO_R_t(&k1_ic[Z_PTR_N(n_bits)]) = - TO_R_t(&k0_ic[Z_PTR_N(n_bits)]) + r_out + IC_corr(n_bits, r_in, p, q);
+}
 
-// -------------------------------------------------------------------------- //
-// --------------------------------- SIGN ----------------------------------- //
-// -------------------------------------------------------------------------- //
-void SIGN_gen(R_t r_in, R_t r_out, uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN]){
-    IC_gen(r_in, r_out, 0, (R_t)((1ULL<<(N_BITS-1))-1), k0, k1);
+R_t IC_eval_n(size_t n_bits, bool b, R_t p, R_t q, const uint8_t kb_ic[], R_t x_hat){
+    R_t output_1 = DCF_eval_n(n_bits, b, kb_ic, (R_t)(UR(x_hat)-UR(p)-1));
+    R_t output_2 = DCF_eval_n(n_bits, b, kb_ic, (R_t)(UR(x_hat)-UR(q)-2));
+    R_t output = b*((MOD_N(x_hat, n_bits)>MOD_N(p, n_bits))-(MOD_N(x_hat, n_bits)>MOD_N(UR(q)+1, n_bits)))
+                 - output_1 + output_2 + TO_R_t(&kb_ic[Z_PTR_N(n_bits)]);
+    return output;
 }
-void SIGN_gen_batch(size_t K, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]){
+
+void IC_gen_batch(size_t K, const R_t p[], const R_t q[], R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]){
+    uint8_t *seeds = random_seeds_batch(K, K*sizeof(R_t));      // then the z0 shares
+    R_t z0;
     size_t k;
 
     // Generate masks
     random_buffer((uint8_t*)r_in_0, K*sizeof(R_t));
     random_buffer((uint8_t*)r_in_1, K*sizeof(R_t));
+#if defined(_OPENMP)
+    #pragma omp parallel for private(z0)
+#endif
     for (k=0; k<K; k++)
     {
-        SIGN_gen(r_in_0[k]+r_in_1[k], 0, &k0[k*KEY_LEN], &k1[k*KEY_LEN]);
-        r_in_1[k] -= theta;
+        memcpy(&z0, &seeds[2*K*S_LEN + k*sizeof(R_t)], sizeof(R_t));
+        IC_gen_seeded((R_t)(UR(r_in_0[k])+UR(r_in_1[k])), 0, p[k], q[k],
+            &seeds[2*k*S_LEN], &seeds[(2*k+1)*S_LEN], z0, &k0[k*KEY_LEN], &k1[k*KEY_LEN]);
     }
+    free(seeds);
 }
-R_t SIGN_eval(bool b, const uint8_t kb[KEY_LEN], R_t x_hat){
-    return IC_eval(b, 0, (R_t)((1ULL<<(N_BITS-1))-1), kb, x_hat);
-}
-void SIGN_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]){
+void IC_eval_batch(size_t K, bool b, const R_t p[], const R_t q[], const uint8_t kb[], const R_t x_hat[], R_t ob[]){
     size_t k;
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.sign_chunk, n_threads);
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
     for (k=0; k<K; k++)
     {
-        ob[k] = SIGN_eval(b, &kb[k*KEY_LEN], x_hat[k]);
+        ob[k] = IC_eval(b, p[k], q[k], &kb[k*KEY_LEN], x_hat[k]);
     }
 }
 
 
 // -------------------------------------------------------------------------- //
-// ------------------------------- FUNSHADE --------------------------------- //
+// --------------------------------- SIGN ----------------------------------- //
 // -------------------------------------------------------------------------- //
+void SIGN_gen(R_t r_in, R_t r_out, uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN]){
+    IC_gen(r_in, r_out, 0, (R_t)((1ULL<<(N_BITS-1))-1), k0, k1);
+}
+void SIGN_gen_batch(size_t K, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]){
+    size_t k;
 
-// .......................... Single evaluation ............................. //
-void funshade_setup(size_t l, R_t theta, R_t r_in[2], R_t d_x0[], R_t d_x1[],
-    R_t d_y0[], R_t d_y1[], R_t d_xy0[], R_t d_xy1[], uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN])
-{
-    size_t i;
-    // Generate randomness for scalar product
-    random_buffer((uint8_t*)d_x0, l*sizeof(R_t)); random_buffer((uint8_t*)d_x1, l*sizeof(R_t));
-    random_buffer((uint8_t*)d_y0, l*sizeof(R_t)); random_buffer((uint8_t*)d_y1, l*sizeof(R_t));
-    random_buffer((uint8_t*)d_xy0, l*sizeof(R_t));random_buffer((uint8_t*)r_in, 2*sizeof(R_t));
-    for (i=0; i<l; i++)
+    // Generate masks
+    random_buffer((uint8_t*)r_in_0, K*sizeof(R_t));
+    random_buffer((uint8_t*)r_in_1, K*sizeof(R_t));
+    for (k=0; k<K; k++)
     {
-        d_xy1[i] = (d_x0[i]+d_x1[i]) * (d_y0[i]+d_y1[i]) - d_xy0[i];
+        SIGN_gen(r_in_0[k]+r_in_1[k], 0, &k0[k*KEY_LEN], &k1[k*KEY_LEN]);
+        r_in_1[k] -= theta;
     }
-    // Generate keys
-    SIGN_gen(r_in[0]+r_in[1], 0, k0, k1);
-    // Remove threshold from r
-    r_in[1] -= theta;
 }
+void SIGN_gen_batch_lm(size_t K, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0_lm[], uint8_t k1_lm[]){
+    size_t k;
 
-
-void funshade_share(size_t l, const R_t v[], const R_t d_v[], R_t D_v[])
-{
-    size_t i;
-    for (i=0; i<l; i++)
+    // Generate masks
+    random_buffer((uint8_t*)r_in_0, K*sizeof(R_t));
+    random_buffer((uint8_t*)r_in_1, K*sizeof(R_t));
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (k=0; k<K; k++)
     {
-        D_v[i] = d_v[i] + v[i];
+        uint8_t k0[KEY_LEN], k1[KEY_LEN];
+        SIGN_gen(r_in_0[k]+r_in_1[k], 0, k0, k1);
+        key_scatter_lm(K, k, k0, k0_lm);
+        key_scatter_lm(K, k, k1, k1_lm);
+        r_in_1[k] -= theta;
     }
 }
-
-
-R_t funshade_eval_dist(size_t l, bool j, R_t r_in_j,
-    const R_t D_x[], const R_t D_y[], const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[])
-{
-    size_t i;
-    R_t z_hat_j = r_in_j;
-    for (i=0; i<l; i++)
+R_t SIGN_eval(bool b, const uint8_t kb[KEY_LEN], R_t x_hat){
+    return IC_eval(b, 0, (R_t)((1ULL<<(N_BITS-1))-1), kb, x_hat);
+}
+void SIGN_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]){
+#ifdef USE_CPP_ENGINE
+    SIGN_eval_batch_cpp(K, b, kb, x_hat, ob);
+#else
+    size_t k;
+    for (k=0; k<K; k++)
     {
-        z_hat_j += j*(D_x[i]*D_y[i]) - (D_x[i]*d_yj[i]) - (D_y[i]*d_xj[i]) + d_xyj[i];
+        ob[k] = SIGN_eval(b, &kb[k*KEY_LEN], x_hat[k]);
     }
-    return z_hat_j;
-}
-
-R_t funshade_eval_sign(bool j, const uint8_t kb[KEY_LEN], R_t z_hat)
-{
-    return SIGN_eval(j, kb, z_hat);
+#endif
 }
 
-// ........................... Batch evaluation ............................. //
-void funshade_setup_batch(size_t K, size_t l, R_t theta,
-    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
-    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
-{
-    size_t idx, k;
-    // Generate randomness for scalar product
-    random_buffer((uint8_t*)d_x0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_x1, K*l*sizeof(R_t));
-    random_buffer((uint8_t*)d_y0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_y1, K*l*sizeof(R_t));
-    random_buffer((uint8_t*)d_xy0, K*l*sizeof(R_t));
+// Keys and masks of index k from (master, k): DCF seeds, z share and r_in shares
+void SIGN_gen_batch_derived(const uint8_t master[MASTER_SEED_LEN], size_t a, size_t b, R_t theta,
+    R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]){
+    size_t k;
 #if defined(_OPENMP)
     #pragma omp parallel for
 #endif
-    for (idx=0; idx<(K*l); idx++)
+    for (k=a; k<b; k++)
     {
-        d_xy1[idx] = (d_x0[idx]+d_x1[idx]) * (d_y0[idx]+d_y1[idx]) - d_xy0[idx];
+        uint8_t buf[2*S_LEN + 3*sizeof(R_t)];
+        R_t r0, r1, z0;
+        size_t i = k - a;
+        random_buffer_derived(buf, sizeof(buf), master, k, DERIVE_KEYS);
+        memcpy(&r0, buf + 2*S_LEN, sizeof(R_t));
+        memcpy(&r1, buf + 2*S_LEN + sizeof(R_t), sizeof(R_t));
+        memcpy(&z0, buf + 2*S_LEN + 2*sizeof(R_t), sizeof(R_t));
+        IC_gen_seeded((R_t)(UR(r0)+UR(r1)), 0, 0, (R_t)((1ULL<<(N_BITS-1))-1), buf, buf + S_LEN, z0,
+                      &k0[i*KEY_LEN], &k1[i*KEY_LEN]);
+        r_in_0[i] = r0;
+        r_in_1[i] = r1 - theta;
     }
-    // Generate masks and fss keys
+}
+
+// Sign of n_bits-bit inputs: x in [0, 2^(n_bits-1)) modulo 2^n_bits
+#define SIGN_Q_N(n_bits)    ((R_t)(((uint64_t)1<<((n_bits)-1))-1))
+void SIGN_gen_n(size_t n_bits, R_t r_in, R_t r_out, uint8_t k0[], uint8_t k1[]){
+    IC_gen_n(n_bits, r_in, r_out, 0, SIGN_Q_N(n_bits), k0, k1);
+}
+R_t SIGN_eval_n(size_t n_bits, bool b, const uint8_t kb[], R_t x_hat){
+    return IC_eval_n(n_bits, b, 0, SIGN_Q_N(n_bits), kb, x_hat);
+}
+void SIGN_gen_batch_n(size_t K, size_t n_bits, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]){
+    size_t k;
+
+    // Generate masks
     random_buffer((uint8_t*)r_in_0, K*sizeof(R_t));
     random_buffer((uint8_t*)r_in_1, K*sizeof(R_t));
 #if defined(_OPENMP)
     #pragma omp parallel for
 #endif
-    for (k=0; k<K; k+=1)
+    for (k=0; k<K; k++)
     {
-        SIGN_gen(r_in_0[k]+r_in_1[k], 0, &k0[k*KEY_LEN], &k1[k*KEY_LEN]);
-        // Remove threshold from r_in shares
+        SIGN_gen_n(n_bits, r_in_0[k]+r_in_1[k], 0, &k0[k*KEY_LEN_N(n_bits)], &k1[k*KEY_LEN_N(n_bits)]);
         r_in_1[k] -= theta;
     }
 }
-
-void funshade_share_batch(size_t K, size_t l, const R_t v[], const R_t d_v[],
-    R_t D_v[])
-{
-    size_t idx;
-
-#if defined(_OPENMP)
-    #pragma omp parallel for
-#endif
-    for (idx=0; idx<K*l; idx++)
+void SIGN_eval_batch_n(size_t K, size_t n_bits, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]){
+    size_t k;
+    for (k=0; k<K; k++)
     {
-        D_v[idx] = d_v[idx] + v[idx];
+        ob[k] = SIGN_eval_n(n_bits, b, &kb[k*KEY_LEN_N(n_bits)], x_hat[k]);
     }
 }
 
-void funshade_eval_dist_batch(size_t K, size_t l, bool j, const R_t r_in_j[], 
-    const R_t D_x[], const R_t D_y[], const R_t d_xj[], const R_t d_yj[],
-    const R_t d_xyj[], R_t z_hat_j[])
-{
-    size_t k,i,idx;
-    memcpy(z_hat_j, r_in_j, K*sizeof(R_t));
-#if defined(_OPENMP)
-    #pragma omp parallel for
-#endif
-    for (k=0; k<K; k++)
+// Evaluates keys [k0, k0+n) of a level-major batch, n <= LM_CHUNK, in lock-step
+//  (x_hat and ob hold the n chunk elements). At each level, the two DCF
+//  traversals of IC_eval advance for all n keys before moving on, so the
+//  level's correction words are read sequentially.
+static void SIGN_eval_lm_chunk(size_t K, bool b, const uint8_t kb_lm[], size_t k0, size_t n,
+    const R_t x_hat[], R_t ob[]){
+    const R_t q = (R_t)((1ULL<<(N_BITS-1))-1), sgn = b?-1:1;   // p = 0
+    uint8_t s[LM_CHUNK][2][S_LEN], g_out[G_SIDE_LEN];
+    R_t x[LM_CHUNK][2], V[LM_CHUNK][2], V_cw;
+    bool t[LM_CHUNK][2], t_cw_L, t_cw_R, bit;
+    const uint8_t *s_cw;
+    size_t i, c, e;
+
+    for (c=0; c<n; c++)
     {
-        for (i=0; i<l; i++)
+        x[c][0] = (R_t)(UR(x_hat[c]) - 1);            // IC_eval: x_hat-p-1
+        x[c][1] = (R_t)(UR(x_hat[c]) - UR(q) - 2);   // IC_eval: x_hat-q-2
+        for (e=0; e<2; e++)
         {
-            idx = k*l + i;
-            z_hat_j[k] += j*(D_x[idx]*D_y[idx]) - (D_x[idx]*d_yj[idx]) - (D_y[idx]*d_xj[idx]) + d_xyj[idx];
+            memcpy(s[c][e], &kb_lm[LM_S_PTR(K, k0+c)], S_LEN);
+            t[c][e] = b;    V[c][e] = 0;
+        }
+    }
+    for (i = 0; i < N_BITS; i++)
+    {
+        for (c=0; c<n; c++)
+        {
+            s_cw   = &kb_lm[LM_S_CW_PTR(K, i, k0+c)];
+            V_cw   = TO_R_t(&kb_lm[LM_V_CW_PTR(K, i, k0+c)]);
+            t_cw_L = TO_BOOL(&kb_lm[LM_T_CW_L_PTR(K, i, k0+c)]);
+            t_cw_R = TO_BOOL(&kb_lm[LM_T_CW_R_PTR(K, i, k0+c)]);
+            for (e=0; e<2; e++)
+            {
+                bit = ((uint64_t)x[c][e] >> (N_BITS-1-i)) & 1;
+                G_side_prg(s[c][e], bit, g_out);
+                V[c][e] += sgn * (TO_R_t(&g_out[GS_V_PTR]) + t[c][e]*V_cw);
+                xor_cond(g_out + GS_S_PTR, s_cw, s[c][e], S_LEN, t[c][e]);
+                t[c][e] = TO_BOOL(g_out + GS_T_PTR) ^ (t[c][e] & (bit?t_cw_R:t_cw_L));
+            }
         }
     }
+    for (c=0; c<n; c++)
+    {
+        for (e=0; e<2; e++)
+        {
+            V[c][e] += sgn * (TO_R_t(s[c][e]) + t[c][e]*TO_R_t(&kb_lm[LM_LAST_CW_PTR(K, k0+c)]));
+        }
+        ob[c] = b*((MOD_N(x_hat[c], N_BITS)>0)-(MOD_N(x_hat[c], N_BITS)>MOD_N(UR(q)+1, N_BITS))) - V[c][0] + V[c][1]
+                + TO_R_t(&kb_lm[LM_Z_PTR(K, k0+c)]);
+    }
 }
-
-void funshade_eval_sign_batch(size_t K, bool j, const uint8_t k_j[], const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[])
-{
-    size_t k;
+void SIGN_eval_batch_lm(size_t K, bool b, const uint8_t kb_lm[], const R_t x_hat[], R_t ob[]){
+    size_t k0;
 #if defined(_OPENMP)
     #pragma omp parallel for
 #endif
-    for (k=0; k<K; k++)
+    for (k0=0; k0<K; k0+=LM_CHUNK)
     {
-        o_j[k]= SIGN_eval(j, &k_j[k*KEY_LEN], z_hat_0[k]+z_hat_1[k]);
+        SIGN_eval_lm_chunk(K, b, kb_lm, k0, (K-k0 < LM_CHUNK) ? K-k0 : LM_CHUNK, &x_hat[k0], &ob[k0]);
     }
 }
 
-R_t funshade_eval_sign_batch_collapse(size_t K, bool j, const uint8_t k_j[], const R_t z_hat_0[], const R_t z_hat_1[])
-{
-    R_t o_j = 0;
-    size_t k;
-#if defined(_OPENMP)
-    #pragma omp parallel for
+
+// -------------------------------------------------------------------------- //
+// ---------------------- DISTRIBUTED POINT FUNCTION ------------------------ //
+// -------------------------------------------------------------------------- //
+// Child c (0: left, 1: right) of node (s, t) at level i, from its side
+//  g = G_side(s, c): seed s_c from the s block and control bit from the lowest
+//  bit of the v block, both corrected by the level's CW if t.
+static bool DPF_child(const uint8_t kb[DPF_KEY_LEN], size_t i, bool t, bool c,
+    const uint8_t g[G_SIDE_LEN], uint8_t s_c[S_LEN]){
+    xor_cond(&g[GS_S_PTR], &kb[DPF_S_CW_PTR(i)], s_c, S_LEN, t);
+    return (g[GS_V_PTR] & 1) ^ (t & kb[c ? DPF_T_CW_R_PTR(i) : DPF_T_CW_L_PTR(i)]);
+}
+
+// Both children of node (s, t) at level i: g_out = s_l | s_r
+static void DPF_expand(const uint8_t kb[DPF_KEY_LEN], size_t i, const uint8_t s[S_LEN], bool t,
+    uint8_t g_out[DPF_G_OUT_LEN], bool *t_l, bool *t_r){
+    uint8_t g[G_SIDE_LEN];
+    G_side_prg(s, 0, g);
+    *t_l = DPF_child(kb, i, t, 0, g, &g_out[S_L_PTR]);
+    G_side_prg(s, 1, g);
+    *t_r = DPF_child(kb, i, t, 1, g, &g_out[S_R_PTR]);
+}
+
+void DPF_gen(R_t alpha, uint8_t k0[DPF_KEY_LEN], uint8_t k1[DPF_KEY_LEN]){
+    uint8_t s[2*S_LEN], *s0 = s, *s1 = s + S_LEN, g_out_0[DPF_G_OUT_LEN], g_out_1[DPF_G_OUT_LEN],
+            s_cw[S_LEN];
+    bool alpha_bits[N_BITS], t0 = 0, t1 = 1, t0_l, t0_r, t1_l, t1_r, t_cw_l, t_cw_r, t_cw_keep;
+    size_t i, keep, lose;
+    R_t V_cw;
+
+    bit_decomposition(alpha, alpha_bits);
+    random_buffer(s, 2*S_LEN);      // one draw: distinct seeds even with the rand() fallback
+    memcpy(&k0[S_PTR], s0, S_LEN);
+    memcpy(&k1[S_PTR], s1, S_LEN);
+    for (i = 0; i < N_BITS; i++)
+    {
+        DPF_expand(k0, i, s0, 0, g_out_0, &t0_l, &t0_r);
+        DPF_expand(k0, i, s1, 0, g_out_1, &t1_l, &t1_r);
+        keep = alpha_bits[i] ? S_R_PTR : S_L_PTR;
+        lose = alpha_bits[i] ? S_L_PTR : S_R_PTR;
+        // Seeds off the path of alpha become equal, on it they stay apart
+        xor(g_out_0 + lose, g_out_1 + lose, s_cw, S_LEN);
+        t_cw_l = t0_l ^ t1_l ^ alpha_bits[i] ^ 1;
+        t_cw_r = t0_r ^ t1_r ^ alpha_bits[i];
+        t_cw_keep = alpha_bits[i] ? t_cw_r : t_cw_l;
+        memcpy(&k0[DPF_S_CW_PTR(i)], s_cw, S_LEN);
+        k0[DPF_T_CW_L_PTR(i)] = t_cw_l;
+        k0[DPF_T_CW_R_PTR(i)] = t_cw_r;
+
+        xor_cond(g_out_0 + keep, s_cw, s0, S_LEN, t0);
+        t0 = (alpha_bits[i] ? t0_r : t0_l) ^ (t0 & t_cw_keep);
+        xor_cond(g_out_1 + keep, s_cw, s1, S_LEN, t1);
+        t1 = (alpha_bits[i] ? t1_r : t1_l) ^ (t1 & t_cw_keep);
+    }
+    V_cw = (t1?-1:1) * (BETA - TO_R_t(s0) + TO_R_t(s1));
+    memcpy(&k0[DPF_LAST_CW_PTR], &V_cw, V_LEN);
+    memset(&k0[DPF_Z_PTR], 0, V_LEN);
+    memcpy(&k1[DPF_S_CW_PTR(0)], &k0[DPF_S_CW_PTR(0)], DPF_KEY_LEN - S_LEN);
+}
+
+R_t DPF_eval(bool b, const uint8_t kb[DPF_KEY_LEN], R_t x){
+    uint8_t s[S_LEN], g[G_SIDE_LEN];
+    bool t = b, bit;
+    size_t i;
+    memcpy(s, &kb[S_PTR], S_LEN);
+    for (i = 0; i < N_BITS; i++)    // only the child on the path of x
+    {
+        bit = ((uint64_t)x >> (N_BITS-i-1)) & 1;
+        G_side_prg(s, bit, g);
+        t = DPF_child(kb, i, t, bit, g, s);
+    }
+    return (b?-1:1) * (TO_R_t(s) + t*TO_R_t(&kb[DPF_LAST_CW_PTR]));
+}
+
+int DPF_eval_full(bool b, const uint8_t kb[DPF_KEY_LEN], size_t n_bits, R_t out[]){
+    size_t n, i, w, x;
+    uint8_t *s, *s_next, *tmp, g_out[DPF_G_OUT_LEN];
+    bool *t, *t_next, *tmp_t, t_l, t_r;
+    R_t V_cw = TO_R_t(&kb[DPF_LAST_CW_PTR]);
+    if (n_bits > DPF_FULL_MAX_BITS || n_bits > N_BITS)  return -1;
+    n = (size_t)1 << n_bits;
+    s = (uint8_t*)malloc(n*S_LEN);      s_next = (uint8_t*)malloc(n*S_LEN);
+    t = (bool*)malloc(n*sizeof(bool));  t_next = (bool*)malloc(n*sizeof(bool));
+    if (!s || !s_next || !t || !t_next)
+    {
+        free(s); free(s_next); free(t); free(t_next);
+        return -1;
+    }
+    // Walk down the all-zero prefix of [0, 2^n_bits)
+    memcpy(s, &kb[S_PTR], S_LEN);
+    t[0] = b;
+    for (i = 0; i < N_BITS - n_bits; i++)
+    {
+        DPF_expand(kb, i, s, t[0], g_out, &t_l, &t_r);
+        memcpy(s, &g_out[S_L_PTR], S_LEN);
+        t[0] = t_l;
+    }
+    // Then expand the subtree one level at a time: node x has children 2x, 2x+1
+    for (w = 1; i < N_BITS; i++, w *= 2)
+    {
+#if defined(_OPENMP)
+        #pragma omp parallel for if (w >= 64)
+#endif
+        for (x = 0; x < w; x++)
+        {
+            uint8_t g[DPF_G_OUT_LEN];
+            bool tl, tr;
+            DPF_expand(kb, i, &s[x*S_LEN], t[x], g, &tl, &tr);
+            memcpy(&s_next[2*x*S_LEN], g, DPF_G_OUT_LEN);     // s_l | s_r
+            t_next[2*x] = tl;
+            t_next[2*x+1] = tr;
+        }
+        tmp = s;    s = s_next;     s_next = tmp;
+        tmp_t = t;  t = t_next;     t_next = tmp_t;
+    }
+    for (x = 0; x < n; x++)
+    {
+        out[x] = (b?-1:1) * (TO_R_t(&s[x*S_LEN]) + t[x]*V_cw);
+    }
+    free(s); free(s_next); free(t); free(t_next);
+    return 0;
+}
+
+// -------------------------------------------------------------------------- //
+// -------------------------------- EQUALITY -------------------------------- //
+// -------------------------------------------------------------------------- //
+void EQ_gen(R_t r_in, R_t r_out, uint8_t k0[DPF_KEY_LEN], uint8_t k1[DPF_KEY_LEN]){
+    DPF_gen(r_in, k0, k1);
+    TO_R_t(&k0[DPF_Z_PTR]) = random_dtype();
+    TO_R_t(&k1[DPF_Z_PTR]) = r_out - TO_R_t(&k0[DPF_Z_PTR]);
+}
+R_t EQ_eval(bool b, const uint8_t kb[DPF_KEY_LEN], R_t x_hat){
+    return DPF_eval(b, kb, x_hat) + TO_R_t(&kb[DPF_Z_PTR]);
+}
+void EQ_gen_batch(size_t K, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]){
+    size_t k;
+
+    // Generate masks
+    random_buffer((uint8_t*)r_in_0, K*sizeof(R_t));
+    random_buffer((uint8_t*)r_in_1, K*sizeof(R_t));
+    for (k=0; k<K; k++)
+    {
+        EQ_gen(r_in_0[k]+r_in_1[k], 0, &k0[k*DPF_KEY_LEN], &k1[k*DPF_KEY_LEN]);
+        r_in_1[k] -= theta;
+    }
+}
+void EQ_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]){
+    size_t k;
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.sign_chunk, n_threads);
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
+    for (k=0; k<K; k++)
+    {
+        ob[k] = EQ_eval(b, &kb[k*DPF_KEY_LEN], x_hat[k]);
+    }
+}
+
+// -------------------------------------------------------------------------- //
+// -------------------------------- SPLINE ---------------------------------- //
+// -------------------------------------------------------------------------- //
+// One DCF tree on alpha = r_in-1 with vector payload: group j holds beta_j =
+//  c_{j-1} - c_j, c_i the coefficients of piece i in x_hat. With D_j the DCF at
+//  x_hat-brk[j]-1, piece i of IC_eval is pub_i - D_i + D_{i+1} + Q_i (Q_i from
+//  IC_corr), hence sum_i c_i*1{x in piece i} = sum_i (pub_i+Q_i)*c_i + sum_j beta_j*D_j:
+//  the keys carry shares of c and of e = sum_i Q_i*c_i, and path j only needs group j.
+//
+// PRG blocks of a node seed s (G_ctr): the child seed of each side, with its t
+//  bit in the lowest bit, then the groups of each side, then the leaf groups.
+#define SPLINE_MAX_W            SPLINE_W(SPLINE_MAX_D)
+#define SPLINE_MAX_NB           SPLINE_GRP_BLOCKS(SPLINE_MAX_D)
+#define SPLINE_MAX_BLOCKS       (2*(1 + SPLINE_MAX_M*SPLINE_MAX_NB))
+#define SPLINE_CTR_S(side)              (side)
+#define SPLINE_CTR_V(nb,j,side,u)       (2 + (2*(j)+(side))*(nb) + (u))
+#define SPLINE_CTR_LEAF(m,nb,j,u)       (2 + 2*(m)*(nb) + (j)*(nb) + (u))
+#define NEG_IF(c, x)            ((c) ? (uint64_t)0-(x) : (x))   // -x if c, modulo 2^64
+
+int SPLINE_check(size_t m, size_t d, const R_t brk[]){
+    size_t i;
+    if (m < 1 || m > SPLINE_MAX_M || d > SPLINE_MAX_D || MOD_N(brk[0], N_BITS) != 0)
+    {
+        return -1;
+    }
+    for (i = 1; i < m; i++)
+    {
+        if (MOD_N(brk[i], N_BITS) <= MOD_N(brk[i-1], N_BITS))     return -1;
+    }
+    return 0;
+}
+
+// Coefficients of f(x + h) from those of f(x), in place (Taylor shift)
+static void SPLINE_shift(size_t d, uint64_t h, uint64_t c[]){
+    size_t j, k;
+    for (j = 0; j < d; j++)
+    {
+        for (k = d; k-- > j; )
+        {
+            c[k] += h*c[k+1];
+        }
+    }
+}
+
+int SPLINE_gen(size_t m, size_t d, const R_t brk[], const R_t coef[], R_t r_in, uint8_t k0[], uint8_t k1[]){
+    uint8_t s[2*S_LEN], s0[S_LEN], s1[S_LEN], s_cw[S_LEN],
+            g0[SPLINE_MAX_BLOCKS*S_LEN], g1[SPLINE_MAX_BLOCKS*S_LEN];
+    uint32_t ctr[SPLINE_MAX_BLOCKS];
+    uint64_t c[SPLINE_MAX_M*SPLINE_MAX_W], V_alpha[SPLINE_MAX_M*SPLINE_MAX_W], e[SPLINE_MAX_W],
+             beta, V_cw, Q;
+    size_t w = SPLINE_W(d), nb = SPLINE_GRP_BLOCKS(d), side_blk = 1 + m*nb, i, j, k, u,
+           keep, lose, off;
+    bool alpha_bits[N_BITS], t0 = 0, t1 = 1, t0_l, t0_r, t1_l, t1_r, t_cw[2];
+    R_t *k1_c;
+
+    if (SPLINE_check(m, d, brk))    return -1;
+    // Coefficients of each piece in x_hat: f_i(x_hat - r_in)
+    for (i = 0; i < m; i++)
+    {
+        for (k = 0; k < w; k++)     c[i*w+k] = UR(coef[i*w+k]);
+        SPLINE_shift(d, (uint64_t)0-UR(r_in), &c[i*w]);
+    }
+    memset(V_alpha, 0, sizeof(V_alpha));
+    bit_decomposition((R_t)(UR(r_in)-1), alpha_bits);
+    random_buffer(s, 2*S_LEN);      // one draw: distinct seeds even with the rand() fallback
+    memcpy(&k0[S_PTR], s, S_LEN);           memcpy(s0, s, S_LEN);
+    memcpy(&k1[S_PTR], s + S_LEN, S_LEN);   memcpy(s1, s + S_LEN, S_LEN);
+
+    // Both sides of a node: seed | groups, left | right
+    for (i = 0; i < 2; i++)
+    {
+        ctr[i*side_blk] = SPLINE_CTR_S(i);
+        for (j = 0; j < m; j++)
+        {
+            for (u = 0; u < nb; u++)    ctr[i*side_blk + 1 + j*nb + u] = SPLINE_CTR_V(nb, j, i, u);
+        }
+    }
+    for (i = 0; i < N_BITS; i++)
+    {
+        G_ctr_prg(1, 2*side_blk, s0, ctr, g0);
+        G_ctr_prg(1, 2*side_blk, s1, ctr, g1);
+        t0_l = g0[0] & 1;   g0[0] &= 0xFE;  t0_r = g0[side_blk*S_LEN] & 1;  g0[side_blk*S_LEN] &= 0xFE;
+        t1_l = g1[0] & 1;   g1[0] &= 0xFE;  t1_r = g1[side_blk*S_LEN] & 1;  g1[side_blk*S_LEN] &= 0xFE;
+        keep = alpha_bits[i] ? side_blk*S_LEN : 0;
+        lose = alpha_bits[i] ? 0 : side_blk*S_LEN;
+        xor(g0 + lose, g1 + lose, s_cw, S_LEN);
+        t_cw[0] = t0_l ^ t1_l ^ alpha_bits[i] ^ 1;
+        t_cw[1] = t0_r ^ t1_r ^ alpha_bits[i];
+        memcpy(&k0[SPLINE_S_CW_PTR(m,d,i)], s_cw, S_LEN);
+        k0[SPLINE_T_CW_L_PTR(m,d,i)] = t_cw[0];
+        k0[SPLINE_T_CW_R_PTR(m,d,i)] = t_cw[1];
+        // Value CWs of each group, as V_cw of DCF_gen_core with payload beta_j
+        for (j = 0; j < m; j++)
+        {
+            for (k = 0; k < w; k++)
+            {
+                off = (1 + j*nb)*S_LEN + k*V_LEN;
+                beta = c[((j+m-1)%m)*w+k] - c[j*w+k];
+                V_cw = NEG_IF(t1, UR(TO_R_t(g1+lose+off)) - UR(TO_R_t(g0+lose+off)) - V_alpha[j*w+k]
+                                  + alpha_bits[i]*beta);
+                V_alpha[j*w+k] += UR(TO_R_t(g0+keep+off)) - UR(TO_R_t(g1+keep+off)) + NEG_IF(t1, V_cw);
+                TO_R_t(&k0[SPLINE_V_CW_PTR(m,d,i,j) + k*V_LEN]) = (R_t)V_cw;
+            }
+        }
+        xor_cond(g0 + keep, s_cw, s0, S_LEN, t0);
+        t0 = (alpha_bits[i] ? t0_r : t0_l) ^ (t0 & t_cw[alpha_bits[i]]);
+        xor_cond(g1 + keep, s_cw, s1, S_LEN, t1);
+        t1 = (alpha_bits[i] ? t1_r : t1_l) ^ (t1 & t_cw[alpha_bits[i]]);
+    }
+    // Leaves: a block per group and per nb
+    for (j = 0; j < m; j++)
+    {
+        for (u = 0; u < nb; u++)    ctr[j*nb + u] = SPLINE_CTR_LEAF(m, nb, j, u);
+    }
+    G_ctr_prg(1, m*nb, s0, ctr, g0);
+    G_ctr_prg(1, m*nb, s1, ctr, g1);
+    for (j = 0; j < m; j++)
+    {
+        for (k = 0; k < w; k++)
+        {
+            off = j*nb*S_LEN + k*V_LEN;
+            TO_R_t(&k0[SPLINE_LAST_CW_PTR(m,d,j) + k*V_LEN]) =
+                (R_t)NEG_IF(t1, UR(TO_R_t(g1+off)) - UR(TO_R_t(g0+off)) - V_alpha[j*w+k]);
+        }
+    }
+    memcpy(&k1[SPLINE_S_CW_PTR(m,d,0)], &k0[SPLINE_S_CW_PTR(m,d,0)], SPLINE_C_PTR(m,d,0) - SPLINE_S_CW_PTR(m,d,0));
+
+    // Shares of c and of e
+    random_buffer(&k0[SPLINE_C_PTR(m,d,0)], (m+1)*SPLINE_GRP_LEN(d));
+    memset(e, 0, sizeof(e));
+    for (i = 0; i < m; i++)
+    {
+        Q = UR(IC_corr(N_BITS, r_in, brk[i], (R_t)(UR(brk[(i+1)%m])-1)));
+        k1_c = (R_t*)&k1[SPLINE_C_PTR(m,d,i)];
+        for (k = 0; k < w; k++)
+        {
+            e[k] += Q*c[i*w+k];
+            k1_c[k] = (R_t)(c[i*w+k] - UR(TO_R_t(&k0[SPLINE_C_PTR(m,d,i) + k*V_LEN])));
+        }
+    }
+    for (k = 0; k < w; k++)
+    {
+        TO_R_t(&k1[SPLINE_E_PTR(m,d) + k*V_LEN]) = (R_t)(e[k] - UR(TO_R_t(&k0[SPLINE_E_PTR(m,d) + k*V_LEN])));
+    }
+    return 0;
+}
+
+// The m paths advance in lock-step: per level, the seed block and the group
+//  blocks of every path go to G_ctr in a single call.
+static R_t SPLINE_eval_d(size_t m, size_t d, bool b, const R_t brk[], const uint8_t kb[], R_t x_hat){
+    static const uint8_t t_clear[S_LEN] = {0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                           0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint64_t s[SPLINE_MAX_M*2], g_s[2], s_cw[2], clr[2], tm;  // Seeds as two words
+    uint8_t out[SPLINE_MAX_BLOCKS*S_LEN], *g;
+    const uint8_t *v_cw;
+    uint32_t ctr[SPLINE_MAX_BLOCKS];
+    uint64_t A[SPLINE_MAX_W], y[SPLINE_MAX_M], xh = MOD_N(x_hat, N_BITS), o;
+    R_t V[SPLINE_MAX_M*SPLINE_MAX_W];
+    size_t w = SPLINE_W(d), nb = SPLINE_GRP_BLOCKS(d), path_blk = 1 + nb, i, j, k, u;
+    bool t[SPLINE_MAX_M], bit, t_g, t_cw[2];
+    int pub;
+
+    memset(V, 0, sizeof(V));
+    memcpy(clr, t_clear, S_LEN);
+    for (j = 0; j < m; j++)
+    {
+        y[j] = UR(x_hat) - UR(brk[j]) - 1;
+        memcpy(&s[2*j], &kb[S_PTR], S_LEN);
+        t[j] = b;
+    }
+    // Sums of v + t*V_cw, party b's sign applied at the end; branch-free in t
+    for (i = 0; i < N_BITS; i++)
+    {
+        for (j = 0; j < m; j++)
+        {
+            bit = (y[j] >> (N_BITS-i-1)) & 1;
+            ctr[j*path_blk] = SPLINE_CTR_S(bit);
+            for (u = 0; u < nb; u++)    ctr[j*path_blk + 1 + u] = SPLINE_CTR_V(nb, j, bit, u);
+        }
+        G_ctr_prg(m, path_blk, (uint8_t*)s, ctr, out);
+        memcpy(s_cw, &kb[SPLINE_S_CW_PTR(m,d,i)], S_LEN);
+        t_cw[0] = TO_BOOL(&kb[SPLINE_T_CW_L_PTR(m,d,i)]);
+        t_cw[1] = TO_BOOL(&kb[SPLINE_T_CW_R_PTR(m,d,i)]);
+        for (j = 0; j < m; j++)
+        {
+            bit = (y[j] >> (N_BITS-i-1)) & 1;
+            g = &out[j*path_blk*S_LEN];
+            v_cw = &kb[SPLINE_V_CW_PTR(m,d,i,j)];
+            tm = (uint64_t)0 - t[j];
+            t_g = g[0] & 1;
+            for (k = 0; k < w; k++)
+            {
+                V[j*w+k] += TO_R_t(g + S_LEN + k*V_LEN) + (TO_R_t(v_cw + k*V_LEN) & (R_t)tm);
+            }
+            memcpy(g_s, g, S_LEN);
+            s[2*j]   = (g_s[0] & clr[0]) ^ (s_cw[0] & tm);
+            s[2*j+1] = (g_s[1] & clr[1]) ^ (s_cw[1] & tm);
+            t[j] = t_g ^ (t[j] & t_cw[bit]);
+        }
+    }
+    for (j = 0; j < m; j++)
+    {
+        for (u = 0; u < nb; u++)    ctr[j*nb + u] = SPLINE_CTR_LEAF(m, nb, j, u);
+    }
+    G_ctr_prg(m, nb, (uint8_t*)s, ctr, out);
+
+    // Coefficients in x_hat: e + sum_j V_j + sum_i pub_i*c_i, then Horner
+    for (k = 0; k < w; k++)
+    {
+        A[k] = UR(TO_R_t(&kb[SPLINE_E_PTR(m,d) + k*V_LEN]));
+    }
+    for (j = 0; j < m; j++)
+    {
+        pub = (xh > MOD_N(brk[j], N_BITS)) - (xh > MOD_N(brk[(j+1)%m], N_BITS));
+        for (k = 0; k < w; k++)
+        {
+            A[k] += NEG_IF(b, UR(V[j*w+k]) + UR(TO_R_t(&out[j*nb*S_LEN + k*V_LEN])) +
+                              (t[j] ? UR(TO_R_t(&kb[SPLINE_LAST_CW_PTR(m,d,j) + k*V_LEN])) : 0));
+            A[k] += (uint64_t)(int64_t)pub * UR(TO_R_t(&kb[SPLINE_C_PTR(m,d,j) + k*V_LEN]));
+        }
+    }
+    o = A[d];
+    for (k = d; k-- > 0; )
+    {
+        o = o*xh + A[k];
+    }
+    return (R_t)o;
+}
+
+R_t SPLINE_eval(size_t m, size_t d, bool b, const R_t brk[], const uint8_t kb[], R_t x_hat){
+    switch (d)
+    {
+        case 0:     return SPLINE_eval_d(m, 0, b, brk, kb, x_hat);
+        case 1:     return SPLINE_eval_d(m, 1, b, brk, kb, x_hat);
+        case 2:     return SPLINE_eval_d(m, 2, b, brk, kb, x_hat);
+        case 3:     return SPLINE_eval_d(m, 3, b, brk, kb, x_hat);
+        default:    return SPLINE_eval_d(m, d, b, brk, kb, x_hat);
+    }
+}
+
+int SPLINE_gen_batch(size_t K, size_t m, size_t d, const R_t brk[], const R_t coef[],
+    R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]){
+    size_t k, key_len = SPLINE_KEY_LEN(m,d);
+    if (SPLINE_check(m, d, brk))    return -1;
+
+    // Generate masks
+    random_buffer((uint8_t*)r_in_0, K*sizeof(R_t));
+    random_buffer((uint8_t*)r_in_1, K*sizeof(R_t));
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (k=0; k<K; k++)
+    {
+        SPLINE_gen(m, d, brk, coef, (R_t)(UR(r_in_0[k])+UR(r_in_1[k])), &k0[k*key_len], &k1[k*key_len]);
+    }
+    return 0;
+}
+int SPLINE_eval_batch(size_t K, size_t m, size_t d, bool b, const R_t brk[], const uint8_t kb[],
+    const R_t x_hat[], R_t ob[]){
+    size_t k, key_len = SPLINE_KEY_LEN(m,d);
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.sign_chunk, n_threads);
+#endif
+    if (SPLINE_check(m, d, brk))    return -1;
+#if defined(_OPENMP)
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
+    for (k=0; k<K; k++)
+    {
+        ob[k] = SPLINE_eval(m, d, b, brk, &kb[k*key_len], x_hat[k]);
+    }
+    return 0;
+}
+
+void SPLINE_relu(R_t brk[SPLINE_RELU_M], R_t coef[SPLINE_RELU_M*SPLINE_W(SPLINE_RELU_D)]){
+    brk[0] = 0;                             coef[0] = 0;    coef[1] = 1;    // [0, 2^(n-1)): x
+    brk[1] = (R_t)(1ULL<<(N_BITS-1));       coef[2] = 0;    coef[3] = 0;    // negative: 0
+}
+
+static double sigmoid(double x){
+    return 1.0/(1.0 + exp(-x));
+}
+// Line through the sigmoid at lo and hi (frac_bits fractional bits): slope with
+//  frac_bits fractional bits, intercept with 2*frac_bits, rounded
+static void SPLINE_sigmoid_piece(size_t frac_bits, double lo, double hi, R_t coef[2]){
+    double sc = ldexp(1.0, (int)frac_bits), a1, a0;
+    a1 = (sigmoid(hi/sc) - sigmoid(lo/sc)) / ((hi - lo)/sc);
+    a0 = (sigmoid(lo/sc) - a1*lo/sc) * sc*sc;
+    a1 *= sc;
+    coef[0] = (R_t)(a0 + (a0 >= 0 ? 0.5 : -0.5));
+    coef[1] = (R_t)(a1 + (a1 >= 0 ? 0.5 : -0.5));
+}
+int SPLINE_sigmoid(size_t frac_bits, size_t n_seg, R_t brk[], R_t coef[]){
+    size_t m = SPLINE_SIGMOID_M(n_seg), k, hi = n_seg;
+    uint64_t range;
+    if (n_seg == 0 || m > SPLINE_MAX_M || 2*frac_bits+2 > N_BITS)  return -1;
+    range = (uint64_t)SPLINE_SIGMOID_RANGE << frac_bits;
+    if (range / n_seg == 0)     return -1;
+#define SEG(k)  ((int64_t)(range*(k)/n_seg))    // Boundary k of the segments of [0, range)
+    for (k = 0; k < n_seg; k++)
+    {
+        brk[k] = (R_t)SEG(k);                                       // [0, range)
+        SPLINE_sigmoid_piece(frac_bits, (double)SEG(k), (double)SEG(k+1), &coef[2*k]);
+        brk[hi+2+k] = (R_t)(0 - UR(SEG(n_seg-k)));                  // [-range, 0)
+        SPLINE_sigmoid_piece(frac_bits, -(double)SEG(n_seg-k), -(double)SEG(n_seg-k-1), &coef[2*(hi+2+k)]);
+    }
+#undef SEG
+    brk[hi]   = (R_t)range;                     // [range, 2^(n-1)): 1
+    coef[2*hi] = (R_t)(1ULL << (2*frac_bits));  coef[2*hi+1] = 0;
+    brk[hi+1] = (R_t)(1ULL<<(N_BITS-1));        // [2^(n-1), -range): 0
+    coef[2*hi+2] = 0;                           coef[2*hi+3] = 0;
+    return 0;
+}
+
+// -------------------------------------------------------------------------- //
+// ------------------------------- FUNSHADE --------------------------------- //
+// -------------------------------------------------------------------------- //
+
+// .......................... Single evaluation ............................. //
+void funshade_setup(size_t l, R_t theta, R_t r_in[2], R_t d_x0[], R_t d_x1[],
+    R_t d_y0[], R_t d_y1[], R_t d_xy0[], R_t d_xy1[], uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN])
+{
+    size_t i;
+    // Generate randomness for scalar product
+    random_buffer((uint8_t*)d_x0, l*sizeof(R_t)); random_buffer((uint8_t*)d_x1, l*sizeof(R_t));
+    random_buffer((uint8_t*)d_y0, l*sizeof(R_t)); random_buffer((uint8_t*)d_y1, l*sizeof(R_t));
+    random_buffer((uint8_t*)d_xy0, l*sizeof(R_t));random_buffer((uint8_t*)r_in, 2*sizeof(R_t));
+    for (i=0; i<l; i++)
+    {
+        d_xy1[i] = (d_x0[i]+d_x1[i]) * (d_y0[i]+d_y1[i]) - d_xy0[i];
+    }
+    // Generate keys
+    SIGN_gen(r_in[0]+r_in[1], 0, k0, k1);
+    // Remove threshold from r
+    r_in[1] -= theta;
+}
+
+
+void funshade_share(size_t l, const R_t v[], const R_t d_v[], R_t D_v[])
+{
+    size_t i;
+    for (i=0; i<l; i++)
+    {
+        D_v[i] = d_v[i] + v[i];
+    }
+}
+
+
+R_t funshade_eval_dist(size_t l, bool j, R_t r_in_j,
+    const R_t D_x[], const R_t D_y[], const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[])
+{
+    size_t i;
+    R_t z_hat_j = r_in_j;
+    for (i=0; i<l; i++)
+    {
+        z_hat_j += j*(D_x[i]*D_y[i]) - (D_x[i]*d_yj[i]) - (D_y[i]*d_xj[i]) + d_xyj[i];
+    }
+    return z_hat_j;
+}
+
+R_t funshade_eval_sign(bool j, const uint8_t kb[KEY_LEN], R_t z_hat)
+{
+    return SIGN_eval(j, kb, z_hat);
+}
+
+// ........................... Batch evaluation ............................. //
+void funshade_setup_batch(size_t K, size_t l, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+{
+    size_t idx, k;
+    // Generate randomness for scalar product
+    random_buffer((uint8_t*)d_x0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_x1, K*l*sizeof(R_t));
+    random_buffer((uint8_t*)d_y0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_y1, K*l*sizeof(R_t));
+    random_buffer((uint8_t*)d_xy0, K*l*sizeof(R_t));
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (idx=0; idx<(K*l); idx++)
+    {
+        d_xy1[idx] = (d_x0[idx]+d_x1[idx]) * (d_y0[idx]+d_y1[idx]) - d_xy0[idx];
+    }
+    // Generate masks and fss keys
+    random_buffer((uint8_t*)r_in_0, K*sizeof(R_t));
+    random_buffer((uint8_t*)r_in_1, K*sizeof(R_t));
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (k=0; k<K; k+=1)
+    {
+        SIGN_gen(r_in_0[k]+r_in_1[k], 0, &k0[k*KEY_LEN], &k1[k*KEY_LEN]);
+        // Remove threshold from r_in shares
+        r_in_1[k] -= theta;
+    }
+}
+
+void funshade_setup_batch_n(size_t K, size_t l, size_t n_bits, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+{
+    size_t idx;
+    // Generate randomness for scalar product
+    random_buffer((uint8_t*)d_x0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_x1, K*l*sizeof(R_t));
+    random_buffer((uint8_t*)d_y0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_y1, K*l*sizeof(R_t));
+    random_buffer((uint8_t*)d_xy0, K*l*sizeof(R_t));
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (idx=0; idx<(K*l); idx++)
+    {
+        d_xy1[idx] = (d_x0[idx]+d_x1[idx]) * (d_y0[idx]+d_y1[idx]) - d_xy0[idx];
+    }
+    // Generate masks and n_bits fss keys, with the threshold removed from r_in_1
+    SIGN_gen_batch_n(K, n_bits, theta, r_in_0, r_in_1, k0, k1);
+}
+
+void funshade_setup_batch_derived(const uint8_t master[MASTER_SEED_LEN], size_t a, size_t b,
+    size_t l, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+{
+    size_t k;
+    // Beaver triples of index k, one stream per share
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (k=a; k<b; k++)
+    {
+        size_t off = (k-a)*l, idx;
+        random_buffer_derived((uint8_t*)&d_x0[off],  l*sizeof(R_t), master, k, DERIVE_D_X0);
+        random_buffer_derived((uint8_t*)&d_x1[off],  l*sizeof(R_t), master, k, DERIVE_D_X1);
+        random_buffer_derived((uint8_t*)&d_y0[off],  l*sizeof(R_t), master, k, DERIVE_D_Y0);
+        random_buffer_derived((uint8_t*)&d_y1[off],  l*sizeof(R_t), master, k, DERIVE_D_Y1);
+        random_buffer_derived((uint8_t*)&d_xy0[off], l*sizeof(R_t), master, k, DERIVE_D_XY0);
+        for (idx=off; idx<off+l; idx++)
+        {
+            d_xy1[idx] = (d_x0[idx]+d_x1[idx]) * (d_y0[idx]+d_y1[idx]) - d_xy0[idx];
+        }
+    }
+    // Masks and fss keys, with the threshold removed from r_in_1
+    SIGN_gen_batch_derived(master, a, b, theta, r_in_0, r_in_1, k0, k1);
+}
+
+void funshade_setup_batch_lm(size_t K, size_t l, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0_lm[], uint8_t k1_lm[])
+{
+    size_t idx;
+    // Generate randomness for scalar product
+    random_buffer((uint8_t*)d_x0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_x1, K*l*sizeof(R_t));
+    random_buffer((uint8_t*)d_y0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_y1, K*l*sizeof(R_t));
+    random_buffer((uint8_t*)d_xy0, K*l*sizeof(R_t));
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (idx=0; idx<(K*l); idx++)
+    {
+        d_xy1[idx] = (d_x0[idx]+d_x1[idx]) * (d_y0[idx]+d_y1[idx]) - d_xy0[idx];
+    }
+    // Generate masks and fss keys, with the threshold removed from r_in_1
+    SIGN_gen_batch_lm(K, theta, r_in_0, r_in_1, k0_lm, k1_lm);
+}
+
+void funshade_share_batch(size_t K, size_t l, const R_t v[], const R_t d_v[],
+    R_t D_v[])
+{
+    size_t idx;
+    uint64_t t0 = TRACE_BEGIN();
+
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (idx=0; idx<K*l; idx++)
+    {
+        D_v[idx] = d_v[idx] + v[idx];
+    }
+    TRACE_END(FUNSHADE_STAGE_SHARE, t0);
+}
+
+void funshade_share_broadcast_batch(size_t K, size_t l, const R_t x[], const R_t d_x[],
+    R_t D_x[])
+{
+    size_t k;
+    uint64_t t0 = TRACE_BEGIN();
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (k=0; k<K; k++)
+    {
+        funshade_share(l, x, &d_x[k*l], &D_x[k*l]);
+    }
+    TRACE_END(FUNSHADE_STAGE_SHARE, t0);
+}
+
+// eval_dist of n <= FLAT_ROWS rows with small l: the products of the whole
+//  block form one contiguous loop (vectorized across rows), then each row is
+//  summed. Beats the per-row reduction when l is too short to fill a vector.
+DIST_CLONES static void eval_dist_flat(size_t n, size_t l, bool j, const R_t r_in_j[],
+    const R_t D_x[], const R_t D_y[], const R_t d_xj[], const R_t d_yj[],
+    const R_t d_xyj[], R_t z_hat_j[])
+{
+    R_t t[FLAT_ROWS*FLAT_MAX_L], jj = (R_t)j, acc;
+    size_t idx, k, i;
+    for (idx=0; idx<n*l; idx++)
+    {
+        t[idx] = D_x[idx]*(jj*D_y[idx] - d_yj[idx]) - D_y[idx]*d_xj[idx] + d_xyj[idx];
+    }
+    for (k=0; k<n; k++)
+    {
+        acc = 0;
+        for (i=0; i<l; i++)
+        {
+            acc += t[k*l+i];
+        }
+        z_hat_j[k] = r_in_j[k] + acc;
+    }
+}
+
+// Dot product share of one row pair, without r_in_j. Row pointers and a local
+//  accumulator keep the loop a plain reduction over contiguous arrays, which
+//  the compiler vectorizes (once per ISA level of DIST_CLONES).
+DIST_CLONES static R_t eval_dist_dot(size_t l, R_t jj, const R_t Dx[], const R_t Dy[],
+    const R_t dx[], const R_t dy[], const R_t dxy[])
+{
+    R_t acc = 0;
+    size_t i;
+    for (i=0; i<l; i++)
+    {
+        acc += Dx[i]*(jj*Dy[i] - dy[i]) - Dy[i]*dx[i] + dxy[i];
+    }
+    return acc;
+}
+
+void funshade_eval_dist_batch(size_t K, size_t l, bool j, const R_t r_in_j[], 
+    const R_t D_x[], const R_t D_y[], const R_t d_xj[], const R_t d_yj[],
+    const R_t d_xyj[], R_t z_hat_j[])
+{
+    size_t k, n_blocks = (K + FLAT_ROWS - 1) / FLAT_ROWS;
+    uint64_t t0 = TRACE_BEGIN();
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.dist_chunk, n_threads);
+#endif
+    if (l <= tuning.dot_flat_max_l && l <= FLAT_MAX_L)
+    {
+#if defined(_OPENMP)
+        chunk = (chunk + FLAT_ROWS - 1) / FLAT_ROWS;
+        #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
+        for (k=0; k<n_blocks; k++)
+        {
+            size_t k0 = k*FLAT_ROWS, n = (K-k0 < FLAT_ROWS) ? K-k0 : FLAT_ROWS;
+            eval_dist_flat(n, l, j, &r_in_j[k0], &D_x[k0*l], &D_y[k0*l], &d_xj[k0*l],
+                &d_yj[k0*l], &d_xyj[k0*l], &z_hat_j[k0]);
+        }
+        TRACE_END_CALL(FUNSHADE_STAGE_EVAL_DIST, t0, K, l);
+        return;
+    }
+#if defined(_OPENMP)
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
+    for (k=0; k<K; k++)
+    {
+        z_hat_j[k] = r_in_j[k] + eval_dist_dot(l, (R_t)j, &D_x[k*l], &D_y[k*l],
+                                               &d_xj[k*l], &d_yj[k*l], &d_xyj[k*l]);
+    }
+    TRACE_END_CALL(FUNSHADE_STAGE_EVAL_DIST, t0, K, l);
+}
+
+void funshade_setup_batch_metric(size_t K, size_t l, funshade_metric metric, bool below, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+{
+    // Fresh masks of y, then the rest as for a stored reference DB
+    random_buffer((uint8_t*)d_y0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_y1, K*l*sizeof(R_t));
+    funshade_setup_batch_db(K, l, metric, below, theta, d_y0, d_y1,
+                            d_x0, d_x1, d_xy0, d_xy1, r_in_0, r_in_1, k0, k1);
+}
+
+void funshade_setup_batch_db(size_t K, size_t l, funshade_metric metric, bool below, R_t theta,
+    const R_t d_y0[], const R_t d_y1[], R_t d_x0[], R_t d_x1[], R_t d_xy0[], R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+{
+    size_t idx;
+    // Generate randomness for the Beaver product (of x and y, or of w = x-y with itself)
+    random_buffer((uint8_t*)d_x0, K*l*sizeof(R_t)); random_buffer((uint8_t*)d_x1, K*l*sizeof(R_t));
+    random_buffer((uint8_t*)d_xy0, K*l*sizeof(R_t));
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (idx=0; idx<(K*l); idx++)
+    {
+        R_t d_x = d_x0[idx]+d_x1[idx], d_y = d_y0[idx]+d_y1[idx];
+        d_xy1[idx] = (metric == FUNSHADE_SQ_L2 ? (d_x-d_y)*(d_x-d_y) : d_x*d_y) - d_xy0[idx];
+    }
+    // Cosine scores are compared with 0, and below compares -score with -theta
+    if (metric == FUNSHADE_COS)     theta = 0;
+    SIGN_gen_batch(K, below ? -theta : theta, r_in_0, r_in_1, k0, k1);
+}
+
+void funshade_refresh_gen(size_t K, size_t l, bool rotate, R_t d_y0[], R_t d_y1[],
+    R_t e[], R_t e_0[], R_t e_1[])
+{
+    size_t idx;
+    random_buffer((uint8_t*)e_0, K*l*sizeof(R_t));
+    if (rotate)     random_buffer((uint8_t*)e, K*l*sizeof(R_t));
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (idx=0; idx<(K*l); idx++)
+    {
+        e_1[idx] = (rotate ? e[idx] : 0) - e_0[idx];
+        d_y0[idx] += e_0[idx];
+        d_y1[idx] += e_1[idx];
+    }
+}
+
+void funshade_refresh_batch(size_t K, size_t l, const R_t e[], const R_t e_j[], R_t D_y[], R_t d_yj[])
+{
+    size_t k;
+#if defined(_OPENMP)
+    // Rows split as in eval_dist, so each thread refreshes the rows it scores
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.dist_chunk, n_threads);
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
+    for (k=0; k<K; k++)
+    {
+        size_t idx;
+        // One pass over each array, e skipped without rotation
+        if (e)
+        {
+            for (idx=k*l; idx<(k+1)*l; idx++)
+            {
+                D_y[idx] += e[idx];
+                d_yj[idx] += e_j[idx];
+            }
+        }
+        else
+        {
+            for (idx=k*l; idx<(k+1)*l; idx++)
+            {
+                d_yj[idx] += e_j[idx];
+            }
+        }
+    }
+}
+
+// Score share of one row pair, without r_in_j (see DISTANCE METRICS)
+DIST_CLONES static R_t eval_dist_row(size_t l, funshade_metric metric, R_t theta, R_t jj,
+    const R_t Dx[], const R_t Dy[], const R_t dx[], const R_t dy[], const R_t dxy[])
+{
+    R_t acc = 0, Dw;
+    size_t i;
+    switch (metric)
+    {
+    case FUNSHADE_SQ_L2:
+        for (i=0; i<l; i++)
+        {
+            Dw = Dx[i] - Dy[i];
+            acc += Dw*(jj*Dw - 2*(dx[i] - dy[i])) + dxy[i];
+        }
+        return acc;
+    case FUNSHADE_COS:
+        for (i=0; i<l-1; i++)
+        {
+            acc += Dx[i]*(jj*Dy[i] - dy[i]) - Dy[i]*dx[i] + dxy[i];
+        }
+        return (R_t)(UR(acc) << COS_FRAC_BITS)
+               - theta*(Dx[l-1]*(jj*Dy[l-1] - dy[l-1]) - Dy[l-1]*dx[l-1] + dxy[l-1]);
+    default:
+        for (i=0; i<l; i++)
+        {
+            acc += Dx[i]*(jj*Dy[i] - dy[i]) - Dy[i]*dx[i] + dxy[i];
+        }
+        return acc;
+    }
+}
+
+void funshade_eval_dist_batch_metric(size_t K, size_t l, funshade_metric metric, bool below, R_t theta,
+    bool j, const R_t r_in_j[], const R_t D_x[], const R_t D_y[],
+    const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[], R_t z_hat_j[])
+{
+    size_t k;
+    uint64_t t0;
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.dist_chunk, n_threads);
+#endif
+    if (metric == FUNSHADE_DOT && !below)
+    {
+        funshade_eval_dist_batch(K, l, j, r_in_j, D_x, D_y, d_xj, d_yj, d_xyj, z_hat_j);
+        return;
+    }
+    if (metric == FUNSHADE_COS && l < 2)                    // no norm element: score 0
+    {
+        memcpy(z_hat_j, r_in_j, K*sizeof(R_t));
+        return;
+    }
+    t0 = TRACE_BEGIN();
+#if defined(_OPENMP)
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
+    for (k=0; k<K; k++)
+    {
+        R_t score = eval_dist_row(l, metric, theta, (R_t)j, &D_x[k*l], &D_y[k*l],
+                                  &d_xj[k*l], &d_yj[k*l], &d_xyj[k*l]);
+        z_hat_j[k] = r_in_j[k] + (below ? -score : score);
+    }
+    TRACE_END(FUNSHADE_STAGE_EVAL_DIST, t0);
+}
+
+void funshade_eval_sign_batch(size_t K, bool j, const uint8_t k_j[], const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[])
+{
+    uint64_t t0 = TRACE_BEGIN();
+#ifdef USE_CPP_ENGINE
+    funshade_eval_sign_batch_cpp(K, j, k_j, z_hat_0, z_hat_1, o_j);
+#else
+    size_t k;
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.sign_chunk, n_threads);
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
+    for (k=0; k<K; k++)
+    {
+        o_j[k]= SIGN_eval(j, &k_j[k*KEY_LEN], z_hat_0[k]+z_hat_1[k]);
+    }
+#endif
+    TRACE_END_CALL(FUNSHADE_STAGE_EVAL_SIGN, t0, K, 0);
+}
+
+R_t funshade_eval_sign_batch_collapse(size_t K, bool j, const uint8_t k_j[], const R_t z_hat_0[], const R_t z_hat_1[])
+{
+    uint64_t t0 = TRACE_BEGIN();
+    R_t o_j = 0;
+#ifdef USE_CPP_ENGINE
+    o_j = funshade_eval_sign_batch_collapse_cpp(K, j, k_j, z_hat_0, z_hat_1);
+#else
+    size_t k;
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.sign_chunk, n_threads);
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads) reduction(+:o_j)
 #endif
     for (k=0; k<K; k++)
     {
         o_j += SIGN_eval(j, &k_j[k*KEY_LEN], z_hat_0[k]+z_hat_1[k]);
     }
+#endif
+    TRACE_END_CALL(FUNSHADE_STAGE_COLLAPSE, t0, K, 0);
+    return o_j;
+}
+
+void funshade_eval_sign_batch_n(size_t K, size_t n_bits, bool j, const uint8_t k_j[], const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[])
+{
+    uint64_t t0 = TRACE_BEGIN();
+    size_t k;
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.sign_chunk, n_threads);
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads)
+#endif
+    for (k=0; k<K; k++)
+    {
+        o_j[k]= SIGN_eval_n(n_bits, j, &k_j[k*KEY_LEN_N(n_bits)], z_hat_0[k]+z_hat_1[k]);
+    }
+    TRACE_END(FUNSHADE_STAGE_EVAL_SIGN, t0);
+}
+
+R_t funshade_eval_sign_batch_collapse_n(size_t K, size_t n_bits, bool j, const uint8_t k_j[], const R_t z_hat_0[], const R_t z_hat_1[])
+{
+    uint64_t t0 = TRACE_BEGIN();
+    R_t o_j = 0;
+    size_t k;
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    size_t chunk = tune_chunk(K, tuning.sign_chunk, n_threads);
+    #pragma omp parallel for schedule(static, chunk) num_threads(n_threads) reduction(+:o_j)
+#endif
+    for (k=0; k<K; k++)
+    {
+        o_j += SIGN_eval_n(n_bits, j, &k_j[k*KEY_LEN_N(n_bits)], z_hat_0[k]+z_hat_1[k]);
+    }
+    TRACE_END(FUNSHADE_STAGE_COLLAPSE, t0);
+    return o_j;
+}
+
+void funshade_eval_sign_batch_lm(size_t K, bool j, const uint8_t k_j_lm[], const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[])
+{
+    size_t k0, k, n;
+#if defined(_OPENMP)
+    #pragma omp parallel for private(k, n)
+#endif
+    for (k0=0; k0<K; k0+=LM_CHUNK)
+    {
+        R_t z_hat[LM_CHUNK];
+        n = (K-k0 < LM_CHUNK) ? K-k0 : LM_CHUNK;
+        for (k=0; k<n; k++)
+        {
+            z_hat[k] = z_hat_0[k0+k] + z_hat_1[k0+k];
+        }
+        SIGN_eval_lm_chunk(K, j, k_j_lm, k0, n, z_hat, &o_j[k0]);
+    }
+}
+
+R_t funshade_eval_sign_batch_collapse_lm(size_t K, bool j, const uint8_t k_j_lm[], const R_t z_hat_0[], const R_t z_hat_1[])
+{
+    R_t o_j = 0;
+    size_t k0, k, n;
+#if defined(_OPENMP)
+    #pragma omp parallel for private(k, n) reduction(+:o_j)
+#endif
+    for (k0=0; k0<K; k0+=LM_CHUNK)
+    {
+        R_t z_hat[LM_CHUNK], o[LM_CHUNK];
+        n = (K-k0 < LM_CHUNK) ? K-k0 : LM_CHUNK;
+        for (k=0; k<n; k++)
+        {
+            z_hat[k] = z_hat_0[k0+k] + z_hat_1[k0+k];
+        }
+        SIGN_eval_lm_chunk(K, j, k_j_lm, k0, n, z_hat, o);
+        for (k=0; k<n; k++)
+        {
+            o_j += o[k];
+        }
+    }
     return o_j;
 }
 
+// ........................... Session context ............................. //
+#define CACHE_LINE      64                                  // Arena alignment
+#define ALIGN_UP(x)     (((x) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))
+
+struct funshade_ctx {
+    size_t K, l;
+    bool j;
+    // Borrowed offline material and reference DB
+    const R_t *r_in_j, *d_xj, *d_yj, *d_xyj, *D_y;
+    const uint8_t *k_j;
+    // Arena and the buffers carved out of it
+    uint8_t *arena;
+    R_t *D_x, *z_hat_j, *o_j;
+};
+
+funshade_ctx *funshade_ctx_new(size_t K, size_t l, bool j)
+{
+    size_t len_D_x = ALIGN_UP(K*l*sizeof(R_t)), len_K = ALIGN_UP(K*sizeof(R_t));
+    uint8_t *base;
+    funshade_ctx *ctx = (funshade_ctx*)calloc(1, sizeof(funshade_ctx));
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+    ctx->arena = (uint8_t*)malloc(len_D_x + 2*len_K + CACHE_LINE);
+    if (ctx->arena == NULL)
+    {
+        free(ctx);
+        return NULL;
+    }
+    base = (uint8_t*)ALIGN_UP((size_t)ctx->arena);
+    ctx->K = K;     ctx->l = l;     ctx->j = j;
+    ctx->D_x     = (R_t*)base;
+    ctx->z_hat_j = (R_t*)(base + len_D_x);
+    ctx->o_j     = (R_t*)(base + len_D_x + len_K);
+    // Touch the arena once so that the first query does not pay the page faults
+    memset(base, 0, len_D_x + 2*len_K);
+    return ctx;
+}
+
+void funshade_ctx_free(funshade_ctx *ctx)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+    free(ctx->arena);
+    free(ctx);
+}
+
+void funshade_ctx_set_offline(funshade_ctx *ctx, const R_t r_in_j[],
+    const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[], const uint8_t k_j[])
+{
+    ctx->r_in_j = r_in_j;   ctx->d_xj = d_xj;   ctx->d_yj = d_yj;
+    ctx->d_xyj = d_xyj;     ctx->k_j = k_j;
+}
+
+void funshade_ctx_set_db(funshade_ctx *ctx, const R_t D_y[])
+{
+    ctx->D_y = D_y;
+}
+
+R_t *funshade_ctx_D_x(funshade_ctx *ctx)
+{
+    return ctx->D_x;
+}
+
+R_t *funshade_ctx_share(funshade_ctx *ctx, const R_t x[], const R_t d_x[])
+{
+    funshade_share_broadcast_batch(ctx->K, ctx->l, x, d_x, ctx->D_x);
+    return ctx->D_x;
+}
+
+R_t *funshade_ctx_eval_dist(funshade_ctx *ctx, const R_t D_x[])
+{
+    funshade_eval_dist_batch(ctx->K, ctx->l, ctx->j, ctx->r_in_j, D_x ? D_x : ctx->D_x,
+        ctx->D_y, ctx->d_xj, ctx->d_yj, ctx->d_xyj, ctx->z_hat_j);
+    return ctx->z_hat_j;
+}
+
+R_t *funshade_ctx_eval_sign(funshade_ctx *ctx, const R_t z_hat_nj[])
+{
+    funshade_eval_sign_batch(ctx->K, ctx->j, ctx->k_j, ctx->z_hat_j, z_hat_nj, ctx->o_j);
+    return ctx->o_j;
+}
+
+R_t funshade_ctx_eval_sign_collapse(funshade_ctx *ctx, const R_t z_hat_nj[])
+{
+    return funshade_eval_sign_batch_collapse(ctx->K, ctx->j, ctx->k_j, ctx->z_hat_j, z_hat_nj);
+}
+
+// ........................ Many-to-many matching ........................... //
+#define MM_REFS         4       // References accumulated together against one probe
+#define MM_MB           64      // Probes per cache block
+#define MM_KB           64      // References per cache block
+#define MM_LB           256     // Elements per cache block: MM_KB*MM_LB*2 R_t fit in L2
+
+// One probe row against MM_REFS reference rows over [i0, i1), into acc:
+//  triple: acc[b] = <p+p2, q[b]+q2[b]>                  (A*B^T of the setup)
+//  else:   acc[b] = <j*p-p2, q[b]> - <p, q2[b]>          (D_X, A_j, D_Y, B_j)
+DIST_CLONES static void mm_micro(size_t i0, size_t i1, bool j, bool triple, const R_t *p, const R_t *p2,
+    const R_t *q[MM_REFS], const R_t *q2[MM_REFS], R_t acc[MM_REFS])
+{
+    const R_t *y0 = q[0], *y1 = q[1], *y2 = q[2], *y3 = q[3],
+              *w0 = q2[0], *w1 = q2[1], *w2 = q2[2], *w3 = q2[3];
+    R_t a0 = 0, a1 = 0, a2 = 0, a3 = 0, u, jj = (R_t)j;
+    size_t i;
+    if (triple)
+    {
+        for (i=i0; i<i1; i++)
+        {
+            u = p[i] + p2[i];
+            a0 += u*(y0[i] + w0[i]);    a1 += u*(y1[i] + w1[i]);
+            a2 += u*(y2[i] + w2[i]);    a3 += u*(y3[i] + w3[i]);
+        }
+    }
+    else
+    {
+        for (i=i0; i<i1; i++)
+        {
+            u = jj*p[i] - p2[i];
+            a0 += u*y0[i] - p[i]*w0[i]; a1 += u*y1[i] - p[i]*w1[i];
+            a2 += u*y2[i] - p[i]*w2[i]; a3 += u*y3[i] - p[i]*w3[i];
+        }
+    }
+    acc[0] = a0;    acc[1] = a1;    acc[2] = a2;    acc[3] = a3;
+}
+
+// Z[m*K+k] += mm_micro of probe m and reference k, for all M*K pairs. Blocks of
+//  MM_MB probes x MM_KB references are split among the threads; within a block
+//  the MM_LB-wide slices of the references stay in cache for all its probes.
+static void mm_blocked(size_t M, size_t K, size_t l, bool j, bool triple, const R_t P[],
+    const R_t P2[], const R_t Q[], const R_t Q2[], R_t Z[])
+{
+    size_t n_mb = (M + MM_MB - 1) / MM_MB, n_kb = (K + MM_KB - 1) / MM_KB, blk;
+#if defined(_OPENMP)
+    int n_threads = tune_threads();
+    #pragma omp parallel for schedule(static) num_threads(n_threads)
+#endif
+    for (blk=0; blk<n_mb*n_kb; blk++)
+    {
+        size_t m0 = (blk / n_kb)*MM_MB, k0 = (blk % n_kb)*MM_KB,
+               m1 = (M-m0 < MM_MB) ? M : m0+MM_MB, k1 = (K-k0 < MM_KB) ? K : k0+MM_KB,
+               i0, i1, m, k, b, kb;
+        const R_t *q[MM_REFS], *q2[MM_REFS];
+        R_t acc[MM_REFS];
+        for (i0=0; i0<l; i0+=MM_LB)
+        {
+            i1 = (l-i0 < MM_LB) ? l : i0+MM_LB;
+            for (m=m0; m<m1; m++)
+            {
+                for (k=k0; k<k1; k+=MM_REFS)
+                {
+                    // A partial group repeats its last reference, discarded below
+                    for (b=0; b<MM_REFS; b++)
+                    {
+                        kb = (k+b < k1) ? k+b : k1-1;
+                        q[b] = &Q[kb*l];    q2[b] = &Q2[kb*l];
+                    }
+                    mm_micro(i0, i1, j, triple, &P[m*l], &P2[m*l], q, q2, acc);
+                    for (b=0; b<MM_REFS && k+b<k1; b++)
+                    {
+                        Z[m*K+k+b] += acc[b];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void funshade_setup_matrix(size_t M, size_t K, size_t l, R_t theta,
+    R_t A0[], R_t A1[], R_t B0[], R_t B1[], R_t C0[], R_t C1[],
+    R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+{
+    size_t idx;
+    // Matrix Beaver triple: C0 + C1 = (A0+A1)*(B0+B1)^T
+    random_buffer((uint8_t*)A0, M*l*sizeof(R_t));   random_buffer((uint8_t*)A1, M*l*sizeof(R_t));
+    random_buffer((uint8_t*)B0, K*l*sizeof(R_t));   random_buffer((uint8_t*)B1, K*l*sizeof(R_t));
+    random_buffer((uint8_t*)C0, M*K*sizeof(R_t));
+    for (idx=0; idx<M*K; idx++)
+    {
+        C1[idx] = -C0[idx];
+    }
+    mm_blocked(M, K, l, 0, true, A0, A1, B0, B1, C1);
+    // Masks and fss keys of the M*K comparisons, with the threshold removed from r_in_1
+    SIGN_gen_batch(M*K, theta, r_in_0, r_in_1, k0, k1);
+}
+
+void funshade_eval_dist_matrix(size_t M, size_t K, size_t l, bool j, const R_t r_in_j[],
+    const R_t D_X[], const R_t D_Y[], const R_t A_j[], const R_t B_j[], const R_t C_j[],
+    R_t z_hat_j[])
+{
+    size_t idx;
+    uint64_t t0 = TRACE_BEGIN();
+    for (idx=0; idx<M*K; idx++)
+    {
+        z_hat_j[idx] = r_in_j[idx] + C_j[idx];
+    }
+    mm_blocked(M, K, l, j, false, D_X, A_j, D_Y, B_j, z_hat_j);
+    TRACE_END(FUNSHADE_STAGE_EVAL_DIST, t0);
+}
+
+// .......................... Quantized inputs .............................. //
+bool funshade_check_overflow(size_t l, R_t max_el, bool normalized)
+{
+    uint64_t m = max_el<0 ? 0-(uint64_t)max_el : (uint64_t)max_el;    // |INT64_MIN| too
+    uint64_t limit = ((uint64_t)1 << (N_BITS-1)) - 1;       // max positive R_t
+    if (m >= ((uint64_t)1 << 32))
+    {
+        return false;                                       // m^2 overflows
+    }
+    limit /= 2;                                             // room for theta
+    if (!normalized)
+    {
+        limit /= (l ? l : 1);
+    }
+    return m*m <= limit;
+}
+
+size_t funshade_sign_bits(size_t l, R_t max_el, bool normalized)
+{
+    uint64_t m = max_el<0 ? 0-(uint64_t)max_el : (uint64_t)max_el, z_max;
+    size_t n_bits = 2;
+    if (m >= ((uint64_t)1 << 32))
+    {
+        return 0;                                           // m^2 overflows
+    }
+    z_max = m*m;
+    if (!normalized)
+    {
+        if (l && z_max > (UINT64_MAX >> 2) / l)     return 0;
+        z_max *= (l ? l : 1);
+    }
+    // |z-theta| <= 2*z_max must fit the signed range [-2^(n-1), 2^(n-1))
+    while (n_bits < 64 && ((uint64_t)1 << (n_bits-1)) <= 2*z_max)
+    {
+        n_bits++;
+    }
+    return n_bits <= N_BITS ? n_bits : 0;
+}
+
+void funshade_share_batch_i8(size_t K, size_t l, const int8_t v[], const R_t d_v[], R_t D_v[])
+{
+    size_t idx;
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (idx=0; idx<K*l; idx++)
+    {
+        D_v[idx] = d_v[idx] + (R_t)v[idx];
+    }
+}
+
+void funshade_share_batch_i16(size_t K, size_t l, const int16_t v[], const R_t d_v[], R_t D_v[])
+{
+    size_t idx;
+#if defined(_OPENMP)
+    #pragma omp parallel for
+#endif
+    for (idx=0; idx<K*l; idx++)
+    {
+        D_v[idx] = d_v[idx] + (R_t)v[idx];
+    }
+}
+
+// Per row: the squared norm (the row is then in cache), then scale, round, check
+//  and share. |e| < max_el+0.5 is exactly "round(e) in [-max_el, max_el]", and
+//  is false for NaN.
+int funshade_share_float_batch(size_t K, size_t l, const float v[], R_t max_el, bool normalize,
+    const R_t d_v[], R_t D_v[])
+{
+    size_t k;
+    int bad = 0;
+    if (!funshade_check_overflow(l, max_el, normalize))
+    {
+        return -1;
+    }
+#if defined(_OPENMP)
+    #pragma omp parallel for reduction(|:bad)
+#endif
+    for (k=0; k<K; k++)
+    {
+        const float *vk = &v[k*l];
+        const R_t *dk = &d_v[k*l];
+        R_t *Dk = &D_v[k*l];
+        float s = (float)max_el;
+        double m = (double)max_el + 0.5, e, n2 = 0;     // exact: max_el passed check_overflow
+        size_t i;
+        if (normalize)
+        {
+            for (i=0; i<l; i++)
+            {
+                n2 += (double)vk[i]*vk[i];
+            }
+            s = (n2 > 0) ? (float)((double)max_el/sqrt(n2)) : 0;
+        }
+        for (i=0; i<l; i++)
+        {
+            e = (double)(vk[i]*s);
+            if (!(e < m && e > -m))                     // also NaN, where the cast is UB
+            {
+                bad = 1;
+                continue;
+            }
+            Dk[i] = dk[i] + (R_t)(e + (e >= 0 ? 0.5 : -0.5));
+        }
+    }
+    return bad ? -1 : 0;
+}
+
+int funshade_share_f64_batch(size_t K, size_t l, const double v[], R_t max_el, bool normalize,
+    const R_t d_v[], R_t D_v[])
+{
+    size_t k;
+    int bad = 0;
+    if (!funshade_check_overflow(l, max_el, normalize))
+    {
+        return -1;
+    }
+#if defined(_OPENMP)
+    #pragma omp parallel for reduction(|:bad)
+#endif
+    for (k=0; k<K; k++)
+    {
+        const double *vk = &v[k*l];
+        const R_t *dk = &d_v[k*l];
+        R_t *Dk = &D_v[k*l];
+        double s = (double)max_el, m = (double)max_el + 0.5, e, n2 = 0;
+        size_t i;
+        if (normalize)
+        {
+            for (i=0; i<l; i++)
+            {
+                n2 += vk[i]*vk[i];
+            }
+            s = (n2 > 0) ? (double)max_el/sqrt(n2) : 0;
+        }
+        for (i=0; i<l; i++)
+        {
+            e = vk[i]*s;
+            if (!(e < m && e > -m))                     // also NaN, where the cast is UB
+            {
+                bad = 1;
+                continue;
+            }
+            Dk[i] = dk[i] + (R_t)(e + (e >= 0 ? 0.5 : -0.5));
+        }
+    }
+    return bad ? -1 : 0;
+}
+
+R_t funshade_scale_threshold(double theta, R_t max_el)
+{
+    double t = theta*(double)max_el*(double)max_el;
+    return (R_t)(t + (t >= 0 ? 0.5 : -0.5));
+}
+
 // -------------------------------------------------------------------------- //
 // --------------------- Outside the scope of Funshade ---------------------- //
 // -------------------------------------------------------------------------- //
@@ -22,6 +22,10 @@
 
 #include "aes.h" // AES-128-NI and AES-128-standalone
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 //----------------------------------------------------------------------------//
 //------------------------  CONFIGURABLE PARAMETERS --------------------------//
 //----------------------------------------------------------------------------//
@@ -38,6 +42,7 @@
 #define CEIL(x,y)       (((x) - 1) / (y) + 1)               // x/y rounded up to the nearest integer
 #define assertm(exp, msg) assert(((void)msg, exp))          // Assert with message
 #define U(x)            ((unsigned)(x))                     // Unsigned cast
+#define UR(x)           ((uint64_t)(x))                     // Unsigned cast, wide enough for R_t (wrapping adds)
 
 // FIXED DEFINITIONS
 #define N_BITS          sizeof(R_t)*8                       // Number of bits in R_t
@@ -56,6 +61,15 @@
 #define CW_CHAIN_LEN    ((CW_LEN*N_BITS)+V_LEN)             // Size of the correction word chain
 #define KEY_LEN         (S_LEN + CW_CHAIN_LEN + V_LEN)      // Size of the FSS key
 
+// Keys of the gates on n-bit inputs (n <= N_BITS, see REDUCED DOMAIN): same
+//  layout with n correction words, so KEY_LEN == KEY_LEN_N(N_BITS)
+#define CW_CHAIN_LEN_N(n)   ((CW_LEN*(n))+V_LEN)                    // Size of the correction word chain
+#define KEY_LEN_N(n)        (S_LEN + CW_CHAIN_LEN_N(n) + V_LEN)     // Size of the FSS key
+#define LAST_CW_PTR_N(n)    (CW_LEN*(n))                            // Position of V_cw_n+1 in the chain
+#define Z_PTR_N(n)          (CW_CHAIN_PTR + CW_CHAIN_LEN_N(n))      // Position of value z
+#define N_MASK(n)           ((n) >= 64 ? ~(uint64_t)0 : (((uint64_t)1<<(n))-1))
+#define MOD_N(x,n)          ((uint64_t)(x) & N_MASK(n))             // x modulo 2^n, unsigned
+
 // Positions of the elements in the correction word chain, for each correction word j
 #define S_CW_PTR(j)     (j*CW_LEN)                          // Position of state s_cw
 #define V_CW_PTR(j)     (S_CW_PTR(j) + S_LEN)               // Position of value V_cw
@@ -63,25 +77,72 @@
 #define T_CW_R_PTR(j)   (T_CW_L_PTR(j) + 1)                 // Position of bit t_cw_r
 #define LAST_CW_PTR     (CW_LEN*N_BITS)                     // Position of last correction word, V_cw_n+1
 
-// Positions of left and right elements in the output of G 
+// Positions of left and right states in the output of G (DPF tree)
 #define S_L_PTR         0                                   // Position of state s_l in G output
 #define S_R_PTR         (S_L_PTR + S_LEN)                   // Position of state s_r in G output
-#define V_L_PTR         (S_R_PTR + S_LEN)                   // Position of value v_l in G output
-#define V_R_PTR         (V_L_PTR + V_LEN)                   // Position of value v_r in G output
-#define T_L_PTR         (V_R_PTR + V_LEN)                   // Position of bit t_l in G output
-#define T_R_PTR         (T_L_PTR + 1)                       // Position of bit t_r in G output
+
+// Positions in the output of G_side (DCF tree): each side, left or right, is
+//  computed on its own and holds s | v | t, so evaluation expands one side only
+#define GS_S_PTR        0                                   // Position of state s in a side
+#define GS_V_PTR        (GS_S_PTR + S_LEN)                  // Position of value v in a side
+#define GS_T_PTR        (GS_V_PTR + V_LEN)                  // Position of bit t in a side
 
 // Positions of the elements in the FSS key
 #define S_PTR           0                                   // Position of state s
 #define CW_CHAIN_PTR    (S_PTR + S_LEN)                     // Position of correction word chain
 #define Z_PTR           (CW_CHAIN_PTR + CW_CHAIN_LEN)       // Position of value z
 
+// Positions of the elements of key k in a level-major batch of K keys. Same
+//  K*KEY_LEN bytes as K contiguous keys, but grouped by element and level:
+//  [s]*K | for each level i: [s_cw]*K [V_cw]*K [t_cw_l]*K [t_cw_r]*K | [V_cw_n+1]*K | [z]*K
+#define LM_S_PTR(K,k)       ((k)*S_LEN)                                     // State s
+#define LM_LVL_PTR(K,i)     ((K)*S_LEN + (i)*(K)*CW_LEN)                    // Level i block
+#define LM_S_CW_PTR(K,i,k)  (LM_LVL_PTR(K,i) + (k)*S_LEN)                   // State s_cw
+#define LM_V_CW_PTR(K,i,k)  (LM_LVL_PTR(K,i) + (K)*S_LEN + (k)*V_LEN)       // Value V_cw
+#define LM_T_CW_L_PTR(K,i,k) (LM_LVL_PTR(K,i) + (K)*(S_LEN+V_LEN) + (k))    // Bit t_cw_l
+#define LM_T_CW_R_PTR(K,i,k) (LM_LVL_PTR(K,i) + (K)*(S_LEN+V_LEN+1) + (k))  // Bit t_cw_r
+#define LM_LAST_CW_PTR(K,k) (LM_LVL_PTR(K,N_BITS) + (k)*V_LEN)              // V_cw_n+1
+#define LM_Z_PTR(K,k)       (LM_LVL_PTR(K,N_BITS) + (K)*V_LEN + (k)*V_LEN)  // Value z
+
+// DPF keys: no values per level, and the control bits t_l/t_r are the lowest
+//  bits of the v blocks of G_side(s, 0)/G_side(s, 1), so evaluation expands
+//  a single side of 2 counter blocks per level.
+//  [s] | for each level i: [s_cw][t_cw_l][t_cw_r] | [V_cw_n+1] | [z]
+#define DPF_G_OUT_LEN   (2*S_LEN)                           // s_l | s_r
+#define DPF_CW_LEN      (S_LEN + 2)                         // Size of the correction words
+#define DPF_KEY_LEN     (S_LEN + DPF_CW_LEN*N_BITS + V_LEN + V_LEN)   // Size of the DPF key
+#define DPF_S_CW_PTR(i)     (S_LEN + (i)*DPF_CW_LEN)        // Position of state s_cw
+#define DPF_T_CW_L_PTR(i)   (DPF_S_CW_PTR(i) + S_LEN)       // Position of bit t_cw_l
+#define DPF_T_CW_R_PTR(i)   (DPF_T_CW_L_PTR(i) + 1)         // Position of bit t_cw_r
+#define DPF_LAST_CW_PTR     (S_LEN + DPF_CW_LEN*N_BITS)     // Position of last correction word
+#define DPF_Z_PTR           (DPF_LAST_CW_PTR + V_LEN)       // Position of value z
+#define DPF_FULL_MAX_BITS   24                              // Largest domain of DPF_eval_full
+
+// Spline keys (SPLINE GATE): s | CW_i for i < N_BITS | last CWs | c shares | e share.
+//  Each CW_i is s_cw | t_cw_l | t_cw_r | V_cw of the m payload groups (SPLINE_W(d) values each).
+#define SPLINE_MAX_M        32                              // Most pieces of a spline
+#define SPLINE_MAX_D        7                               // Highest degree of a piece
+#define SPLINE_W(d)         ((d)+1)                         // Values per group: coefficients of degree 0..d
+#define SPLINE_GRP_LEN(d)   (SPLINE_W(d)*V_LEN)             // Size of a payload group
+#define SPLINE_GRP_BLOCKS(d) CEIL(SPLINE_GRP_LEN(d),S_LEN)  // PRG blocks per payload group
+#define SPLINE_CW_LEN(m,d)  (S_LEN + 2 + (m)*SPLINE_GRP_LEN(d))             // Size of the correction words
+#define SPLINE_S_CW_PTR(m,d,i)      (S_LEN + (i)*SPLINE_CW_LEN(m,d))        // Position of state s_cw
+#define SPLINE_T_CW_L_PTR(m,d,i)    (SPLINE_S_CW_PTR(m,d,i) + S_LEN)        // Position of bit t_cw_l
+#define SPLINE_T_CW_R_PTR(m,d,i)    (SPLINE_T_CW_L_PTR(m,d,i) + 1)          // Position of bit t_cw_r
+#define SPLINE_V_CW_PTR(m,d,i,j)    (SPLINE_T_CW_R_PTR(m,d,i) + 1 + (j)*SPLINE_GRP_LEN(d))  // V_cw of group j
+#define SPLINE_LAST_CW_PTR(m,d,j)   (SPLINE_S_CW_PTR(m,d,N_BITS) + (j)*SPLINE_GRP_LEN(d))   // Last CW of group j
+#define SPLINE_C_PTR(m,d,i)         (SPLINE_LAST_CW_PTR(m,d,m) + (i)*SPLINE_GRP_LEN(d))     // Share of c_i
+#define SPLINE_E_PTR(m,d)           SPLINE_C_PTR(m,d,m)                                     // Share of e
+#define SPLINE_KEY_LEN(m,d)         (SPLINE_E_PTR(m,d) + SPLINE_GRP_LEN(d))                 // Size of the spline key
+
 //----------------------------------------------------------------------------//
 //--------------------------------  PRIVATE  ---------------------------------//
 //----------------------------------------------------------------------------//
+#ifndef __cplusplus     // xor is an operator name in C++
 void xor(const uint8_t *a, const uint8_t *b, uint8_t *res, size_t s_len);
 void bit_decomposition(R_t value, bool *bits_array);
 void xor_cond(const uint8_t *a, const uint8_t *b, uint8_t *res, size_t len, bool cond);
+#endif
 #ifdef USE_LIBSODIUM
 void init_libsodium();
 #endif
@@ -97,9 +158,17 @@ R_t random_dtype_seeded(const uint8_t seed[SEED_LEN]);
 void random_buffer(uint8_t buffer[], size_t buffer_len);   // Non-deterministic seed 
 void random_buffer_seeded(uint8_t buffer[], size_t buffer_len, const uint8_t seed[SEED_LEN]);
 
+// Keyed derivation: stream number domain of index k under a master seed, as
+//  AES in counter mode (Miyaguchi-Preneel). Deterministic and seekable: any
+//  index can be generated alone, in any order, with the same bytes on any host.
+#define MASTER_SEED_LEN AES_BLOCKLEN
+enum { DERIVE_KEYS = 0, DERIVE_D_X0, DERIVE_D_X1, DERIVE_D_Y0, DERIVE_D_Y1, DERIVE_D_XY0 };
+void random_buffer_derived(uint8_t buffer[], size_t buffer_len, const uint8_t master[MASTER_SEED_LEN],
+    uint64_t k, uint32_t domain);
+
 //................................ DCF GATE ..................................//
 // FSS gate for the Distributed Conditional Function (DCF) gate.
-//  Yields o0 + o1 = BETA*((unsigned)x>(unsigned)alpha)
+//  Yields o0 + o1 = BETA*((unsigned)x<(unsigned)alpha)
 
 /// @brief Generate a FSS key pair for the DCF gate
 /// @param alpha input mask (should be uniformly random in R_t)
@@ -114,9 +183,14 @@ void DCF_gen_seeded(R_t alpha, uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN], uint8_t
 /// @param b        party number (0 or 1)
 /// @param kb       pointer to the key of the party
 /// @param x_hat    public input to the FSS gate
-/// @return         result of the FSS gate o, such that o0 + o1 = BETA*((unsigned)x>(unsigned)alpha)
+/// @return         result of the FSS gate o, such that o0 + o1 = BETA*((unsigned)x<(unsigned)alpha)
 R_t DCF_eval(bool b, const uint8_t kb[KEY_LEN], R_t x_hat);
 
+/// @brief DCF_gen of K keys, one per alpha[k] (keys k*KEY_LEN), multithreaded
+void DCF_gen_batch(size_t K, const R_t alpha[], uint8_t k0[], uint8_t k1[]);
+/// @brief ob[k] = DCF_eval(b, &kb[k*KEY_LEN], x_hat[k]), multithreaded
+void DCF_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]);
+
 
 //................................ IC GATE ...................................//
 
@@ -138,12 +212,131 @@ void IC_gen(R_t r_in, R_t r_out, R_t p, R_t q, uint8_t k0_ic[KEY_LEN], uint8_t k
 /// @return         result of the FSS gate oj, such that o0 + o1 = BETA*(p<=x<=q)
 R_t IC_eval(bool b, R_t p, R_t q, const uint8_t kb_ic[KEY_LEN], R_t x_hat);
 
+/// @brief IC_gen with the DCF seeds s0/s1 (NULL: generated) and the z share z0 of party 0
+void IC_gen_seeded(R_t r_in, R_t r_out, R_t p, R_t q, uint8_t s0[S_LEN], uint8_t s1[S_LEN], R_t z0,
+    uint8_t k0_ic[KEY_LEN], uint8_t k1_ic[KEY_LEN]);
+
+/// @brief K IC keys with per-element bounds [p[k], q[k]] and random input
+///        masks shared as r_in_0[k] + r_in_1[k]: with x_hat[k] = x[k] + r_in_0[k]
+///        + r_in_1[k], the outputs of IC_eval_batch on the same p and q add up
+///        to (p[k] <= x[k] <= q[k]) (unsigned comparisons, as IC_eval).
+void IC_gen_batch(size_t K, const R_t p[], const R_t q[], R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+void IC_eval_batch(size_t K, bool b, const R_t p[], const R_t q[], const uint8_t kb[], const R_t x_hat[], R_t ob[]);
+
 //................................. SIGN GATE ................................//
 void SIGN_gen(R_t r_in, R_t r_out, uint8_t k0[KEY_LEN], uint8_t k1[KEY_LEN]);
 R_t SIGN_eval(bool b, const uint8_t kb[KEY_LEN], R_t x_hat);
 void SIGN_gen_batch(size_t K, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
 void SIGN_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]);
 
+/// @brief SIGN_gen_batch for indices [a, b) of a batch derived from master
+///        (b-a masks and keys), independent of any other index.
+void SIGN_gen_batch_derived(const uint8_t master[MASTER_SEED_LEN], size_t a, size_t b, R_t theta,
+    R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+
+// LEVEL-MAJOR KEY BATCHES
+//  Same keys as above, stored with the LM_* layout so that evaluating K keys in
+//  lock-step reads each level's correction words sequentially.
+void FSS_keys_to_level_major(size_t K, const uint8_t k[], uint8_t k_lm[]);
+void FSS_keys_from_level_major(size_t K, const uint8_t k_lm[], uint8_t k[]);
+void SIGN_gen_batch_lm(size_t K, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0_lm[], uint8_t k1_lm[]);
+void SIGN_eval_batch_lm(size_t K, bool b, const uint8_t kb_lm[], const R_t x_hat[], R_t ob[]);
+
+//............................. REDUCED DOMAIN ...............................//
+// DCF, IC and SIGN gates on n_bits-bit inputs, 1 <= n_bits <= N_BITS: inputs
+//  are taken modulo 2^n_bits (their n_bits lowest bits) and outputs stay in R_t.
+//  Keys take KEY_LEN_N(n_bits) bytes and evaluation n_bits PRG levels instead
+//  of N_BITS, for comparisons bounded by |x| < 2^(n_bits-1) (funshade_sign_bits).
+//  Masks can stay uniform in R_t: their n_bits lowest bits mask x modulo 2^n_bits.
+void DCF_gen_n(size_t n_bits, R_t alpha, uint8_t k0[], uint8_t k1[]);
+R_t DCF_eval_n(size_t n_bits, bool b, const uint8_t kb[], R_t x_hat);
+void IC_gen_n(size_t n_bits, R_t r_in, R_t r_out, R_t p, R_t q, uint8_t k0_ic[], uint8_t k1_ic[]);
+R_t IC_eval_n(size_t n_bits, bool b, R_t p, R_t q, const uint8_t kb_ic[], R_t x_hat);
+void SIGN_gen_n(size_t n_bits, R_t r_in, R_t r_out, uint8_t k0[], uint8_t k1[]);
+R_t SIGN_eval_n(size_t n_bits, bool b, const uint8_t kb[], R_t x_hat);
+void SIGN_gen_batch_n(size_t K, size_t n_bits, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+void SIGN_eval_batch_n(size_t K, size_t n_bits, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]);
+
+//................................ DPF GATE ..................................//
+// FSS gate for the Distributed Point Function (DPF), with its own DPF_KEY_LEN
+//  keys (shorter than KEY_LEN). Yields o0 + o1 = BETA*(x == alpha) in a single
+//  tree traversal of 2 AES blocks per level, where IC_eval with p=q takes two
+//  DCF traversals of 2 blocks per level.
+
+/// @brief Generate a FSS key pair for the DPF gate of point alpha
+void DPF_gen(R_t alpha, uint8_t k0[DPF_KEY_LEN], uint8_t k1[DPF_KEY_LEN]);
+
+/// @brief Evaluate the DPF gate on x: o0 + o1 = BETA*(x == alpha)
+R_t DPF_eval(bool b, const uint8_t kb[DPF_KEY_LEN], R_t x);
+
+/// @brief Full-domain evaluation: out[x] = DPF_eval(b, kb, x) for all x in
+///        [0, 2^n_bits), expanding the tree once (~2^n_bits PRG calls instead
+///        of n_bits*2^n_bits). Meant for small domains, e.g. a secret index
+///        alpha < 2^n_bits into a table T, where sum_x T[x]*out[x] shares T[alpha].
+/// @return 0, or -1 if n_bits > DPF_FULL_MAX_BITS (or N_BITS) or out of memory
+int DPF_eval_full(bool b, const uint8_t kb[DPF_KEY_LEN], size_t n_bits, R_t out[]);
+
+//.............................. EQUALITY GATE ...............................//
+// Equality on masked inputs x_hat = x + r_in, on DPF keys of point r_in:
+//  o0 + o1 = BETA*(x == 0) + r_out. The batch variants mirror SIGN_*_batch:
+//  the keys compare with theta, removed from r_in_1, so that z_hat = z + r_in_0
+//  + r_in_1 yields (z == theta), e.g. for exact-ID and tag matching.
+void EQ_gen(R_t r_in, R_t r_out, uint8_t k0[DPF_KEY_LEN], uint8_t k1[DPF_KEY_LEN]);
+R_t EQ_eval(bool b, const uint8_t kb[DPF_KEY_LEN], R_t x_hat);
+void EQ_gen_batch(size_t K, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+void EQ_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]);
+
+//............................... SPLINE GATE ................................//
+// Piecewise polynomial f on masked inputs x_hat = x + r_in: o0 + o1 = f(x), for
+//  activations on shared scores (ReLU, sigmoid). The m pieces are given by
+//  breakpoints brk[0] = 0 < brk[1] < ... < brk[m-1] (unsigned order), piece i
+//  covering [brk[i], brk[i+1]) and piece m-1 [brk[m-1], 2^N_BITS), and by the
+//  coefficients coef[i*(d+1) + k] of x^k in piece i, all in the ring.
+//
+// The pieces share a single DCF tree on r_in-1, with one payload group per
+//  breakpoint: the difference of the coefficients of the pieces it separates,
+//  re-expressed in x_hat. Evaluation follows the m paths x_hat-brk[j]-1 (one per
+//  breakpoint, each used by the two adjacent IC terms), all in lock-step with
+//  their PRG blocks in one pipelined call per level, and expands only the group
+//  of each path. The result is linear in the shares: no multiplication round.
+//  m separate IC gates take 2m traversals and give only the indicators.
+
+/// @brief Check a spline: 1 <= m <= SPLINE_MAX_M, d <= SPLINE_MAX_D, brk[0] = 0
+///        and strictly increasing breakpoints (unsigned).
+/// @return 0 if valid, -1 otherwise
+int SPLINE_check(size_t m, size_t d, const R_t brk[]);
+
+/// @brief Generate a key pair of SPLINE_KEY_LEN(m,d) bytes for input mask r_in
+/// @return 0, or -1 if the spline is invalid (SPLINE_check)
+int SPLINE_gen(size_t m, size_t d, const R_t brk[], const R_t coef[], R_t r_in, uint8_t k0[], uint8_t k1[]);
+
+/// @brief Evaluate the spline gate on x_hat = x + r_in: o0 + o1 = f(x).
+///        The spline must be valid and the one of SPLINE_gen.
+R_t SPLINE_eval(size_t m, size_t d, bool b, const R_t brk[], const uint8_t kb[], R_t x_hat);
+
+/// @brief Batch of K elements under the same spline, masks r_in_0 + r_in_1
+///        drawn like IC_gen_batch, keys of SPLINE_KEY_LEN(m,d) bytes each.
+/// @return 0, or -1 if the spline is invalid (SPLINE_check)
+int SPLINE_gen_batch(size_t K, size_t m, size_t d, const R_t brk[], const R_t coef[],
+    R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+int SPLINE_eval_batch(size_t K, size_t m, size_t d, bool b, const R_t brk[], const uint8_t kb[],
+    const R_t x_hat[], R_t ob[]);
+
+// Presets. ReLU: max(x, 0) on signed x, exact.
+#define SPLINE_RELU_M           2
+#define SPLINE_RELU_D           1
+void SPLINE_relu(R_t brk[SPLINE_RELU_M], R_t coef[SPLINE_RELU_M*SPLINE_W(SPLINE_RELU_D)]);
+
+// Sigmoid: piecewise linear interpolation on n_seg segments of [0, 8) and of
+//  [-8, 0), saturated outside, on x with frac_bits fractional bits. The output
+//  has 2*frac_bits fractional bits (x times a slope of frac_bits).
+#define SPLINE_SIGMOID_RANGE    8
+#define SPLINE_SIGMOID_M(n_seg) (2*(n_seg)+2)
+#define SPLINE_SIGMOID_D        1
+/// @brief Breakpoints (SPLINE_SIGMOID_M(n_seg)) and coefficients (twice as many)
+/// @return 0, or -1 if the pieces do not fit in R_t or are empty
+int SPLINE_sigmoid(size_t frac_bits, size_t n_seg, R_t brk[], R_t coef[]);
+
 //................................. FUNSHADE .................................//
 // SINGLE EVALUATION
 
@@ -199,6 +392,11 @@ void funshade_setup_batch(size_t K, size_t l, R_t theta,
 void funshade_share_batch(size_t K, size_t l, const R_t v[], const R_t d_v[],
     R_t D_v[]);
 
+/// @brief Share a single vector x against K masks, D_x[k*l+i] = d_x[k*l+i] + x[i].
+///        Equivalent to funshade_share_batch on x tiled K times, without the tile.
+void funshade_share_broadcast_batch(size_t K, size_t l, const R_t x[], const R_t d_x[],
+    R_t D_x[]);
+
 void funshade_eval_dist_batch(size_t K, size_t l, bool j,
     const R_t r_in_j[], const R_t D_x[], const R_t D_y[],
     const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[],
@@ -207,6 +405,233 @@ void funshade_eval_dist_batch(size_t K, size_t l, bool j,
 void funshade_eval_sign_batch(size_t K, bool j, const uint8_t kj[], const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[]);
 R_t funshade_eval_sign_batch_collapse(size_t K, bool j, const uint8_t kj[], const R_t z_hat_0[], const R_t z_hat_1[]);
 
+/// @brief funshade_setup_batch for indices [a, b) of the batch derived from
+///        master: outputs hold b-a elements (triples (b-a)*l), the same bytes
+///        as the [a, b) slice of any larger derived batch. Slices can thus be
+///        dealt by separate threads or machines, or regenerated when lost. The
+///        master seed yields the material of both parties: keep it with the dealer.
+void funshade_setup_batch_derived(const uint8_t master[MASTER_SEED_LEN], size_t a, size_t b,
+    size_t l, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+
+// Level-major variants (see LEVEL-MAJOR KEY BATCHES), keys k0_lm/k1_lm/k_j_lm
+void funshade_setup_batch_lm(size_t K, size_t l, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0_lm[], uint8_t k1_lm[]);
+void funshade_eval_sign_batch_lm(size_t K, bool j, const uint8_t k_j_lm[], const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[]);
+R_t funshade_eval_sign_batch_collapse_lm(size_t K, bool j, const uint8_t k_j_lm[], const R_t z_hat_0[], const R_t z_hat_1[]);
+
+// Reduced-domain variants (see REDUCED DOMAIN), keys k0/k1/k_j of K*KEY_LEN_N(n_bits)
+void funshade_setup_batch_n(size_t K, size_t l, size_t n_bits, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+void funshade_eval_sign_batch_n(size_t K, size_t n_bits, bool j, const uint8_t k_j[], const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[]);
+R_t funshade_eval_sign_batch_collapse_n(size_t K, size_t n_bits, bool j, const uint8_t k_j[], const R_t z_hat_0[], const R_t z_hat_1[]);
+
+// DISTANCE METRICS
+//  funshade_eval_dist_batch computes <x,y>. The _metric variants pick the score
+//  of each row pair and the direction of the comparison with theta:
+//   FUNSHADE_DOT    <x,y>, same material and outputs as funshade_setup_batch.
+//   FUNSHADE_SQ_L2  ||x-y||^2, in one Beaver product on w = x-y: D_w = D_x-D_y
+//                   is public, and the setup deals shares of d_w^2 in d_xy.
+//   FUNSHADE_COS    <x,y> compared with theta*||x||*||y||, on secret-shared
+//                   norms: the last of the l elements of each row is the
+//                   (fixed-point) norm of the l-1 others, shared with them.
+//                   The score is <x,y>*2^COS_FRAC_BITS - theta*||x||*||y||,
+//                   for theta = round(cos_theta*2^COS_FRAC_BITS), compared
+//                   with 0 (theta is public and passed to eval_dist instead).
+//                   Rows need l >= 2 (eval_dist scores shorter rows 0,
+//                   z_hat_j = r_in_j). The score is 2^COS_FRAC_BITS times larger
+//                   than <x,y>: bound it with funshade_check_overflow or
+//                   funshade_sign_bits on max_el << COS_FRAC_BITS/2 (e.g.
+//                   max_el <= 127 for normalized rows with 32-bit R_t).
+//  With below, rows match when score <= theta (e.g. distances) instead of >=:
+//  eval_dist negates the score and the keys compare it with -theta. Outputs go
+//  to funshade_eval_sign_batch(_collapse) unchanged.
+#define COS_FRAC_BITS   16                                  // Fixed-point bits of the cosine threshold
+
+typedef enum { FUNSHADE_DOT = 0, FUNSHADE_SQ_L2, FUNSHADE_COS } funshade_metric;
+
+void funshade_setup_batch_metric(size_t K, size_t l, funshade_metric metric, bool below, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+void funshade_eval_dist_batch_metric(size_t K, size_t l, funshade_metric metric, bool below, R_t theta,
+    bool j, const R_t r_in_j[], const R_t D_x[], const R_t D_y[],
+    const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[], R_t z_hat_j[]);
+
+// LONG-LIVED REFERENCE DB
+//  A reference DB is Delta-shared once, D_y = y + d_y0 + d_y1, and kept. Each
+//  query then needs masks of x, Beaver products and keys dealt against the
+//  stored d_y0/d_y1 (_db setup), not fresh masks of y that would require the
+//  plaintext y to be shared again. The masks of y can be refreshed in place:
+//   - the dealer draws a delta e and a random split e = e_0 + e_1, and adds
+//     e_j to its copy of d_yj (funshade_refresh_gen);
+//   - party j receives e_j, and e if rotated, and adds e to D_y and e_j to
+//     d_yj (funshade_refresh_batch).
+//  y = D_y - d_y0 - d_y1 is preserved. Without rotation (e = 0) D_y and d_y
+//  stay, and only their split is re-randomized: old shares of one party and
+//  new shares of the other are independent. Rotation only changes D_y (and
+//  d_y) by e, which both parties receive in the clear: it adds no secrecy and
+//  is no stronger than a plain refresh.
+
+/// @brief Same as funshade_setup_batch_metric, against the stored masks d_y0/d_y1
+///        [K*l] of a Delta-shared reference DB, which are inputs here.
+void funshade_setup_batch_db(size_t K, size_t l, funshade_metric metric, bool below, R_t theta,
+    const R_t d_y0[], const R_t d_y1[], R_t d_x0[], R_t d_x1[], R_t d_xy0[], R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+
+/// @brief Dealer side of a refresh of the masks d_y0/d_y1 [K*l], updated in place.
+/// @param[in] rotate   draw a random e [K*l] (else e = 0 and e is not written, may be NULL)
+/// @param[out] e_0     refresh of party 0 [K*l]
+/// @param[out] e_1     refresh of party 1 [K*l], e_0 + e_1 = e
+void funshade_refresh_gen(size_t K, size_t l, bool rotate, R_t d_y0[], R_t d_y1[],
+    R_t e[], R_t e_0[], R_t e_1[]);
+
+/// @brief Party side of a refresh, in place and in a single pass: D_y += e
+///        (skipped if e is NULL, i.e. without rotation) and d_yj += e_j.
+void funshade_refresh_batch(size_t K, size_t l, const R_t e[], const R_t e_j[], R_t D_y[], R_t d_yj[]);
+
+// QUANTIZED INPUTS
+//  Fixed-point templates bounded by max_el fit in int8/int16 lanes. Only the
+//  plaintext inputs are stored narrow: masks d_v and Delta shares D_v live in
+//  R_t (the accumulator ring), as required for the Beaver product to hold.
+
+/// @brief Check that the comparison z-theta of a dot product z cannot overflow
+///        the signed range of R_t, for any |theta| up to the largest |z|.
+/// @param[in] l            number of elements per vector
+/// @param[in] max_el       largest absolute value of any vector element
+/// @param[in] normalized   vectors have L2 norm <= max_el, so |z| <= max_el^2
+///                         (Cauchy-Schwarz) instead of l*max_el^2
+/// @return                 true if 2*|z| fits in R_t
+bool funshade_check_overflow(size_t l, R_t max_el, bool normalized);
+
+/// @brief Smallest n_bits for the reduced-domain sign of z-theta, with the
+///        bounds of funshade_check_overflow (|theta| up to the largest |z|).
+/// @return                 n_bits, or 0 if z-theta does not fit in R_t
+size_t funshade_sign_bits(size_t l, R_t max_el, bool normalized);
+
+/// @brief Same as funshade_share_batch, with int8/int16 quantized inputs v.
+void funshade_share_batch_i8(size_t K, size_t l, const int8_t v[], const R_t d_v[], R_t D_v[]);
+void funshade_share_batch_i16(size_t K, size_t l, const int16_t v[], const R_t d_v[], R_t D_v[]);
+
+/// @brief Fused quantize-and-share of float embeddings, one pass per row:
+///        v = round(v_f*max_el/||v_f||) (v_f*max_el if !normalize), rounded
+///        half away from zero, checked and shared as D_v = d_v + v.
+/// @param[in] v            float (or double for _f64) inputs [K*l]
+/// @param[in] max_el       fixed-point scale, and bound on the quantized elements
+/// @param[in] normalize    L2-normalize each row before scaling
+/// @return                 0, or -1 if max_el overflows the ring for l (see
+///                         funshade_check_overflow) or an element is out of
+///                         [-max_el, max_el] or NaN (D_v is then unspecified,
+///                         those elements are left unwritten)
+int funshade_share_float_batch(size_t K, size_t l, const float v[], R_t max_el, bool normalize,
+    const R_t d_v[], R_t D_v[]);
+int funshade_share_f64_batch(size_t K, size_t l, const double v[], R_t max_el, bool normalize,
+    const R_t d_v[], R_t D_v[]);
+
+/// @brief Threshold theta on the similarity of normalized float vectors,
+///        upscaled like their quantized dot product: round(theta*max_el^2).
+R_t funshade_scale_threshold(double theta, R_t max_el);
+
+// SESSION CONTEXT
+//  Holds the offline material of party j for a fixed (K, l) and owns a single
+//  cache-aligned arena with the broadcast D_x and all the outputs, so that
+//  repeated queries run without allocations. Outputs are overwritten by the
+//  next call on the same context. Material pointers are borrowed, not copied.
+typedef struct funshade_ctx funshade_ctx;
+
+/// @brief Create a context for K references of length l, evaluated by party j.
+/// @return             NULL if the arena cannot be allocated
+funshade_ctx *funshade_ctx_new(size_t K, size_t l, bool j);
+void funshade_ctx_free(funshade_ctx *ctx);
+
+/// @brief Bind the offline material (K-sized r_in_j, K*l-sized d_*j, K*KEY_LEN k_j)
+///        and the Delta-shared reference DB D_y (K*l).
+void funshade_ctx_set_offline(funshade_ctx *ctx, const R_t r_in_j[],
+    const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[], const uint8_t k_j[]);
+void funshade_ctx_set_db(funshade_ctx *ctx, const R_t D_y[]);
+
+/// @brief Context-owned D_x buffer [K*l], to receive the Delta share of x in place.
+R_t *funshade_ctx_D_x(funshade_ctx *ctx);
+
+/// @brief Broadcast-share the live template x[l] against d_x[K*l] into the
+///        context D_x. Returns the context-owned D_x.
+R_t *funshade_ctx_share(funshade_ctx *ctx, const R_t x[], const R_t d_x[]);
+
+/// @brief funshade_eval_dist_batch on D_x (NULL for the context D_x).
+///        Returns the context-owned z_hat_j [K].
+R_t *funshade_ctx_eval_dist(funshade_ctx *ctx, const R_t D_x[]);
+
+/// @brief funshade_eval_sign_batch(_collapse) on the own z_hat_j from the last
+///        funshade_ctx_eval_dist and the peer's z_hat_nj [K].
+///        funshade_ctx_eval_sign returns the context-owned o_j [K].
+R_t *funshade_ctx_eval_sign(funshade_ctx *ctx, const R_t z_hat_nj[]);
+R_t funshade_ctx_eval_sign_collapse(funshade_ctx *ctx, const R_t z_hat_nj[]);
+
+// MANY-TO-MANY MATCHING
+//  M probes X [M*l] against K references Y [K*l], all M*K comparisons at once.
+//  The setup yields a matrix Beaver triple instead of one triple per pair:
+//  masks A [M*l] and B [K*l], and C = A*B^T [M*K], each additively shared, so
+//  the Delta shares D_X = X+A and D_Y = Y+B (funshade_share_batch) take
+//  O((M+K)*l) instead of O(M*K*l). Outputs are M*K, row-major by probe:
+//      z_hat_j[m*K+k] = r_in_j + j*<D_X[m],D_Y[k]> - <D_X[m],B_j[k]> - <A_j[m],D_Y[k]> + C_j
+//  and are compared by a single funshade_eval_sign_batch(M*K, ...) on the keys
+//  k0/k1 [M*K*KEY_LEN].
+
+/// @brief Generate the matrix triple (A_j [M*l], B_j [K*l], C_j [M*K]), the
+///        masks r_in_j [M*K] and the fss keys k_j [M*K*KEY_LEN] of threshold theta.
+void funshade_setup_matrix(size_t M, size_t K, size_t l, R_t theta,
+    R_t A0[], R_t A1[], R_t B0[], R_t B1[], R_t C0[], R_t C1[],
+    R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+
+/// @brief z_hat_j [M*K] of all probe/reference pairs, as a cache-blocked
+///        matrix product (OpenMP over blocks of probes x references).
+void funshade_eval_dist_matrix(size_t M, size_t K, size_t l, bool j, const R_t r_in_j[],
+    const R_t D_X[], const R_t D_Y[], const R_t A_j[], const R_t B_j[], const R_t C_j[],
+    R_t z_hat_j[]);
+
+// ................................ TUNING .................................. //
+// Runtime choices of the gates (PRG) and of the OpenMP loops of
+//  funshade_eval_dist_batch and funshade_eval_sign_batch(_collapse), usually
+//  picked per host by the calibration of tune.h. The defaults match a plain
+//  static OpenMP loop with the fastest PRG of the CPU.
+typedef enum {
+    FUNSHADE_PRG_TINY = 0,          // standalone AES-128
+    FUNSHADE_PRG_NI                 // AES-NI (if the CPU has it, see CPU DISPATCH)
+} funshade_prg;
+
+typedef struct {
+    funshade_prg prg;               // AES backend of the DCF PRG (keys are interchangeable)
+    size_t  dot_flat_max_l;         // eval_dist: blocks of rows as one flat product up to this l (0: never)
+    size_t  n_threads;              // OpenMP threads (0: OpenMP default)
+    size_t  sign_chunk;             // keys per static chunk of the sign batches (0: K/n_threads)
+    size_t  dist_chunk;             // rows per static chunk of eval_dist (0: K/n_threads)
+} funshade_tuning;
+
+/// @brief Current tuning of the batch functions.
+const funshade_tuning *funshade_tuning_get(void);
+
+/// @brief Replace the tuning, between batch calls.
+/// @return -1 if t->prg is not available (the tuning is left unchanged), 0 otherwise
+int funshade_tuning_set(const funshade_tuning *t);
+
+// ............................. CPU DISPATCH ............................... //
+// Portable builds (no -march=native nor -maes) carry the ISA-specific code
+//  paths and pick them from CPUID when the library is loaded: the AES-NI PRG
+//  on x86 with GCC/Clang (aes.h), and the eval_dist and matrix kernels cloned
+//  for AVX-512F, AVX2 and the baseline (x86-64 ELF targets, resolved by the
+//  loader). Builds for a fixed -march keep working and use that ISA only.
+#define FUNSHADE_CPU_AESNI      0x1
+#define FUNSHADE_CPU_AVX2       0x2
+#define FUNSHADE_CPU_AVX512F    0x4
+
+/// @brief FUNSHADE_CPU_* extensions of this CPU that the library can use.
+unsigned funshade_cpu_features(void);
+
+/// @brief Active backends, e.g. "prg=ni dist=avx2" (string literal, thread-safe).
+const char *funshade_backend(void);
+
 // .................... Outside the scope of Funshade ....................... //
 void funshade_setup_ss_batch(size_t K, size_t l, R_t theta,
      R_t a0[], R_t a1[], R_t b0[], R_t b1[], R_t c0[], R_t c1[],
@@ -219,4 +644,20 @@ void funshade_eval_dist_ss_batch(size_t K, size_t l, bool j,
     const R_t aj[], const R_t bj[], const R_t cj[],
     R_t z_hat_j[]);
 
+// ............................... C++ ENGINE ............................... //
+// Evaluation with the compile-time specialized engine of fss.hpp, on the same
+//  keys and with the same outputs. Built from fss_engine.cpp with USE_CPP_ENGINE,
+//  which also routes SIGN_eval_batch and funshade_eval_sign_batch(_collapse) to it.
+#ifdef USE_CPP_ENGINE
+R_t DCF_eval_cpp(bool b, const uint8_t kb[KEY_LEN], R_t x_hat);
+R_t IC_eval_cpp(bool b, R_t p, R_t q, const uint8_t kb_ic[KEY_LEN], R_t x_hat);
+R_t SIGN_eval_cpp(bool b, const uint8_t kb[KEY_LEN], R_t x_hat);
+void SIGN_eval_batch_cpp(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]);
+void funshade_eval_sign_batch_cpp(size_t K, bool j, const uint8_t kj[], const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[]);
+R_t funshade_eval_sign_batch_collapse_cpp(size_t K, bool j, const uint8_t kj[], const R_t z_hat_0[], const R_t z_hat_1[]);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
 #endif // __FSS_H__
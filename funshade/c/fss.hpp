@@ -0,0 +1,224 @@
+// FSS ENGINE: Compile-time specialized C++17 evaluation of the FSS gates
+// -----------------------------------------------------------------------------
+// Header-only counterpart of the evaluation side of fss.c:
+//  - Dcf<R, Bits, Prg>:      DCF_eval
+//  - Ic<R, Bits, Prg>:       IC_eval
+//  - Sign<R, Bits, Prg>:     SIGN_eval, SIGN_eval_batch
+//  - Funshade<R, Bits, Prg>: funshade_eval_sign_batch[_collapse]
+//
+// The key layout is a constexpr function of (R, Bits), the level loop is fully
+//  unrolled and the seed is kept in a __m128i register from the key to the
+//  last level. With R = R_t and Bits = N_BITS it reads the keys of fss.c and
+//  produces the same outputs, bit for bit. fss_engine.cpp exposes it to C.
+//
+// Requires SSE2. Like aes.c, the AES-NI PRG is compiled in without -maes (the
+//  engine functions carry FSS_ENGINE_TARGET) and picked at runtime by the
+//  caller with aes_ni_available(); TinyPrg (G_side_tiny) runs anywhere.
+
+#ifndef __FSS_HPP__
+#define __FSS_HPP__
+
+#include <cstdint>      // uint8_t
+#include <cstddef>      // size_t
+#include <cstring>      // memcpy
+#include <type_traits>  // make_unsigned_t
+#include <utility>      // index_sequence
+#include <emmintrin.h>  // SSE2
+
+#include "aes.h"        // G_side_tiny, AES_NI, AES_NI_TARGET
+
+// Instruction set of the engine functions: AES-NI usable by any Prg, which only
+//  AesNiPrg uses (the compiler never emits AES instructions on its own)
+#ifdef AES_NI
+#define FSS_ENGINE_TARGET   AES_NI_TARGET
+#else
+#define FSS_ENGINE_TARGET
+#endif
+
+namespace funshade {
+
+//----------------------------------------------------------------------------//
+//--------------------------------- LAYOUT -----------------------------------//
+//----------------------------------------------------------------------------//
+// Same positions as the *_PTR macros of fss.h, for any ring R and Bits levels
+template <class R, unsigned Bits>
+struct Layout {
+    static_assert(Bits >= 1 && Bits <= 8*sizeof(R), "Bits must fit in R");
+    static constexpr size_t s_len    = 16;                          // S_LEN
+    static constexpr size_t v_len    = sizeof(R);                   // V_LEN
+    static constexpr size_t cw_len   = s_len + v_len + 2;           // CW_LEN
+    static constexpr size_t chain    = s_len;                       // CW_CHAIN_PTR
+    static constexpr size_t last_cw  = chain + cw_len*Bits;         // LAST_CW_PTR
+    static constexpr size_t z        = last_cw + v_len;             // Z_PTR
+    static constexpr size_t key_len  = z + v_len;                   // KEY_LEN
+    static constexpr size_t s_cw(unsigned i)  { return chain + i*cw_len; }
+    static constexpr size_t v_cw(unsigned i)  { return s_cw(i) + s_len; }
+    static constexpr size_t t_cw(unsigned i, bool right) { return v_cw(i) + v_len + right; }
+    // Output of one side of G_side: s, v, t
+    static constexpr size_t g_v      = s_len;                       // GS_V_PTR
+    static constexpr size_t g_t      = s_len + v_len;               // GS_T_PTR
+    static constexpr size_t g_blocks = 2;                           // G_SIDE_LEN/16
+    static_assert(g_t < g_blocks*16, "R too wide for G_side");
+};
+
+//----------------------------------------------------------------------------//
+//---------------------------------- PRG -------------------------------------//
+//----------------------------------------------------------------------------//
+// G_side(s, side): out[j] = MP(iv, s ^ (2*side+j)), as in aes.c.
+//  A Prg provides: static void side(__m128i s, bool right, __m128i out[2])
+
+// Portable, through the C implementation (G_side_tiny)
+struct TinyPrg {
+    FSS_ENGINE_TARGET static inline void side(__m128i s, bool right, __m128i out[2]) {
+        alignas(16) uint8_t in[16], buf[G_SIDE_LEN];
+        _mm_store_si128((__m128i*)in, s);
+        G_side_tiny(in, right, buf);
+        out[0] = _mm_load_si128((const __m128i*)&buf[0]);
+        out[1] = _mm_load_si128((const __m128i*)&buf[16]);
+    }
+};
+
+#ifdef AES_NI
+struct AesNiPrg {
+    // Round keys of the fixed IV key (iv_aes_128 in aes.c), FIPS-197 A.1. Constant
+    //  so that loading the engine runs no AES-NI instruction on a CPU without it
+    alignas(16) static inline const uint8_t rk[11][16] = {
+        {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c},
+        {0xa0, 0xfa, 0xfe, 0x17, 0x88, 0x54, 0x2c, 0xb1, 0x23, 0xa3, 0x39, 0x39, 0x2a, 0x6c, 0x76, 0x05},
+        {0xf2, 0xc2, 0x95, 0xf2, 0x7a, 0x96, 0xb9, 0x43, 0x59, 0x35, 0x80, 0x7a, 0x73, 0x59, 0xf6, 0x7f},
+        {0x3d, 0x80, 0x47, 0x7d, 0x47, 0x16, 0xfe, 0x3e, 0x1e, 0x23, 0x7e, 0x44, 0x6d, 0x7a, 0x88, 0x3b},
+        {0xef, 0x44, 0xa5, 0x41, 0xa8, 0x52, 0x5b, 0x7f, 0xb6, 0x71, 0x25, 0x3b, 0xdb, 0x0b, 0xad, 0x00},
+        {0xd4, 0xd1, 0xc6, 0xf8, 0x7c, 0x83, 0x9d, 0x87, 0xca, 0xf2, 0xb8, 0xbc, 0x11, 0xf9, 0x15, 0xbc},
+        {0x6d, 0x88, 0xa3, 0x7a, 0x11, 0x0b, 0x3e, 0xfd, 0xdb, 0xf9, 0x86, 0x41, 0xca, 0x00, 0x93, 0xfd},
+        {0x4e, 0x54, 0xf7, 0x0e, 0x5f, 0x5f, 0xc9, 0xf3, 0x84, 0xa6, 0x4f, 0xb2, 0x4e, 0xa6, 0xdc, 0x4f},
+        {0xea, 0xd2, 0x73, 0x21, 0xb5, 0x8d, 0xba, 0xd2, 0x31, 0x2b, 0xf5, 0x60, 0x7f, 0x8d, 0x29, 0x2f},
+        {0xac, 0x77, 0x66, 0xf3, 0x19, 0xfa, 0xdc, 0x21, 0x28, 0xd1, 0x29, 0x41, 0x57, 0x5c, 0x00, 0x6e},
+        {0xd0, 0x14, 0xf9, 0xa8, 0xc9, 0xee, 0x25, 0x89, 0xe1, 0x3f, 0x0c, 0xc8, 0xb6, 0x63, 0x0c, 0xa6}};
+    FSS_ENGINE_TARGET static inline __m128i key(int i) { return _mm_load_si128((const __m128i*)rk[i]); }
+    FSS_ENGINE_TARGET static inline __m128i mp_iv(__m128i m) {
+        __m128i c = _mm_xor_si128(m, key(0));
+        c = _mm_aesenc_si128(c, key(1));    c = _mm_aesenc_si128(c, key(2));
+        c = _mm_aesenc_si128(c, key(3));    c = _mm_aesenc_si128(c, key(4));
+        c = _mm_aesenc_si128(c, key(5));    c = _mm_aesenc_si128(c, key(6));
+        c = _mm_aesenc_si128(c, key(7));    c = _mm_aesenc_si128(c, key(8));
+        c = _mm_aesenc_si128(c, key(9));    c = _mm_aesenclast_si128(c, key(10));
+        return _mm_xor_si128(_mm_xor_si128(c, key(0)), m);
+    }
+    FSS_ENGINE_TARGET static inline void side(__m128i s, bool right, __m128i out[2]) {
+        out[0] = mp_iv(_mm_xor_si128(s, _mm_cvtsi32_si128(2*right)));
+        out[1] = mp_iv(_mm_xor_si128(s, _mm_cvtsi32_si128(2*right + 1)));
+    }
+};
+#endif
+#ifdef __AES__
+using DefaultPrg = AesNiPrg;
+#else
+using DefaultPrg = TinyPrg;     // without -maes, pick AesNiPrg at runtime (fss_engine.cpp)
+#endif
+
+//----------------------------------------------------------------------------//
+//---------------------------------- GATES -----------------------------------//
+//----------------------------------------------------------------------------//
+template <class R, unsigned Bits, class Prg = DefaultPrg>
+struct Dcf {
+    using L = Layout<R, Bits>;
+    using UR = std::make_unsigned_t<R>;     // Ring arithmetic, wrapping
+
+    FSS_ENGINE_TARGET static inline UR load_r(const uint8_t *p) { R v; std::memcpy(&v, p, sizeof(R)); return (UR)v; }
+
+    struct State { __m128i s; bool t; UR V; };
+
+    // Level I of DCF_eval: expand the side of s given by bit x_I, apply the I-th CW
+    template <unsigned I>
+    FSS_ENGINE_TARGET static inline void level(State &st, const uint8_t *kb, UR x, UR sgn) {
+        alignas(16) uint8_t g[16];              // Second block: v, t
+        __m128i out[L::g_blocks];
+        const bool bit = (x >> (Bits-1-I)) & 1;
+        Prg::side(st.s, bit, out);
+        _mm_store_si128((__m128i*)g, out[1]);
+        const bool t_cw = kb[L::t_cw(I, bit)] & 1;
+        UR v; std::memcpy(&v, &g[L::g_v - L::s_len], sizeof(R));
+        st.V += sgn * (v + (UR)st.t * load_r(&kb[L::v_cw(I)]));
+        // s = s_side ^ (t ? s_cw : 0), branch-free
+        const __m128i mask = _mm_set1_epi8(-(char)st.t);
+        const __m128i s_cw = _mm_loadu_si128((const __m128i*)&kb[L::s_cw(I)]);
+        st.s = _mm_xor_si128(out[0], _mm_and_si128(s_cw, mask));
+        st.t = (g[L::g_t - L::s_len] & 1) ^ (st.t & t_cw);
+    }
+    template <unsigned... I>
+    FSS_ENGINE_TARGET static inline void levels(State &st, const uint8_t *kb, UR x, UR sgn, std::integer_sequence<unsigned, I...>) {
+        (level<I>(st, kb, x, sgn), ...);
+    }
+
+    /// Same as DCF_eval(b, kb, x_hat)
+    FSS_ENGINE_TARGET static inline R eval(bool b, const uint8_t *kb, R x_hat) {
+        const UR sgn = b ? (UR)-1 : (UR)1;
+        State st{_mm_loadu_si128((const __m128i*)kb), b, 0};
+        levels(st, kb, (UR)x_hat, sgn, std::make_integer_sequence<unsigned, Bits>{});
+        UR s0; std::memcpy(&s0, &st.s, sizeof(R));
+        st.V += sgn * (s0 + (UR)st.t * load_r(&kb[L::last_cw]));
+        return (R)st.V;
+    }
+};
+
+template <class R, unsigned Bits, class Prg = DefaultPrg>
+struct Ic {
+    using D = Dcf<R, Bits, Prg>;
+    using UR = typename D::UR;
+    /// Same as IC_eval(b, p, q, kb, x_hat), comparisons over the whole ring
+    FSS_ENGINE_TARGET static inline R eval(bool b, R p, R q, const uint8_t *kb, R x_hat) {
+        const UR x = (UR)x_hat;
+        const UR o1 = (UR)D::eval(b, kb, (R)(x - (UR)p - 1));
+        const UR o2 = (UR)D::eval(b, kb, (R)(x - (UR)q - 2));
+        const UR in = (UR)((x > (UR)p) - (x > (UR)((UR)q + 1)));
+        return (R)((UR)b*in - o1 + o2 + D::load_r(&kb[Layout<R, Bits>::z]));
+    }
+};
+
+template <class R, unsigned Bits, class Prg = DefaultPrg>
+struct Sign {
+    using L = Layout<R, Bits>;
+    static constexpr R q = (R)((1ULL << (Bits-1)) - 1);
+    /// Same as SIGN_eval(b, kb, x_hat)
+    FSS_ENGINE_TARGET static inline R eval(bool b, const uint8_t *kb, R x_hat) {
+        return Ic<R, Bits, Prg>::eval(b, 0, q, kb, x_hat);
+    }
+    FSS_ENGINE_TARGET static void eval_batch(size_t K, bool b, const uint8_t *kb, const R *x_hat, R *ob) {
+        long k;
+#if defined(_OPENMP)
+        #pragma omp parallel for
+#endif
+        for (k = 0; k < (long)K; k++) ob[k] = eval(b, &kb[k*L::key_len], x_hat[k]);
+    }
+};
+
+template <class R, unsigned Bits, class Prg = DefaultPrg>
+struct Funshade {
+    using S = Sign<R, Bits, Prg>;
+    using L = Layout<R, Bits>;
+    using UR = std::make_unsigned_t<R>;
+    /// Same as funshade_eval_sign_batch
+    FSS_ENGINE_TARGET static void eval_sign_batch(size_t K, bool j, const uint8_t *k_j, const R *z_hat_0, const R *z_hat_1, R *o_j) {
+        long k;
+#if defined(_OPENMP)
+        #pragma omp parallel for
+#endif
+        for (k = 0; k < (long)K; k++)
+            o_j[k] = S::eval(j, &k_j[k*L::key_len], (R)((UR)z_hat_0[k] + (UR)z_hat_1[k]));
+    }
+    /// Same as funshade_eval_sign_batch_collapse
+    FSS_ENGINE_TARGET static R eval_sign_batch_collapse(size_t K, bool j, const uint8_t *k_j, const R *z_hat_0, const R *z_hat_1) {
+        UR o_j = 0;
+        long k;
+#if defined(_OPENMP)
+        #pragma omp parallel for reduction(+:o_j)
+#endif
+        for (k = 0; k < (long)K; k++)
+            o_j += (UR)S::eval(j, &k_j[k*L::key_len], (R)((UR)z_hat_0[k] + (UR)z_hat_1[k]));
+        return (R)o_j;
+    }
+};
+
+} // namespace funshade
+
+#endif // __FSS_HPP__
@@ -0,0 +1,47 @@
+// C entry points of the C++ engine (fss.hpp), instantiated for R_t and N_BITS.
+//  Compile with -std=c++17 and -DUSE_CPP_ENGINE, together with fss.c and aes.c.
+#include "fss.h"
+#include "fss.hpp"
+
+using Layout_t   = funshade::Layout<R_t, N_BITS>;
+
+// Gates of both PRGs when AES-NI is picked at runtime, as in fss.c
+#if defined(AES_NI) && !defined(__AES__)
+static const bool engine_ni = aes_ni_available() == 1;
+#define ENGINE_CALL(gate, fn, ...) \
+    (engine_ni ? funshade::gate<R_t, N_BITS, funshade::AesNiPrg>::fn(__VA_ARGS__) \
+                        : funshade::gate<R_t, N_BITS, funshade::TinyPrg>::fn(__VA_ARGS__))
+#else
+#define ENGINE_CALL(gate, fn, ...)  funshade::gate<R_t, N_BITS>::fn(__VA_ARGS__)
+#endif
+
+// The engine must read the keys written by fss.c
+static_assert(Layout_t::key_len == KEY_LEN,                         "KEY_LEN mismatch");
+static_assert(Layout_t::z == Z_PTR,                                 "Z_PTR mismatch");
+static_assert(Layout_t::last_cw == CW_CHAIN_PTR + LAST_CW_PTR,      "LAST_CW_PTR mismatch");
+static_assert(Layout_t::t_cw(1, 1) == CW_CHAIN_PTR + T_CW_R_PTR(1), "CW layout mismatch");
+static_assert(Layout_t::g_t == GS_T_PTR,                            "G_side layout mismatch");
+static_assert(Layout_t::g_blocks*16 == G_SIDE_LEN,                  "G_SIDE_LEN mismatch");
+
+extern "C" {
+
+R_t DCF_eval_cpp(bool b, const uint8_t kb[KEY_LEN], R_t x_hat){
+    return ENGINE_CALL(Dcf, eval, b, kb, x_hat);
+}
+R_t IC_eval_cpp(bool b, R_t p, R_t q, const uint8_t kb_ic[KEY_LEN], R_t x_hat){
+    return ENGINE_CALL(Ic, eval, b, p, q, kb_ic, x_hat);
+}
+R_t SIGN_eval_cpp(bool b, const uint8_t kb[KEY_LEN], R_t x_hat){
+    return ENGINE_CALL(Sign, eval, b, kb, x_hat);
+}
+void SIGN_eval_batch_cpp(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[]){
+    ENGINE_CALL(Sign, eval_batch, K, b, kb, x_hat, ob);
+}
+void funshade_eval_sign_batch_cpp(size_t K, bool j, const uint8_t kj[], const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[]){
+    ENGINE_CALL(Funshade, eval_sign_batch, K, j, kj, z_hat_0, z_hat_1, o_j);
+}
+R_t funshade_eval_sign_batch_collapse_cpp(size_t K, bool j, const uint8_t kj[], const R_t z_hat_0[], const R_t z_hat_1[]){
+    return ENGINE_CALL(Funshade, eval_sign_batch_collapse, K, j, kj, z_hat_0, z_hat_1);
+}
+
+} // extern "C"
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE             // sched_setaffinity, CPU_SET, syscall, MAP_ANONYMOUS
+#include "numa_mem.h"
+
+#ifdef FUNSHADE_HAS_MEM
+#include <string.h>     // memset
+#include <sys/mman.h>   // mmap, munmap, madvise
+#include <unistd.h>     // sysconf, syscall
+#ifdef __linux__
+#include <sched.h>      // sched_setaffinity, cpu_set_t
+#include <sys/syscall.h>// SYS_mbind
+#endif
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+#define MEM_HEADER          64          // Mapping info before the rows, keeps them cache aligned
+#define MEM_MAX_NODES       64          // Nodes of a single unsigned long mask
+#define MEM_MPOL_INTERLEAVE 3           // <linux/mempolicy.h>
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT      26
+#endif
+
+typedef struct { size_t len, page; } mem_header;
+
+#ifdef __linux__
+static cpu_set_t mem_unbound;           // Affinity before funshade_mem_bind_threads
+static bool      mem_bound = false;
+
+// CPUs of a node from sysfs ("0-15,32-47"). Returns their number, -1 if unknown.
+static int node_cpus(size_t node, cpu_set_t *set){
+    char path[64];
+    unsigned a, b;
+    int c, n = 0;
+    FILE *f;
+    sprintf(path, "/sys/devices/system/node/node%lu/cpulist", (unsigned long)node);
+    if ((f = fopen(path, "r")) == NULL)     return -1;
+    CPU_ZERO(set);
+    while (fscanf(f, "%u", &a) == 1)
+    {
+        b = a;
+        c = fgetc(f);
+        if (c == '-')
+        {
+            if (fscanf(f, "%u", &b) != 1)   break;
+            c = fgetc(f);
+        }
+        for (; a <= b && a < CPU_SETSIZE; a++)
+        {
+            CPU_SET(a, set);    n++;
+        }
+        if (c != ',')   break;
+    }
+    fclose(f);
+    return n;
+}
+
+static size_t mem_nodes_raw(void){
+    cpu_set_t set;
+    size_t n = 0;
+    while (n < MEM_MAX_NODES && node_cpus(n, &set) >= 0)    n++;
+    return n;
+}
+#endif
+
+// Anonymous mapping of at least len bytes with pages of 2^page_shift bytes
+//  (0 for the default pages), rounded up to whole pages.
+static void *mem_map(size_t len, unsigned page_shift, size_t *map_len, size_t *page){
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *p;
+    *page = page_shift ? (size_t)1 << page_shift : (size_t)sysconf(_SC_PAGESIZE);
+    *map_len = CEIL(len, *page) * *page;
+    if (page_shift)
+    {
+#ifdef MAP_HUGETLB
+        flags |= MAP_HUGETLB | (int)(page_shift << MAP_HUGE_SHIFT);
+#else
+        return NULL;
+#endif
+    }
+    p = mmap(NULL, *map_len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+size_t funshade_mem_nodes(void){
+#ifdef __linux__
+    size_t n = mem_nodes_raw();
+    return n ? n : 1;
+#else
+    return 1;
+#endif
+}
+
+int funshade_mem_bind_threads(size_t n_nodes){
+#ifdef __linux__
+    size_t n_online = mem_nodes_raw();
+    int err = 0;
+    if (!mem_bound)
+    {
+        if (sched_getaffinity(0, sizeof(mem_unbound), &mem_unbound) != 0)   return -1;
+        mem_bound = true;
+    }
+    if (n_online == 0)  return 1;       // no sysfs topology: nothing to place
+    if (n_nodes == 0 || n_nodes > n_online)     n_nodes = n_online;
+    #if defined(_OPENMP)
+    #pragma omp parallel reduction(|:err)
+    #endif
+    {
+        size_t t = 0, n_threads = 1;
+        cpu_set_t set;
+        #if defined(_OPENMP)
+        t = omp_get_thread_num();   n_threads = omp_get_num_threads();
+        #endif
+        if (node_cpus(t*n_nodes/n_threads, &set) <= 0 || sched_setaffinity(0, sizeof(set), &set) != 0)
+        {
+            err = 1;
+        }
+    }
+    return err ? -1 : (int)n_nodes;
+#else
+    (void)n_nodes;
+    return -1;
+#endif
+}
+
+int funshade_mem_unbind_threads(void){
+#ifdef __linux__
+    int err = 0;
+    if (!mem_bound)     return -1;
+    #if defined(_OPENMP)
+    #pragma omp parallel reduction(|:err)
+    #endif
+    {
+        if (sched_setaffinity(0, sizeof(mem_unbound), &mem_unbound) != 0)   err = 1;
+    }
+    mem_bound = false;
+    return err ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
+void *funshade_mem_alloc(size_t K, size_t row_len, funshade_mem_policy policy){
+    size_t len = MEM_HEADER + K*row_len, map_len = 0, page = 0;
+    uint8_t *base = NULL, *rows;
+    mem_header *h;
+    size_t k;
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask;
+    size_t n_nodes;
+#endif
+    // Largest reserved huge pages that the array fills, then the default pages
+    if (len >= ((size_t)1 << 30))   base = (uint8_t*)mem_map(len, 30, &map_len, &page);
+    if (!base && len >= ((size_t)1 << 21))  base = (uint8_t*)mem_map(len, 21, &map_len, &page);
+    if (!base)
+    {
+        base = (uint8_t*)mem_map(len, 0, &map_len, &page);
+        if (!base)  return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(base, map_len, MADV_HUGEPAGE);  // best effort
+#endif
+    }
+#if defined(__linux__) && defined(SYS_mbind)
+    n_nodes = mem_nodes_raw();
+    if (policy == FUNSHADE_MEM_INTERLEAVE && n_nodes > 1)
+    {
+        mask = (n_nodes >= MEM_MAX_NODES) ? ~0UL : (1UL << n_nodes) - 1;
+        syscall(SYS_mbind, base, map_len, MEM_MPOL_INTERLEAVE, &mask, n_nodes + 1, 0);
+    }
+#endif
+    h = (mem_header*)base;
+    h->len = map_len;   h->page = page;
+    rows = base + MEM_HEADER;
+    // Fault the pages in now: by the caller, or row by row by the OpenMP threads
+    //  in the same static schedule as the batch loops (first touch placement)
+    if (policy == FUNSHADE_MEM_PARTITION)
+    {
+        #if defined(_OPENMP)
+        #pragma omp parallel for schedule(static)
+        #endif
+        for (k = 0; k < K; k++)
+        {
+            memset(&rows[k*row_len], 0, row_len);
+        }
+    }
+    else
+    {
+        memset(rows, 0, K*row_len);
+    }
+    return rows;
+}
+
+size_t funshade_mem_page_size(const void *p){
+    return ((const mem_header*)((const uint8_t*)p - MEM_HEADER))->page;
+}
+
+void funshade_mem_free(void *p){
+    uint8_t *base;
+    if (p == NULL)  return;
+    base = (uint8_t*)p - MEM_HEADER;
+    munmap(base, ((mem_header*)base)->len);
+}
+
+#endif // FUNSHADE_HAS_MEM
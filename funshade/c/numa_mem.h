@@ -0,0 +1,68 @@
+// NUMA_MEM: NUMA-aware, huge-page backed allocation of the offline material
+// -----------------------------------------------------------------------------
+// The key (K*KEY_LEN) and triple (K*l) arrays are read once per query by the
+//  OpenMP threads of the batch functions. With plain malloc their pages land
+//  on the node of the allocating thread, so on multi-socket machines half of
+//  the threads read remote memory, and 4 KB pages thrash the TLB. This module:
+//  - maps the arrays with 1 GB / 2 MB huge pages when reserved (MAP_HUGETLB),
+//    falling back to transparent huge pages (MADV_HUGEPAGE);
+//  - places them per NUMA node, either interleaved or partitioned by rows the
+//    same way the `#pragma omp parallel for` loops split [0, K);
+//  - binds the OpenMP threads to the nodes in the same order, so that thread t
+//    evaluates the rows that live on its own node.
+//
+// Typical use: funshade_mem_bind_threads(0) once, then funshade_mem_alloc(K,
+//  KEY_LEN, FUNSHADE_MEM_PARTITION) for k_j and (K, l*sizeof(R_t), ...) for d_*.
+//
+// Thread binding and FUNSHADE_MEM_PARTITION need a build with OpenMP
+//  (-fopenmp), like the parallel batch functions: without it there is a single
+//  thread, which is the one pinned and the one touching every row, so only
+//  FUNSHADE_MEM_INTERLEAVE spreads the pages. Placement is Linux only;
+//  elsewhere (other unix) the arrays are plain mmaps.
+
+#ifndef __NUMA_MEM_H__
+#define __NUMA_MEM_H__
+
+#include "fss.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FUNSHADE_HAS_MEM
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+typedef enum {
+    FUNSHADE_MEM_LOCAL = 0,         // first touch by the calling thread
+    FUNSHADE_MEM_INTERLEAVE,        // pages round-robin over the online nodes
+    FUNSHADE_MEM_PARTITION          // rows first-touched by the thread evaluating them (OpenMP)
+} funshade_mem_policy;
+
+/// @brief Number of online NUMA nodes (1 if unknown).
+size_t funshade_mem_nodes(void);
+
+/// @brief Pin the OpenMP threads to the CPUs of node t*n_nodes/n_threads,
+///        matching FUNSHADE_MEM_PARTITION, over the first n_nodes nodes (0 for
+///        all). Without OpenMP only the calling thread is pinned (to node 0).
+///        The affinity before the first call is kept for funshade_mem_unbind_threads.
+/// @return number of nodes used, or -1 on error
+int funshade_mem_bind_threads(size_t n_nodes);
+
+/// @brief Give the OpenMP threads (the calling thread without OpenMP) back
+///        the affinity the calling thread had before funshade_mem_bind_threads.
+/// @return 0, or -1 on error or if the threads were not bound
+int funshade_mem_unbind_threads(void);
+
+/// @brief Allocate K rows of row_len bytes, zeroed and placed by policy. The
+///        result is 64-byte aligned.
+/// @return NULL on error
+void *funshade_mem_alloc(size_t K, size_t row_len, funshade_mem_policy policy);
+
+/// @brief Page size backing an array of funshade_mem_alloc (4 KB, 2 MB, 1 GB).
+///        With transparent huge pages the kernel may still promote 4 KB maps.
+size_t funshade_mem_page_size(const void *p);
+
+/// @brief Release an array of funshade_mem_alloc (NULL is ignored).
+void funshade_mem_free(void *p);
+
+#endif // unix
+#endif // __NUMA_MEM_H__
@@ -0,0 +1,248 @@
+#define _DEFAULT_SOURCE         // sysconf, pipe with -std=c90
+#include "pool.h"
+
+#ifdef FUNSHADE_HAS_POOL
+#include <errno.h>      // errno, EINTR, EAGAIN
+#include <fcntl.h>      // fcntl, O_NONBLOCK
+#include <poll.h>       // poll
+#include <pthread.h>    // pthread_*
+#include <unistd.h>     // pipe, read, write, close, sysconf
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+struct funshade_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;               // queued work or shutdown
+    funshade_job    *head, *tail;       // pending jobs, FIFO
+    funshade_job    *done, *done_tail;  // completed jobs, FIFO
+    bool            stop;
+    size_t          n_threads;
+    pthread_t       *threads;
+    int             pipe_fd[2];         // completion notifications
+};
+
+#define IS_SIGN(job)    ((job)->op == POOL_OP_SIGN || (job)->op == POOL_OP_SIGN_COLLAPSE)
+
+static void run_job(funshade_job *job){
+    switch (job->op)
+    {
+    case POOL_OP_SETUP:
+        funshade_setup_batch(job->K, job->l, job->theta,
+            job->setup[0], job->setup[1], job->setup[2], job->setup[3], job->setup[4], job->setup[5],
+            job->setup[6], job->setup[7], job->k0, job->k1);
+        break;
+    case POOL_OP_DIST:
+        funshade_eval_dist_batch(job->K, job->l, job->j, job->r_in_j, job->D_x, job->D_y,
+            job->d_xj, job->d_yj, job->d_xyj, job->out);
+        break;
+    case POOL_OP_SIGN:
+        funshade_eval_sign_batch(job->K, job->j, job->k_j, job->z_hat_0, job->z_hat_1, job->out);
+        break;
+    case POOL_OP_SIGN_COLLAPSE:
+        job->o_sum = funshade_eval_sign_batch_collapse(job->K, job->j, job->k_j, job->z_hat_0, job->z_hat_1);
+        break;
+    }
+}
+
+// Gather a chain of small sign jobs of the same party (n keys in total) into
+//  the worker scratch, evaluate them as one batch and scatter the outputs.
+static void run_coalesced(funshade_job *group, size_t n, uint8_t *k, R_t *z){
+    R_t *z0 = z, *z1 = z + POOL_COALESCE_K, *o = z + 2*POOL_COALESCE_K;
+    funshade_job *job;
+    size_t off = 0, i;
+    for (job = group; job != NULL; job = job->next)
+    {
+        memcpy(&k[off*KEY_LEN], job->k_j, job->K*KEY_LEN);
+        memcpy(&z0[off], job->z_hat_0, job->K*sizeof(R_t));
+        memcpy(&z1[off], job->z_hat_1, job->K*sizeof(R_t));
+        off += job->K;
+    }
+    funshade_eval_sign_batch(n, group->j, k, z0, z1, o);
+    off = 0;
+    for (job = group; job != NULL; job = job->next)
+    {
+        if (job->op == POOL_OP_SIGN)
+        {
+            memcpy(job->out, &o[off], job->K*sizeof(R_t));
+        }
+        else
+        {
+            job->o_sum = 0;
+            for (i = 0; i < job->K; i++)    job->o_sum += o[off+i];
+        }
+        off += job->K;
+    }
+}
+
+// Wake up the reader. A full pipe is already readable, so EAGAIN is fine.
+static void notify(funshade_pool *pool){
+    char c = 1;
+    while (write(pool->pipe_fd[1], &c, 1) < 0 && errno == EINTR);
+}
+
+static void *pool_worker(void *arg){
+    funshade_pool *pool = (funshade_pool*)arg;
+    funshade_job *group, *last, *it, *prev, *next;
+    uint8_t *k = (uint8_t*)malloc(POOL_COALESCE_K*KEY_LEN);
+    R_t *z = (R_t*)malloc(3*POOL_COALESCE_K*sizeof(R_t));
+    size_t n;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == NULL && !pool->stop)
+        {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->head == NULL)         // stop, and nothing left to do
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        group = last = pool->head;
+        pool->head = group->next;
+        group->next = NULL;
+        n = group->K;
+        // Take along the queued small sign jobs of the same party that fit
+        if (IS_SIGN(group) && k != NULL && z != NULL && n < POOL_COALESCE_K)
+        {
+            prev = NULL;
+            for (it = pool->head; it != NULL; it = next)
+            {
+                next = it->next;
+                if (IS_SIGN(it) && it->j == group->j && n + it->K <= POOL_COALESCE_K)
+                {
+                    if (prev)   prev->next = next;
+                    else        pool->head = next;
+                    it->next = NULL;    last->next = it;    last = it;
+                    n += it->K;
+                }
+                else
+                {
+                    prev = it;
+                }
+            }
+            pool->tail = prev;          // the scan covered the whole queue
+        }
+        if (pool->head == NULL)     pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (group->next != NULL)    run_coalesced(group, n, k, z);
+        else                        run_job(group);
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->done_tail)    pool->done_tail->next = group;
+        else                    pool->done = group;
+        pool->done_tail = last;
+        pthread_mutex_unlock(&pool->lock);
+        notify(pool);
+    }
+    free(k); free(z);
+    return NULL;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+funshade_pool *funshade_pool_new(size_t n_threads){
+    funshade_pool *pool = (funshade_pool*)calloc(1, sizeof(funshade_pool));
+    long n_cpu;
+    size_t t;
+    if (pool == NULL)   return NULL;
+    if (n_threads == 0)
+    {
+        n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = (n_cpu > 0) ? (size_t)n_cpu : 1;
+    }
+    pool->threads = (pthread_t*)malloc(n_threads*sizeof(pthread_t));
+    if (pool->threads == NULL || pipe(pool->pipe_fd) < 0)
+    {
+        free(pool->threads); free(pool);
+        return NULL;
+    }
+    fcntl(pool->pipe_fd[0], F_SETFL, fcntl(pool->pipe_fd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(pool->pipe_fd[1], F_SETFL, fcntl(pool->pipe_fd[1], F_GETFL) | O_NONBLOCK);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (t = 0; t < n_threads; t++)
+    {
+        if (pthread_create(&pool->threads[t], NULL, pool_worker, pool) != 0)    break;
+    }
+    pool->n_threads = t;
+    if (t == 0)
+    {
+        funshade_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void funshade_pool_free(funshade_pool *pool){
+    size_t t;
+    if (pool == NULL)   return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (t = 0; t < pool->n_threads; t++)
+    {
+        pthread_join(pool->threads[t], NULL);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    close(pool->pipe_fd[0]); close(pool->pipe_fd[1]);
+    free(pool->threads); free(pool);
+}
+
+int funshade_pool_submit(funshade_pool *pool, funshade_job *job){
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stop)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    job->next = NULL;
+    if (pool->tail)     pool->tail->next = job;
+    else                pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int funshade_pool_fd(const funshade_pool *pool){
+    return pool->pipe_fd[0];
+}
+
+size_t funshade_pool_poll(funshade_pool *pool, funshade_job *done[], size_t max){
+    char buf[64];
+    size_t n = 0;
+    bool more;
+    // Consume the notifications first, so that none is lost for later jobs
+    while (read(pool->pipe_fd[0], buf, sizeof(buf)) > 0);
+    pthread_mutex_lock(&pool->lock);
+    while (n < max && pool->done != NULL)
+    {
+        done[n++] = pool->done;
+        pool->done = pool->done->next;
+    }
+    if (pool->done == NULL)     pool->done_tail = NULL;
+    more = (pool->done != NULL);
+    pthread_mutex_unlock(&pool->lock);
+    if (more)   notify(pool);   // keep the fd readable for the rest
+    return n;
+}
+
+size_t funshade_pool_wait(funshade_pool *pool, funshade_job *done[], size_t max){
+    struct pollfd pfd;
+    size_t n;
+    pfd.fd = pool->pipe_fd[0];  pfd.events = POLLIN;
+    while ((n = funshade_pool_poll(pool, done, max)) == 0)
+    {
+        poll(&pfd, 1, -1);
+    }
+    return n;
+}
+
+#endif // FUNSHADE_HAS_POOL
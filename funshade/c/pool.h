@@ -0,0 +1,79 @@
+// POOL: Native worker pool with fd-based completion, for event-loop callers
+// -----------------------------------------------------------------------------
+// Jobs (setup, eval_dist, eval_sign, eval_sign_collapse) are queued to a fixed
+//  set of pthreads and run with the batch functions of fss.h. Each completion
+//  makes funshade_pool_fd readable, so that an event loop (e.g. asyncio's
+//  add_reader) can drain finished jobs with funshade_pool_poll, without a
+//  thread blocked per request.
+//
+// Small eval_sign/eval_sign_collapse jobs of the same party that are queued
+//  together are coalesced into a single funshade_eval_sign_batch call.
+//
+// POSIX only.
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "fss.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FUNSHADE_HAS_POOL
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+#define POOL_COALESCE_K     256     // Max keys of a coalesced eval_sign batch
+
+typedef enum {
+    POOL_OP_SETUP = 1,              // funshade_setup_batch
+    POOL_OP_DIST,                   // funshade_eval_dist_batch
+    POOL_OP_SIGN,                   // funshade_eval_sign_batch
+    POOL_OP_SIGN_COLLAPSE           // funshade_eval_sign_batch_collapse
+} funshade_pool_op;
+
+/// @brief A unit of work. Filled and owned by the caller, which must keep it
+///        and every buffer it points to alive until it is returned by
+///        funshade_pool_poll/funshade_pool_wait. Unused pointers may be NULL.
+typedef struct funshade_job {
+    funshade_pool_op op;
+    uint64_t        id;             // caller tag, untouched by the pool
+    size_t          K, l;
+    bool            j;
+    R_t             theta;          // SETUP
+    // Inputs
+    const R_t       *r_in_j, *D_x, *D_y, *d_xj, *d_yj, *d_xyj;  // DIST
+    const uint8_t   *k_j;                                       // SIGN*
+    const R_t       *z_hat_0, *z_hat_1;                         // SIGN*
+    // Outputs
+    R_t             *out;           // z_hat_j [K] (DIST) or o_j [K] (SIGN)
+    R_t             o_sum;          // SIGN_COLLAPSE
+    R_t             *setup[8];      // SETUP: d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in_0, r_in_1
+    uint8_t         *k0, *k1;       // SETUP
+    // Private
+    struct funshade_job *next;
+} funshade_job;
+
+typedef struct funshade_pool funshade_pool;
+
+/// @brief Start a pool of n_threads workers (0 for one per online CPU).
+/// @return NULL on error
+funshade_pool *funshade_pool_new(size_t n_threads);
+
+/// @brief Finish the queued jobs, stop the workers and release the pool.
+///        Completed jobs that were not polled are dropped.
+void funshade_pool_free(funshade_pool *pool);
+
+/// @brief Queue a job. Returns 0, or -1 if the pool is shutting down.
+int funshade_pool_submit(funshade_pool *pool, funshade_job *job);
+
+/// @brief File descriptor that becomes readable when jobs complete.
+int funshade_pool_fd(const funshade_pool *pool);
+
+/// @brief Return up to max completed jobs in done, without blocking.
+size_t funshade_pool_poll(funshade_pool *pool, funshade_job *done[], size_t max);
+
+/// @brief Same as funshade_pool_poll, blocking until at least one job is done.
+size_t funshade_pool_wait(funshade_pool *pool, funshade_job *done[], size_t max);
+
+#endif // unix
+#endif // __POOL_H__
@@ -0,0 +1,311 @@
+#define _DEFAULT_SOURCE         // nanosleep with -std=c90
+#include "replay.h"
+
+#ifdef FUNSHADE_HAS_REPLAY
+#include <stdio.h>      // FILE, fopen, fread, fwrite
+#include <pthread.h>    // pthread_*
+#include <time.h>       // nanosleep
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+#define REPLAY_MAGIC    0x50525346u     // "FSRP"
+#define REPLAY_VERSION  1
+#define REPLAY_LEAD_NS  1000000         // First release, after the workers start
+#define REPLAY_SPIN_NS  50000           // Busy-wait the last part of a wait
+
+typedef struct {
+    uint32_t magic;     // REPLAY_MAGIC
+    uint32_t version;   // REPLAY_VERSION
+    uint32_t rec_len;   // sizeof(funshade_trace_call) of the recording build
+    uint32_t reserved;
+    uint64_t n;         // number of calls
+} replay_hdr_t;
+
+// Synthetic material, shared by the workers, and per-call schedule
+typedef struct {
+    const funshade_trace_call *calls;
+    size_t      n, K_max;
+    uint64_t    *release, *lat;     // ns: absolute release time, release to completion
+    volatile long next;             // next call to take
+    R_t         *r_in, *D_x, *D_y, *d_x, *d_y, *d_xy, *z_hat_0, *z_hat_1;
+    uint8_t     *keys;
+} replay_state;
+
+typedef struct {
+    replay_state *st;
+    R_t         *out;               // K_max outputs of this worker
+    uint64_t    t_done;             // last completion
+} replay_worker;
+
+static int cmp_call(const void *a, const void *b){
+    uint64_t ta = ((const funshade_trace_call*)a)->t, tb = ((const funshade_trace_call*)b)->t;
+    return (ta > tb) - (ta < tb);
+}
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void wait_until(uint64_t t){
+    uint64_t now, d;
+    struct timespec ts;
+    while ((now = funshade_trace_now()) < t)
+    {
+        if ((d = t - now) > REPLAY_SPIN_NS)
+        {
+            d -= REPLAY_SPIN_NS;
+            ts.tv_sec = (time_t)(d / 1000000000u);  ts.tv_nsec = (long)(d % 1000000000u);
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+static void replay_free(replay_state *st){
+    free(st->release);  free(st->lat);  free(st->r_in);     free(st->D_x);  free(st->D_y);
+    free(st->d_x);      free(st->d_y);  free(st->d_xy);     free(st->z_hat_0);  free(st->z_hat_1);
+    free(st->keys);
+}
+
+// Inputs for the largest call: K_max elements, and K*l of the largest eval_dist
+static int replay_alloc(replay_state *st, const funshade_trace_call calls[], size_t n){
+    size_t i, k, n_keys, kl_max = 1;
+    uint8_t *k1;
+    memset(st, 0, sizeof(*st));
+    st->calls = calls;  st->n = n;  st->K_max = 1;
+    for (i=0; i<n; i++)
+    {
+        if (calls[i].K > st->K_max)     st->K_max = calls[i].K;
+        if (calls[i].stage == FUNSHADE_STAGE_EVAL_DIST && (size_t)calls[i].K*calls[i].l > kl_max)
+        {
+            kl_max = (size_t)calls[i].K*calls[i].l;
+        }
+    }
+    n_keys = (st->K_max < REPLAY_KEYS) ? st->K_max : REPLAY_KEYS;
+    st->release = (uint64_t*)malloc(n*sizeof(uint64_t));    st->lat = (uint64_t*)malloc(n*sizeof(uint64_t));
+    st->r_in    = (R_t*)malloc(st->K_max*sizeof(R_t));
+    st->z_hat_0 = (R_t*)malloc(st->K_max*sizeof(R_t));      st->z_hat_1 = (R_t*)malloc(st->K_max*sizeof(R_t));
+    st->D_x  = (R_t*)malloc(kl_max*sizeof(R_t));    st->D_y  = (R_t*)malloc(kl_max*sizeof(R_t));
+    st->d_x  = (R_t*)malloc(kl_max*sizeof(R_t));    st->d_y  = (R_t*)malloc(kl_max*sizeof(R_t));
+    st->d_xy = (R_t*)malloc(kl_max*sizeof(R_t));
+    st->keys = (uint8_t*)malloc(st->K_max*KEY_LEN);
+    k1 = (uint8_t*)malloc(n_keys*KEY_LEN);
+    if (!st->release || !st->lat || !st->r_in || !st->z_hat_0 || !st->z_hat_1 || !st->D_x ||
+        !st->D_y || !st->d_x || !st->d_y || !st->d_xy || !st->keys || !k1)
+    {
+        free(k1);   replay_free(st);
+        return -1;
+    }
+    // Key contents do not change the cost of an evaluation: tile n_keys of them
+    SIGN_gen_batch(n_keys, 0, st->z_hat_0, st->z_hat_1, st->keys, k1);
+    for (k=n_keys; k<st->K_max; k+=n_keys)
+    {
+        memcpy(&st->keys[k*KEY_LEN], st->keys, ((st->K_max-k < n_keys) ? st->K_max-k : n_keys)*KEY_LEN);
+    }
+    free(k1);
+    random_buffer((uint8_t*)st->r_in, st->K_max*sizeof(R_t));
+    random_buffer((uint8_t*)st->z_hat_0, st->K_max*sizeof(R_t));
+    random_buffer((uint8_t*)st->z_hat_1, st->K_max*sizeof(R_t));
+    random_buffer((uint8_t*)st->D_x, kl_max*sizeof(R_t));   random_buffer((uint8_t*)st->D_y, kl_max*sizeof(R_t));
+    random_buffer((uint8_t*)st->d_x, kl_max*sizeof(R_t));   random_buffer((uint8_t*)st->d_y, kl_max*sizeof(R_t));
+    random_buffer((uint8_t*)st->d_xy, kl_max*sizeof(R_t));
+    return 0;
+}
+
+static void *replay_worker_main(void *arg){
+    replay_worker *w = (replay_worker*)arg;
+    replay_state *st = w->st;
+    const funshade_trace_call *c;
+    uint64_t now;
+    size_t i;
+    int paused = funshade_trace_calls_pause(1);     // the replay does not log itself
+    while ((i = (size_t)__sync_fetch_and_add(&st->next, 1)) < st->n)
+    {
+        c = &st->calls[i];
+        wait_until(st->release[i]);
+        switch (c->stage)
+        {
+        case FUNSHADE_STAGE_EVAL_DIST:
+            funshade_eval_dist_batch(c->K, c->l, i & 1, st->r_in, st->D_x, st->D_y,
+                                     st->d_x, st->d_y, st->d_xy, w->out);
+            break;
+        case FUNSHADE_STAGE_EVAL_SIGN:
+            funshade_eval_sign_batch(c->K, i & 1, st->keys, st->z_hat_0, st->z_hat_1, w->out);
+            break;
+        case FUNSHADE_STAGE_COLLAPSE:
+            w->out[0] = funshade_eval_sign_batch_collapse(c->K, i & 1, st->keys, st->z_hat_0, st->z_hat_1);
+            break;
+        default:
+            break;
+        }
+        now = funshade_trace_now();
+        st->lat[i] = now - st->release[i];
+        if (now > w->t_done)    w->t_done = now;
+    }
+    funshade_trace_calls_pause(paused);
+    return NULL;
+}
+
+static int replay_once(replay_state *st, double speed, size_t n_threads, funshade_replay_report *rep){
+    replay_worker *w;
+    pthread_t *th;
+    size_t i, t, started = 0;
+    uint64_t t0, t_first = UINT64_MAX, t_last = 0, t_done = 0;
+    int rc = 0;
+
+    memset(rep, 0, sizeof(*rep));
+    rep->speed = speed;     rep->n_calls = st->n;
+    if (n_threads == 0)     n_threads = 1;
+    w  = (replay_worker*)calloc(n_threads, sizeof(replay_worker));
+    th = (pthread_t*)malloc(n_threads*sizeof(pthread_t));
+    for (t=0; w && t<n_threads; t++)
+    {
+        w[t].st = st;
+        if ((w[t].out = (R_t*)malloc(st->K_max*sizeof(R_t))) == NULL)  rc = -1;
+    }
+    if (!w || !th || rc)
+    {
+        for (t=0; w && t<n_threads; t++)    free(w[t].out);
+        free(w);    free(th);
+        return -1;
+    }
+    // Schedule, relative to the earliest recorded call
+    for (i=0; i<st->n; i++)
+    {
+        if (st->calls[i].t < t_first)   t_first = st->calls[i].t;
+        if (st->calls[i].t > t_last)    t_last = st->calls[i].t;
+        rep->elements += st->calls[i].K;
+    }
+    t0 = funshade_trace_now() + REPLAY_LEAD_NS;
+    for (i=0; i<st->n; i++)
+    {
+        st->release[i] = t0 + (uint64_t)((double)(st->calls[i].t - t_first) / speed);
+    }
+    st->next = 0;
+    for (t=0; t<n_threads; t++)
+    {
+        if (pthread_create(&th[t], NULL, replay_worker_main, &w[t]) != 0)  break;
+        started++;
+    }
+    if (started == 0)   replay_worker_main(&w[0]);      // replay on the caller
+    for (t=0; t<started; t++)
+    {
+        pthread_join(th[t], NULL);
+    }
+
+    for (t=0; t<n_threads; t++)
+    {
+        if (w[t].t_done > t_done)   t_done = w[t].t_done;
+        free(w[t].out);
+    }
+    free(w);    free(th);
+    qsort(st->lat, st->n, sizeof(uint64_t), cmp_u64);
+    rep->duration   = (double)(t_done - t0) / 1e9;
+    rep->offered    = (t_last > t_first) ? (double)st->n * speed / ((double)(t_last - t_first) / 1e9) : 0;
+    rep->throughput = (double)st->n / rep->duration;
+    rep->elem_rate  = (double)rep->elements / rep->duration;
+    rep->p50  = st->lat[(size_t)(0.50*(double)(st->n-1))];
+    rep->p90  = st->lat[(size_t)(0.90*(double)(st->n-1))];
+    rep->p99  = st->lat[(size_t)(0.99*(double)(st->n-1))];
+    rep->p999 = st->lat[(size_t)(0.999*(double)(st->n-1))];
+    rep->max  = st->lat[st->n-1];
+    return 0;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+int funshade_replay_save(const char *path, const funshade_trace_call calls[], size_t n){
+    replay_hdr_t h;
+    funshade_trace_call *sorted = (funshade_trace_call*)malloc((n ? n : 1)*sizeof(funshade_trace_call));
+    FILE *f;
+    int err;
+    if (sorted == NULL)     return -1;
+    memcpy(sorted, calls, n*sizeof(funshade_trace_call));
+    qsort(sorted, n, sizeof(funshade_trace_call), cmp_call);   // logged in order of completion
+    memset(&h, 0, sizeof(h));
+    h.magic = REPLAY_MAGIC;     h.version = REPLAY_VERSION;
+    h.rec_len = sizeof(funshade_trace_call);    h.n = n;
+    if ((f = fopen(path, "wb")) == NULL)
+    {
+        free(sorted);
+        return -1;
+    }
+    err  = (fwrite(&h, sizeof(h), 1, f) != 1);
+    err |= (fwrite(sorted, sizeof(funshade_trace_call), n, f) != n);
+    err |= (fclose(f) != 0);
+    free(sorted);
+    return err ? -1 : 0;
+}
+
+int funshade_replay_load(const char *path, funshade_trace_call **calls, size_t *n){
+    replay_hdr_t h;
+    size_t i;
+    FILE *f = fopen(path, "rb");
+    *calls = NULL;  *n = 0;
+    if (f == NULL)  return -1;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != REPLAY_MAGIC || h.version != REPLAY_VERSION ||
+        h.rec_len != sizeof(funshade_trace_call) || h.n > SIZE_MAX/sizeof(funshade_trace_call) ||
+        (*calls = (funshade_trace_call*)malloc((h.n ? h.n : 1)*sizeof(funshade_trace_call))) == NULL ||
+        fread(*calls, sizeof(funshade_trace_call), h.n, f) != h.n)
+    {
+        free(*calls);   *calls = NULL;
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    for (i=0; i<h.n; i++)
+    {
+        if ((*calls)[i].stage >= FUNSHADE_N_STAGES)
+        {
+            free(*calls);   *calls = NULL;
+            return -1;
+        }
+    }
+    *n = h.n;
+    return 0;
+}
+
+int funshade_replay_run(const funshade_trace_call calls[], size_t n, double speed, size_t n_threads,
+    funshade_replay_report *rep){
+    replay_state st;
+    int rc;
+    if (!(speed > 0))   return -1;
+    if (n == 0)
+    {
+        memset(rep, 0, sizeof(*rep));   rep->speed = speed;
+        return 0;
+    }
+    if (replay_alloc(&st, calls, n))    return -1;
+    rc = replay_once(&st, speed, n_threads, rep);
+    replay_free(&st);
+    return rc;
+}
+
+int funshade_replay_sweep(const funshade_trace_call calls[], size_t n, const double speeds[],
+    size_t n_speeds, size_t n_threads, funshade_replay_report reps[]){
+    replay_state st;
+    size_t s;
+    int sat = -1;
+    for (s=0; s<n_speeds; s++)
+    {
+        if (!(speeds[s] > 0))   return -2;
+    }
+    if (n == 0 || n_speeds == 0)    return -1;
+    if (replay_alloc(&st, calls, n))    return -2;      // material shared by the runs
+    for (s=0; s<n_speeds; s++)
+    {
+        if (replay_once(&st, speeds[s], n_threads, &reps[s]))
+        {
+            sat = -2;   break;
+        }
+        if (reps[s].offered > 0 && reps[s].throughput >= REPLAY_KEEP_UP*reps[s].offered)
+        {
+            sat = (int)s;
+        }
+    }
+    replay_free(&st);
+    return sat;
+}
+
+#endif // FUNSHADE_HAS_REPLAY
@@ -0,0 +1,76 @@
+// REPLAY: Record-and-replay load harness of the online matching path
+// -----------------------------------------------------------------------------
+// The fixed-size loops of test_fss.c do not show how the library behaves under
+//  a real mix of batch sizes, vector lengths and concurrent requests. With
+//  FUNSHADE_TRACE_CALLS (trace.h), every funshade_eval_dist_batch,
+//  funshade_eval_sign_batch and funshade_eval_sign_batch_collapse call is
+//  logged with its sizes and start time; funshade_replay_save writes the log
+//  to a compact file (24 bytes per call), e.g. recorded on a production host.
+//
+// funshade_replay_run plays a log back against the library, open loop: call i
+//  is released at its recorded offset divided by speed, and n_threads workers
+//  take the released calls in order, like the request threads of a server.
+//  Latency runs from release to completion, so it includes queueing once the
+//  workers fall behind. Inputs are synthetic (valid keys, random masks and
+//  values) and sized for the largest call, shared by all workers like a
+//  reference DB, so that sizes and concurrency, hence cache and threading
+//  behavior, are those of the recording.
+//
+// funshade_replay_sweep runs a list of increasing speeds and finds the
+//  saturation point: the fastest speed whose throughput keeps up with the
+//  offered load (REPLAY_KEEP_UP).
+//
+// Files use native endianness (recorded and replayed on the same build).
+// POSIX only.
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "fss.h"
+#include "trace.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FUNSHADE_HAS_REPLAY
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+#define REPLAY_KEEP_UP      0.95    // Completed/offered call rate of a sustained speed
+#define REPLAY_KEYS         1024    // Distinct keys generated, tiled up to the largest K
+
+/// @brief Outcome of one replay.
+typedef struct {
+    double   speed;                     // speed multiplier
+    size_t   n_calls;                   // calls replayed
+    uint64_t elements;                  // sum of K over the calls
+    double   duration;                  // s, from the first release to the last completion
+    double   offered;                   // calls/s released (0: all at once)
+    double   throughput;                // calls/s completed
+    double   elem_rate;                 // elements/s completed
+    uint64_t p50, p90, p99, p999, max;  // ns, release to completion
+} funshade_replay_report;
+
+/// @brief Write n logged calls (funshade_trace_calls_get) to path, sorted by start time.
+/// @return 0 on success, -1 on allocation or I/O error
+int funshade_replay_save(const char *path, const funshade_trace_call calls[], size_t n);
+
+/// @brief Read a file of funshade_replay_save into *calls (malloc'ed, to free).
+/// @return 0 on success, -1 on allocation or I/O error or bad file
+int funshade_replay_load(const char *path, funshade_trace_call **calls, size_t *n);
+
+/// @brief Replay n calls at speed (> 0, 2 replays twice as fast) with
+///        n_threads workers (0 for one). The replayed calls are not logged with
+///        FUNSHADE_TRACE_CALLS (calls of other threads still are); with other
+///        trace flags they are traced too.
+/// @return 0 on success, -1 on allocation or thread error
+int funshade_replay_run(const funshade_trace_call calls[], size_t n, double speed, size_t n_threads,
+    funshade_replay_report *rep);
+
+/// @brief funshade_replay_run at each of the n_speeds increasing speeds, into reps.
+/// @return index of the saturation point (last speed that keeps up), -1 if
+///         none does, -2 on error
+int funshade_replay_sweep(const funshade_trace_call calls[], size_t n, const double speeds[],
+    size_t n_speeds, size_t n_threads, funshade_replay_report reps[]);
+
+#endif // unix
+#endif // __REPLAY_H__
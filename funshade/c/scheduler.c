@@ -0,0 +1,434 @@
+#define _DEFAULT_SOURCE         // sysconf with -std=c90
+#include "scheduler.h"
+
+#ifdef FUNSHADE_HAS_SCHED
+#include <pthread.h>    // pthread_*
+#include <unistd.h>     // sysconf
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+#define SCHED_GRAIN_KEYS    16          // Keys per chunk for setup and sign
+#define SCHED_GRAIN_ELEMS   16384       // Elements (rows*l) per chunk for dist
+#define SCHED_CHUNKS(n, g)  (((n) + (g) - 1) / (g))     // CEIL, 0 for n = 0
+
+// Deque of lanes of a worker: the owner pushes and pops at the bottom, thieves
+//  steal from the top. top/bottom grow monotonically, modulo cap.
+typedef struct {
+    pthread_mutex_t lock;
+    funshade_task   **buf;
+    size_t          cap, top, bottom;
+} sched_deque;
+
+struct funshade_task {
+    funshade_range_fn fn;
+    void            (*fin)(void *arg);  // run once, when the last chunk is done
+    void            *arg;               // copy of the caller's arg, after the struct
+    size_t          n, grain;
+    size_t          next, left;         // next index to hand out, indices not yet done
+    size_t          lanes;              // lanes queued or running
+    size_t          limit;              // max lanes (0: no limit), applied when ready
+    size_t          n_deps;             // dependencies not yet done
+    size_t          refs;               // handle + dependents that still read the task
+    funshade_task   **dependents;
+    size_t          n_dependents, cap_dependents;
+    bool            done;
+};
+
+struct funshade_sched {
+    pthread_mutex_t lock;               // task state and queued
+    pthread_cond_t  cond;               // queued lanes, finished tasks, stop
+    sched_deque     *deques;
+    size_t          n_workers, rr;      // rr: next deque for external submissions
+    size_t          queued;             // lanes in the deques
+    pthread_t       *threads;
+    pthread_key_t   self;               // worker index + 1, NULL for external threads
+    bool            stop;
+};
+
+static void *sched_alloc(void *old, size_t len){
+    void *p = realloc(old, len);
+    if (p == NULL)
+    {
+        printf("<Funshade Error>: scheduler out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void deque_push(sched_deque *d, funshade_task *task){
+    funshade_task **buf;
+    size_t i;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top == d->cap)
+    {
+        buf = (funshade_task**)sched_alloc(NULL, 2*d->cap*sizeof(funshade_task*));
+        for (i = d->top; i < d->bottom; i++)    buf[i % (2*d->cap)] = d->buf[i % d->cap];
+        free(d->buf);
+        d->buf = buf;   d->cap *= 2;
+    }
+    d->buf[d->bottom++ % d->cap] = task;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static funshade_task *deque_take(sched_deque *d, bool steal){
+    funshade_task *task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top)
+    {
+        task = steal ? d->buf[d->top++ % d->cap] : d->buf[--d->bottom % d->cap];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+// Own deque first (most recent lane), then steal the oldest lane of the others
+static funshade_task *sched_take(funshade_sched *sched){
+    size_t self = (size_t)pthread_getspecific(sched->self), w, i;
+    funshade_task *task = NULL;
+    if (self)   task = deque_take(&sched->deques[self-1], false);
+    for (i = 0; task == NULL && i < sched->n_workers; i++)
+    {
+        w = (self + i) % sched->n_workers;
+        task = deque_take(&sched->deques[w], true);
+    }
+    if (task)
+    {
+        pthread_mutex_lock(&sched->lock);
+        sched->queued--;
+        pthread_mutex_unlock(&sched->lock);
+    }
+    return task;
+}
+
+static void task_complete(funshade_sched *sched, funshade_task *task);
+
+// Queue the lanes of a task whose dependencies are done. Holds sched->lock.
+static void task_ready(funshade_sched *sched, funshade_task *task, size_t limit){
+    size_t self = (size_t)pthread_getspecific(sched->self), lanes = SCHED_CHUNKS(task->n, task->grain), i;
+    if (task->n == 0)
+    {
+        task_complete(sched, task);
+        return;
+    }
+    if (limit > 0 && lanes > limit)     lanes = limit;
+    if (lanes > sched->n_workers)       lanes = sched->n_workers;
+    task->lanes = lanes;
+    for (i = 0; i < lanes; i++)
+    {
+        deque_push(&sched->deques[self ? self-1 : sched->rr++ % sched->n_workers], task);
+    }
+    sched->queued += lanes;
+    pthread_cond_broadcast(&sched->cond);
+}
+
+// Holds sched->lock
+static void task_complete(funshade_sched *sched, funshade_task *task){
+    funshade_task *dep;
+    size_t i;
+    if (task->fin)  task->fin(task->arg);
+    for (i = 0; i < task->n_dependents; i++)
+    {
+        dep = task->dependents[i];
+        if (--dep->n_deps == 0)     task_ready(sched, dep, dep->limit);
+    }
+    task->done = true;
+    task->refs -= task->n_dependents;   // the dependents have seen it done
+    pthread_cond_broadcast(&sched->cond);
+}
+
+// Grab chunks of the task until none is left
+static void run_lane(funshade_sched *sched, funshade_task *task){
+    size_t b, e;
+    pthread_mutex_lock(&sched->lock);
+    while (task->next < task->n)
+    {
+        b = task->next;
+        e = (task->n - b < task->grain) ? task->n : b + task->grain;
+        task->next = e;
+        pthread_mutex_unlock(&sched->lock);
+        task->fn(task->arg, b, e);
+        pthread_mutex_lock(&sched->lock);
+        task->left -= e - b;
+        if (task->left == 0)    task_complete(sched, task);
+    }
+    if (--task->lanes == 0)     pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+typedef struct { funshade_sched *sched; size_t w; } worker_arg;
+
+static void *sched_worker(void *arg){
+    funshade_sched *sched = ((worker_arg*)arg)->sched;
+    funshade_task *task;
+    pthread_setspecific(sched->self, (void*)(((worker_arg*)arg)->w + 1));
+    free(arg);
+    for (;;)
+    {
+        task = sched_take(sched);
+        if (task)
+        {
+            run_lane(sched, task);
+            continue;
+        }
+        pthread_mutex_lock(&sched->lock);
+        while (sched->queued == 0 && !sched->stop)
+        {
+            pthread_cond_wait(&sched->cond, &sched->lock);
+        }
+        if (sched->queued == 0 && sched->stop)
+        {
+            pthread_mutex_unlock(&sched->lock);
+            break;
+        }
+        pthread_mutex_unlock(&sched->lock);
+    }
+    return NULL;
+}
+
+static funshade_task *sched_submit_fin(funshade_sched *sched, size_t n, size_t grain, size_t limit,
+    funshade_range_fn fn, void (*fin)(void *arg), const void *arg, size_t arg_len, size_t extra_len,
+    funshade_task *const deps[], size_t n_deps){
+    funshade_task *task = (funshade_task*)malloc(sizeof(funshade_task) + arg_len + extra_len), *dep;
+    size_t i;
+    if (task == NULL)   return NULL;
+    memset(task, 0, sizeof(funshade_task));
+    task->arg = (void*)(task + 1);
+    memcpy(task->arg, arg, arg_len);
+    task->fn = fn;      task->fin = fin;
+    task->n = n;        task->grain = grain ? grain : 1;    task->left = n;
+    task->limit = limit;
+    task->refs = 1;
+
+    // A dependency that is not done yet keeps a reference from this task until
+    //  task_complete has read it; a done one is only read here, under the lock.
+    pthread_mutex_lock(&sched->lock);
+    for (i = 0; i < n_deps; i++)
+    {
+        dep = deps[i];
+        if (dep->done)  continue;
+        if (dep->n_dependents == dep->cap_dependents)
+        {
+            dep->cap_dependents = dep->cap_dependents ? 2*dep->cap_dependents : 4;
+            dep->dependents = (funshade_task**)sched_alloc(dep->dependents, dep->cap_dependents*sizeof(funshade_task*));
+        }
+        dep->dependents[dep->n_dependents++] = task;
+        dep->refs++;
+        task->n_deps++;
+    }
+    if (task->n_deps == 0)  task_ready(sched, task, limit);
+    pthread_mutex_unlock(&sched->lock);
+    return task;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+funshade_sched *funshade_sched_new(size_t n_workers){
+    funshade_sched *sched = (funshade_sched*)calloc(1, sizeof(funshade_sched));
+    worker_arg *arg;
+    long n_cpu;
+    size_t w;
+    if (sched == NULL)  return NULL;
+    if (n_workers == 0)
+    {
+        n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = (n_cpu > 0) ? (size_t)n_cpu : 1;
+    }
+    sched->deques = (sched_deque*)calloc(n_workers, sizeof(sched_deque));
+    sched->threads = (pthread_t*)malloc(n_workers*sizeof(pthread_t));
+    if (sched->deques == NULL || sched->threads == NULL || pthread_key_create(&sched->self, NULL) != 0)
+    {
+        free(sched->deques); free(sched->threads); free(sched);
+        return NULL;
+    }
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->cond, NULL);
+    sched->n_workers = n_workers;
+    for (w = 0; w < n_workers; w++)
+    {
+        pthread_mutex_init(&sched->deques[w].lock, NULL);
+        sched->deques[w].cap = 16;
+        sched->deques[w].buf = (funshade_task**)sched_alloc(NULL, 16*sizeof(funshade_task*));
+    }
+    for (w = 0; w < n_workers; w++)
+    {
+        arg = (worker_arg*)sched_alloc(NULL, sizeof(worker_arg));
+        arg->sched = sched;     arg->w = w;
+        if (pthread_create(&sched->threads[w], NULL, sched_worker, arg) != 0)
+        {
+            printf("<Funshade Error>: could not start scheduler worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return sched;
+}
+
+void funshade_sched_free(funshade_sched *sched){
+    size_t w;
+    if (sched == NULL)  return;
+    pthread_mutex_lock(&sched->lock);
+    sched->stop = true;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+    for (w = 0; w < sched->n_workers; w++)
+    {
+        pthread_join(sched->threads[w], NULL);
+        pthread_mutex_destroy(&sched->deques[w].lock);
+        free(sched->deques[w].buf);
+    }
+    pthread_key_delete(sched->self);
+    pthread_cond_destroy(&sched->cond);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->deques); free(sched->threads); free(sched);
+}
+
+funshade_task *funshade_sched_submit(funshade_sched *sched, size_t n, size_t grain, size_t limit,
+    funshade_range_fn fn, const void *arg, size_t arg_len, funshade_task *const deps[], size_t n_deps){
+    return sched_submit_fin(sched, n, grain, limit, fn, NULL, arg, arg_len, 0, deps, n_deps);
+}
+
+void funshade_sched_wait(funshade_sched *sched, funshade_task *task){
+    funshade_task *other;
+    bool last;
+    pthread_mutex_lock(&sched->lock);
+    while (!task->done || task->lanes > 0)
+    {
+        if (sched->queued > 0)      // help instead of blocking
+        {
+            pthread_mutex_unlock(&sched->lock);
+            other = sched_take(sched);
+            if (other)  run_lane(sched, other);
+            pthread_mutex_lock(&sched->lock);
+            continue;
+        }
+        pthread_cond_wait(&sched->cond, &sched->lock);
+    }
+    last = (--task->refs == 0);         // drop the handle
+    pthread_mutex_unlock(&sched->lock);
+    if (last)
+    {
+        free(task->dependents);
+        free(task);
+    }
+}
+
+// ............................... FUNSHADE .................................. //
+// The chunks run serial loops over the fss.h single functions: the batch
+//  functions have OpenMP loops of their own, which would nest in the workers.
+#ifdef USE_CPP_ENGINE
+#define SCHED_SIGN_EVAL     SIGN_eval_cpp
+#else
+#define SCHED_SIGN_EVAL     SIGN_eval
+#endif
+
+typedef struct {
+    size_t l;   R_t theta;
+    R_t *d_x0, *d_x1, *d_y0, *d_y1, *d_xy0, *d_xy1, *r_in_0, *r_in_1;
+    uint8_t *k0, *k1;
+} setup_arg;
+static void setup_range(void *arg, size_t b, size_t e){
+    setup_arg *a = (setup_arg*)arg;
+    size_t l = a->l, len = (e-b)*l*sizeof(R_t), idx, k;
+    random_buffer((uint8_t*)&a->d_x0[b*l], len);    random_buffer((uint8_t*)&a->d_x1[b*l], len);
+    random_buffer((uint8_t*)&a->d_y0[b*l], len);    random_buffer((uint8_t*)&a->d_y1[b*l], len);
+    random_buffer((uint8_t*)&a->d_xy0[b*l], len);
+    for (idx = b*l; idx < e*l; idx++)
+    {
+        a->d_xy1[idx] = (a->d_x0[idx]+a->d_x1[idx]) * (a->d_y0[idx]+a->d_y1[idx]) - a->d_xy0[idx];
+    }
+    random_buffer((uint8_t*)&a->r_in_0[b], (e-b)*sizeof(R_t));
+    random_buffer((uint8_t*)&a->r_in_1[b], (e-b)*sizeof(R_t));
+    for (k = b; k < e; k++)
+    {
+        SIGN_gen(a->r_in_0[k]+a->r_in_1[k], 0, &a->k0[k*KEY_LEN], &a->k1[k*KEY_LEN]);
+        a->r_in_1[k] -= a->theta;
+    }
+}
+funshade_task *funshade_sched_setup_batch(funshade_sched *sched, size_t limit,
+    funshade_task *const deps[], size_t n_deps, size_t K, size_t l, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[]){
+    setup_arg a;
+    a.l = l;    a.theta = theta;
+    a.d_x0 = d_x0;  a.d_x1 = d_x1;  a.d_y0 = d_y0;  a.d_y1 = d_y1;  a.d_xy0 = d_xy0;  a.d_xy1 = d_xy1;
+    a.r_in_0 = r_in_0;  a.r_in_1 = r_in_1;  a.k0 = k0;  a.k1 = k1;
+    return funshade_sched_submit(sched, K, SCHED_GRAIN_KEYS, limit, setup_range, &a, sizeof(a), deps, n_deps);
+}
+
+typedef struct {
+    size_t l;   bool j;
+    const R_t *r_in_j, *D_x, *D_y, *d_xj, *d_yj, *d_xyj;
+    R_t *z_hat_j;
+} dist_arg;
+static void dist_range(void *arg, size_t b, size_t e){
+    dist_arg *a = (dist_arg*)arg;
+    size_t l = a->l, k;
+    for (k = b; k < e; k++)
+    {
+        a->z_hat_j[k] = funshade_eval_dist(l, a->j, a->r_in_j[k], &a->D_x[k*l], &a->D_y[k*l],
+            &a->d_xj[k*l], &a->d_yj[k*l], &a->d_xyj[k*l]);
+    }
+}
+funshade_task *funshade_sched_eval_dist_batch(funshade_sched *sched, size_t limit,
+    funshade_task *const deps[], size_t n_deps, size_t K, size_t l, bool j,
+    const R_t r_in_j[], const R_t D_x[], const R_t D_y[],
+    const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[], R_t z_hat_j[]){
+    dist_arg a;
+    a.l = l;    a.j = j;    a.r_in_j = r_in_j;  a.D_x = D_x;    a.D_y = D_y;
+    a.d_xj = d_xj;  a.d_yj = d_yj;  a.d_xyj = d_xyj;    a.z_hat_j = z_hat_j;
+    return funshade_sched_submit(sched, K, CEIL(SCHED_GRAIN_ELEMS, l ? l : 1), limit, dist_range,
+        &a, sizeof(a), deps, n_deps);
+}
+
+// Collapsed sign: each chunk writes its partial sum, fin adds them up
+typedef struct {
+    size_t K;   bool j;
+    const uint8_t *k_j;
+    const R_t *z_hat_0, *z_hat_1;
+    R_t *o_j;                       // [K] outputs, or the collapsed output
+} sign_arg;
+#define SIGN_PARTIALS(a)    ((R_t*)((sign_arg*)(a) + 1))
+static void sign_range(void *arg, size_t b, size_t e){
+    sign_arg *a = (sign_arg*)arg;
+    size_t k;
+    for (k = b; k < e; k++)
+    {
+        a->o_j[k] = SCHED_SIGN_EVAL(a->j, &a->k_j[k*KEY_LEN], a->z_hat_0[k]+a->z_hat_1[k]);
+    }
+}
+static void sign_collapse_range(void *arg, size_t b, size_t e){
+    sign_arg *a = (sign_arg*)arg;
+    R_t o = 0;
+    size_t k;
+    for (k = b; k < e; k++)
+    {
+        o += SCHED_SIGN_EVAL(a->j, &a->k_j[k*KEY_LEN], a->z_hat_0[k]+a->z_hat_1[k]);
+    }
+    SIGN_PARTIALS(a)[b/SCHED_GRAIN_KEYS] = o;
+}
+static void sign_collapse_fin(void *arg){
+    sign_arg *a = (sign_arg*)arg;
+    R_t o = 0;
+    size_t c;
+    for (c = 0; c < SCHED_CHUNKS(a->K, SCHED_GRAIN_KEYS); c++)  o += SIGN_PARTIALS(a)[c];
+    *a->o_j = o;
+}
+funshade_task *funshade_sched_eval_sign_batch(funshade_sched *sched, size_t limit,
+    funshade_task *const deps[], size_t n_deps, size_t K, bool j, const uint8_t k_j[],
+    const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[]){
+    sign_arg a;
+    a.K = K;    a.j = j;    a.k_j = k_j;    a.z_hat_0 = z_hat_0;    a.z_hat_1 = z_hat_1;    a.o_j = o_j;
+    return funshade_sched_submit(sched, K, SCHED_GRAIN_KEYS, limit, sign_range, &a, sizeof(a), deps, n_deps);
+}
+funshade_task *funshade_sched_eval_sign_batch_collapse(funshade_sched *sched, size_t limit,
+    funshade_task *const deps[], size_t n_deps, size_t K, bool j, const uint8_t k_j[],
+    const R_t z_hat_0[], const R_t z_hat_1[], R_t *o_j){
+    sign_arg a;
+    a.K = K;    a.j = j;    a.k_j = k_j;    a.z_hat_0 = z_hat_0;    a.z_hat_1 = z_hat_1;    a.o_j = o_j;
+    *o_j = 0;
+    return sched_submit_fin(sched, K, SCHED_GRAIN_KEYS, limit, sign_collapse_range, sign_collapse_fin,
+        &a, sizeof(a), SCHED_CHUNKS(K, SCHED_GRAIN_KEYS)*sizeof(R_t), deps, n_deps);
+}
+
+#endif // FUNSHADE_HAS_SCHED
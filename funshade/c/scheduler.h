@@ -0,0 +1,81 @@
+// SCHEDULER: Work-stealing task scheduler for the batch functions
+// -----------------------------------------------------------------------------
+// Alternative to the static `#pragma omp parallel for` loops of fss.c, for
+//  processes that run many batch queries at once:
+//  - A task is a range [0, n) processed in chunks of `grain` indices by at
+//    most `limit` workers at a time (its lanes). Lanes are pushed to per-worker
+//    deques and stolen by idle workers; within a task, lanes grab chunks
+//    dynamically, so uneven chunks do not leave workers idle.
+//  - Tasks may depend on other tasks (a task graph, e.g. setup -> dist -> sign)
+//    and become runnable when all their dependencies are done.
+//  - Any thread may submit and wait, including tasks themselves (nesting):
+//    a waiting thread runs pending lanes instead of blocking.
+//
+// The chunks of the FUNSHADE tasks below run serial loops, so the scheduler can
+//  share a -fopenmp build with the OpenMP batch functions without nesting.
+//
+// POSIX only.
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include "fss.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FUNSHADE_HAS_SCHED
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+typedef struct funshade_sched funshade_sched;
+typedef struct funshade_task funshade_task;
+
+/// @brief Body of a task, processing indices [begin, end) of its range.
+typedef void (*funshade_range_fn)(void *arg, size_t begin, size_t end);
+
+/// @brief Start a scheduler with n_workers threads (0 for one per online CPU).
+/// @return NULL on error
+funshade_sched *funshade_sched_new(size_t n_workers);
+
+/// @brief Stop the workers and release the scheduler. All submitted tasks must
+///        have been waited for.
+void funshade_sched_free(funshade_sched *sched);
+
+/// @brief Submit fn over [0, n) in chunks of grain, on at most limit workers
+///        (0 for all), once the n_deps tasks in deps are done.
+/// @param arg      copied into the task (arg_len bytes), fn receives the copy
+/// @return         task handle, to be passed to funshade_sched_wait exactly
+///                 once, or NULL on allocation failure
+funshade_task *funshade_sched_submit(funshade_sched *sched, size_t n, size_t grain, size_t limit,
+    funshade_range_fn fn, const void *arg, size_t arg_len, funshade_task *const deps[], size_t n_deps);
+
+/// @brief Run pending work until task is done, then release the handle. The
+///        task may no longer be passed as a dependency after that.
+void funshade_sched_wait(funshade_sched *sched, funshade_task *task);
+
+// ............................... FUNSHADE .................................. //
+//  Same as the fss.h batch functions, as tasks over the K dimension.
+//  The arrays must stay valid until the task is waited for.
+
+funshade_task *funshade_sched_setup_batch(funshade_sched *sched, size_t limit,
+    funshade_task *const deps[], size_t n_deps, size_t K, size_t l, R_t theta,
+    R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[],R_t d_xy1[],
+    R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[]);
+
+funshade_task *funshade_sched_eval_dist_batch(funshade_sched *sched, size_t limit,
+    funshade_task *const deps[], size_t n_deps, size_t K, size_t l, bool j,
+    const R_t r_in_j[], const R_t D_x[], const R_t D_y[],
+    const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[], R_t z_hat_j[]);
+
+funshade_task *funshade_sched_eval_sign_batch(funshade_sched *sched, size_t limit,
+    funshade_task *const deps[], size_t n_deps, size_t K, bool j, const uint8_t k_j[],
+    const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[]);
+
+/// @brief Collapsed variant: the sum of the outputs is written to *o_j when the
+///        task is done.
+funshade_task *funshade_sched_eval_sign_batch_collapse(funshade_sched *sched, size_t limit,
+    funshade_task *const deps[], size_t n_deps, size_t K, bool j, const uint8_t k_j[],
+    const R_t z_hat_0[], const R_t z_hat_1[], R_t *o_j);
+
+#endif // unix
+#endif // __SCHEDULER_H__
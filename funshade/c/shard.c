@@ -0,0 +1,290 @@
+#define _DEFAULT_SOURCE         // socketpair, fork, waitpid with -std=c90
+#include "shard.h"
+#include "fd_io.h"
+
+#ifdef FUNSHADE_HAS_SHARD
+#include <errno.h>      // errno, EINTR
+#include <unistd.h>     // close, fork, unlink
+#include <sys/socket.h> // socketpair, socket, bind, listen, accept, connect
+#include <sys/un.h>     // sockaddr_un
+#include <sys/wait.h>   // waitpid
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+// Wire format: a fixed header followed by the payload arrays, native endianness
+//  (coordinator and workers are expected to run the same build).
+#define SHARD_OP_DIST           1       // D_x[K*l]          -> z_hat_j[K]
+#define SHARD_OP_SIGN           2       // z_hat_0[K], z_hat_1[K] -> o_j[K]
+#define SHARD_OP_SIGN_COLLAPSE  3       // z_hat_0[K], z_hat_1[K] -> o_j[1]
+#define SHARD_OK                0
+#define SHARD_ERR               1
+
+typedef struct {
+    uint32_t op;        // SHARD_OP_*
+    uint32_t status;    // SHARD_OK / SHARD_ERR (responses only)
+    uint64_t K;         // number of keys in the payload
+    uint64_t l;         // vector length (SHARD_OP_DIST only)
+} shard_msg_t;
+
+static int send_msg(int fd, uint32_t op, uint32_t status, size_t K, size_t l,
+    const void *p0, size_t len0, const void *p1, size_t len1){
+    shard_msg_t h;
+    h.op = op;  h.status = status;  h.K = K;  h.l = l;
+    if (fd_write_full(fd, &h, sizeof(h)))       return -1;
+    if (len0 && fd_write_full(fd, p0, len0))    return -1;
+    if (len1 && fd_write_full(fd, p1, len1))    return -1;
+    return 0;
+}
+// Returns 0, -1 on I/O or protocol error, -2 if the worker rejected the request
+static int recv_reply(int fd, uint32_t op, size_t K, void *out, size_t out_len){
+    shard_msg_t h;
+    if (fd_read_full(fd, &h, sizeof(h)) != (ssize_t)sizeof(h))     return -1;
+    if (h.op != op)                                             return -1;
+    if (h.status != SHARD_OK)                                   return -2;
+    if (h.K != K)                                               return -1;
+    if (out_len && fd_read_full(fd, out, out_len) != (ssize_t)out_len) return -1;
+    return 0;
+}
+
+// Reply SHARD_ERR to a request the worker cannot serve, after reading its
+//  payload so that the coordinator is not left blocked sending it.
+static int reject(int fd, const shard_msg_t *h, void *buf, size_t buf_len){
+    uint64_t left = 0;
+    size_t len;
+    if (h->op == SHARD_OP_DIST)                                     left = h->K*h->l*sizeof(R_t);
+    if (h->op == SHARD_OP_SIGN || h->op == SHARD_OP_SIGN_COLLAPSE)  left = 2*h->K*sizeof(R_t);
+    while (left > 0)
+    {
+        len = (left < buf_len) ? (size_t)left : buf_len;
+        if (fd_read_full(fd, buf, len) != (ssize_t)len)                return -1;
+        left -= len;
+    }
+    return send_msg(fd, h->op, SHARD_ERR, h->K, h->l, NULL, 0, NULL, 0);
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+void funshade_shard_range(size_t K, size_t n_shards, size_t s, size_t *k_start, size_t *k_len){
+    // The first K%n_shards shards get one extra key
+    size_t base = K / n_shards, extra = K % n_shards;
+    *k_start = s*base + (s < extra ? s : extra);
+    *k_len   = base + (s < extra);
+}
+
+void funshade_shard_slice(size_t K, size_t l, size_t n_shards, size_t s, bool j,
+    const R_t r_in_j[], const R_t D_y[], const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[],
+    const uint8_t k_j[], funshade_shard_t *shard){
+    size_t k0, Ks;
+    funshade_shard_range(K, n_shards, s, &k0, &Ks);
+    shard->j = j;   shard->K = Ks;  shard->l = l;
+    shard->r_in_j = r_in_j ? &r_in_j[k0]     : NULL;
+    shard->D_y    = D_y    ? &D_y[k0*l]      : NULL;
+    shard->d_xj   = d_xj   ? &d_xj[k0*l]     : NULL;
+    shard->d_yj   = d_yj   ? &d_yj[k0*l]     : NULL;
+    shard->d_xyj  = d_xyj  ? &d_xyj[k0*l]    : NULL;
+    shard->k_j    = k_j    ? &k_j[k0*KEY_LEN] : NULL;
+}
+
+// ................................ WORKER .................................. //
+int funshade_shard_serve(int fd, const funshade_shard_t *shard){
+    shard_msg_t h;
+    ssize_t n;
+    R_t *in = NULL, *out = NULL, o;
+    size_t K = shard->K, l = shard->l, in_len = (K*l > 2*K ? K*l : 2*K) * sizeof(R_t) + 1;
+    int rc = 0;
+    bool has_dist = shard->r_in_j && shard->D_y && shard->d_xj && shard->d_yj && shard->d_xyj;
+
+    // Request buffers are sized once for the largest request this shard serves
+    in  = (R_t*)malloc(in_len);
+    out = (R_t*)malloc(K * sizeof(R_t) + 1);
+    if (in == NULL || out == NULL)
+    {
+        free(in); free(out);
+        return -1;
+    }
+    while (rc == 0)
+    {
+        n = fd_read_full(fd, &h, sizeof(h));
+        if (n == 0)                         break;      // coordinator closed
+        if (n < 0)                          { rc = -1; break; }
+        // A request for another shard, an unknown op or an op whose material
+        //  the shard lacks is answered with SHARD_ERR before closing, so the
+        //  coordinator can tell it from a crash
+        if (h.K != K || (h.op == SHARD_OP_DIST && h.l != l) ||
+            (h.op != SHARD_OP_DIST && h.op != SHARD_OP_SIGN && h.op != SHARD_OP_SIGN_COLLAPSE) ||
+            (h.op == SHARD_OP_DIST && !has_dist) || (h.op != SHARD_OP_DIST && shard->k_j == NULL))
+        {
+            reject(fd, &h, in, in_len);
+            rc = -1;
+            break;
+        }
+        switch (h.op)
+        {
+        case SHARD_OP_DIST:
+            // EOF mid-request is a disconnect, not an empty payload
+            if (fd_read_full(fd, in, K*l*sizeof(R_t)) != (ssize_t)(K*l*sizeof(R_t)))  { rc = -1; break; }
+            funshade_eval_dist_batch(K, l, shard->j, shard->r_in_j, in, shard->D_y,
+                shard->d_xj, shard->d_yj, shard->d_xyj, out);
+            rc = send_msg(fd, h.op, SHARD_OK, K, l, out, K*sizeof(R_t), NULL, 0);
+            break;
+        case SHARD_OP_SIGN:
+        case SHARD_OP_SIGN_COLLAPSE:
+            if (fd_read_full(fd, in, 2*K*sizeof(R_t)) != (ssize_t)(2*K*sizeof(R_t)))   { rc = -1; break; }
+            if (h.op == SHARD_OP_SIGN)
+            {
+                funshade_eval_sign_batch(K, shard->j, shard->k_j, in, in+K, out);
+                rc = send_msg(fd, h.op, SHARD_OK, K, 0, out, K*sizeof(R_t), NULL, 0);
+            }
+            else
+            {
+                o = funshade_eval_sign_batch_collapse(K, shard->j, shard->k_j, in, in+K);
+                rc = send_msg(fd, h.op, SHARD_OK, K, 0, &o, sizeof(R_t), NULL, 0);
+            }
+            break;
+        default:
+            rc = -1;
+        }
+    }
+    free(in); free(out);
+    return rc;
+}
+
+int funshade_shard_spawn(size_t n_shards, const funshade_shard_t shards[], int fds[], pid_t pids[]){
+    size_t s, t;
+    int sv[2];
+    for (s=0; s<n_shards; s++)
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        {
+            funshade_shard_close(s, fds, pids);
+            return -1;
+        }
+        pids[s] = fork();
+        if (pids[s] < 0)
+        {
+            close(sv[0]); close(sv[1]);
+            funshade_shard_close(s, fds, pids);
+            return -1;
+        }
+        if (pids[s] == 0)       // Worker: keep only its own end
+        {
+            for (t=0; t<s; t++) close(fds[t]);
+            close(sv[0]);
+            _exit(funshade_shard_serve(sv[1], &shards[s]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        close(sv[1]);
+        fds[s] = sv[0];
+    }
+    return 0;
+}
+
+static int unix_socket(const char *path, struct sockaddr_un *addr){
+    int fd;
+    if (strlen(path) >= sizeof(addr->sun_path))     return -1;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    return fd;
+}
+int funshade_shard_listen(const char *path){
+    struct sockaddr_un addr;
+    int lfd = unix_socket(path, &addr), fd;
+    if (lfd < 0)                                                    return -1;
+    unlink(path);
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0)
+    {
+        close(lfd);
+        return -1;
+    }
+    do { fd = accept(lfd, NULL, NULL); } while (fd < 0 && errno == EINTR);
+    close(lfd);
+    unlink(path);
+    return fd;
+}
+int funshade_shard_connect(const char *path){
+    struct sockaddr_un addr;
+    int fd = unix_socket(path, &addr);
+    if (fd < 0)                                                     return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void funshade_shard_close(size_t n_shards, int fds[], const pid_t pids[]){
+    size_t s;
+    int status;
+    for (s=0; s<n_shards; s++)
+    {
+        // shutdown reaches the worker even if other forked processes still
+        //  hold a copy of this descriptor; workers exit on EOF.
+        shutdown(fds[s], SHUT_RDWR);
+        close(fds[s]);
+        fds[s] = -1;
+    }
+    if (pids == NULL)               return;
+    for (s=0; s<n_shards; s++)
+    {
+        while (waitpid(pids[s], &status, 0) < 0 && errno == EINTR);
+    }
+}
+
+// ............................. COORDINATOR ................................ //
+int funshade_shard_eval_dist(size_t n_shards, const int fds[], const size_t K_s[], size_t l,
+    const R_t D_x[], R_t z_hat_j[]){
+    size_t s, k0;
+    int rc;
+    // Fan out all requests first so that shards compute concurrently
+    for (s=0, k0=0; s<n_shards; k0+=K_s[s], s++)
+    {
+        if (send_msg(fds[s], SHARD_OP_DIST, SHARD_OK, K_s[s], l,
+                &D_x[k0*l], K_s[s]*l*sizeof(R_t), NULL, 0))             return -1;
+    }
+    for (s=0, k0=0; s<n_shards; k0+=K_s[s], s++)
+    {
+        if ((rc = recv_reply(fds[s], SHARD_OP_DIST, K_s[s], &z_hat_j[k0], K_s[s]*sizeof(R_t))))  return rc;
+    }
+    return 0;
+}
+
+static int shard_sign_send(size_t n_shards, const int fds[], const size_t K_s[], uint32_t op,
+    const R_t z_hat_0[], const R_t z_hat_1[]){
+    size_t s, k0;
+    for (s=0, k0=0; s<n_shards; k0+=K_s[s], s++)
+    {
+        if (send_msg(fds[s], op, SHARD_OK, K_s[s], 0, &z_hat_0[k0], K_s[s]*sizeof(R_t),
+                &z_hat_1[k0], K_s[s]*sizeof(R_t)))                      return -1;
+    }
+    return 0;
+}
+int funshade_shard_eval_sign(size_t n_shards, const int fds[], const size_t K_s[],
+    const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[]){
+    size_t s, k0;
+    int rc;
+    if (shard_sign_send(n_shards, fds, K_s, SHARD_OP_SIGN, z_hat_0, z_hat_1))  return -1;
+    for (s=0, k0=0; s<n_shards; k0+=K_s[s], s++)
+    {
+        if ((rc = recv_reply(fds[s], SHARD_OP_SIGN, K_s[s], &o_j[k0], K_s[s]*sizeof(R_t))))  return rc;
+    }
+    return 0;
+}
+int funshade_shard_eval_sign_collapse(size_t n_shards, const int fds[], const size_t K_s[],
+    const R_t z_hat_0[], const R_t z_hat_1[], R_t *o_j){
+    size_t s;
+    R_t o_s;
+    int rc;
+    if (shard_sign_send(n_shards, fds, K_s, SHARD_OP_SIGN_COLLAPSE, z_hat_0, z_hat_1)) return -1;
+    *o_j = 0;
+    for (s=0; s<n_shards; s++)
+    {
+        if ((rc = recv_reply(fds[s], SHARD_OP_SIGN_COLLAPSE, K_s[s], &o_s, sizeof(R_t))))    return rc;
+        *o_j += o_s;
+    }
+    return 0;
+}
+#endif // FUNSHADE_HAS_SHARD
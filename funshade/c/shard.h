@@ -0,0 +1,96 @@
+// SHARD: Multi-process evaluation of large reference databases
+// -----------------------------------------------------------------------------
+// Splits the K dimension of the offline material (keys, masks, triples) and of
+//  the reference database D_y across worker processes. A coordinator fans out
+//  eval_dist/eval_sign requests to every shard and merges the z_hat and o_j
+//  slices (or sums the collapsed outputs) into the full K-sized result.
+//
+// Each party runs its own coordinator and shards; the z_hat exchange between
+//  parties happens at coordinator level, on the merged K-sized vectors.
+//
+// Transport is a stream socket per shard (AF_UNIX, local or by path). POSIX only.
+
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include "fss.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FUNSHADE_HAS_SHARD
+
+#include <sys/types.h>  // pid_t
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+
+/// @brief Material of party j for one shard, covering keys [k_start, k_start+K).
+///        All pointers refer to the shard's own slice (K elements, or K*l, or
+///        K*KEY_LEN bytes). D_y, d_xj, d_yj, d_xyj may be NULL if the shard only
+///        serves eval_sign, k_j may be NULL if it only serves eval_dist.
+typedef struct {
+    bool            j;          // party number (0 or 1)
+    size_t          K;          // number of keys/rows in this shard
+    size_t          l;          // number of elements per vector
+    const R_t       *r_in_j;    // [K]      input mask shares
+    const R_t       *D_y;       // [K*l]    Delta shares of the reference DB
+    const R_t       *d_yj;      // [K*l]    delta shares #j of y
+    const R_t       *d_xj;      // [K*l]    delta shares #j of x
+    const R_t       *d_xyj;     // [K*l]    delta shares #j of <d_x*d_y>
+    const uint8_t   *k_j;       // [K*KEY_LEN] FSS keys of party j
+} funshade_shard_t;
+
+/// @brief Contiguous range of shard s when splitting K keys into n_shards.
+/// @param[in] K        total number of keys
+/// @param[in] n_shards number of shards
+/// @param[in] s        shard index, in [0, n_shards)
+/// @param[out] k_start first key of the shard
+/// @param[out] k_len   number of keys in the shard
+void funshade_shard_range(size_t K, size_t n_shards, size_t s, size_t *k_start, size_t *k_len);
+
+/// @brief Slice the full K-sized material of party j into the view of shard s.
+void funshade_shard_slice(size_t K, size_t l, size_t n_shards, size_t s, bool j,
+    const R_t r_in_j[], const R_t D_y[], const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[],
+    const uint8_t k_j[], funshade_shard_t *shard);
+
+// ................................ WORKER .................................. //
+/// @brief Serve coordinator requests on fd until it closes the connection.
+///        Requests for a different K (or l), or for an op whose material the
+///        shard lacks, are answered with an error reply, then the worker closes.
+/// @return 0 on orderly shutdown, -1 on I/O or protocol error
+int funshade_shard_serve(int fd, const funshade_shard_t *shard);
+
+/// @brief Fork n_shards local worker processes, each serving shards[s] over a
+///        Unix socketpair. The coordinator ends are returned in fds.
+/// @return 0 on success, -1 on error (no workers are left running)
+int funshade_shard_spawn(size_t n_shards, const funshade_shard_t shards[], int fds[], pid_t pids[]);
+
+/// @brief Listen on / connect to a Unix socket path, for workers started as
+///        separate processes. funshade_shard_listen returns the accepted fd.
+int funshade_shard_listen(const char *path);
+int funshade_shard_connect(const char *path);
+
+/// @brief Shut down the workers behind fds and reap them (pids may be NULL).
+void funshade_shard_close(size_t n_shards, int fds[], const pid_t pids[]);
+
+// ............................. COORDINATOR ................................ //
+//  K_s[s] is the number of keys held by shard s; inputs and outputs are the
+//  full K-sized (or K*l-sized) arrays, split and merged in shard order.
+//  All functions return 0 on success, -1 on I/O or protocol error, -2 if a
+//  worker replied with an error (e.g. K_s[s] or l do not match its shard, or
+//  its material is missing). Close the connections after an error.
+
+/// @brief Sharded funshade_eval_dist_batch. D_x is the K*l Delta share of x.
+int funshade_shard_eval_dist(size_t n_shards, const int fds[], const size_t K_s[], size_t l,
+    const R_t D_x[], R_t z_hat_j[]);
+
+/// @brief Sharded funshade_eval_sign_batch.
+int funshade_shard_eval_sign(size_t n_shards, const int fds[], const size_t K_s[],
+    const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[]);
+
+/// @brief Sharded funshade_eval_sign_batch_collapse, output in o_j.
+int funshade_shard_eval_sign_collapse(size_t n_shards, const int fds[], const size_t K_s[],
+    const R_t z_hat_0[], const R_t z_hat_1[], R_t *o_j);
+
+#endif // unix
+#endif // __SHARD_H__
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE             // memfd_create, syscall, shm_open with -std=c90
+#include "shm_chan.h"
+
+#ifdef FUNSHADE_HAS_CHAN
+#include <errno.h>      // errno, EINTR
+#include <fcntl.h>      // O_CREAT, O_EXCL, O_RDWR
+#include <limits.h>     // INT_MAX
+#include <string.h>     // memcpy, strlen
+#include <sys/mman.h>   // mmap, munmap, shm_open, shm_unlink
+#include <sys/stat.h>   // fstat
+#include <unistd.h>     // close, dup, ftruncate, getpid
+#if defined(__linux__)
+#include <linux/futex.h>    // FUTEX_WAIT, FUTEX_WAKE
+#include <sys/syscall.h>    // SYS_futex, SYS_memfd_create
+#endif
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+#define CHAN_MAGIC      0x6e616863u             // "chan"
+#define CHAN_VERSION    1
+#define CHAN_DATA_OFF   4096                    // Rings start on the page after the header
+#define CHAN_MIN_CAP    4096
+#define CHAN_WRAP       UINT64_MAX              // Record padding the end of a ring
+#define CHAN_SPIN       4096                    // Polls before sleeping
+#define CHAN_ALIGN_UP(x)    (((x) + CHAN_ALIGN - 1) & ~(uint64_t)(CHAN_ALIGN - 1))
+
+#define LOAD_ACQ(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v)     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define FETCH_ADD(p, v)     __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define FETCH_SUB(p, v)     __atomic_fetch_sub((p), (v), __ATOMIC_SEQ_CST)
+#if defined(__x86_64__) || defined(__i386__)
+    #define CPU_RELAX()     __builtin_ia32_pause()
+#else
+    #define CPU_RELAX()
+#endif
+
+// Messages of one direction. head and tail count bytes ever written/released
+//  (positions are taken modulo the capacity) and live on their own lines.
+typedef struct {
+    uint64_t head;      uint8_t pad0[CHAN_ALIGN - 8];
+    uint64_t tail;      uint8_t pad1[CHAN_ALIGN - 8];
+    uint32_t data_seq;      // futex: bumped on commit
+    uint32_t data_wait;     // consumers sleeping on data_seq
+    uint32_t space_seq;     // futex: bumped on release
+    uint32_t space_wait;    // producers sleeping on space_seq
+    uint8_t  pad2[CHAN_ALIGN - 16];
+} chan_ring;
+
+// Start of the mapping, followed at CHAN_DATA_OFF by the data of ring 0 and 1
+typedef struct {
+    uint32_t magic, version;
+    uint64_t capacity;      // data bytes per ring, a power of two
+    uint32_t joined;        // side 1 attached
+    uint32_t closed[2];     // side s closed
+    uint8_t  pad[CHAN_ALIGN - 28];
+    chan_ring ring[2];      // ring[s]: sent by side s
+} chan_hdr;
+
+// A record is a CHAN_ALIGN header with the payload length, then the payload
+typedef struct {
+    uint64_t len;
+} chan_rec;
+
+struct funshade_chan {
+    chan_hdr    *hdr;
+    size_t      map_len, cap;
+    int         fd, side;
+    chan_ring   *tx, *rx;
+    uint8_t     *tx_data, *rx_data;
+    uint64_t    tx_next;    // head after the pending reservation
+    uint64_t    rx_next;    // tail after the pending release
+    char        name[256];  // shm object to unlink on close (side 0), or empty
+};
+
+// Spinning only pays off when the peer runs on another CPU meanwhile
+static int chan_spin(void){
+    static int n_spin = -1;
+    if (n_spin < 0)     n_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CHAN_SPIN : 0;
+    return n_spin;
+}
+
+static double chan_now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+// Sleep while *word == val, for at most timeout_ms (-1: no limit)
+static void chan_sleep(uint32_t *word, uint32_t val, int timeout_ms){
+    struct timespec ts;
+#if defined(__linux__) && defined(SYS_futex)
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    syscall(SYS_futex, word, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+#else
+    (void)word; (void)val; (void)timeout_ms;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 50000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static void chan_wake(uint32_t *seq, uint32_t *wait){
+    FETCH_ADD(seq, 1);
+#if defined(__linux__) && defined(SYS_futex)
+    if (LOAD_ACQ(wait))
+    {
+        syscall(SYS_futex, seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+#else
+    (void)wait;
+#endif
+}
+
+// A message to receive (data), or need free bytes to send (!data)
+static bool chan_ready(const funshade_chan *ch, bool data, uint64_t need){
+    if (data)   return LOAD_ACQ(&ch->rx->head) != ch->rx->tail;
+    return ch->cap - (ch->tx->head - LOAD_ACQ(&ch->tx->tail)) >= need;
+}
+
+// Wait for chan_ready. Returns 0, or -1 on timeout or if the peer closed first.
+static int chan_wait(funshade_chan *ch, bool data, uint64_t need, int timeout_ms){
+    chan_ring *r = data ? ch->rx : ch->tx;
+    uint32_t *seq = data ? &r->data_seq : &r->space_seq, *wait = data ? &r->data_wait : &r->space_wait, s;
+    double deadline = chan_now_ms() + timeout_ms, left = -1;
+    int i, n_spin = chan_spin();
+    for (i = 0; i < n_spin; i++)
+    {
+        if (chan_ready(ch, data, need))     return 0;
+        CPU_RELAX();
+    }
+    for (;;)
+    {
+        FETCH_ADD(wait, 1);     // announce before checking: a later update wakes us
+        s = LOAD_ACQ(seq);
+        if (chan_ready(ch, data, need))
+        {
+            FETCH_SUB(wait, 1);
+            return 0;
+        }
+        if (timeout_ms >= 0)    left = deadline - chan_now_ms();
+        if (LOAD_ACQ(&ch->hdr->closed[1 - ch->side]) || (timeout_ms >= 0 && left <= 0))
+        {
+            FETCH_SUB(wait, 1);
+            return -1;
+        }
+        chan_sleep(seq, s, timeout_ms < 0 ? -1 : (int)left + 1);
+        FETCH_SUB(wait, 1);
+    }
+}
+
+static funshade_chan *chan_map(int fd, int side, const char *name){
+    funshade_chan *ch = (funshade_chan*)calloc(1, sizeof(funshade_chan));
+    struct stat st;
+    void *p;
+    if (ch == NULL || fstat(fd, &st) != 0 || st.st_size < CHAN_DATA_OFF)
+    {
+        free(ch);
+        return NULL;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        free(ch);
+        return NULL;
+    }
+    ch->hdr = (chan_hdr*)p;
+    ch->map_len = (size_t)st.st_size;
+    ch->fd = fd;
+    ch->side = side;
+    if (name != NULL)   strcpy(ch->name, name);
+    return ch;
+}
+
+// Set the ring pointers of a mapped channel, after checking its header
+static funshade_chan *chan_bind(funshade_chan *ch){
+    uint64_t cap = ch->hdr->capacity;
+    if (ch->hdr->magic != CHAN_MAGIC || ch->hdr->version != CHAN_VERSION ||
+        cap < CHAN_MIN_CAP || (cap & (cap - 1)) || ch->map_len != CHAN_DATA_OFF + 2*cap)
+    {
+        munmap(ch->hdr, ch->map_len);
+        close(ch->fd);
+        free(ch);
+        return NULL;
+    }
+    ch->cap = (size_t)cap;
+    ch->tx = &ch->hdr->ring[ch->side];
+    ch->rx = &ch->hdr->ring[1 - ch->side];
+    ch->tx_data = (uint8_t*)ch->hdr + CHAN_DATA_OFF + ch->side*ch->cap;
+    ch->rx_data = (uint8_t*)ch->hdr + CHAN_DATA_OFF + (1 - ch->side)*ch->cap;
+    return ch;
+}
+
+// "/name" as required by shm_open
+static int chan_shm_path(const char *name, char path[256]){
+    if (strlen(name) + 2 > 256)     return -1;
+    sprintf(path, "%s%s", name[0] == '/' ? "" : "/", name);
+    return 0;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+funshade_chan *funshade_chan_create(const char *name, size_t capacity){
+    static uint32_t n_anon = 0;
+    char path[256];
+    size_t cap = CHAN_MIN_CAP;
+    int fd = -1;
+    funshade_chan *ch;
+    while (cap < capacity)  cap <<= 1;
+    if (name != NULL)
+    {
+        if (chan_shm_path(name, path))  return NULL;
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    else
+    {
+#if defined(__linux__) && defined(SYS_memfd_create)
+        fd = (int)syscall(SYS_memfd_create, "funshade_chan", 0);
+#endif
+        if (fd < 0)         // no memfd: an shm object unlinked right away
+        {
+            sprintf(path, "/funshade_chan.%ld.%u", (long)getpid(), (unsigned)FETCH_ADD(&n_anon, 1));
+            fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+            if (fd >= 0)    shm_unlink(path);
+        }
+    }
+    if (fd < 0)     return NULL;
+    if (ftruncate(fd, (off_t)(CHAN_DATA_OFF + 2*cap)) != 0 ||
+        (ch = chan_map(fd, 0, name != NULL ? path : NULL)) == NULL)
+    {
+        if (name != NULL)   shm_unlink(path);
+        close(fd);
+        return NULL;
+    }
+    // The object is zero-filled: positions and futex words start at 0
+    ch->hdr->capacity = cap;
+    ch->hdr->version = CHAN_VERSION;
+    STORE_REL(&ch->hdr->magic, CHAN_MAGIC);
+    return chan_bind(ch);
+}
+
+funshade_chan *funshade_chan_attach(int fd){
+    uint32_t expected = 0;
+    funshade_chan *ch;
+    int own = dup(fd);
+    if (own < 0)    return NULL;
+    if ((ch = chan_map(own, 1, NULL)) == NULL)
+    {
+        close(own);
+        return NULL;
+    }
+    if ((ch = chan_bind(ch)) == NULL)   return NULL;
+    if (!__atomic_compare_exchange_n(&ch->hdr->joined, &expected, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+        munmap(ch->hdr, ch->map_len);
+        close(ch->fd);
+        free(ch);
+        return NULL;
+    }
+    return ch;
+}
+
+funshade_chan *funshade_chan_open(const char *name){
+    char path[256];
+    funshade_chan *ch;
+    int fd;
+    if (chan_shm_path(name, path) || (fd = shm_open(path, O_RDWR, 0600)) < 0)    return NULL;
+    ch = funshade_chan_attach(fd);
+    close(fd);
+    return ch;
+}
+
+int funshade_chan_fd(const funshade_chan *ch){
+    return ch->fd;
+}
+
+size_t funshade_chan_max_msg(const funshade_chan *ch){
+    return ch->cap/2 - CHAN_ALIGN;      // with the wrap padding, two fit in a ring
+}
+
+void *funshade_chan_reserve(funshade_chan *ch, size_t len){
+    uint64_t head = ch->tx->head, pos = head & (ch->cap - 1), need, skip;
+    if (len > funshade_chan_max_msg(ch))    return NULL;
+    need = CHAN_ALIGN + CHAN_ALIGN_UP(len);
+    skip = (pos + need > ch->cap) ? ch->cap - pos : 0;      // messages are contiguous
+    if (chan_wait(ch, false, skip + need, -1))  return NULL;
+    if (skip)
+    {
+        ((chan_rec*)(ch->tx_data + pos))->len = CHAN_WRAP;
+        pos = 0;
+    }
+    ((chan_rec*)(ch->tx_data + pos))->len = len;
+    ch->tx_next = head + skip + need;
+    return ch->tx_data + pos + CHAN_ALIGN;
+}
+
+void funshade_chan_commit(funshade_chan *ch){
+    STORE_REL(&ch->tx->head, ch->tx_next);
+    chan_wake(&ch->tx->data_seq, &ch->tx->data_wait);
+}
+
+int funshade_chan_send(funshade_chan *ch, const void *buf, size_t len){
+    void *p = funshade_chan_reserve(ch, len);
+    if (p == NULL)  return -1;
+    memcpy(p, buf, len);
+    funshade_chan_commit(ch);
+    return 0;
+}
+
+const void *funshade_chan_recv(funshade_chan *ch, size_t *len, int timeout_ms){
+    uint64_t tail = ch->rx->tail, pos = tail & (ch->cap - 1), head, rec_len;
+    chan_rec *rec;
+    *len = 0;
+    if (chan_wait(ch, true, 0, timeout_ms))     return NULL;
+    // The peer writes head and the records: read each once, and check them
+    //  before trusting them with a pointer or the next tail
+    head = LOAD_ACQ(&ch->rx->head);
+    rec = (chan_rec*)(ch->rx_data + pos);
+    rec_len = rec->len;
+    if (rec_len == CHAN_WRAP)       // committed together with the next message
+    {
+        tail += ch->cap - pos;
+        pos = 0;
+        rec = (chan_rec*)ch->rx_data;
+        rec_len = rec->len;
+    }
+    if (head - ch->rx->tail > ch->cap || rec_len > funshade_chan_max_msg(ch) ||
+        pos + CHAN_ALIGN + CHAN_ALIGN_UP(rec_len) > ch->cap ||
+        tail + CHAN_ALIGN + CHAN_ALIGN_UP(rec_len) - ch->rx->tail > head - ch->rx->tail)
+    {
+        *len = CHAN_BAD_MSG;
+        return NULL;
+    }
+    *len = (size_t)rec_len;
+    ch->rx_next = tail + CHAN_ALIGN + CHAN_ALIGN_UP(rec_len);
+    return (const uint8_t*)rec + CHAN_ALIGN;
+}
+
+void funshade_chan_release(funshade_chan *ch){
+    STORE_REL(&ch->rx->tail, ch->rx_next);
+    chan_wake(&ch->rx->space_seq, &ch->rx->space_wait);
+}
+
+void funshade_chan_shutdown(funshade_chan *ch){
+    int r;
+    if (ch == NULL)     return;
+    STORE_REL(&ch->hdr->closed[ch->side], 1);
+    for (r = 0; r < 2; r++)     // wake the peer wherever it sleeps
+    {
+        chan_wake(&ch->hdr->ring[r].data_seq, &ch->hdr->ring[r].data_wait);
+        chan_wake(&ch->hdr->ring[r].space_seq, &ch->hdr->ring[r].space_wait);
+    }
+}
+
+void funshade_chan_close(funshade_chan *ch){
+    if (ch == NULL)     return;
+    funshade_chan_shutdown(ch);
+    munmap(ch->hdr, ch->map_len);
+    close(ch->fd);
+    if (ch->side == 0 && ch->name[0] != '\0')   shm_unlink(ch->name);
+    free(ch);
+}
+
+#endif // FUNSHADE_HAS_CHAN
@@ -0,0 +1,91 @@
+// SHM_CHAN: Zero-copy shared-memory channel between co-located parties
+// -----------------------------------------------------------------------------
+// When both parties (or a dealer and a party) run on the same host, z_hat_j
+//  and the offline material do not need to cross a socket. A channel is one
+//  shared mapping (memfd, or a named POSIX shm object) holding two single-
+//  producer/single-consumer rings of variable-size messages, one per direction.
+//
+// Messages are written and read in place: the sender reserves space in its
+//  ring and passes the returned pointer as the output of a batch function,
+//  e.g. funshade_eval_dist_batch(..., funshade_chan_reserve(ch, K*sizeof(R_t)))
+//  then funshade_chan_commit; the receiver gets a pointer into the same pages
+//  from funshade_chan_recv, hands it to funshade_eval_sign_batch as z_hat_nj,
+//  and gives the space back with funshade_chan_release. No byte is copied.
+//
+// Waiting spins briefly, then sleeps on a futex (Linux) shared by both
+//  processes; the other side only issues a wake-up syscall if someone sleeps.
+//  Payloads are 64-byte aligned. Elsewhere (other unix) waits poll with sleeps.
+//
+// POSIX only.
+
+#ifndef __SHM_CHAN_H__
+#define __SHM_CHAN_H__
+
+#include "fss.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FUNSHADE_HAS_CHAN
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+#define CHAN_DEFAULT_CAPACITY   ((size_t)64 << 20)  // Bytes per direction
+#define CHAN_ALIGN              64                  // Message header and payload alignment
+#define CHAN_BAD_MSG            ((size_t)-1)        // *len of funshade_chan_recv on a corrupt record
+
+typedef struct funshade_chan funshade_chan;
+
+/// @brief Create a channel with capacity bytes per direction (rounded up to a
+///        power of two), as side 0. With name NULL the mapping is an anonymous
+///        memfd, shared through funshade_chan_fd (fork, SCM_RIGHTS); otherwise
+///        a POSIX shm object "/name" that the peer opens with funshade_chan_open
+///        (unlinked when the creator closes the channel).
+/// @return NULL on error
+funshade_chan *funshade_chan_create(const char *name, size_t capacity);
+
+/// @brief Join a channel as side 1, from the fd of its creator or by name.
+/// @return NULL on error (not a channel, or already joined)
+funshade_chan *funshade_chan_attach(int fd);
+funshade_chan *funshade_chan_open(const char *name);
+
+/// @brief File descriptor of the mapping, to pass to the peer.
+int funshade_chan_fd(const funshade_chan *ch);
+
+/// @brief Largest message of the channel, in bytes.
+size_t funshade_chan_max_msg(const funshade_chan *ch);
+
+/// @brief Reserve len bytes for the next outgoing message, waiting for space.
+///        The pointer stays valid until funshade_chan_commit. One reservation
+///        at a time.
+/// @return NULL if len exceeds funshade_chan_max_msg or the peer closed
+void *funshade_chan_reserve(funshade_chan *ch, size_t len);
+
+/// @brief Publish the reserved message to the peer. The sender may keep reading
+///        it (e.g. its own z_hat_j for eval_sign) until its next reservation.
+void funshade_chan_commit(funshade_chan *ch);
+
+/// @brief Copy len bytes as one message (reserve, memcpy, commit).
+/// @return 0, or -1 as funshade_chan_reserve
+int funshade_chan_send(funshade_chan *ch, const void *buf, size_t len);
+
+/// @brief Next incoming message, in place, waiting up to timeout_ms (-1: forever).
+///        Valid until funshade_chan_release, which must be called before the
+///        next funshade_chan_recv.
+///        The record is checked against funshade_chan_max_msg and the bytes
+///        the peer published, so a faulty peer cannot make it read past the ring.
+/// @return NULL on timeout, or if the peer closed and no message is left (*len
+///         is 0), or on a corrupt record (*len is CHAN_BAD_MSG, nothing consumed)
+const void *funshade_chan_recv(funshade_chan *ch, size_t *len, int timeout_ms);
+
+/// @brief Give the space of the last received message back to the peer.
+void funshade_chan_release(funshade_chan *ch);
+
+/// @brief Close this side without unmapping: the peer's waits return, and
+///        reserved or received messages stay readable until funshade_chan_close.
+void funshade_chan_shutdown(funshade_chan *ch);
+
+/// @brief Close this side (the peer's waits return) and unmap.
+void funshade_chan_close(funshade_chan *ch);
+
+#endif // unix
+#endif // __SHM_CHAN_H__
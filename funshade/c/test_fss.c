@@ -14,8 +14,28 @@
 #include <string.h> // memcmp
 #include <stdio.h>  // printf
 #include <time.h>   // clock_gettime
+#include <math.h>   // sqrt
 #include "fss.h"     // FSS functions
 #include "aes.h"     // AES-128-NI and AES-128-tiny (standalone)
+#include "shard.h"   // Multi-process sharding
+#include "pool.h"    // Native worker pool
+#include "scheduler.h" // Work-stealing task scheduler
+#include "numa_mem.h"  // NUMA-aware allocation
+#include "tune.h"    // Per-host calibration
+#include "trace.h"   // Latency tracing
+#include "shm_chan.h" // Shared-memory channel
+#include "dealer.h"   // Streaming dealer
+#include "replay.h"   // Record-and-replay load harness
+#ifdef FUNSHADE_HAS_CHAN
+#include <sys/wait.h> // waitpid
+#include <unistd.h>   // fork, _exit
+#endif
+#ifdef FUNSHADE_HAS_DEALER
+#include <unistd.h>   // lseek
+#endif
+#ifdef FUNSHADE_HAS_POOL
+#include <pthread.h>  // pthread_create, pthread_join
+#endif
 
 
 
@@ -51,12 +71,18 @@ void print_buffer(const uint8_t *buffer, size_t size){
 // ------------------------------ TESTS ------------------------------------- //
 //----------------------------------------------------------------------------//
 bool test_aes(int n_times) {
-    uint8_t plain[G_IN_LEN]={0}, hash_ni[G_OUT_LEN]={0}, hash_sa[G_OUT_LEN]={0};
-    double t_ni=0, t_sa=0;
+    uint8_t plain[G_IN_LEN]={0}, hash_ni[G_OUT_LEN]={0}, hash_sa[G_OUT_LEN]={0},
+            side_ni[G_SIDE_LEN]={0}, side_sa[2*G_SIDE_LEN]={0},
+            ctr_ni[4*AES_BLOCKLEN]={0}, ctr_sa[4*AES_BLOCKLEN]={0};
+    uint32_t ctr[4];
+    double t_ni=0, t_sa=0, t_side_ni=0, t_side_sa=0;
     int i;
     bool correct = true;
 
-    for(i=0; i<n_times; i++){
+    // AES-NI is used, from load time, exactly when this CPU has it
+    correct &= ((funshade_tuning_get()->prg == FUNSHADE_PRG_NI) == (aes_ni_available() == 1));
+    correct &= ((funshade_cpu_features() & FUNSHADE_CPU_AESNI) != 0) == (aes_ni_available() == 1);
+    for(i=0; i<n_times && aes_ni_available(); i++){
         // Generate random input
         random_buffer(plain, G_IN_LEN);
 
@@ -66,11 +92,28 @@ bool test_aes(int n_times) {
 
         // check if both hashes are equal with memcmp
         correct &= (memcmp(hash_ni, hash_sa, sizeof(hash_ni)) == 0);
+
+        // Same for each side of G_side, which must also differ from each other
+        tic();  G_side_ni  (plain, i&1, side_ni); t_side_ni+= toc();
+        tic();  G_side_tiny(plain, i&1, side_sa); t_side_sa+= toc();
+        G_side_tiny(plain, !(i&1), side_sa + G_SIDE_LEN);
+        correct &= (memcmp(side_ni, side_sa, G_SIDE_LEN) == 0);
+        correct &= (memcmp(side_sa, side_sa + G_SIDE_LEN, G_SIDE_LEN) != 0);
+
+        // Same for G_ctr, whose counters 2*side and 2*side+1 give G_side
+        ctr[0] = 2*(i&1);   ctr[1] = 2*(i&1) + 1;   ctr[2] = (uint32_t)i << 8;  ctr[3] = 0xffffffffu - i;
+        G_ctr_ni  (1, 4, plain, ctr, ctr_ni);
+        G_ctr_tiny(1, 4, plain, ctr, ctr_sa);
+        correct &= (memcmp(ctr_ni, ctr_sa, sizeof(ctr_ni)) == 0);
+        correct &= (memcmp(ctr_sa, side_sa, G_SIDE_LEN) == 0);
     }
     printf("Test AES fully correct: %s\n", correct ? "true" : "false");
     if (TIMEIT){
         printf(" - Avg. time G_ni:   %-5.0f (ns)\n", t_ni/n_times);
         printf(" - Avg. time G_tiny: %-5.0f (ns)\n", t_sa/n_times);
+        printf(" - Avg. time G_side_ni:   %-5.0f (ns)\n", t_side_ni/n_times);
+        printf(" - Avg. time G_side_tiny: %-5.0f (ns)\n", t_side_sa/n_times);
+        printf(" - Backend: %s\n", funshade_backend());
     }
     return correct;
 }
@@ -165,6 +208,285 @@ bool test_ic(int n_times){
 }
 
 
+// Exact IC outputs over the whole ring: masks and bounds whose sums wrap
+//  around, including q = largest R_t and the top bit of int64 masks
+bool test_ic_ring(int n_times){
+    const R_t edge[] = {0, 1, -1, (R_t)(UR(1)<<(N_BITS-1)), (R_t)((UR(1)<<(N_BITS-1))-1)};
+    const size_t n_edge = sizeof(edge)/sizeof(edge[0]);
+    uint8_t k0[KEY_LEN], k1[KEY_LEN];
+    R_t r_in, x, p, q, o;
+    bool correct=true;
+    int i;
+
+    for (i=0; i<n_times; i++)
+    {
+        r_in = (i < (int)n_edge) ? edge[i] : random_dtype();
+        x    = (i % 3 == 0) ? edge[i % n_edge] : random_dtype();
+        p    = random_dtype();      q = random_dtype();
+        if (i % 4 == 0)             { p = 0;    q = edge[4]; }          // SIGN interval
+        if (MOD_N(p, N_BITS) > MOD_N(q, N_BITS))  { o = p; p = q; q = o; }
+        IC_gen(r_in, 0, p, q, k0, k1);
+        o = IC_eval(0, p, q, k0, (R_t)(UR(x)+UR(r_in))) + IC_eval(1, p, q, k1, (R_t)(UR(x)+UR(r_in)));
+        correct &= (o == (R_t)((MOD_N(p, N_BITS) <= MOD_N(x, N_BITS)) & (MOD_N(x, N_BITS) <= MOD_N(q, N_BITS))));
+    }
+    printf("Test IC over the ring fully correct: %s\n", correct ? "true" : "false");
+    return correct;
+}
+
+
+bool test_dcf_ic_batch(size_t K){
+    double t_dcf=0, t_ic=0;
+    size_t k;
+    R_t *alpha  = (R_t*)malloc(K*sizeof(R_t)),  *x      = (R_t*)malloc(K*sizeof(R_t)),
+        *p      = (R_t*)malloc(K*sizeof(R_t)),  *q      = (R_t*)malloc(K*sizeof(R_t)),
+        *r_in_0 = (R_t*)malloc(K*sizeof(R_t)),  *r_in_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *x_hat  = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0    = (R_t*)malloc(K*sizeof(R_t)),  *o_1    = (R_t*)malloc(K*sizeof(R_t));
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    bool correct=true;
+
+    // DCF: one comparison point per element
+    random_buffer((uint8_t*)alpha, K*sizeof(R_t));
+    for (k=0; k<K; k++)     x[k] = alpha[k] + (R_t)(k%3) - 1;
+    x[0] = alpha[0] ^ ((R_t)1<<(N_BITS-1));
+    DCF_gen_batch(K, alpha, k0, k1);
+    tic(); DCF_eval_batch(K, 0, k0, x, o_0); DCF_eval_batch(K, 1, k1, x, o_1); t_dcf += toc();
+    for (k=0; k<K; k++){
+        correct &= (o_0[k] + o_1[k] == (MOD_N(x[k], N_BITS) < MOD_N(alpha[k], N_BITS)));
+    }
+
+    // IC: one band [p, q] per element (e.g. age bands), masked inputs
+    for (k=0; k<K; k++){
+        x[k] = (R_t)(k*7919 % 100);
+        p[k] = (R_t)(k % 80);
+        q[k] = p[k] + (R_t)(k % 23);
+    }
+    IC_gen_batch(K, p, q, r_in_0, r_in_1, k0, k1);
+    for (k=0; k<K; k++)     x_hat[k] = x[k] + r_in_0[k] + r_in_1[k];
+    tic(); IC_eval_batch(K, 0, p, q, k0, x_hat, o_0); IC_eval_batch(K, 1, p, q, k1, x_hat, o_1); t_ic += toc();
+    for (k=0; k<K; k++){
+        correct &= (o_0[k] + o_1[k] == ((p[k] <= x[k]) && (x[k] <= q[k])));
+    }
+
+    printf("Test DCF/IC batch fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time DCF_eval_batch: %-5.0f (ns)\n", t_dcf/(2*K));
+        printf(" - Avg. time IC_eval_batch:  %-5.0f (ns)\n", t_ic/(2*K));
+    }
+    free(alpha); free(x); free(p); free(q); free(r_in_0); free(r_in_1); free(x_hat); free(o_0); free(o_1);
+    free(k0); free(k1);
+    return correct;
+}
+
+
+// f(x) of a spline in the clear: the last piece whose breakpoint is <= x
+static R_t spline_ref(size_t m, size_t d, const R_t brk[], const R_t coef[], R_t x){
+    size_t i = m-1, k;
+    uint64_t o;
+    while (MOD_N(x, N_BITS) < MOD_N(brk[i], N_BITS))    i--;
+    o = UR(coef[i*(d+1)+d]);
+    for (k = d; k-- > 0; )  o = o*UR(x) + UR(coef[i*(d+1)+k]);
+    return (R_t)o;
+}
+// Gate on x[K] with fresh masks and keys, o = o0 + o1. buf: 4*K R_t and 2 keys per element
+static bool spline_batch(size_t K, size_t m, size_t d, const R_t brk[], const R_t coef[], const R_t x[],
+    R_t o[], R_t buf[], uint8_t keys[], double *t_eval){
+    size_t k, key_len = SPLINE_KEY_LEN(m,d);
+    R_t *r_in_0 = buf, *r_in_1 = buf + K, *x_hat = buf + 2*K, *o_1 = buf + 3*K;
+    uint8_t *k0 = keys, *k1 = keys + K*key_len;
+    bool correct = (SPLINE_gen_batch(K, m, d, brk, coef, r_in_0, r_in_1, k0, k1) == 0);
+    for (k=0; k<K; k++)     x_hat[k] = (R_t)(UR(x[k]) + UR(r_in_0[k]) + UR(r_in_1[k]));
+    tic();
+    correct &= (SPLINE_eval_batch(K, m, d, 0, brk, k0, x_hat, o) == 0);
+    correct &= (SPLINE_eval_batch(K, m, d, 1, brk, k1, x_hat, o_1) == 0);
+    *t_eval = toc();
+    for (k=0; k<K; k++)
+    {
+        o[k] = (R_t)(UR(o[k]) + UR(o_1[k]));
+        correct &= (o[k] == spline_ref(m, d, brk, coef, x[k]));
+    }
+    return correct;
+}
+
+bool test_spline(size_t K){
+    size_t k, frac_bits = 8, n_seg = 8, m_sig = SPLINE_SIGMOID_M(8);
+    double t_relu=0, t_sig=0, t_poly=0, err, max_err = 0;
+    R_t brk_relu[SPLINE_RELU_M], coef_relu[2*SPLINE_RELU_M], brk_sig[SPLINE_SIGMOID_M(8)],
+        coef_sig[2*SPLINE_SIGMOID_M(8)], brk_poly[3], coef_poly[3*4], bad_brk[2] = {0, 0};
+    R_t *x = (R_t*)malloc(K*sizeof(R_t)), *o = (R_t*)malloc(K*sizeof(R_t)), *buf = (R_t*)malloc(4*K*sizeof(R_t));
+    uint8_t *keys = (uint8_t*)malloc(2*K*SPLINE_KEY_LEN(SPLINE_SIGMOID_M(8), SPLINE_SIGMOID_D));
+    bool correct = true;
+
+    // ReLU, exact, including the ends of both pieces
+    SPLINE_relu(brk_relu, coef_relu);
+    random_buffer((uint8_t*)x, K*sizeof(R_t));
+    x[0] = 0;   x[1] = -1;  x[2] = (R_t)(1ULL<<(N_BITS-1));   x[3] = (R_t)((1ULL<<(N_BITS-1))-1);
+    correct &= spline_batch(K, SPLINE_RELU_M, SPLINE_RELU_D, brk_relu, coef_relu, x, o, buf, keys, &t_relu);
+    for (k=0; k<K; k++)     correct &= (o[k] == (x[k] > 0 ? x[k] : 0));
+
+    // Sigmoid on [-10, 10) with 8 fractional bits, against the real one
+    correct &= (SPLINE_sigmoid(frac_bits, n_seg, brk_sig, coef_sig) == 0);
+    for (k=0; k<K; k++)     x[k] = (R_t)((int64_t)(k*131 % 5120) - 2560);
+    correct &= spline_batch(K, m_sig, SPLINE_SIGMOID_D, brk_sig, coef_sig, x, o, buf, keys, &t_sig);
+    for (k=0; k<K; k++)
+    {
+        err = fabs(o[k]/ldexp(1.0, 2*frac_bits) - 1.0/(1.0 + exp(-x[k]/ldexp(1.0, frac_bits))));
+        max_err = err > max_err ? err : max_err;
+    }
+    correct &= (max_err < 0.02);
+
+    // Cubics on three pieces with arbitrary coefficients, over the whole ring
+    brk_poly[0] = 0;    brk_poly[1] = 1000;     brk_poly[2] = (R_t)(1ULL<<(N_BITS-2));
+    random_buffer((uint8_t*)coef_poly, sizeof(coef_poly));
+    random_buffer((uint8_t*)x, K*sizeof(R_t));
+    for (k=0; k<K; k+=4)    x[k] = (R_t)(k % 2000);
+    x[1] = 999;     x[2] = 1000;    x[3] = brk_poly[2];
+    correct &= spline_batch(K, 3, 3, brk_poly, coef_poly, x, o, buf, keys, &t_poly);
+
+    // Invalid breakpoints are rejected
+    correct &= (SPLINE_check(2, 1, bad_brk) == -1) && (SPLINE_sigmoid(N_BITS/2, n_seg, brk_sig, coef_sig) == -1);
+
+    printf("Test SPLINE fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time SPLINE_eval_batch, ReLU (m=2, d=1):    %-5.0f (ns)\n", t_relu/(2*K));
+        printf(" - Avg. time SPLINE_eval_batch, sigmoid (m=%d, d=1): %-5.0f (ns), max error %.4f\n",
+               (int)m_sig, t_sig/(2*K), max_err);
+        printf(" - Avg. time SPLINE_eval_batch, cubic (m=3, d=3):   %-5.0f (ns)\n", t_poly/(2*K));
+    }
+    free(x); free(o); free(buf); free(keys);
+    return correct;
+}
+
+
+bool test_reduced_domain(int n_times, size_t K){
+    size_t n_bits_list[3] = {8, 16, N_BITS}, n_bits, b, k;
+    R_t alpha, x = 0, o, theta,
+        *z      = (R_t*)malloc(K*sizeof(R_t)),   *x_hat  = (R_t*)malloc(K*sizeof(R_t)),
+        *r_in_0 = (R_t*)malloc(K*sizeof(R_t)),   *r_in_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0    = (R_t*)malloc(K*sizeof(R_t)),   *o_1    = (R_t*)malloc(K*sizeof(R_t)),
+        *zero   = (R_t*)calloc(K, sizeof(R_t)),  o_sum = 0;
+    uint8_t k0[KEY_LEN], k1[KEY_LEN], *kb0 = (uint8_t*)malloc(K*KEY_LEN), *kb1 = (uint8_t*)malloc(K*KEY_LEN);
+    double t_eval=0, t_eval_n=0;
+    bool correct=true;
+    int i;
+
+    // DCF on the n_bits lowest bits: o0 + o1 = (x mod 2^n_bits < alpha mod 2^n_bits)
+    for (b=0; b<3; b++)
+    {
+        n_bits = n_bits_list[b];
+        for (i=0; i<n_times; i++)
+        {
+            alpha = random_dtype();
+            x = random_dtype() + (R_t)(i*2654435761u);
+            DCF_gen_n(n_bits, alpha, k0, k1);
+            o = DCF_eval_n(n_bits, 0, k0, x) + DCF_eval_n(n_bits, 1, k1, x);
+            correct &= (o == (R_t)(MOD_N(x, n_bits) < MOD_N(alpha, n_bits)));
+            correct &= (DCF_eval_n(n_bits, 0, k0, x) == DCF_eval_n(n_bits, 0, k0, x + (R_t)N_MASK(n_bits) + 1));
+        }
+    }
+    correct &= (DCF_eval_n(N_BITS, 1, k1, x) == DCF_eval(1, k1, x));    // full-width keys are DCF keys
+
+    // Batched sign of z-theta on 16 bits, for |z|, |theta| < 2^13
+    n_bits = 16;
+    theta = (R_t)MOD_N(random_dtype(), 14) - (1<<13);
+    SIGN_gen_batch_n(K, n_bits, theta, r_in_0, r_in_1, kb0, kb1);
+    for (k=0; k<K; k++){
+        z[k] = (R_t)MOD_N(k*2654435761u, 14) - (1<<13);
+        x_hat[k] = z[k] + r_in_0[k] + r_in_1[k];
+        o_sum += (z[k] >= theta);
+    }
+    tic(); SIGN_eval_batch_n(K, n_bits, 0, kb0, x_hat, o_0); t_eval_n += toc();
+    tic(); SIGN_eval_batch_n(K, n_bits, 1, kb1, x_hat, o_1); t_eval_n += toc();
+    for (k=0; k<K; k++){
+        correct &= (o_0[k] + o_1[k] == (z[k] >= theta));
+    }
+    funshade_eval_sign_batch_n(K, n_bits, 0, kb0, x_hat, zero, o_1);
+    correct &= (memcmp(o_0, o_1, K*sizeof(R_t)) == 0);
+    correct &= (funshade_eval_sign_batch_collapse_n(K, n_bits, 0, kb0, x_hat, zero) +
+                funshade_eval_sign_batch_collapse_n(K, n_bits, 1, kb1, zero, x_hat) == o_sum);
+    // Same comparisons on full-width keys, for timing
+    SIGN_gen_batch(K, theta, r_in_0, r_in_1, kb0, kb1);
+    for (k=0; k<K; k++){
+        x_hat[k] = z[k] + r_in_0[k] + r_in_1[k];
+    }
+    tic(); SIGN_eval_batch(K, 0, kb0, x_hat, o_0); t_eval += toc();
+    tic(); SIGN_eval_batch(K, 1, kb1, x_hat, o_1); t_eval += toc();
+
+    // Bounds of a normalized and a raw dot product of l=512, max_el=2^12
+    correct &= (funshade_sign_bits(512, 1<<12, true) == 27);
+    correct &= (funshade_sign_bits(512, 1<<12, false) == (N_BITS >= 36 ? 36 : 0));
+    correct &= (funshade_sign_bits(512, -(1<<12), true) == 27);
+    correct &= (funshade_sign_bits(512, (R_t)((uint64_t)1<<(N_BITS-1)), true) == 0);
+
+    printf("Test reduced-domain gates fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Key bytes 16-bit / full:      %d / %d\n", (int)KEY_LEN_N(16), (int)KEY_LEN);
+        printf(" - Avg. time SIGN_eval_n (16):   %-5.0f (ns)\n", t_eval_n/(K*2));
+        printf(" - Avg. time SIGN_eval (full):   %-5.0f (ns)\n", t_eval/(K*2));
+    }
+    free(z); free(x_hat); free(r_in_0); free(r_in_1); free(o_0); free(o_1); free(zero); free(kb0); free(kb1);
+    return correct;
+}
+
+bool test_dpf(int n_times, size_t K){
+    double t_gen=0, t_eval=0, t_full=0;
+    R_t alpha, x, r_in, theta, *out0, *out1, *z_hat = (R_t*)malloc(K*sizeof(R_t)),
+        *r_in_0 = (R_t*)malloc(K*sizeof(R_t)), *r_in_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0 = (R_t*)malloc(K*sizeof(R_t)), *o_1 = (R_t*)malloc(K*sizeof(R_t));
+    uint8_t k0[DPF_KEY_LEN], k1[DPF_KEY_LEN], *kb0 = (uint8_t*)malloc(K*DPF_KEY_LEN),
+            *kb1 = (uint8_t*)malloc(K*DPF_KEY_LEN);
+    size_t n_bits = 10, n = (size_t)1 << n_bits, k;
+    bool correct=true;
+    int i;
+
+    out0 = (R_t*)malloc(n*sizeof(R_t));     out1 = (R_t*)malloc(n*sizeof(R_t));
+    for (i=0; i<n_times; i++)
+    {
+        // Point function: BETA at alpha, 0 elsewhere
+        alpha = random_dtype();
+        tic(); DPF_gen(alpha, k0, k1); t_gen += toc();
+        tic(); correct &= (DPF_eval(0, k0, alpha) + DPF_eval(1, k1, alpha) == BETA); t_eval += toc();
+        correct &= (DPF_eval(0, k0, alpha+1) + DPF_eval(1, k1, alpha+1) == 0);
+        correct &= (DPF_eval(0, k0, alpha^(R_t)1<<(N_BITS-1)) + DPF_eval(1, k1, alpha^(R_t)1<<(N_BITS-1)) == 0);
+        // Equality on masked inputs, zero and non-zero
+        r_in = random_dtype();
+        EQ_gen(r_in, 0, k0, k1);
+        x = (i % 2) ? 0 : random_dtype() | 1;
+        correct &= (EQ_eval(0, k0, x+r_in) + EQ_eval(1, k1, x+r_in) == (x == 0));
+        // Full domain
+        alpha = (R_t)(U(random_dtype()) % n);
+        DPF_gen(alpha, k0, k1);
+        tic();
+        correct &= (DPF_eval_full(0, k0, n_bits, out0) == 0) && (DPF_eval_full(1, k1, n_bits, out1) == 0);
+        t_full += toc();
+        for (k=0; k<n; k++){
+            correct &= (out0[k] + out1[k] == BETA*((R_t)k == alpha));
+        }
+        correct &= (out0[n-1] == DPF_eval(0, k0, (R_t)(n-1)));
+    }
+    correct &= (DPF_eval_full(0, k0, DPF_FULL_MAX_BITS+1, out0) == -1);
+    // Batch: z == theta on every other element
+    theta = random_dtype();
+    EQ_gen_batch(K, theta, r_in_0, r_in_1, kb0, kb1);
+    for (k=0; k<K; k++){
+        z_hat[k] = ((k % 2) ? theta : theta + (R_t)k + 1) + r_in_0[k] + r_in_1[k];
+    }
+    EQ_eval_batch(K, 0, kb0, z_hat, o_0);
+    EQ_eval_batch(K, 1, kb1, z_hat, o_1);
+    for (k=0; k<K; k++){
+        correct &= (o_0[k] + o_1[k] == (R_t)(k % 2));
+    }
+    printf("Test DPF fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time DPF_gen:      %-5.0f (ns)\n", t_gen/(n_times));
+        printf(" - Avg. time DPF_eval:     %-5.0f (ns)\n", t_eval/(n_times*2));
+        printf(" - Avg. time DPF_eval_full: %-5.0f (ns/point, 2^%lu)\n", t_full/(n_times*2*n), (unsigned long)n_bits);
+        printf(" - Key length: %lu (DPF) vs %lu (DCF) bytes\n", (unsigned long)DPF_KEY_LEN, (unsigned long)KEY_LEN);
+    }
+    free(out0); free(out1); free(z_hat); free(r_in_0); free(r_in_1); free(o_0); free(o_1); free(kb0); free(kb1);
+    return correct;
+}
+
 bool test_funshade(size_t n_times, size_t l){
     // Allocate empty everything with malloc
     uint8_t *k0 = (uint8_t*)malloc(KEY_LEN*sizeof(uint8_t));
@@ -312,16 +634,1403 @@ bool test_funshade_batch(size_t n_times, size_t l, size_t K){
     return correct;
 }
 
+bool test_derived(size_t l, size_t K){
+    size_t v_size = l*K, a = K/3, idx, k, m;
+    uint8_t master[MASTER_SEED_LEN] = {0}, *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN),
+            *k0_s = (uint8_t*)malloc(K*KEY_LEN), *k1_s = (uint8_t*)malloc(K*KEY_LEN);
+    R_t *mat[8], *mat_s[8], *x = (R_t*)malloc(v_size*sizeof(R_t)), *y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_x = (R_t*)malloc(v_size*sizeof(R_t)), *D_y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)), *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0 = (R_t*)malloc(K*sizeof(R_t)), *o_1 = (R_t*)malloc(K*sizeof(R_t)), z, theta = 0;
+    double t_derived=0, t_random=0;
+    bool correct=true;
+
+    for (m=0; m<8; m++){
+        mat[m]   = (R_t*)malloc((m<6 ? v_size : K)*sizeof(R_t));
+        mat_s[m] = (R_t*)malloc((m<6 ? v_size : K)*sizeof(R_t));
+    }
+    for (m=0; m<MASTER_SEED_LEN; m++)   master[m] = (uint8_t)(m*37 + 1);
+
+    // The whole batch, then the same indices as two slices [0, a) and [a, K) in reverse order
+    tic(); funshade_setup_batch_derived(master, 0, K, l, theta, mat[0], mat[1], mat[2], mat[3],
+        mat[4], mat[5], mat[6], mat[7], k0, k1); t_derived += toc();
+    funshade_setup_batch_derived(master, a, K, l, theta, mat_s[0]+a*l, mat_s[1]+a*l, mat_s[2]+a*l, mat_s[3]+a*l,
+        mat_s[4]+a*l, mat_s[5]+a*l, mat_s[6]+a, mat_s[7]+a, k0_s+a*KEY_LEN, k1_s+a*KEY_LEN);
+    funshade_setup_batch_derived(master, 0, a, l, theta, mat_s[0], mat_s[1], mat_s[2], mat_s[3],
+        mat_s[4], mat_s[5], mat_s[6], mat_s[7], k0_s, k1_s);
+    for (m=0; m<8; m++){
+        correct &= (memcmp(mat[m], mat_s[m], (m<6 ? v_size : K)*sizeof(R_t)) == 0);
+    }
+    correct &= (memcmp(k0, k0_s, K*KEY_LEN) == 0) && (memcmp(k1, k1_s, K*KEY_LEN) == 0);
+    // Another master seed draws other material
+    master[0] ^= 1;
+    SIGN_gen_batch_derived(master, 0, K, theta, mat_s[6], mat_s[7], k0_s, k1_s);
+    correct &= (memcmp(mat[6], mat_s[6], K*sizeof(R_t)) != 0) && (memcmp(k0, k0_s, K*KEY_LEN) != 0);
+
+    // The derived material runs the protocol
+    for (idx=0; idx<v_size; idx++){
+        x[idx] = (R_t)(idx*2654435761u) % 1024;
+        y[idx] = (R_t)(idx*40503u + 7) % 1024 - 512;
+        D_x[idx] = x[idx] + mat[0][idx] + mat[1][idx];
+        D_y[idx] = y[idx] + mat[2][idx] + mat[3][idx];
+    }
+    funshade_eval_dist_batch(K, l, 0, mat[6], D_x, D_y, mat[0], mat[2], mat[4], z_hat_0);
+    funshade_eval_dist_batch(K, l, 1, mat[7], D_x, D_y, mat[1], mat[3], mat[5], z_hat_1);
+    funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+    funshade_eval_sign_batch(K, 1, k1, z_hat_0, z_hat_1, o_1);
+    for (k=0; k<K; k++){
+        for (z=0, idx=k*l; idx<(k+1)*l; idx++)  z += x[idx]*y[idx];
+        correct &= (o_0[k] + o_1[k] == (z >= theta));
+    }
+    tic(); funshade_setup_batch(K, l, theta, mat_s[0], mat_s[1], mat_s[2], mat_s[3],
+        mat_s[4], mat_s[5], mat_s[6], mat_s[7], k0_s, k1_s); t_random += toc();
+
+    printf("Test derived setup fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time funshade_setup_batch_derived: %-5.0f (ns)\n", t_derived/K);
+        printf(" - Avg. time funshade_setup_batch:         %-5.0f (ns)\n", t_random/K);
+    }
+    for (m=0; m<8; m++){
+        free(mat[m]); free(mat_s[m]);
+    }
+    free(k0); free(k1); free(k0_s); free(k1_s); free(x); free(y); free(D_x); free(D_y);
+    free(z_hat_0); free(z_hat_1); free(o_0); free(o_1);
+    return correct;
+}
+
+bool test_metrics(size_t l, size_t K){
+    // Dot product, squared L2 and cosine (l-1 elements and their norm), both directions
+    size_t v_size = l*K, idx, k, i, m, below;
+    funshade_metric metrics[3] = {FUNSHADE_DOT, FUNSHADE_SQ_L2, FUNSHADE_COS};
+    R_t thetas[3] = {0, (R_t)(9*l), (R_t)(0.1*(1<<COS_FRAC_BITS))};
+    R_t *x     = (R_t*)malloc(v_size*sizeof(R_t)),   *y     = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x0  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_x1  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_y0  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y1  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_xy0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_xy1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x   = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_x   = (R_t*)malloc(v_size*sizeof(R_t)),   *D_y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *r_in_0= (R_t*)malloc(K*sizeof(R_t)),        *r_in_1= (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),      *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0   = (R_t*)malloc(K*sizeof(R_t)),        *o_1   = (R_t*)malloc(K*sizeof(R_t)),
+        score, nx, ny, theta;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    bool correct=true, match;
+    double t_eval[3] = {0};
+
+    for (idx=0; idx<v_size; idx++){
+        x[idx] = (R_t)((idx*2654435761u >> 7) % 7) - 3;
+        y[idx] = (R_t)((idx*40503u + 11) % 7) - 3;
+    }
+    for (m=0; m<3; m++){
+        for (below=0; below<2; below++){
+            theta = thetas[m];
+            funshade_setup_batch_metric(K, l, metrics[m], below, theta, d_x0, d_x1, d_y0, d_y1,
+                d_xy0, d_xy1, r_in_0, r_in_1, k0, k1);
+            if (metrics[m] == FUNSHADE_COS){
+                // Last element of each row: its fixed-point norm
+                for (k=0; k<K; k++){
+                    for (nx=0, ny=0, i=0; i<l-1; i++){
+                        nx += x[k*l+i]*x[k*l+i];    ny += y[k*l+i]*y[k*l+i];
+                    }
+                    x[k*l+l-1] = (R_t)(sqrt((double)nx) + 0.5);  y[k*l+l-1] = (R_t)(sqrt((double)ny) + 0.5);
+                }
+            }
+            for (idx=0; idx<v_size; idx++){
+                d_x[idx] = d_x0[idx] + d_x1[idx];   d_y[idx] = d_y0[idx] + d_y1[idx];
+            }
+            funshade_share_batch(K, l, x, d_x, D_x);
+            funshade_share_batch(K, l, y, d_y, D_y);
+            tic();
+            funshade_eval_dist_batch_metric(K, l, metrics[m], below, theta, 0, r_in_0, D_x, D_y, d_x0, d_y0, d_xy0, z_hat_0);
+            funshade_eval_dist_batch_metric(K, l, metrics[m], below, theta, 1, r_in_1, D_x, D_y, d_x1, d_y1, d_xy1, z_hat_1);
+            t_eval[m] += toc();
+            funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+            funshade_eval_sign_batch(K, 1, k1, z_hat_0, z_hat_1, o_1);
+            for (k=0; k<K; k++){
+                score = 0;
+                for (i=0; i<(metrics[m] == FUNSHADE_COS ? l-1 : l); i++){
+                    score += (metrics[m] == FUNSHADE_SQ_L2) ? (x[k*l+i]-y[k*l+i])*(x[k*l+i]-y[k*l+i])
+                                                            : x[k*l+i]*y[k*l+i];
+                }
+                if (metrics[m] == FUNSHADE_COS){
+                    score = score*(1<<COS_FRAC_BITS) - theta*x[k*l+l-1]*y[k*l+l-1];
+                    match = below ? (score <= 0) : (score >= 0);
+                } else {
+                    match = below ? (score <= theta) : (score >= theta);
+                }
+                correct &= (o_0[k] + o_1[k] == match);
+            }
+        }
+    }
+    // Cosine rows need their norm: shorter rows score 0
+    z_hat_0[0] = 42;
+    funshade_eval_dist_batch_metric(1, 1, FUNSHADE_COS, false, thetas[2], 0, r_in_0, D_x, D_y, d_x0, d_y0, d_xy0, z_hat_0);
+    correct &= (z_hat_0[0] == r_in_0[0]);
+    z_hat_0[0] = 42;
+    funshade_eval_dist_batch_metric(1, 0, FUNSHADE_COS, false, thetas[2], 0, r_in_0, D_x, D_y, d_x0, d_y0, d_xy0, z_hat_0);
+    correct &= (z_hat_0[0] == r_in_0[0]);
+    // Scores scaled by 2^COS_FRAC_BITS: max_el << COS_FRAC_BITS/2 bounds them
+    correct &= funshade_check_overflow(l, (R_t)(127 << COS_FRAC_BITS/2), true);
+    correct &= funshade_check_overflow(l, (R_t)(128 << COS_FRAC_BITS/2), true) == (N_BITS > 32);
+    printf("Test distance metrics fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time eval_dist dot:    %-5.0f (ns)\n", t_eval[0]/(4*K));
+        printf(" - Avg. time eval_dist sq_l2:  %-5.0f (ns)\n", t_eval[1]/(4*K));
+        printf(" - Avg. time eval_dist cosine: %-5.0f (ns)\n", t_eval[2]/(4*K));
+    }
+    free(x); free(y); free(d_x0); free(d_x1); free(d_y0); free(d_y1); free(d_xy0); free(d_xy1);
+    free(d_x); free(d_y); free(D_x); free(D_y); free(r_in_0); free(r_in_1);
+    free(z_hat_0); free(z_hat_1); free(o_0); free(o_1); free(k0); free(k1);
+    return correct;
+}
+
+bool test_db_refresh(size_t l, size_t K, size_t n_rounds){
+    // Reference DB shared once, queried after each refresh (alternating rotation)
+    size_t v_size = l*K, idx, k, i, r;
+    R_t *x     = (R_t*)malloc(l*sizeof(R_t)),       *y     = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x0  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_x1  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_y0  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y1  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_xy0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_xy1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *p_y0  = (R_t*)malloc(v_size*sizeof(R_t)),   *p_y1  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_y_0 = (R_t*)malloc(v_size*sizeof(R_t)),   *D_y_1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *e     = (R_t*)malloc(v_size*sizeof(R_t)),   *d_x   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *e_0   = (R_t*)malloc(v_size*sizeof(R_t)),   *e_1   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_x   = (R_t*)malloc(v_size*sizeof(R_t)),   *D_y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *r_in_0= (R_t*)malloc(K*sizeof(R_t)),        *r_in_1= (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),      *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0   = (R_t*)malloc(K*sizeof(R_t)),        *o_1   = (R_t*)malloc(K*sizeof(R_t)),
+        z, theta = 3;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    bool correct=true, rotate, moved;
+    double t_refresh = 0;
+
+    for (i=0; i<l; i++)         x[i] = (R_t)((i*2654435761u >> 7) % 7) - 3;
+    for (idx=0; idx<v_size; idx++)  y[idx] = (R_t)((idx*40503u + 11) % 7) - 3;
+    // Enrollment: masks kept by the dealer (d_y0/d_y1) and the parties (p_y0/p_y1)
+    funshade_setup_batch(K, l, theta, d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in_0, r_in_1, k0, k1);
+    for (idx=0; idx<v_size; idx++)  d_x[idx] = d_y0[idx] + d_y1[idx];
+    funshade_share_batch(K, l, y, d_x, D_y);
+    memcpy(D_y_0, D_y, v_size*sizeof(R_t));     memcpy(D_y_1, D_y, v_size*sizeof(R_t));
+    memcpy(p_y0, d_y0, v_size*sizeof(R_t));     memcpy(p_y1, d_y1, v_size*sizeof(R_t));
+    for (r=0; r<n_rounds; r++){
+        rotate = r & 1;
+        funshade_refresh_gen(K, l, rotate, d_y0, d_y1, rotate ? e : NULL, e_0, e_1);
+        tic();
+        funshade_refresh_batch(K, l, rotate ? e : NULL, e_0, D_y_0, p_y0);
+        funshade_refresh_batch(K, l, rotate ? e : NULL, e_1, D_y_1, p_y1);
+        t_refresh += toc();
+        // Same DB and masks on all sides, split always re-randomized, D_y moved on rotation
+        correct &= (memcmp(D_y_0, D_y_1, v_size*sizeof(R_t)) == 0);
+        correct &= (memcmp(p_y0, d_y0, v_size*sizeof(R_t)) == 0) && (memcmp(p_y1, d_y1, v_size*sizeof(R_t)) == 0);
+        for (moved=false, idx=0; idx<v_size; idx++){
+            correct &= (D_y_0[idx] - p_y0[idx] - p_y1[idx] == y[idx]);
+            moved |= (D_y_0[idx] != D_y[idx]);
+        }
+        correct &= (moved == rotate) && (e_0[0] != 0 || e_0[1] != 0);
+        memcpy(D_y, D_y_0, v_size*sizeof(R_t));
+        // Query against the refreshed masks
+        funshade_setup_batch_db(K, l, FUNSHADE_DOT, false, theta, d_y0, d_y1,
+            d_x0, d_x1, d_xy0, d_xy1, r_in_0, r_in_1, k0, k1);
+        for (idx=0; idx<v_size; idx++)  d_x[idx] = d_x0[idx] + d_x1[idx];
+        funshade_share_broadcast_batch(K, l, x, d_x, D_x);
+        funshade_eval_dist_batch(K, l, 0, r_in_0, D_x, D_y_0, d_x0, p_y0, d_xy0, z_hat_0);
+        funshade_eval_dist_batch(K, l, 1, r_in_1, D_x, D_y_1, d_x1, p_y1, d_xy1, z_hat_1);
+        funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+        funshade_eval_sign_batch(K, 1, k1, z_hat_0, z_hat_1, o_1);
+        for (k=0; k<K; k++){
+            for (z=0, i=0; i<l; i++)    z += x[i]*y[k*l+i];
+            correct &= (o_0[k] + o_1[k] == (z >= theta));
+        }
+    }
+    printf("Test DB refresh fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time funshade_refresh_batch: %-5.0f (ns per reference)\n", t_refresh/(2*n_rounds*K));
+    }
+    free(x); free(y); free(d_x0); free(d_x1); free(d_y0); free(d_y1); free(d_xy0); free(d_xy1);
+    free(p_y0); free(p_y1); free(D_y_0); free(D_y_1); free(e); free(d_x); free(e_0); free(e_1);
+    free(D_x); free(D_y); free(r_in_0); free(r_in_1); free(z_hat_0); free(z_hat_1); free(o_0); free(o_1);
+    free(k0); free(k1);
+    return correct;
+}
+
+bool test_funshade_quantized(size_t l, size_t K){
+    // Quantized int16 inputs, masks and Delta shares in R_t
+    size_t v_size = l*K;
+    int16_t *x_q = (int16_t*)malloc(v_size*sizeof(int16_t)), *y_q = (int16_t*)malloc(v_size*sizeof(int16_t));
+    R_t *x     = (R_t*)malloc(v_size*sizeof(R_t)),   *y     = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x   = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x0  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y0  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x1  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y1  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_x   = (R_t*)malloc(v_size*sizeof(R_t)),   *D_y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_x_q = (R_t*)malloc(v_size*sizeof(R_t)),   *D_y_q = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_xy0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_xy1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *r_in_0= (R_t*)malloc(K*sizeof(R_t)),        *r_in_1= (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),      *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *z       = (R_t*)calloc(K, sizeof(R_t));
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    R_t max_el = 1<<6, theta = 0;
+    double t_share=0, t_share_q=0, t_eval_sp=0;
+    bool correct=true;
+    size_t idx;
+
+    // Overflow bounds: l*max_el^2 must fit for raw vectors, max_el^2 for normalized
+    correct &= funshade_check_overflow(l, max_el, false);
+    correct &= !funshade_check_overflow(l, (R_t)1<<(N_BITS/2), true);
+    correct &= !funshade_check_overflow(l, (R_t)((uint64_t)1<<(N_BITS-1)), true);     // most negative R_t
+
+    for (idx=0; idx<v_size; idx++){
+        x_q[idx] = (int16_t)(random_dtype() % max_el);   x[idx] = x_q[idx];
+        y_q[idx] = (int16_t)(random_dtype() % max_el);   y[idx] = y_q[idx];
+        z[idx/l] += x[idx]*y[idx];
+    }
+    funshade_setup_batch(K, l, theta, d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in_0, r_in_1, k0, k1);
+    for (idx=0; idx<v_size; idx++){
+        d_x[idx] = d_x0[idx] + d_x1[idx];
+        d_y[idx] = d_y0[idx] + d_y1[idx];
+    }
+    // Quantized shares must match the full-width shares
+    tic(); funshade_share_batch(K, l, x, d_x, D_x);         t_share += toc();
+    tic(); funshade_share_batch(K, l, y, d_y, D_y);         t_share += toc();
+    tic(); funshade_share_batch_i16(K, l, x_q, d_x, D_x_q); t_share_q += toc();
+    tic(); funshade_share_batch_i16(K, l, y_q, d_y, D_y_q); t_share_q += toc();
+    correct &= (memcmp(D_x, D_x_q, v_size*sizeof(R_t)) == 0);
+    correct &= (memcmp(D_y, D_y_q, v_size*sizeof(R_t)) == 0);
+
+    // Dot products reconstruct exactly
+    tic(); funshade_eval_dist_batch(K, l, 0, r_in_0, D_x_q, D_y_q, d_x0, d_y0, d_xy0, z_hat_0); t_eval_sp+= toc();
+    tic(); funshade_eval_dist_batch(K, l, 1, r_in_1, D_x_q, D_y_q, d_x1, d_y1, d_xy1, z_hat_1); t_eval_sp+= toc();
+    for (idx=0; idx<K; idx++){
+        correct &= ((z_hat_0[idx] + z_hat_1[idx]) - (r_in_0[idx] + r_in_1[idx]) == z[idx]);
+    }
+    printf("Test Funshade quantized fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time funshade_share:      %-5.0f (ns)\n", t_share/2);
+        printf(" - Avg. time funshade_share_i16:  %-5.0f (ns)\n", t_share_q/2);
+        printf(" - Avg. time funshade_eval_dist:  %-5.0f (ns)\n", t_eval_sp/2);
+    }
+    free(x_q); free(y_q); free(x); free(y); free(d_x); free(d_y); free(d_x0); free(d_x1);
+    free(d_y0); free(d_y1); free(D_x); free(D_y); free(D_x_q); free(D_y_q); free(d_xy0); free(d_xy1);
+    free(r_in_0); free(r_in_1); free(z_hat_0); free(z_hat_1); free(z); free(k0); free(k1);
+    return correct;
+}
+bool test_share_float(size_t l, size_t K){
+    size_t v_size = l*K, k, i;
+    float *v = (float*)malloc(v_size*sizeof(float));
+    double *v64 = (double*)malloc(v_size*sizeof(double)), *tmp = (double*)malloc(v_size*sizeof(double)), n2;
+    R_t *d_v = (R_t*)malloc(v_size*sizeof(R_t)), *q = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_v = (R_t*)malloc(v_size*sizeof(R_t)), *D_f = (R_t*)malloc(v_size*sizeof(R_t)),
+        max_el = 1<<12;
+    double t_passes=0, t_fused=0;
+    bool correct=true;
+
+    random_buffer((uint8_t*)d_v, v_size*sizeof(R_t));
+    for (i=0; i<v_size; i++){
+        v[i] = (float)(random_dtype() % 2000) / 1000.0f - 1.0f;
+        v64[i] = v[i];
+    }
+    // Reference: normalize, scale, round and share as separate passes
+    tic();
+    for (k=0; k<K; k++){
+        for (n2=0, i=0; i<l; i++)   n2 += v64[k*l+i]*v64[k*l+i];
+        for (i=0; i<l; i++)         tmp[k*l+i] = v64[k*l+i]/sqrt(n2);
+    }
+    for (i=0; i<v_size; i++)    q[i] = (R_t)(tmp[i]*max_el + (tmp[i] >= 0 ? 0.5 : -0.5));
+    funshade_share_batch(K, l, q, d_v, D_v);
+    t_passes += toc();
+    tic(); correct &= (funshade_share_f64_batch(K, l, v64, max_el, true, d_v, D_f) == 0); t_fused += toc();
+    for (i=0; i<v_size; i++){
+        correct &= (D_f[i] - D_v[i] >= -1) && (D_f[i] - D_v[i] <= 1);   // float rounding at .5
+    }
+    tic(); correct &= (funshade_share_float_batch(K, l, v, max_el, true, d_v, D_f) == 0); t_fused += toc();
+    for (i=0; i<v_size; i++){
+        correct &= (D_f[i] - D_v[i] >= -1) && (D_f[i] - D_v[i] <= 1);
+    }
+    // Without normalization, bounded inputs quantize exactly; larger ones are rejected
+    for (i=0; i<v_size; i++)    q[i] = (R_t)(tmp[i]*64 + (tmp[i] >= 0 ? 0.5 : -0.5));
+    funshade_share_batch(K, l, q, d_v, D_v);
+    correct &= (funshade_share_f64_batch(K, l, tmp, 64, false, d_v, D_f) == 0);
+    correct &= (memcmp(D_v, D_f, v_size*sizeof(R_t)) == 0);
+    for (i=0; i<v_size; i++)    tmp[i] *= 64;
+    correct &= (funshade_share_f64_batch(K, l, tmp, 1, false, d_v, D_f) == -1);
+    correct &= (funshade_share_float_batch(K, l, v, (R_t)1<<(N_BITS/2), true, d_v, D_f) == -1);
+    // NaN and elements far outside R_t are rejected before the conversion
+    tmp[0] = sqrt(-1.0);
+    correct &= (funshade_share_f64_batch(K, l, tmp, 64, false, d_v, D_f) == -1);
+    v[0] = 1e30f;
+    correct &= (funshade_share_float_batch(K, l, v, 64, false, d_v, D_f) == -1);
+    correct &= (funshade_scale_threshold(0.4, max_el) == (R_t)(0.4*max_el*max_el + 0.5));
+    correct &= (funshade_scale_threshold(-0.4, max_el) == -(R_t)(0.4*max_el*max_el + 0.5));
+
+    printf("Test share float fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time separate passes:    %-5.0f (ns)\n", t_passes);
+        printf(" - Avg. time funshade_share_float: %-5.0f (ns)\n", t_fused/2);
+    }
+    free(v); free(v64); free(tmp); free(d_v); free(q); free(D_v); free(D_f);
+    return correct;
+}
+
+bool test_funshade_ctx(size_t n_times, size_t l, size_t K){
+    size_t v_size = l*K, i, idx;
+    R_t *x     = (R_t*)malloc(l*sizeof(R_t)),        *y     = (R_t*)malloc(v_size*sizeof(R_t)),
+        *x_t   = (R_t*)malloc(v_size*sizeof(R_t)),   *D_x   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x   = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x0  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y0  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x1  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y1  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_xy0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_xy1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *r_in_0= (R_t*)malloc(K*sizeof(R_t)),        *r_in_1= (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),      *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *D_x_ctx, *zc_hat_0, *zc_hat_1, o0, o1;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    funshade_ctx *ctx0 = funshade_ctx_new(K, l, 0), *ctx1 = funshade_ctx_new(K, l, 1);
+    double t_share=0, t_eval_sp=0, t_eval_sign=0;
+    bool correct = (ctx0 != NULL) && (ctx1 != NULL);
+
+    // Offline phase and enrollment, bound once to each party's context
+    funshade_setup_batch(K, l, 0, d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in_0, r_in_1, k0, k1);
+    for (idx=0; idx<v_size; idx++){
+        d_x[idx] = d_x0[idx] + d_x1[idx];
+        d_y[idx] = d_y0[idx] + d_y1[idx];
+        y[idx] = random_dtype()/(2*l);
+    }
+    funshade_share_batch(K, l, y, d_y, D_y);
+    funshade_ctx_set_offline(ctx0, r_in_0, d_x0, d_y0, d_xy0, k0);  funshade_ctx_set_db(ctx0, D_y);
+    funshade_ctx_set_offline(ctx1, r_in_1, d_x1, d_y1, d_xy1, k1);  funshade_ctx_set_db(ctx1, D_y);
+
+    // Repeated queries reuse the context buffers
+    for (i=0; i<n_times; i++)
+    {
+        for (idx=0; idx<l; idx++){
+            x[idx] = random_dtype()/(2*l);
+        }
+        for (idx=0; idx<v_size; idx++){
+            x_t[idx] = x[idx%l];
+        }
+        funshade_share_batch(K, l, x_t, d_x, D_x);
+        funshade_eval_dist_batch(K, l, 0, r_in_0, D_x, D_y, d_x0, d_y0, d_xy0, z_hat_0);
+        funshade_eval_dist_batch(K, l, 1, r_in_1, D_x, D_y, d_x1, d_y1, d_xy1, z_hat_1);
+
+        tic(); D_x_ctx = funshade_ctx_share(ctx1, x, d_x); t_share += toc();
+        correct &= (memcmp(D_x, D_x_ctx, v_size*sizeof(R_t)) == 0);
+        memcpy(funshade_ctx_D_x(ctx0), D_x_ctx, v_size*sizeof(R_t));   // Send(D_x)
+        tic(); zc_hat_0 = funshade_ctx_eval_dist(ctx0, NULL); t_eval_sp += toc();
+        tic(); zc_hat_1 = funshade_ctx_eval_dist(ctx1, NULL); t_eval_sp += toc();
+        correct &= (memcmp(z_hat_0, zc_hat_0, K*sizeof(R_t)) == 0);
+        correct &= (memcmp(z_hat_1, zc_hat_1, K*sizeof(R_t)) == 0);
+        tic(); o0 = funshade_ctx_eval_sign_collapse(ctx0, zc_hat_1); t_eval_sign += toc();
+        tic(); o1 = funshade_ctx_eval_sign_collapse(ctx1, zc_hat_0); t_eval_sign += toc();
+        correct &= (o0 == funshade_eval_sign_batch_collapse(K, 0, k0, z_hat_0, z_hat_1));
+        correct &= (o1 == funshade_eval_sign_batch_collapse(K, 1, k1, z_hat_0, z_hat_1));
+    }
+    printf("Test Funshade context fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time funshade_ctx_share:      %-5.0f (ns)\n", t_share/(n_times));
+        printf(" - Avg. time funshade_ctx_eval_dist:  %-5.0f (ns)\n", t_eval_sp/(n_times*2));
+        printf(" - Avg. time funshade_ctx_eval_sign:  %-5.0f (ns)\n", t_eval_sign/(n_times*2));
+    }
+    funshade_ctx_free(ctx0); funshade_ctx_free(ctx1);
+    free(x); free(y); free(x_t); free(D_x); free(d_x); free(d_y); free(d_x0); free(d_x1);
+    free(d_y0); free(d_y1); free(D_y); free(d_xy0); free(d_xy1); free(r_in_0); free(r_in_1);
+    free(z_hat_0); free(z_hat_1); free(k0); free(k1);
+    return correct;
+}
+
+bool test_level_major(size_t n_times, size_t K){
+    size_t i, k;
+    R_t *r_in_0  = (R_t*)malloc(K*sizeof(R_t)),      *r_in_1  = (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),      *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *x_hat   = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0     = (R_t*)malloc(K*sizeof(R_t)),      *o_1     = (R_t*)malloc(K*sizeof(R_t)),
+        *o_lm_0  = (R_t*)malloc(K*sizeof(R_t)),      *o_lm_1  = (R_t*)malloc(K*sizeof(R_t));
+    uint8_t *k0    = (uint8_t*)malloc(K*KEY_LEN),  *k1    = (uint8_t*)malloc(K*KEY_LEN),
+            *k0_lm = (uint8_t*)malloc(K*KEY_LEN),  *k1_lm = (uint8_t*)malloc(K*KEY_LEN),
+            *k_rt  = (uint8_t*)malloc(K*KEY_LEN);
+    double t_eval=0, t_eval_lm=0;
+    bool correct=true;
+
+    // Layout conversion round-trips byte for byte
+    SIGN_gen_batch(K, 0, r_in_0, r_in_1, k0, k1);
+    FSS_keys_to_level_major(K, k0, k0_lm);  FSS_keys_to_level_major(K, k1, k1_lm);
+    FSS_keys_from_level_major(K, k0_lm, k_rt);
+    correct &= (memcmp(k0, k_rt, K*KEY_LEN) == 0);
+
+    // Lock-step evaluation matches the key-major one
+    for (i=0; i<n_times; i++)
+    {
+        for (k=0; k<K; k++){
+            x_hat[k] = random_dtype() + r_in_0[k] + r_in_1[k];
+        }
+        tic(); SIGN_eval_batch(K, 0, k0, x_hat, o_0); t_eval += toc();
+        tic(); SIGN_eval_batch(K, 1, k1, x_hat, o_1); t_eval += toc();
+        tic(); SIGN_eval_batch_lm(K, 0, k0_lm, x_hat, o_lm_0); t_eval_lm += toc();
+        tic(); SIGN_eval_batch_lm(K, 1, k1_lm, x_hat, o_lm_1); t_eval_lm += toc();
+        correct &= (memcmp(o_0, o_lm_0, K*sizeof(R_t)) == 0);
+        correct &= (memcmp(o_1, o_lm_1, K*sizeof(R_t)) == 0);
+    }
+
+    // Keys generated directly in level-major layout match their key-major form
+    SIGN_gen_batch_lm(K, 0, r_in_0, r_in_1, k0_lm, k1_lm);
+    FSS_keys_from_level_major(K, k0_lm, k0);
+    for (k=0; k<K; k++){
+        z_hat_0[k] = random_dtype() + r_in_0[k];     z_hat_1[k] = r_in_1[k];
+    }
+    funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+    funshade_eval_sign_batch_lm(K, 0, k0_lm, z_hat_0, z_hat_1, o_lm_0);
+    correct &= (memcmp(o_0, o_lm_0, K*sizeof(R_t)) == 0);
+    correct &= (funshade_eval_sign_batch_collapse_lm(K, 0, k0_lm, z_hat_0, z_hat_1) ==
+                funshade_eval_sign_batch_collapse(K, 0, k0, z_hat_0, z_hat_1));
+
+    printf("Test level-major keys fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time SIGN_eval_batch:     %-5.0f (ns)\n", t_eval/(n_times*2));
+        printf(" - Avg. time SIGN_eval_batch_lm:  %-5.0f (ns)\n", t_eval_lm/(n_times*2));
+    }
+    free(r_in_0); free(r_in_1); free(z_hat_0); free(z_hat_1); free(x_hat); free(o_0); free(o_1);
+    free(o_lm_0); free(o_lm_1); free(k0); free(k1); free(k0_lm); free(k1_lm); free(k_rt);
+    return correct;
+}
+
+#ifdef USE_CPP_ENGINE
+bool test_cpp_engine(int n_times){
+    uint8_t k0[KEY_LEN], k1[KEY_LEN], *kb;
+    R_t x, p, q, o_c, o_cpp, r_in = random_dtype();
+    double t_c=0, t_cpp=0;
+    bool correct=true;
+    int i, b;
+
+    // Same outputs as the C gates on the same keys, for both parties
+    for (i=0; i<n_times; i++)
+    {
+        random_buffer((uint8_t*)&x, sizeof(R_t));   x += i;
+        random_buffer((uint8_t*)&p, sizeof(R_t));   q = p + (U(x)>>2);
+        for (b=0; b<2; b++)
+        {
+            kb = b ? k1 : k0;
+            DCF_gen(r_in, k0, k1);
+            correct &= (DCF_eval(b, kb, x) == DCF_eval_cpp(b, kb, x));
+            IC_gen(r_in, 0, p, q, k0, k1);
+            correct &= (IC_eval(b, p, q, kb, x) == IC_eval_cpp(b, p, q, kb, x));
+            SIGN_gen(r_in, 0, k0, k1);
+            tic(); o_c   = SIGN_eval(b, kb, x);       t_c   += toc();
+            tic(); o_cpp = SIGN_eval_cpp(b, kb, x);   t_cpp += toc();
+            correct &= (o_c == o_cpp);
+        }
+    }
+    printf("Test C++ engine fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time SIGN_eval:      %-5.0f (ns)\n", t_c/(n_times*2));
+        printf(" - Avg. time SIGN_eval_cpp:  %-5.0f (ns)\n", t_cpp/(n_times*2));
+    }
+    return correct;
+}
+#endif
+
+bool test_funshade_matrix(size_t l, size_t M, size_t K){
+    size_t idx, m, k, i;
+    R_t *X = (R_t*)malloc(M*l*sizeof(R_t)),         *Y = (R_t*)malloc(K*l*sizeof(R_t)),
+        *A0 = (R_t*)malloc(M*l*sizeof(R_t)),        *A1 = (R_t*)malloc(M*l*sizeof(R_t)),
+        *B0 = (R_t*)malloc(K*l*sizeof(R_t)),        *B1 = (R_t*)malloc(K*l*sizeof(R_t)),
+        *A = (R_t*)malloc(M*l*sizeof(R_t)),         *B = (R_t*)malloc(K*l*sizeof(R_t)),
+        *D_X = (R_t*)malloc(M*l*sizeof(R_t)),       *D_Y = (R_t*)malloc(K*l*sizeof(R_t)),
+        *C0 = (R_t*)malloc(M*K*sizeof(R_t)),        *C1 = (R_t*)malloc(M*K*sizeof(R_t)),
+        *r_in_0 = (R_t*)malloc(M*K*sizeof(R_t)),    *r_in_1 = (R_t*)malloc(M*K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(M*K*sizeof(R_t)),   *z_hat_1 = (R_t*)malloc(M*K*sizeof(R_t)),
+        *o_0 = (R_t*)malloc(M*K*sizeof(R_t)),       *o_1 = (R_t*)malloc(M*K*sizeof(R_t)),
+        *d_xy = (R_t*)malloc(K*l*sizeof(R_t)),      *D_x = (R_t*)malloc(K*l*sizeof(R_t)),
+        z, theta = 0;
+    uint8_t *k0 = (uint8_t*)malloc(M*K*KEY_LEN), *k1 = (uint8_t*)malloc(M*K*KEY_LEN);
+    double t_matrix=0, t_tiled=0;
+    bool correct = true;
+
+    for (idx=0; idx<M*l; idx++)     X[idx] = random_dtype() % 64;
+    for (idx=0; idx<K*l; idx++)     Y[idx] = random_dtype() % 64;
+    funshade_setup_matrix(M, K, l, theta, A0, A1, B0, B1, C0, C1, r_in_0, r_in_1, k0, k1);
+    for (idx=0; idx<M*l; idx++)     A[idx] = A0[idx] + A1[idx];
+    for (idx=0; idx<K*l; idx++)     B[idx] = B0[idx] + B1[idx];
+    funshade_share_batch(M, l, X, A, D_X);
+    funshade_share_batch(K, l, Y, B, D_Y);
+    tic();
+    funshade_eval_dist_matrix(M, K, l, 0, r_in_0, D_X, D_Y, A0, B0, C0, z_hat_0);
+    funshade_eval_dist_matrix(M, K, l, 1, r_in_1, D_X, D_Y, A1, B1, C1, z_hat_1);
+    t_matrix += toc();
+    funshade_eval_sign_batch(M*K, 0, k0, z_hat_0, z_hat_1, o_0);
+    funshade_eval_sign_batch(M*K, 1, k1, z_hat_0, z_hat_1, o_1);
+    // Every pair: reconstructed score r_in + z, and its comparison
+    for (m=0; m<M; m++){
+        for (k=0; k<K; k++){
+            z = 0;
+            for (i=0; i<l; i++)     z += X[m*l+i]*Y[k*l+i];
+            idx = m*K+k;
+            correct &= (z_hat_0[idx] + z_hat_1[idx] == r_in_0[idx] + r_in_1[idx] + z);
+            correct &= (o_0[idx] + o_1[idx] == (z >= theta));
+        }
+    }
+    // Reference: M tiled funshade_eval_dist_batch calls over the K pair triples
+    random_buffer((uint8_t*)d_xy, K*l*sizeof(R_t));
+    tic();
+    for (m=0; m<M; m++){
+        funshade_share_broadcast_batch(K, l, &X[m*l], B0, D_x);
+        funshade_eval_dist_batch(K, l, 0, &r_in_0[m*K], D_x, D_Y, B0, B1, d_xy, &z_hat_0[m*K]);
+        funshade_eval_dist_batch(K, l, 1, &r_in_1[m*K], D_x, D_Y, B1, B0, d_xy, &z_hat_1[m*K]);
+    }
+    t_tiled += toc();
+
+    printf("Test Funshade many-to-many fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time eval_dist_matrix:     %-5.0f (ns/pair)\n", t_matrix/(M*K));
+        printf(" - Avg. time tiled eval_dist_batch: %-5.0f (ns/pair)\n", t_tiled/(M*K));
+    }
+    free(X); free(Y); free(A0); free(A1); free(B0); free(B1); free(A); free(B); free(D_X); free(D_Y);
+    free(C0); free(C1); free(r_in_0); free(r_in_1); free(z_hat_0); free(z_hat_1); free(o_0); free(o_1);
+    free(d_xy); free(D_x); free(k0); free(k1);
+    return correct;
+}
+
+bool test_tune(size_t K){
+    size_t l, v_size = 16*K;
+    R_t *D_x = (R_t*)malloc(v_size*sizeof(R_t)),  *D_y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x = (R_t*)malloc(v_size*sizeof(R_t)),  *d_y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_xy = (R_t*)malloc(v_size*sizeof(R_t)), *r_in = (R_t*)malloc(K*sizeof(R_t)),
+        *r_in_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),   *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0 = (R_t*)malloc(K*sizeof(R_t)),       *ot_0 = (R_t*)malloc(K*sizeof(R_t)), o1, ot1;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    funshade_tuning def = *funshade_tuning_get(), t, t_loaded;
+    const char *path = "funshade_tune_test.txt", *name;
+    double t_cal=0;
+    bool correct = true;
+
+    random_buffer((uint8_t*)D_x, v_size*sizeof(R_t));   random_buffer((uint8_t*)D_y, v_size*sizeof(R_t));
+    random_buffer((uint8_t*)d_x, v_size*sizeof(R_t));   random_buffer((uint8_t*)d_y, v_size*sizeof(R_t));
+    random_buffer((uint8_t*)d_xy, v_size*sizeof(R_t));  random_buffer((uint8_t*)r_in, K*sizeof(R_t));
+    random_buffer((uint8_t*)z_hat_1, K*sizeof(R_t));
+    SIGN_gen_batch(K, 0, r_in, r_in_1, k0, k1);
+    // Flat and row eval_dist kernels, any chunking: same z_hat
+    for (l=1; l<=16; l*=2){
+        t = def;    funshade_tuning_set(&t);
+        funshade_eval_dist_batch(K, l, 1, r_in, D_x, D_y, d_x, d_y, d_xy, z_hat_0);
+        t.dot_flat_max_l = 64;  t.dist_chunk = 3;   t.n_threads = 2;
+        funshade_tuning_set(&t);
+        funshade_eval_dist_batch(K, l, 1, r_in, D_x, D_y, d_x, d_y, d_xy, ot_0);
+        correct &= (memcmp(z_hat_0, ot_0, K*sizeof(R_t)) == 0);
+    }
+    // Calibrated tuning: same outputs as the defaults
+    funshade_tuning_set(&def);
+    funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+    o1 = funshade_eval_sign_batch_collapse(K, 1, k1, z_hat_0, z_hat_1);
+    tic(); funshade_tune_calibrate(64, &t); t_cal += toc();
+    correct &= (funshade_tuning_set(&t) == 0);
+    funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, ot_0);
+    ot1 = funshade_eval_sign_batch_collapse(K, 1, k1, z_hat_0, z_hat_1);
+    correct &= (memcmp(o_0, ot_0, K*sizeof(R_t)) == 0) && (o1 == ot1);
+    // Profile round trip
+    correct &= (funshade_tune_save(path, &t) == 0) && (funshade_tune_load(path, &t_loaded) == 0);
+    correct &= (t.prg == t_loaded.prg) && (t.dot_flat_max_l == t_loaded.dot_flat_max_l) &&
+               (t.n_threads == t_loaded.n_threads) && (t.sign_chunk == t_loaded.sign_chunk) &&
+               (t.dist_chunk == t_loaded.dist_chunk);
+    remove(path);
+    correct &= (funshade_tune_load(path, &t_loaded) == -1);
+    // Backend names are literals: a name stays valid when the PRG changes
+    t = def;    t.prg = FUNSHADE_PRG_TINY;  funshade_tuning_set(&t);
+    name = funshade_backend();
+    t.prg = aes_ni_available() ? FUNSHADE_PRG_NI : FUNSHADE_PRG_TINY;   funshade_tuning_set(&t);
+    correct &= (strncmp(name, "prg=tiny ", 9) == 0) &&
+               (strncmp(funshade_backend(), aes_ni_available() ? "prg=ni " : "prg=tiny ", 7) == 0);
+    funshade_tuning_set(&def);
+
+    printf("Test tuning fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Calibration time (K=64):  %-5.0f (ms)\n", t_cal/1e6);
+        printf(" - Profile: prg %d, dot_flat_max_l %lu, n_threads %lu, sign_chunk %lu, dist_chunk %lu\n",
+            (int)t.prg, (unsigned long)t.dot_flat_max_l, (unsigned long)t.n_threads,
+            (unsigned long)t.sign_chunk, (unsigned long)t.dist_chunk);
+    }
+    free(D_x); free(D_y); free(d_x); free(d_y); free(d_xy); free(r_in); free(r_in_1); free(z_hat_0); free(z_hat_1);
+    free(o_0); free(ot_0); free(k0); free(k1);
+    return correct;
+}
+
+#ifdef FUNSHADE_HAS_POOL
+// One record from a new thread (test_trace)
+static void *trace_one(void *arg){
+    (void)arg;
+    funshade_trace_record(FUNSHADE_STAGE_SHARE, 0, 10);
+    return NULL;
+}
+#endif
+
+bool test_trace(size_t l, size_t K){
+    size_t v_size = l*K, r;
+    int st;
+    R_t *x = (R_t*)malloc(l*sizeof(R_t)),           *y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_x1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_y0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_xy0 = (R_t*)malloc(v_size*sizeof(R_t)),  *d_xy1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *r_in0 = (R_t*)malloc(K*sizeof(R_t)),       *r_in1 = (R_t*)malloc(K*sizeof(R_t)),
+        *D_x = (R_t*)malloc(v_size*sizeof(R_t)),    *D_y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),     *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0 = (R_t*)malloc(K*sizeof(R_t)), theta = 0;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    uint64_t t0, v, p;
+    funshade_trace_stats s;
+    const char *path = "funshade_trace_test.json";
+    FILE *f;
+    int c, n_events;
+#ifdef FUNSHADE_HAS_POOL
+    pthread_t th;
+#endif
+    bool correct = true;
+
+    random_buffer((uint8_t*)x, l*sizeof(R_t));  random_buffer((uint8_t*)y, v_size*sizeof(R_t));
+    funshade_setup_batch(K, l, theta, d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in0, r_in1, k0, k1);
+    funshade_share_batch(K, l, y, d_y0, D_y);               // before enabling: not recorded
+    funshade_trace_reset();
+    funshade_trace_enable(FUNSHADE_TRACE_HIST | FUNSHADE_TRACE_EVENTS);
+    for (r=0; r<8; r++){
+        funshade_share_broadcast_batch(K, l, x, d_x0, D_x);
+        funshade_eval_dist_batch(K, l, 0, r_in0, D_x, D_y, d_x0, d_y0, d_xy0, z_hat_0);
+        t0 = funshade_trace_now();
+        funshade_eval_dist_batch(K, l, 1, r_in1, D_x, D_y, d_x1, d_y1, d_xy1, z_hat_1);
+        funshade_trace_record(FUNSHADE_STAGE_EXCHANGE, t0, funshade_trace_now());
+        funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+        funshade_eval_sign_batch_collapse(K, 1, k1, z_hat_0, z_hat_1);
+    }
+    // One record per call, ordered statistics
+    for (st=0; st<FUNSHADE_N_STAGES; st++){
+        correct &= (funshade_trace_stats_get((funshade_stage)st, -1, &s) == 0);
+        correct &= (s.count == (st == FUNSHADE_STAGE_EVAL_DIST ? 16 : 8));
+        correct &= (s.min <= s.p50) && (s.p50 <= s.p90) && (s.p90 <= s.p99) && (s.p99 <= s.p999)
+                && (s.p999 <= s.max) && (s.min <= s.mean) && (s.mean <= s.max);
+        if (TIMEIT){
+            printf(" - %-10s p50 %-8lu p99 %-8lu max %-8lu (ns)\n", funshade_trace_stage_name((funshade_stage)st),
+                (unsigned long)s.p50, (unsigned long)s.p99, (unsigned long)s.max);
+        }
+    }
+    // Chrome trace: one event per call
+    correct &= (funshade_trace_dump_chrome(path) == 0);
+    if ((f = fopen(path, "r")) != NULL){
+        n_events = 0;
+        while ((c = fgetc(f)) != EOF)   n_events += (c == 'X');
+        fclose(f);
+        correct &= (n_events == 6*8);
+    } else {
+        correct = false;
+    }
+    remove(path);
+    // Known latencies 1..1000 ns: percentiles within one bucket (~3%) above the exact value
+    funshade_trace_reset();
+    for (v=1; v<=1000; v++){
+        funshade_trace_record(FUNSHADE_STAGE_EXCHANGE, 1000, 1000+v);
+    }
+    correct &= (funshade_trace_stats_get(FUNSHADE_STAGE_EXCHANGE, -1, &s) == 0);
+    correct &= (s.count == 1000) && (s.min == 1) && (s.max == 1000) && (s.mean == 500.5);
+    p = funshade_trace_percentile(FUNSHADE_STAGE_EXCHANGE, -1, 0.5);
+    correct &= (p >= 500) && (p <= 500 + 500/16) && (p == s.p50);
+    correct &= (s.p99 >= 990) && (s.p99 <= 1000) && (s.p999 == 1000);
+    correct &= (funshade_trace_stats_get(FUNSHADE_STAGE_SHARE, -1, &s) == -1);
+    // Disabled: nothing recorded
+    funshade_trace_enable(0);
+    funshade_trace_record(FUNSHADE_STAGE_SHARE, 0, 10);
+    funshade_share_batch(K, l, y, d_y0, D_y);
+    correct &= (funshade_trace_stats_get(FUNSHADE_STAGE_SHARE, -1, &s) == -1);
+#ifdef FUNSHADE_HAS_POOL
+    // Threads past TRACE_MAX_THREADS are dropped, not merged into a shared slot
+    funshade_trace_enable(FUNSHADE_TRACE_HIST);
+    for (r=0; r<TRACE_MAX_THREADS+2; r++){
+        correct &= (pthread_create(&th, NULL, trace_one, NULL) == 0) && (pthread_join(th, NULL) == 0);
+    }
+    funshade_trace_enable(0);
+    correct &= (funshade_trace_stats_get(FUNSHADE_STAGE_SHARE, -1, &s) == 0);
+    correct &= (funshade_trace_threads() == TRACE_MAX_THREADS) && (funshade_trace_dropped() >= 2);
+    correct &= (s.count + funshade_trace_dropped() == TRACE_MAX_THREADS+2);
+#endif
+    funshade_trace_reset();
+    correct &= (funshade_trace_dropped() == 0);
+
+    printf("Test tracing fully correct: %s\n", correct ? "true" : "false");
+    free(x); free(y); free(d_x0); free(d_x1); free(d_y0); free(d_y1); free(d_xy0); free(d_xy1);
+    free(r_in0); free(r_in1); free(D_x); free(D_y); free(z_hat_0); free(z_hat_1); free(o_0); free(k0); free(k1);
+    return correct;
+}
+
+#ifdef FUNSHADE_HAS_POOL
+bool test_funshade_pool(size_t l, size_t K, size_t chunk){
+    size_t v_size = l*K, n_jobs = CEIL(K, chunk), n_done = 0, n, c, idx;
+    R_t *D_x = (R_t*)malloc(v_size*sizeof(R_t)),      *D_y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *o_0 = (R_t*)malloc(K*sizeof(R_t)),           *op_0 = (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),       *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *zp_hat_0 = (R_t*)malloc(K*sizeof(R_t)),      *zp_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *mat[8], o1 = 0, op1 = 0;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    funshade_job *jobs = (funshade_job*)calloc(2*n_jobs + 3, sizeof(funshade_job)), *done[16];
+    funshade_pool *pool = funshade_pool_new(4);
+    double t_eval_sign=0;
+    bool correct = (pool != NULL);
+
+    for (c=0; c<8; c++){
+        mat[c] = (R_t*)malloc((c<6 ? v_size : K)*sizeof(R_t));
+    }
+    // Setup and both eval_dist through the pool
+    jobs[0].op = POOL_OP_SETUP;  jobs[0].K = K;  jobs[0].l = l;  jobs[0].k0 = k0;  jobs[0].k1 = k1;
+    memcpy(jobs[0].setup, mat, sizeof(mat));
+    correct &= (funshade_pool_submit(pool, &jobs[0]) == 0);
+    correct &= (funshade_pool_wait(pool, done, 16) == 1) && (done[0] == &jobs[0]);
+    for (idx=0; idx<v_size; idx++){
+        D_x[idx] = random_dtype()/(2*l) + mat[0][idx] + mat[1][idx];
+        D_y[idx] = random_dtype()/(2*l) + mat[2][idx] + mat[3][idx];
+    }
+    for (c=0; c<2; c++){
+        jobs[1+c].op = POOL_OP_DIST;    jobs[1+c].K = K;    jobs[1+c].l = l;    jobs[1+c].j = c;
+        jobs[1+c].r_in_j = mat[6+c];    jobs[1+c].D_x = D_x;    jobs[1+c].D_y = D_y;
+        jobs[1+c].d_xj = mat[0+c];      jobs[1+c].d_yj = mat[2+c];  jobs[1+c].d_xyj = mat[4+c];
+        jobs[1+c].out = c ? zp_hat_1 : zp_hat_0;
+        correct &= (funshade_pool_submit(pool, &jobs[1+c]) == 0);
+    }
+    while (n_done < 2){
+        n_done += funshade_pool_wait(pool, done, 16);
+    }
+    funshade_eval_dist_batch(K, l, 0, mat[6], D_x, D_y, mat[0], mat[2], mat[4], z_hat_0);
+    funshade_eval_dist_batch(K, l, 1, mat[7], D_x, D_y, mat[1], mat[3], mat[5], z_hat_1);
+    correct &= (memcmp(z_hat_0, zp_hat_0, K*sizeof(R_t)) == 0);
+    correct &= (memcmp(z_hat_1, zp_hat_1, K*sizeof(R_t)) == 0);
+
+    // Many small eval_sign requests of both parties, coalesced by the pool
+    funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+    o1 = funshade_eval_sign_batch_collapse(K, 1, k1, z_hat_0, z_hat_1);
+    tic();
+    for (c=0; c<n_jobs; c++){
+        n = (K - c*chunk < chunk) ? K - c*chunk : chunk;
+        jobs[3+2*c].op = POOL_OP_SIGN;  jobs[3+2*c+1].op = POOL_OP_SIGN_COLLAPSE;
+        for (idx=0; idx<2; idx++){
+            jobs[3+2*c+idx].K = n;      jobs[3+2*c+idx].j = idx;
+            jobs[3+2*c+idx].k_j = &(idx ? k1 : k0)[c*chunk*KEY_LEN];
+            jobs[3+2*c+idx].z_hat_0 = &zp_hat_0[c*chunk];
+            jobs[3+2*c+idx].z_hat_1 = &zp_hat_1[c*chunk];
+            jobs[3+2*c+idx].out = &op_0[c*chunk];
+            correct &= (funshade_pool_submit(pool, &jobs[3+2*c+idx]) == 0);
+        }
+    }
+    for (n_done=0; n_done < 2*n_jobs; ){
+        n = funshade_pool_wait(pool, done, 16);
+        for (idx=0; idx<n; idx++){
+            if (done[idx]->op == POOL_OP_SIGN_COLLAPSE) op1 += done[idx]->o_sum;
+        }
+        n_done += n;
+    }
+    t_eval_sign += toc();
+    correct &= (memcmp(o_0, op_0, K*sizeof(R_t)) == 0) && (o1 == op1);
+    funshade_pool_free(pool);
+
+    printf("Test Funshade pool fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time pooled eval_sign:  %-5.0f (ns/key)\n", t_eval_sign/(2*K));
+    }
+    for (c=0; c<8; c++) free(mat[c]);
+    free(D_x); free(D_y); free(o_0); free(op_0); free(z_hat_0); free(z_hat_1);
+    free(zp_hat_0); free(zp_hat_1); free(k0); free(k1); free(jobs);
+    return correct;
+}
+#endif
+
+#ifdef FUNSHADE_HAS_SCHED
+// Mask the inputs once the setup is done: D = x + d_0 + d_1
+typedef struct { R_t *x, *y, *d_x0, *d_x1, *d_y0, *d_y1, *D_x, *D_y; } mask_arg;
+static void mask_range(void *arg, size_t b, size_t e){
+    mask_arg *a = (mask_arg*)arg;
+    size_t idx;
+    for (idx=b; idx<e; idx++){
+        a->D_x[idx] = a->x[idx] + a->d_x0[idx] + a->d_x1[idx];
+        a->D_y[idx] = a->y[idx] + a->d_y0[idx] + a->d_y1[idx];
+    }
+}
+
+bool test_funshade_sched(size_t l, size_t K){
+    size_t v_size = l*K, c, idx;
+    R_t *x   = (R_t*)malloc(v_size*sizeof(R_t)),      *y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_x = (R_t*)malloc(v_size*sizeof(R_t)),      *D_y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *o_0 = (R_t*)malloc(K*sizeof(R_t)),           *os_0 = (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),       *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *zs_hat_0 = (R_t*)malloc(K*sizeof(R_t)),      *zs_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *mat[8], o1, os1 = 0, o_empty = 1;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    funshade_sched *sched = funshade_sched_new(4);
+    funshade_task *t_setup, *t_mask, *t_dist[2], *t_sign, *t_collapse;
+    mask_arg m;
+    double t_graph=0;
+    bool correct = (sched != NULL);
+
+    for (c=0; c<8; c++){
+        mat[c] = (R_t*)malloc((c<6 ? v_size : K)*sizeof(R_t));
+    }
+    for (idx=0; idx<v_size; idx++){
+        x[idx] = random_dtype()/(2*l);
+        y[idx] = random_dtype()/(2*l);
+    }
+    m.x = x;    m.y = y;    m.D_x = D_x;    m.D_y = D_y;
+    m.d_x0 = mat[0];    m.d_x1 = mat[1];    m.d_y0 = mat[2];    m.d_y1 = mat[3];
+
+    // setup -> mask -> dist (both parties) -> sign (limited to 1 worker) / collapse (2 workers)
+    tic();
+    t_setup = funshade_sched_setup_batch(sched, 0, NULL, 0, K, l, 0, mat[0], mat[1], mat[2], mat[3],
+        mat[4], mat[5], mat[6], mat[7], k0, k1);
+    t_mask = funshade_sched_submit(sched, v_size, 4096, 0, mask_range, &m, sizeof(m), &t_setup, 1);
+    for (c=0; c<2; c++){
+        t_dist[c] = funshade_sched_eval_dist_batch(sched, 0, &t_mask, 1, K, l, c, mat[6+c], D_x, D_y,
+            mat[0+c], mat[2+c], mat[4+c], c ? zs_hat_1 : zs_hat_0);
+    }
+    t_sign = funshade_sched_eval_sign_batch(sched, 1, t_dist, 2, K, 0, k0, zs_hat_0, zs_hat_1, os_0);
+    t_collapse = funshade_sched_eval_sign_batch_collapse(sched, 2, t_dist, 2, K, 1, k1, zs_hat_0, zs_hat_1, &os1);
+    funshade_sched_wait(sched, t_collapse);
+    funshade_sched_wait(sched, t_sign);
+    funshade_sched_wait(sched, t_dist[1]);
+    funshade_sched_wait(sched, t_dist[0]);
+    funshade_sched_wait(sched, t_mask);
+    funshade_sched_wait(sched, t_setup);
+    t_graph += toc();
+
+    // Empty batches with a lane limit complete, alone and readied by a dependency
+    t_dist[0] = funshade_sched_eval_dist_batch(sched, 0, NULL, 0, K, l, 0, mat[6], D_x, D_y,
+        mat[0], mat[2], mat[4], zs_hat_0);
+    t_sign = funshade_sched_eval_sign_batch(sched, 2, t_dist, 1, 0, 0, k0, zs_hat_0, zs_hat_1, os_0);
+    t_collapse = funshade_sched_eval_sign_batch_collapse(sched, 1, NULL, 0, 0, 1, k1, zs_hat_0, zs_hat_1, &o_empty);
+    funshade_sched_wait(sched, t_collapse);
+    funshade_sched_wait(sched, t_sign);
+    funshade_sched_wait(sched, t_dist[0]);
+    correct &= (o_empty == 0);
+    funshade_sched_free(sched);
+
+    // Reference: the batch functions on the same keys and masks
+    funshade_eval_dist_batch(K, l, 0, mat[6], D_x, D_y, mat[0], mat[2], mat[4], z_hat_0);
+    funshade_eval_dist_batch(K, l, 1, mat[7], D_x, D_y, mat[1], mat[3], mat[5], z_hat_1);
+    correct &= (memcmp(z_hat_0, zs_hat_0, K*sizeof(R_t)) == 0);
+    correct &= (memcmp(z_hat_1, zs_hat_1, K*sizeof(R_t)) == 0);
+    funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+    o1 = funshade_eval_sign_batch_collapse(K, 1, k1, z_hat_0, z_hat_1);
+    correct &= (memcmp(o_0, os_0, K*sizeof(R_t)) == 0) && (o1 == os1);
+
+    printf("Test Funshade sched fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time scheduled graph:  %-5.0f (ns/key)\n", t_graph/K);
+    }
+    for (c=0; c<8; c++) free(mat[c]);
+    free(x); free(y); free(D_x); free(D_y); free(o_0); free(os_0); free(z_hat_0); free(z_hat_1);
+    free(zs_hat_0); free(zs_hat_1); free(k0); free(k1);
+    return correct;
+}
+#endif
+
+#ifdef FUNSHADE_HAS_MEM
+bool test_funshade_mem(size_t l, size_t K){
+    size_t v_size = l*K, c;
+    R_t *mat[8], *mm[6], *D_x = (R_t*)malloc(v_size*sizeof(R_t)), *D_y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),  *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *zm_hat_0 = (R_t*)malloc(K*sizeof(R_t)), *o_0 = (R_t*)malloc(K*sizeof(R_t)),
+        *om_0 = (R_t*)malloc(K*sizeof(R_t));
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN), *km0;
+    double t_malloc=0, t_mem=0;
+    int n_nodes = funshade_mem_bind_threads(0);
+    bool correct = (n_nodes != -1);
+#if defined(_OPENMP)
+    double t_nodes[2] = {0, 0};     // eval_sign on node 0, on all nodes
+#endif
+
+    for (c=0; c<8; c++){
+        mat[c] = (R_t*)malloc((c<6 ? v_size : K)*sizeof(R_t));
+    }
+    funshade_setup_batch(K, l, 0, mat[0], mat[1], mat[2], mat[3], mat[4], mat[5], mat[6], mat[7], k0, k1);
+    for (c=0; c<v_size; c++){
+        D_x[c] = random_dtype()/(2*l) + mat[0][c] + mat[1][c];
+        D_y[c] = random_dtype()/(2*l) + mat[2][c] + mat[3][c];
+    }
+    // Keys partitioned by rows, triples interleaved, same results as malloc
+    km0 = (uint8_t*)funshade_mem_alloc(K, KEY_LEN, FUNSHADE_MEM_PARTITION);
+    correct &= (km0 != NULL) && ((size_t)km0 % 64 == 0);
+    for (c=0; c<6; c++){
+        mm[c] = (R_t*)funshade_mem_alloc(K, l*sizeof(R_t), FUNSHADE_MEM_INTERLEAVE);
+        correct &= (mm[c] != NULL);
+        memcpy(mm[c], mat[c], v_size*sizeof(R_t));
+    }
+    memcpy(km0, k0, K*KEY_LEN);
+    funshade_eval_dist_batch(K, l, 0, mat[6], D_x, D_y, mat[0], mat[2], mat[4], z_hat_0);
+    funshade_eval_dist_batch(K, l, 1, mat[7], D_x, D_y, mat[1], mat[3], mat[5], z_hat_1);
+    funshade_eval_dist_batch(K, l, 0, mat[6], D_x, D_y, mm[0], mm[2], mm[4], zm_hat_0);
+    correct &= (memcmp(z_hat_0, zm_hat_0, K*sizeof(R_t)) == 0);
+    tic(); funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0); t_malloc += toc();
+    tic(); funshade_eval_sign_batch(K, 0, km0, z_hat_0, z_hat_1, om_0); t_mem += toc();
+    correct &= (memcmp(o_0, om_0, K*sizeof(R_t)) == 0);
+#if defined(_OPENMP)
+    // Scaling from one node to all: keys partitioned over the threads of node 0
+    //  only (as many as it has CPUs), then over the threads of every node
+    {
+        funshade_tuning def = *funshade_tuning_get(), t = def;
+        size_t n_max = (size_t)omp_get_max_threads();
+        uint8_t *km;
+        for (c=0; c<2; c++){
+            correct &= (funshade_mem_bind_threads(c ? 0 : 1) != -1);
+            t.n_threads = c ? n_max : CEIL(n_max, (size_t)n_nodes);
+            funshade_tuning_set(&t);
+            km = (uint8_t*)funshade_mem_alloc(K, KEY_LEN, FUNSHADE_MEM_PARTITION);
+            memcpy(km, k0, K*KEY_LEN);
+            tic(); funshade_eval_sign_batch(K, 0, km, z_hat_0, z_hat_1, om_0); t_nodes[c] += toc();
+            correct &= (memcmp(o_0, om_0, K*sizeof(R_t)) == 0);
+            funshade_mem_free(km);
+        }
+        funshade_tuning_set(&def);
+    }
+#endif
+    // Later tests run with the affinity they had before
+    correct &= (funshade_mem_unbind_threads() == 0);
+
+    printf("Test Funshade NUMA allocation fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - NUMA nodes: %d, key page size: %lu (B)\n", n_nodes, (unsigned long)funshade_mem_page_size(km0));
+        printf(" - Avg. time eval_sign malloc keys:  %-5.0f (ns/key)\n", t_malloc/K);
+        printf(" - Avg. time eval_sign placed keys:  %-5.0f (ns/key)\n", t_mem/K);
+#if defined(_OPENMP)
+        printf(" - Avg. time eval_sign on 1 node:    %-5.0f (ns/key)\n", t_nodes[0]/K);
+        printf(" - Avg. time eval_sign on %d node(s): %-5.0f (ns/key), x%.2f\n", n_nodes, t_nodes[1]/K,
+               t_nodes[0]/t_nodes[1]);
+#endif
+    }
+    for (c=0; c<6; c++) funshade_mem_free(mm[c]);
+    for (c=0; c<8; c++) free(mat[c]);
+    funshade_mem_free(km0);
+    free(D_x); free(D_y); free(z_hat_0); free(z_hat_1); free(zm_hat_0); free(o_0); free(om_0);
+    free(k0); free(k1);
+    return correct;
+}
+#endif
+
+#ifdef FUNSHADE_HAS_SHARD
+bool test_funshade_sharded(size_t l, size_t K, size_t n_shards){
+    size_t v_size = l*K, s, idx;
+    R_t *x     = (R_t*)malloc(v_size*sizeof(R_t)),   *y     = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x0  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y0  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x1  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y1  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_x   = (R_t*)malloc(v_size*sizeof(R_t)),   *D_y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_xy0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_xy1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *r_in_0= (R_t*)malloc(K*sizeof(R_t)),        *r_in_1= (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),      *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *zs_hat_0= (R_t*)malloc(K*sizeof(R_t)),      *zs_hat_1= (R_t*)malloc(K*sizeof(R_t)),
+        *o_0     = (R_t*)malloc(K*sizeof(R_t)),      *os_0    = (R_t*)malloc(K*sizeof(R_t)),
+        o0, o1, os0, os1;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    funshade_shard_t *shards0 = (funshade_shard_t*)malloc(n_shards*sizeof(funshade_shard_t)),
+                     *shards1 = (funshade_shard_t*)malloc(n_shards*sizeof(funshade_shard_t));
+    int *fds0 = (int*)malloc(n_shards*sizeof(int)), *fds1 = (int*)malloc(n_shards*sizeof(int));
+    pid_t *pids0 = (pid_t*)malloc(n_shards*sizeof(pid_t)), *pids1 = (pid_t*)malloc(n_shards*sizeof(pid_t));
+    size_t *K_s = (size_t*)malloc(n_shards*sizeof(size_t));
+    double t_eval_sp=0, t_eval_sign=0;
+    bool correct=true;
+
+    for (idx=0; idx<v_size; idx++){
+        x[idx] = random_dtype()/(2*l);
+        y[idx] = random_dtype()/(2*l);
+    }
+    funshade_setup_batch(K, l, 0, d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in_0, r_in_1, k0, k1);
+    for (idx=0; idx<v_size; idx++){
+        D_x[idx] = x[idx] + d_x0[idx] + d_x1[idx];
+        D_y[idx] = y[idx] + d_y0[idx] + d_y1[idx];
+    }
+    // Reference: single-process evaluation
+    funshade_eval_dist_batch(K, l, 0, r_in_0, D_x, D_y, d_x0, d_y0, d_xy0, z_hat_0);
+    funshade_eval_dist_batch(K, l, 1, r_in_1, D_x, D_y, d_x1, d_y1, d_xy1, z_hat_1);
+    funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+    o0 = funshade_eval_sign_batch_collapse(K, 0, k0, z_hat_0, z_hat_1);
+    o1 = funshade_eval_sign_batch_collapse(K, 1, k1, z_hat_0, z_hat_1);
+
+    // Sharded: each party spawns its own workers over Unix sockets
+    for (s=0; s<n_shards; s++){
+        funshade_shard_slice(K, l, n_shards, s, 0, r_in_0, D_y, d_x0, d_y0, d_xy0, k0, &shards0[s]);
+        funshade_shard_slice(K, l, n_shards, s, 1, r_in_1, D_y, d_x1, d_y1, d_xy1, k1, &shards1[s]);
+        K_s[s] = shards0[s].K;
+    }
+    correct &= (funshade_shard_spawn(n_shards, shards0, fds0, pids0) == 0);
+    correct &= (funshade_shard_spawn(n_shards, shards1, fds1, pids1) == 0);
+    tic(); correct &= (funshade_shard_eval_dist(n_shards, fds0, K_s, l, D_x, zs_hat_0) == 0); t_eval_sp += toc();
+    tic(); correct &= (funshade_shard_eval_dist(n_shards, fds1, K_s, l, D_x, zs_hat_1) == 0); t_eval_sp += toc();
+    correct &= (memcmp(z_hat_0, zs_hat_0, K*sizeof(R_t)) == 0);
+    correct &= (memcmp(z_hat_1, zs_hat_1, K*sizeof(R_t)) == 0);
+    correct &= (funshade_shard_eval_sign(n_shards, fds0, K_s, zs_hat_0, zs_hat_1, os_0) == 0);
+    correct &= (memcmp(o_0, os_0, K*sizeof(R_t)) == 0);
+    tic(); correct &= (funshade_shard_eval_sign_collapse(n_shards, fds0, K_s, zs_hat_0, zs_hat_1, &os0) == 0); t_eval_sign += toc();
+    tic(); correct &= (funshade_shard_eval_sign_collapse(n_shards, fds1, K_s, zs_hat_0, zs_hat_1, &os1) == 0); t_eval_sign += toc();
+    correct &= (o0 == os0) && (o1 == os1);
+    funshade_shard_close(n_shards, fds0, pids0);
+    funshade_shard_close(n_shards, fds1, pids1);
+    // A request of the wrong size gets an error reply, not a dropped connection
+    K_s[0] = shards0[0].K + 1;
+    correct &= (funshade_shard_spawn(1, shards0, fds0, pids0) == 0);
+    correct &= (funshade_shard_eval_dist(1, fds0, K_s, l, D_x, zs_hat_0) == -2);
+    funshade_shard_close(1, fds0, pids0);
+    // So does a request the shard has no material for, and the worker closes
+    K_s[0] = shards0[0].K;
+    shards0[0].D_y = NULL;
+    correct &= (funshade_shard_spawn(1, shards0, fds0, pids0) == 0);
+    correct &= (funshade_shard_eval_dist(1, fds0, K_s, l, D_x, zs_hat_0) == -2);
+    correct &= (funshade_shard_eval_sign(1, fds0, K_s, zs_hat_0, zs_hat_1, os_0) == -1);
+    funshade_shard_close(1, fds0, pids0);
+
+    printf("Test Funshade sharded fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time funshade_shard_eval_dist:  %-5.0f (ns)\n", t_eval_sp/2);
+        printf(" - Avg. time funshade_shard_eval_sign:  %-5.0f (ns)\n", t_eval_sign/2);
+    }
+    free(x); free(y); free(d_x0); free(d_x1); free(d_y0); free(d_y1); free(D_x); free(D_y);
+    free(d_xy0); free(d_xy1); free(r_in_0); free(r_in_1); free(z_hat_0); free(z_hat_1);
+    free(zs_hat_0); free(zs_hat_1); free(o_0); free(os_0); free(k0); free(k1);
+    free(shards0); free(shards1); free(fds0); free(fds1); free(pids0); free(pids1); free(K_s);
+    return correct;
+}
+#endif
+
+#ifdef FUNSHADE_HAS_CHAN
+// One party of test_funshade_chan: z_hat_j is computed in place in the ring,
+//  the peer's z_hat is evaluated in place too. Returns the collapsed o_j.
+static R_t chan_party(funshade_chan *ch, size_t K, size_t l, bool j, const R_t r_in_j[],
+                      const R_t D_x[], const R_t D_y[], const R_t d_xj[], const R_t d_yj[],
+                      const R_t d_xyj[], const uint8_t kj[]){
+    R_t *own = (R_t*)funshade_chan_reserve(ch, K*sizeof(R_t)), o;
+    const R_t *peer;
+    size_t len;
+    funshade_eval_dist_batch(K, l, j, r_in_j, D_x, D_y, d_xj, d_yj, d_xyj, own);
+    funshade_chan_commit(ch);
+    peer = (const R_t*)funshade_chan_recv(ch, &len, -1);
+    o = j ? funshade_eval_sign_batch_collapse(K, 1, kj, peer, own)
+          : funshade_eval_sign_batch_collapse(K, 0, kj, own, peer);
+    funshade_chan_release(ch);
+    return o;
+}
+
+bool test_funshade_chan(size_t l, size_t K, size_t n_msgs){
+    size_t v_size = l*K, idx, len, rlen, max_len;
+    R_t *x     = (R_t*)malloc(v_size*sizeof(R_t)),   *y     = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x0  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y0  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x1  = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y1  = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_x   = (R_t*)malloc(v_size*sizeof(R_t)),   *D_y   = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_xy0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_xy1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *r_in_0= (R_t*)malloc(K*sizeof(R_t)),        *r_in_1= (R_t*)malloc(K*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),      *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        o0, o1, oc0, oc1 = 0;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN), *msg;
+    const uint8_t *in;
+    funshade_chan *ch = funshade_chan_create(NULL, 4*K*sizeof(R_t)), *peer;
+    pid_t pid;
+    int status = 1;
+    double t_rtt = 0;
+    bool correct = (ch != NULL);
+
+    for (idx=0; idx<v_size; idx++){
+        x[idx] = random_dtype()/(2*l);
+        y[idx] = random_dtype()/(2*l);
+    }
+    funshade_setup_batch(K, l, 0, d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in_0, r_in_1, k0, k1);
+    for (idx=0; idx<v_size; idx++){
+        D_x[idx] = x[idx] + d_x0[idx] + d_x1[idx];
+        D_y[idx] = y[idx] + d_y0[idx] + d_y1[idx];
+    }
+    // Reference: both parties in one process
+    funshade_eval_dist_batch(K, l, 0, r_in_0, D_x, D_y, d_x0, d_y0, d_xy0, z_hat_0);
+    funshade_eval_dist_batch(K, l, 1, r_in_1, D_x, D_y, d_x1, d_y1, d_xy1, z_hat_1);
+    o0 = funshade_eval_sign_batch_collapse(K, 0, k0, z_hat_0, z_hat_1);
+    o1 = funshade_eval_sign_batch_collapse(K, 1, k1, z_hat_0, z_hat_1);
+    if (!correct)   goto end;
+    max_len = funshade_chan_max_msg(ch);
+
+    pid = fork();
+    if (pid == 0){      // party 1: joins through the inherited fd
+        peer = funshade_chan_attach(funshade_chan_fd(ch));
+        if (peer == NULL)   _exit(1);
+        oc1 = chan_party(peer, K, l, 1, r_in_1, D_x, D_y, d_x1, d_y1, d_xy1, k1);
+        funshade_chan_send(peer, &oc1, sizeof(R_t));
+        while ((in = (const uint8_t*)funshade_chan_recv(peer, &len, -1)) != NULL){     // echo
+            msg = (uint8_t*)funshade_chan_reserve(peer, len);
+            memcpy(msg, in, len);
+            funshade_chan_release(peer);
+            funshade_chan_commit(peer);
+        }
+        funshade_chan_close(peer);
+        _exit(0);
+    }
+    oc0 = chan_party(ch, K, l, 0, r_in_0, D_x, D_y, d_x0, d_y0, d_xy0, k0);
+    in = (const uint8_t*)funshade_chan_recv(ch, &len, -1);
+    correct &= (in != NULL) && (len == sizeof(R_t));
+    if (in != NULL){
+        memcpy(&oc1, in, sizeof(R_t));
+        funshade_chan_release(ch);
+    }
+    correct &= (oc0 == o0) && (oc1 == o1);
+
+    // Echo messages of all sizes, wrapping around the ring many times
+    for (idx=0; idx<n_msgs && correct; idx++){
+        len = (idx*2654435761u) % (max_len + 1);
+        msg = (uint8_t*)funshade_chan_reserve(ch, len);
+        correct &= (msg != NULL) && (((uintptr_t)msg % CHAN_ALIGN) == 0);
+        if (!correct)   break;
+        memset(msg, (int)(idx & 0xFF), len);
+        tic(); funshade_chan_commit(ch);
+        in = (const uint8_t*)funshade_chan_recv(ch, &rlen, -1); t_rtt += toc();
+        correct &= (in != NULL) && (rlen == len) && (len == 0 || (in[0] == (idx & 0xFF) && in[len-1] == (idx & 0xFF)));
+        if (in != NULL)     funshade_chan_release(ch);
+    }
+    correct &= (funshade_chan_reserve(ch, max_len + 1) == NULL);
+    correct &= (funshade_chan_recv(ch, &len, 10) == NULL);      // nothing sent: times out
+    funshade_chan_close(ch);
+
+    // Records are checked: a length over the limit, or past what was published
+    ch = funshade_chan_create(NULL, 4096);
+    peer = ch ? funshade_chan_attach(dup(funshade_chan_fd(ch))) : NULL;
+    correct &= (peer != NULL);
+    if (peer != NULL){
+        msg = (uint8_t*)funshade_chan_reserve(ch, 8);
+        *(uint64_t*)(msg - CHAN_ALIGN) = funshade_chan_max_msg(ch) + 1;
+        funshade_chan_commit(ch);
+        correct &= (funshade_chan_recv(peer, &len, 0) == NULL) && (len == CHAN_BAD_MSG);
+        *(uint64_t*)(msg - CHAN_ALIGN) = funshade_chan_max_msg(ch);
+        correct &= (funshade_chan_recv(peer, &len, 0) == NULL) && (len == CHAN_BAD_MSG);
+        *(uint64_t*)(msg - CHAN_ALIGN) = 8;                     // nothing was consumed
+        correct &= (funshade_chan_recv(peer, &len, 0) != NULL) && (len == 8);
+        funshade_chan_close(peer);
+    }
+    funshade_chan_close(ch);
+    waitpid(pid, &status, 0);
+    correct &= WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+
+end:
+    printf("Test Funshade shared-memory channel fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. round trip funshade_chan:       %-5.0f (ns)\n", t_rtt/n_msgs);
+    }
+    free(x); free(y); free(d_x0); free(d_x1); free(d_y0); free(d_y1); free(D_x); free(D_y);
+    free(d_xy0); free(d_xy1); free(r_in_0); free(r_in_1); free(z_hat_0); free(z_hat_1);
+    free(k0); free(k1);
+    return correct;
+}
+#endif
+
+
+#ifdef FUNSHADE_HAS_DEALER
+// Read a whole party stream written by funshade_deal_stream into K-sized arrays
+static bool deal_read_all(int fd, int fd_cw, size_t K, size_t l, bool j, R_t r_in_j[],
+                          R_t d_xj[], R_t d_yj[], R_t d_xyj[], uint8_t k_j[]){
+    funshade_deal_reader rd;
+    size_t done = 0, n = 1;
+    bool ok = (funshade_deal_open(&rd, fd, fd_cw) == 0) && (rd.K == K) && (rd.l == l) && (rd.j == j);
+    while (ok && n > 0){
+        ok = (funshade_deal_read(&rd, &n, &r_in_j[done], &d_xj[done*l], &d_yj[done*l],
+                                 &d_xyj[done*l], &k_j[done*KEY_LEN]) == 0) && (done + n <= K);
+        done += n;
+    }
+    funshade_deal_close(&rd);
+    return ok && (done == K);
+}
+
+bool test_funshade_dealer(size_t l, size_t K, size_t chunk){
+    size_t v_size = l*K, idx, k, m;
+    R_t *mat[8], *x = (R_t*)malloc(v_size*sizeof(R_t)), *y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *D_x = (R_t*)malloc(v_size*sizeof(R_t)), *D_y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)), *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0 = (R_t*)malloc(K*sizeof(R_t)), *o_1 = (R_t*)malloc(K*sizeof(R_t)), z, theta = 100;
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    FILE *f[3];
+    int fd[3], sep;
+    off_t len[3] = {0};
+    double t_deal = 0;
+    bool correct = true;
+
+    for (m=0; m<8; m++)     mat[m] = (R_t*)malloc((m<6 ? v_size : K)*sizeof(R_t));
+    for (idx=0; idx<v_size; idx++){
+        x[idx] = (R_t)(idx*2654435761u) % 1024;
+        y[idx] = (R_t)(idx*40503u + 7) % 1024 - 512;
+    }
+    // Chains inline in both party streams (sep=0), then in their own stream (sep=1)
+    for (sep=0; sep<2; sep++){
+        for (m=0; m<3; m++){
+            f[m] = tmpfile();
+            fd[m] = f[m] ? fileno(f[m]) : -1;
+            correct &= (f[m] != NULL);
+        }
+        if (!correct)   break;
+        tic(); correct &= (funshade_deal_stream(K, l, theta, chunk, fd[0], fd[1], sep ? fd[2] : -1) == 0); t_deal += toc();
+        for (m=0; m<3; m++){
+            len[m] = lseek(fd[m], 0, SEEK_END);
+            lseek(fd[m], 0, SEEK_SET);
+        }
+        // Each party reads the chain stream from the start
+        correct &= deal_read_all(fd[0], fd[2], K, l, 0, mat[6], mat[0], mat[2], mat[4], k0);
+        lseek(fd[2], 0, SEEK_SET);
+        correct &= deal_read_all(fd[1], fd[2], K, l, 1, mat[7], mat[1], mat[3], mat[5], k1);
+        // The chains are shared: only the seeds and z differ
+        for (k=0; k<K; k++){
+            correct &= (memcmp(&k0[k*KEY_LEN+CW_CHAIN_PTR], &k1[k*KEY_LEN+CW_CHAIN_PTR], CW_CHAIN_LEN) == 0);
+        }
+        // The streamed material runs the protocol
+        for (idx=0; idx<v_size; idx++){
+            D_x[idx] = x[idx] + mat[0][idx] + mat[1][idx];
+            D_y[idx] = y[idx] + mat[2][idx] + mat[3][idx];
+        }
+        funshade_eval_dist_batch(K, l, 0, mat[6], D_x, D_y, mat[0], mat[2], mat[4], z_hat_0);
+        funshade_eval_dist_batch(K, l, 1, mat[7], D_x, D_y, mat[1], mat[3], mat[5], z_hat_1);
+        funshade_eval_sign_batch(K, 0, k0, z_hat_0, z_hat_1, o_0);
+        funshade_eval_sign_batch(K, 1, k1, z_hat_0, z_hat_1, o_1);
+        for (k=0; k<K; k++){
+            for (z=0, idx=k*l; idx<(k+1)*l; idx++)  z += x[idx]*y[idx];
+            correct &= (o_0[k] + o_1[k] == (z >= theta));
+        }
+        // Truncated streams are rejected
+        lseek(fd[0], 0, SEEK_SET);  lseek(fd[2], 0, SEEK_SET);
+        correct &= (ftruncate(fd[0], len[0]/2) == 0) && !deal_read_all(fd[0], fd[2], K, l, 0, mat[6], mat[0], mat[2], mat[4], k0);
+        for (m=0; m<3; m++)     fclose(f[m]);
+    }
+
+    printf("Test Funshade streaming dealer fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        printf(" - Avg. time funshade_deal_stream:      %-5.0f (ns)\n", t_deal/(2*K));
+        printf(" - Bytes per element: %.0f per party + %.0f of chains, vs %lu per party\n",
+            (double)len[0]/K, (double)len[2]/K, (unsigned long)((1+3*l)*sizeof(R_t) + KEY_LEN));
+    }
+    for (m=0; m<8; m++)     free(mat[m]);
+    free(x); free(y); free(D_x); free(D_y); free(z_hat_0); free(z_hat_1); free(o_0); free(o_1);
+    free(k0); free(k1);
+    return correct;
+}
+#endif
+
 
 // ------------------------------ MAIN -------------------------------------- //
+#ifdef FUNSHADE_HAS_REPLAY
+bool test_replay(size_t l, size_t K, size_t n_rounds){
+    // Skewed mix of batch sizes recorded, saved, and replayed at several speeds
+    size_t v_size = l*K, r, i, n, n_loaded, sizes[3], elements = 0;
+    R_t *x = (R_t*)malloc(l*sizeof(R_t)),           *y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_x0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_x1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_y0 = (R_t*)malloc(v_size*sizeof(R_t)),   *d_y1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *d_xy0 = (R_t*)malloc(v_size*sizeof(R_t)),  *d_xy1 = (R_t*)malloc(v_size*sizeof(R_t)),
+        *r_in0 = (R_t*)malloc(K*sizeof(R_t)),       *r_in1 = (R_t*)malloc(K*sizeof(R_t)),
+        *D_x = (R_t*)malloc(v_size*sizeof(R_t)),    *D_y = (R_t*)malloc(v_size*sizeof(R_t)),
+        *z_hat_0 = (R_t*)malloc(K*sizeof(R_t)),     *z_hat_1 = (R_t*)malloc(K*sizeof(R_t)),
+        *o_0 = (R_t*)malloc(K*sizeof(R_t));
+    uint8_t *k0 = (uint8_t*)malloc(K*KEY_LEN), *k1 = (uint8_t*)malloc(K*KEY_LEN);
+    const funshade_trace_call *log;
+    funshade_trace_call *loaded = NULL;
+    funshade_replay_report rep[3];
+    double speeds[3] = {0.5, 1, 1e6};
+    const char *path = "funshade_replay_test.bin";
+    int sat;
+    bool correct = true;
+
+    sizes[0] = 1;   sizes[1] = K/10 ? K/10 : 1;     sizes[2] = K;
+    random_buffer((uint8_t*)x, l*sizeof(R_t));  random_buffer((uint8_t*)y, v_size*sizeof(R_t));
+    funshade_setup_batch(K, l, 0, d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in0, r_in1, k0, k1);
+    funshade_share_batch(K, l, y, d_y0, D_y);
+    funshade_share_broadcast_batch(K, l, x, d_x0, D_x);
+    funshade_trace_reset();
+    funshade_trace_enable(FUNSHADE_TRACE_CALLS);
+    for (r=0; r<n_rounds; r++){
+        funshade_eval_dist_batch(sizes[r%3], l, 0, r_in0, D_x, D_y, d_x0, d_y0, d_xy0, z_hat_0);
+        funshade_eval_dist_batch(sizes[r%3], l, 1, r_in1, D_x, D_y, d_x1, d_y1, d_xy1, z_hat_1);
+        funshade_eval_sign_batch(sizes[r%3], 0, k0, z_hat_0, z_hat_1, o_0);
+        funshade_eval_sign_batch_collapse(sizes[r%3], 1, k1, z_hat_0, z_hat_1);
+        elements += 4*sizes[r%3];
+    }
+    funshade_trace_enable(0);
+    // One entry per call, with its sizes, in call order on a single thread
+    n = funshade_trace_calls_get(&log);
+    correct &= (n == 4*n_rounds);
+    for (i=0; i<n && correct; i++){
+        correct &= (log[i].K == sizes[(i/4)%3]) && (log[i].thread == log[0].thread);
+        correct &= (log[i].stage == (i%4 < 2 ? FUNSHADE_STAGE_EVAL_DIST : i%4 == 2 ? FUNSHADE_STAGE_EVAL_SIGN
+                                                                        : FUNSHADE_STAGE_COLLAPSE));
+        correct &= (log[i].l == (i%4 < 2 ? l : 0)) && (i == 0 || log[i].t >= log[i-1].t + log[i-1].dur);
+    }
+    // Saved and loaded unchanged (already in start order)
+    correct &= (funshade_replay_save(path, log, n) == 0) && (funshade_replay_load(path, &loaded, &n_loaded) == 0);
+    correct &= loaded && (n_loaded == n) && (memcmp(loaded, log, n*sizeof(funshade_trace_call)) == 0);
+    remove(path);
+    free(loaded);
+    correct &= (funshade_replay_load(path, &loaded, &n_loaded) == -1) && (loaded == NULL);
+    correct &= (funshade_replay_save(path, log, n) == 0) && (funshade_replay_load(path, &loaded, &n_loaded) == 0);
+    remove(path);
+    // Released all at once, the workers cannot keep up with the offered load.
+    //  The replayed calls are not logged, the calls of other threads still are
+    funshade_trace_enable(FUNSHADE_TRACE_CALLS);
+    sat = funshade_replay_sweep(loaded, n_loaded, speeds, 3, 2, rep);
+    correct &= (sat >= -1) && (sat < 2);
+    correct &= (funshade_trace_flags == FUNSHADE_TRACE_CALLS) && (funshade_trace_calls_get(&log) == n);
+    funshade_eval_sign_batch(sizes[0], 0, k0, z_hat_0, z_hat_1, o_0);
+    correct &= (funshade_trace_calls_get(&log) == n + 1);
+    funshade_trace_enable(0);
+    for (i=0; i<3; i++){
+        correct &= (rep[i].n_calls == n) && (rep[i].elements == elements) && (rep[i].speed == speeds[i]);
+        correct &= (rep[i].offered > 0) && (rep[i].throughput > 0) && (rep[i].duration > 0);
+        correct &= (rep[i].p50 <= rep[i].p90) && (rep[i].p90 <= rep[i].p99) && (rep[i].p99 <= rep[i].p999)
+                && (rep[i].p999 <= rep[i].max);
+    }
+    correct &= (funshade_replay_run(loaded, n_loaded, 0, 1, rep) == -1);
+    printf("Test replay fully correct: %s\n", correct ? "true" : "false");
+    if (TIMEIT){
+        for (i=0; i<3; i++){
+            printf(" - Replay x%-6g offered %-9.0f done %-9.0f (calls/s), p50 %-8lu p99 %-8lu (ns)%s\n",
+                rep[i].speed, rep[i].offered, rep[i].throughput, (unsigned long)rep[i].p50,
+                (unsigned long)rep[i].p99, (int)i == sat ? " <- saturation" : "");
+        }
+    }
+    free(loaded);
+    free(x); free(y); free(d_x0); free(d_x1); free(d_y0); free(d_y1); free(d_xy0); free(d_xy1);
+    free(r_in0); free(r_in1); free(D_x); free(D_y); free(z_hat_0); free(z_hat_1); free(o_0);
+    free(k0); free(k1);
+    return correct;
+}
+#endif
+
 int main() {
     bool correct=true;
     correct &= test_aes(N_REPETITIONS);
     correct &= test_dcf(N_REPETITIONS);
     correct &= test_ic(N_REPETITIONS);
+    correct &= test_ic_ring(100*N_REPETITIONS);
+    correct &= test_dcf_ic_batch(N_REF_DB/10);
+    correct &= test_dpf(N_REPETITIONS, N_REF_DB/10);
+    correct &= test_spline(N_REF_DB/10);
+    correct &= test_reduced_domain(N_REPETITIONS, N_REF_DB/10);
     correct &= test_funshade(N_REPETITIONS, 1);
     correct &= test_funshade(N_REPETITIONS, EMBEDDING_LEN);
     correct &= test_funshade_batch(N_REPETITIONS, EMBEDDING_LEN, N_REF_DB);
+    correct &= test_derived(EMBEDDING_LEN, N_REF_DB/10);
+    correct &= test_metrics(17, N_REF_DB/10);
+    correct &= test_db_refresh(EMBEDDING_LEN, N_REF_DB/10, 4);
+    correct &= test_funshade_quantized(EMBEDDING_LEN, N_REF_DB/10);
+    correct &= test_share_float(EMBEDDING_LEN, N_REF_DB);
+    correct &= test_funshade_matrix(EMBEDDING_LEN, 16, N_REF_DB/10);
+    correct &= test_funshade_ctx(N_REPETITIONS, EMBEDDING_LEN, N_REF_DB/10);
+    correct &= test_level_major(N_REPETITIONS, N_REF_DB/10);
+#ifdef USE_CPP_ENGINE
+    correct &= test_cpp_engine(N_REPETITIONS);
+#endif
+    correct &= test_tune(N_REF_DB/10);
+    correct &= test_trace(EMBEDDING_LEN, N_REF_DB/10);
+#ifdef FUNSHADE_HAS_POOL
+    correct &= test_funshade_pool(EMBEDDING_LEN, N_REF_DB/10, 7);
+#endif
+#ifdef FUNSHADE_HAS_SCHED
+    correct &= test_funshade_sched(EMBEDDING_LEN, N_REF_DB/10);
+#endif
+#ifdef FUNSHADE_HAS_MEM
+    correct &= test_funshade_mem(EMBEDDING_LEN, N_REF_DB);
+#endif
+#ifdef FUNSHADE_HAS_SHARD
+    correct &= test_funshade_sharded(EMBEDDING_LEN, N_REF_DB/10, 3);
+#endif
+#ifdef FUNSHADE_HAS_CHAN
+    correct &= test_funshade_chan(EMBEDDING_LEN, N_REF_DB/10, 1000);
+#endif
+#ifdef FUNSHADE_HAS_DEALER
+    correct &= test_funshade_dealer(EMBEDDING_LEN, N_REF_DB/10, 7);
+#endif
+#ifdef FUNSHADE_HAS_REPLAY
+    correct &= test_replay(EMBEDDING_LEN, N_REF_DB/10, 12);
+#endif
     if (correct)
     {
         printf("All Tests passed. \n");
@@ -0,0 +1,289 @@
+#define _POSIX_C_SOURCE 199309L // clock_gettime, CLOCK_MONOTONIC
+#include "trace.h"
+#include <stdio.h>      // FILE, fprintf
+#include <stdlib.h>     // calloc, free
+#include <string.h>     // memset
+#include <time.h>       // clock_gettime, clock
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+#define TRACE_SUB_BITS  5                                       // 32 buckets per power of two
+#define TRACE_SUB       (1 << TRACE_SUB_BITS)
+#define TRACE_MAX_BITS  40                                      // Values up to 2^40 ns
+#define TRACE_BUCKETS   ((TRACE_MAX_BITS - TRACE_SUB_BITS + 1) * TRACE_SUB)
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    #define TRACE_TLS               __declspec(thread)
+    #define TRACE_FETCH_ADD(p, v)   _InterlockedExchangeAdd((volatile long*)(p), (v))
+#else
+    #define TRACE_TLS               __thread
+    #define TRACE_FETCH_ADD(p, v)   __sync_fetch_and_add((p), (v))
+#endif
+
+typedef struct {
+    uint64_t t_begin, t_end;
+    int stage;
+} trace_event;
+
+typedef struct {
+    uint32_t    hist[FUNSHADE_N_STAGES][TRACE_BUCKETS];
+    uint64_t    count[FUNSHADE_N_STAGES], sum[FUNSHADE_N_STAGES];
+    uint64_t    min[FUNSHADE_N_STAGES], max[FUNSHADE_N_STAGES];
+    trace_event *events;            // TRACE_EVENTS_PER_THREAD ring, allocated on demand
+    uint64_t    n_events;           // events written (ring index: n_events % size)
+} trace_slot;
+
+volatile int funshade_trace_flags = 0;
+static trace_slot *volatile slots[TRACE_MAX_THREADS];
+static volatile long n_slots = 0;
+static uint64_t epoch = 0;          // time origin of the Chrome traces
+static TRACE_TLS int my_slot = -1;  // TRACE_MAX_THREADS: no slot left, records dropped
+static volatile long n_dropped = 0;
+static TRACE_TLS int calls_paused = 0;      // FUNSHADE_TRACE_CALLS skipped on this thread
+static funshade_trace_call *calls = NULL;   // TRACE_CALLS_MAX log, allocated on demand
+static volatile long n_calls = 0;           // calls logged (or dropped past TRACE_CALLS_MAX)
+
+static const char *stage_names[FUNSHADE_N_STAGES] = {
+    "share", "eval_dist", "exchange", "eval_sign", "collapse"
+};
+
+// Bucket of a value: exact below TRACE_SUB, then TRACE_SUB per power of two
+static size_t bucket_of(uint64_t v){
+    int e = 0;
+    uint64_t x;
+    if (v < TRACE_SUB)  return (size_t)v;
+    if (v >= ((uint64_t)1 << TRACE_MAX_BITS))   v = ((uint64_t)1 << TRACE_MAX_BITS) - 1;
+    for (x = v; x >>= 1; )  e++;                // e = msb(v) >= TRACE_SUB_BITS
+    return (size_t)(e - TRACE_SUB_BITS + 1) * TRACE_SUB + ((v >> (e - TRACE_SUB_BITS)) & (TRACE_SUB - 1));
+}
+
+// Largest value of a bucket
+static uint64_t bucket_top(size_t b){
+    size_t e = b / TRACE_SUB, sub = b % TRACE_SUB;
+    if (e == 0)     return (uint64_t)b;
+    e += TRACE_SUB_BITS - 1;
+    return (((uint64_t)(TRACE_SUB + sub + 1)) << (e - TRACE_SUB_BITS)) - 1;
+}
+
+// Slot of the calling thread, owned by it alone so that its counters need no
+//  atomics. NULL for threads past TRACE_MAX_THREADS.
+static trace_slot *get_slot(void){
+    trace_slot *s;
+    int i = my_slot;
+    if (i < 0)
+    {
+        i = (int)TRACE_FETCH_ADD(&n_slots, 1);
+        if (i >= TRACE_MAX_THREADS) i = TRACE_MAX_THREADS;
+        my_slot = i;
+    }
+    if (i == TRACE_MAX_THREADS)     return NULL;
+    if ((s = slots[i]) == NULL)
+    {
+        if ((s = (trace_slot*)calloc(1, sizeof(trace_slot))) == NULL)   return NULL;
+        slots[i] = s;
+    }
+    if ((funshade_trace_flags & FUNSHADE_TRACE_EVENTS) && s->events == NULL)
+    {
+        s->events = (trace_event*)malloc(TRACE_EVENTS_PER_THREAD*sizeof(trace_event));
+    }
+    return s;
+}
+
+// Aggregated histogram of a stage over one or all threads. Returns the count.
+static uint64_t merge(funshade_stage stage, int thread, uint64_t hist[TRACE_BUCKETS],
+    uint64_t *sum, uint64_t *min, uint64_t *max){
+    size_t t, b, n = funshade_trace_threads();
+    uint64_t count = 0;
+    trace_slot *s;
+    memset(hist, 0, TRACE_BUCKETS*sizeof(uint64_t));
+    *sum = 0;   *min = UINT64_MAX;  *max = 0;
+    for (t = 0; t < n; t++)
+    {
+        if ((thread >= 0 && (size_t)thread != t) || (s = slots[t]) == NULL || s->count[stage] == 0)
+        {
+            continue;
+        }
+        for (b = 0; b < TRACE_BUCKETS; b++)     hist[b] += s->hist[stage][b];
+        count += s->count[stage];   *sum += s->sum[stage];
+        if (s->min[stage] < *min)   *min = s->min[stage];
+        if (s->max[stage] > *max)   *max = s->max[stage];
+    }
+    return count;
+}
+
+static uint64_t quantile(const uint64_t hist[TRACE_BUCKETS], uint64_t count, uint64_t max, double q){
+    uint64_t target = (uint64_t)(q*(double)count), acc = 0, top;     // ceil(q*count), >= 1
+    size_t b;
+    if ((double)target < q*(double)count || target == 0)    target++;
+    for (b = 0; b < TRACE_BUCKETS; b++)
+    {
+        acc += hist[b];
+        if (acc >= target)
+        {
+            top = bucket_top(b);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+uint64_t funshade_trace_now(void){
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+#else
+    return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+void funshade_trace_enable(int flags){
+    if (flags && epoch == 0)    epoch = funshade_trace_now();
+    if ((flags & FUNSHADE_TRACE_CALLS) && calls == NULL)
+    {
+        calls = (funshade_trace_call*)malloc(TRACE_CALLS_MAX*sizeof(funshade_trace_call));
+        if (calls == NULL)  flags &= ~FUNSHADE_TRACE_CALLS;
+    }
+    funshade_trace_flags = flags;
+}
+
+void funshade_trace_reset(void){
+    size_t t, n = funshade_trace_threads();
+    trace_event *events;
+    for (t = 0; t < n; t++)
+    {
+        if (slots[t] == NULL)   continue;
+        events = slots[t]->events;
+        memset(slots[t], 0, sizeof(trace_slot));
+        slots[t]->events = events;
+    }
+    n_calls = 0;
+    n_dropped = 0;
+    epoch = funshade_trace_now();
+}
+
+void funshade_trace_record(funshade_stage stage, uint64_t t_begin, uint64_t t_end){
+    uint64_t dt = (t_end > t_begin) ? t_end - t_begin : 0;
+    trace_slot *s;
+    trace_event *e;
+    if (!funshade_trace_flags || (unsigned)stage >= FUNSHADE_N_STAGES)  return;
+    if ((s = get_slot()) == NULL)
+    {
+        TRACE_FETCH_ADD(&n_dropped, 1);
+        return;
+    }
+    s->hist[stage][bucket_of(dt)]++;
+    if (s->count[stage] == 0 || dt < s->min[stage])     s->min[stage] = dt;
+    if (dt > s->max[stage])                             s->max[stage] = dt;
+    s->count[stage]++;
+    s->sum[stage] += dt;
+    if ((funshade_trace_flags & FUNSHADE_TRACE_EVENTS) && s->events != NULL)
+    {
+        e = &s->events[s->n_events++ % TRACE_EVENTS_PER_THREAD];
+        e->t_begin = t_begin;   e->t_end = t_end;   e->stage = (int)stage;
+    }
+}
+
+void funshade_trace_record_call(funshade_stage stage, size_t K, size_t l, uint64_t t_begin, uint64_t t_end){
+    long i;
+    funshade_trace_call *c;
+    funshade_trace_record(stage, t_begin, t_end);
+    if (!(funshade_trace_flags & FUNSHADE_TRACE_CALLS) || calls == NULL || calls_paused ||
+        my_slot < 0 || my_slot == TRACE_MAX_THREADS)
+    {
+        return;
+    }
+    if ((i = TRACE_FETCH_ADD(&n_calls, 1)) >= TRACE_CALLS_MAX)
+    {
+        n_calls = TRACE_CALLS_MAX;      // keep the counter from wrapping
+        return;
+    }
+    c = &calls[i];
+    c->t = t_begin - epoch;
+    c->dur = (t_end - t_begin > UINT32_MAX) ? UINT32_MAX : (uint32_t)(t_end - t_begin);
+    c->K = (K > UINT32_MAX) ? UINT32_MAX : (uint32_t)K;
+    c->l = (l > UINT32_MAX) ? UINT32_MAX : (uint32_t)l;
+    c->stage = (uint16_t)stage;
+    c->thread = (uint16_t)my_slot;
+}
+
+int funshade_trace_calls_pause(int pause){
+    int was = calls_paused;
+    calls_paused = pause;
+    return was;
+}
+
+size_t funshade_trace_calls_get(const funshade_trace_call **log){
+    long n = n_calls;
+    *log = calls;
+    return (calls == NULL) ? 0 : (size_t)(n < TRACE_CALLS_MAX ? n : TRACE_CALLS_MAX);
+}
+
+size_t funshade_trace_threads(void){
+    long n = n_slots;
+    return (size_t)(n < TRACE_MAX_THREADS ? n : TRACE_MAX_THREADS);
+}
+
+size_t funshade_trace_dropped(void){
+    return (size_t)n_dropped;
+}
+
+int funshade_trace_stats_get(funshade_stage stage, int thread, funshade_trace_stats *st){
+    static TRACE_TLS uint64_t hist[TRACE_BUCKETS];
+    uint64_t sum, min, max, count;
+    if ((unsigned)stage >= FUNSHADE_N_STAGES)   return -1;
+    count = merge(stage, thread, hist, &sum, &min, &max);
+    memset(st, 0, sizeof(funshade_trace_stats));
+    if (count == 0)     return -1;
+    st->count = count;  st->min = min;  st->max = max;
+    st->mean = (double)sum / (double)count;
+    st->p50  = quantile(hist, count, max, 0.50);
+    st->p90  = quantile(hist, count, max, 0.90);
+    st->p99  = quantile(hist, count, max, 0.99);
+    st->p999 = quantile(hist, count, max, 0.999);
+    return 0;
+}
+
+uint64_t funshade_trace_percentile(funshade_stage stage, int thread, double q){
+    static TRACE_TLS uint64_t hist[TRACE_BUCKETS];
+    uint64_t sum, min, max, count;
+    if ((unsigned)stage >= FUNSHADE_N_STAGES)   return 0;
+    count = merge(stage, thread, hist, &sum, &min, &max);
+    return count ? quantile(hist, count, max, q) : 0;
+}
+
+int funshade_trace_dump_chrome(const char *path){
+    size_t t, n = funshade_trace_threads();
+    uint64_t i, first;
+    int err = 0, sep = 0;
+    const trace_event *e;
+    trace_slot *s;
+    FILE *f = fopen(path, "w");
+    if (f == NULL)  return -1;
+    fprintf(f, "{\"traceEvents\":[");
+    for (t = 0; t < n; t++)
+    {
+        if ((s = slots[t]) == NULL || s->events == NULL)    continue;
+        first = (s->n_events > TRACE_EVENTS_PER_THREAD) ? s->n_events - TRACE_EVENTS_PER_THREAD : 0;
+        for (i = first; i < s->n_events; i++)
+        {
+            e = &s->events[i % TRACE_EVENTS_PER_THREAD];
+            err |= fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                sep ? "," : "", stage_names[e->stage], (unsigned long)t,
+                (double)(int64_t)(e->t_begin - epoch)/1e3, (double)(e->t_end - e->t_begin)/1e3) < 0;
+            sep = 1;
+        }
+    }
+    err |= fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n") < 0;
+    err |= (fclose(f) != 0);
+    return err ? -1 : 0;
+}
+
+const char *funshade_trace_stage_name(funshade_stage stage){
+    return ((unsigned)stage < FUNSHADE_N_STAGES) ? stage_names[stage] : "unknown";
+}
@@ -0,0 +1,121 @@
+// TRACE: Per-stage latency histograms and Chrome traces of the online phase
+// -----------------------------------------------------------------------------
+// When enabled, the online batch functions (share, eval_dist, eval_sign,
+//  eval_sign collapse) time each call with CLOCK_MONOTONIC and add it to a
+//  per-thread, per-stage log-linear histogram (HDR-style: 2^TRACE_SUB_BITS
+//  buckets per power of two, ~3% relative error, 1 ns to ~18 min). Stages
+//  outside the library, like waiting for the peer's z_hat, are recorded by the
+//  caller with funshade_trace_now/funshade_trace_record.
+//
+// Percentiles are computed on demand, per thread or over all threads. With
+//  FUNSHADE_TRACE_EVENTS, the last TRACE_EVENTS_PER_THREAD calls of each thread
+//  are also kept and can be dumped as Chrome trace JSON (chrome://tracing,
+//  Perfetto), which shows where OpenMP barriers stretch the tail.
+//
+// With FUNSHADE_TRACE_CALLS, the calls of funshade_eval_dist_batch,
+//  funshade_eval_sign_batch and funshade_eval_sign_batch_collapse are also
+//  logged with their sizes, up to TRACE_CALLS_MAX, to be saved and replayed
+//  as a load test (replay.h).
+//
+// Disabled tracing costs one load and branch per batch call.
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>     // uint64_t
+#include <stddef.h>     // size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+#define FUNSHADE_TRACE_HIST     1       // Record histograms
+#define FUNSHADE_TRACE_EVENTS   2       // Also keep the last calls for Chrome traces
+#define FUNSHADE_TRACE_CALLS    4       // Also log the calls with their sizes, for replay
+
+#define TRACE_MAX_THREADS       64      // Threads traced (records of later threads are dropped)
+#define TRACE_EVENTS_PER_THREAD 65536   // Ring of events per thread
+#define TRACE_CALLS_MAX         (1 << 20)   // Logged calls (24 MiB), later ones are dropped
+
+typedef enum {
+    FUNSHADE_STAGE_SHARE = 0,       // funshade_share_batch, funshade_share_broadcast_batch
+    FUNSHADE_STAGE_EVAL_DIST,       // funshade_eval_dist_batch, funshade_eval_dist_matrix
+    FUNSHADE_STAGE_EXCHANGE,        // z_hat exchange wait, recorded by the caller
+    FUNSHADE_STAGE_EVAL_SIGN,       // funshade_eval_sign_batch
+    FUNSHADE_STAGE_COLLAPSE,        // funshade_eval_sign_batch_collapse
+    FUNSHADE_N_STAGES
+} funshade_stage;
+
+typedef struct {
+    uint64_t count, min, max;       // ns
+    uint64_t p50, p90, p99, p999;   // ns, upper bound of the bucket
+    double mean;                    // ns
+} funshade_trace_stats;
+
+/// @brief A logged call (24 bytes).
+typedef struct {
+    uint64_t t;                     // start, ns since funshade_trace_enable/reset
+    uint32_t dur;                   // ns (saturated)
+    uint32_t K;                     // batch size
+    uint32_t l;                     // vector length, 0 for the sign stages
+    uint16_t stage;                 // funshade_stage
+    uint16_t thread;                // thread id, as in funshade_trace_stats_get
+} funshade_trace_call;
+
+extern volatile int funshade_trace_flags;   // Read by the instrumented functions
+
+/// @brief Enable tracing with FUNSHADE_TRACE_* flags (0 disables). Recorded data is kept.
+///        FUNSHADE_TRACE_CALLS is dropped if its log cannot be allocated.
+void funshade_trace_enable(int flags);
+
+/// @brief Clear all histograms and events (not while traced calls are running).
+void funshade_trace_reset(void);
+
+/// @brief Monotonic time in ns.
+uint64_t funshade_trace_now(void);
+
+/// @brief Record a call of stage from t_begin to t_end (funshade_trace_now) on
+///        the calling thread. No-op when tracing is disabled.
+void funshade_trace_record(funshade_stage stage, uint64_t t_begin, uint64_t t_end);
+
+/// @brief funshade_trace_record of a batch call of K elements of length l,
+///        also logged with FUNSHADE_TRACE_CALLS.
+void funshade_trace_record_call(funshade_stage stage, size_t K, size_t l, uint64_t t_begin, uint64_t t_end);
+
+/// @brief Stop (1) or resume (0) the FUNSHADE_TRACE_CALLS log of the calling
+///        thread only; other threads keep logging.
+/// @return the previous state, to restore
+int funshade_trace_calls_pause(int pause);
+
+/// @brief Calls logged since enable/reset, in order of completion. The log
+///        stays valid until the next reset, and must be read while no traced
+///        call is running.
+/// @return number of calls in *calls, at most TRACE_CALLS_MAX
+size_t funshade_trace_calls_get(const funshade_trace_call **calls);
+
+/// @brief Number of threads that recorded something (thread ids 0..n-1).
+size_t funshade_trace_threads(void);
+
+/// @brief Records dropped since enable/reset, from threads past TRACE_MAX_THREADS.
+size_t funshade_trace_dropped(void);
+
+/// @brief Statistics of a stage for one thread, or all threads if thread < 0.
+/// @return 0, or -1 if nothing was recorded
+int funshade_trace_stats_get(funshade_stage stage, int thread, funshade_trace_stats *s);
+
+/// @brief Latency of a stage at quantile q in [0, 1] (e.g. 0.99), in ns.
+uint64_t funshade_trace_percentile(funshade_stage stage, int thread, double q);
+
+/// @brief Write the recorded events as Chrome trace JSON. Returns 0, or -1 on I/O error.
+int funshade_trace_dump_chrome(const char *path);
+
+/// @brief Name of a stage ("share", "eval_dist", ...).
+const char *funshade_trace_stage_name(funshade_stage stage);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // __TRACE_H__
@@ -0,0 +1,250 @@
+#include "tune.h"
+#include <string.h>     // strchr, strcmp, strcspn, strncmp, strncpy
+
+//----------------------------------------------------------------------------//
+//-------------------------------- PRIVATE -----------------------------------//
+//----------------------------------------------------------------------------//
+#define TUNE_REPS       3       // Best of TUNE_REPS runs per candidate
+#define TUNE_DIST_L     128     // l of the eval_dist chunk benchmark
+#define TUNE_HOST_LEN   192
+
+// Wall-clock seconds (CPU time without OpenMP, single-threaded anyway)
+static double tune_now(void){
+#if defined(_OPENMP)
+    return omp_get_wtime();
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// CPU model, CPU count, ring size and compiled backends: what a profile depends on
+static void tune_host(char host[TUNE_HOST_LEN]){
+    char line[256], model[128] = "unknown";
+    int n_cpus = 1;
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f != NULL)
+    {
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+            if (strncmp(line, "model name", 10) == 0 && strchr(line, ':') != NULL)
+            {
+                strncpy(model, strchr(line, ':') + 2, sizeof(model) - 1);
+                model[strcspn(model, "\n")] = '\0';
+                break;
+            }
+        }
+        fclose(f);
+    }
+#if defined(_OPENMP)
+    n_cpus = omp_get_num_procs();
+#endif
+    sprintf(host, "%.120s|%d|%d|%s", model, n_cpus, (int)N_BITS, aes_ni_available() ? "tiny,ni" : "tiny");
+}
+
+// Deterministic filler: calibration keys need not be valid, only realistic
+static void tune_fill(uint8_t buf[], size_t len){
+    uint32_t x = 0x9e3779b9;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        x = x*1664525 + 1013904223;
+        buf[i] = (uint8_t)(x >> 24);
+    }
+}
+
+typedef struct {
+    size_t K;
+    uint8_t *k_j;
+    R_t *z0, *z1, *o, *D, *d;   // D and d: K*TUNE_DIST_L
+} tune_bench;
+
+static double time_sign(const tune_bench *b, const funshade_tuning *t){
+    double best = -1, t0, dt;
+    int r;
+    funshade_tuning_set(t);
+    for (r = 0; r < TUNE_REPS; r++)
+    {
+        t0 = tune_now();
+        funshade_eval_sign_batch(b->K, 0, b->k_j, b->z0, b->z1, b->o);
+        dt = tune_now() - t0;
+        if (best < 0 || dt < best)  best = dt;
+    }
+    return best;
+}
+
+// PRG backends, on the single-key gate (the batches may use the C++ engine)
+static double time_prg(const tune_bench *b, const funshade_tuning *t){
+    double best = -1, t0, dt;
+    size_t k;
+    int r;
+    funshade_tuning_set(t);
+    for (r = 0; r < TUNE_REPS; r++)
+    {
+        t0 = tune_now();
+        for (k = 0; k < b->K; k++)
+        {
+            b->o[k] = SIGN_eval(0, &b->k_j[k*KEY_LEN], b->z0[k]);
+        }
+        dt = tune_now() - t0;
+        if (best < 0 || dt < best)  best = dt;
+    }
+    return best;
+}
+
+static double time_dist(const tune_bench *b, const funshade_tuning *t, size_t l){
+    double best = -1, t0, dt;
+    size_t K = b->K*TUNE_DIST_L/l;     // same number of elements for every l
+    int r;
+    funshade_tuning_set(t);
+    for (r = 0; r < TUNE_REPS; r++)
+    {
+        t0 = tune_now();
+        funshade_eval_dist_batch(K, l, 0, b->z0, b->D, b->D, b->d, b->d, b->d, b->o);
+        dt = tune_now() - t0;
+        if (best < 0 || dt < best)  best = dt;
+    }
+    return best;
+}
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+void funshade_tune_calibrate(size_t K, funshade_tuning *t){
+    static const size_t sign_chunks[] = {0, 1, 4, 16, 64}, dist_chunks[] = {0, 16, 64, 256};
+    funshade_tuning saved = *funshade_tuning_get(), cand;
+    tune_bench b;
+    double best, dt;
+    size_t c, l;
+#if defined(_OPENMP)
+    size_t n, max_threads = (size_t)omp_get_max_threads();
+#endif
+    b.K = K ? K : TUNE_DEFAULT_K;
+    b.k_j = (uint8_t*)malloc(b.K*KEY_LEN);
+    b.z0 = (R_t*)malloc(b.K*TUNE_DIST_L*sizeof(R_t));   // also r_in/o of eval_dist with l=1
+    b.z1 = (R_t*)malloc(b.K*sizeof(R_t));
+    b.o  = (R_t*)malloc(b.K*TUNE_DIST_L*sizeof(R_t));
+    b.D  = (R_t*)malloc(b.K*TUNE_DIST_L*sizeof(R_t));
+    b.d  = (R_t*)malloc(b.K*TUNE_DIST_L*sizeof(R_t));
+    *t = saved;
+    if (!b.k_j || !b.z0 || !b.z1 || !b.o || !b.D || !b.d)
+    {
+        free(b.k_j); free(b.z0); free(b.z1); free(b.o); free(b.D); free(b.d);
+        return;
+    }
+    tune_fill(b.k_j, b.K*KEY_LEN);
+    tune_fill((uint8_t*)b.z0, b.K*TUNE_DIST_L*sizeof(R_t));
+    tune_fill((uint8_t*)b.z1, b.K*sizeof(R_t));
+    tune_fill((uint8_t*)b.D, b.K*TUNE_DIST_L*sizeof(R_t));
+    tune_fill((uint8_t*)b.d, b.K*TUNE_DIST_L*sizeof(R_t));
+
+    // PRG backend
+    t->prg = FUNSHADE_PRG_TINY;     t->dot_flat_max_l = 0;
+    t->n_threads = t->sign_chunk = t->dist_chunk = 0;
+    if (aes_ni_available())
+    {
+        cand = *t;  cand.prg = FUNSHADE_PRG_NI;
+        if (time_prg(&b, &cand) < time_prg(&b, t))  *t = cand;
+    }
+    best = time_sign(&b, t);
+#if defined(_OPENMP)
+    // Thread count: powers of two and the maximum
+    for (n = 1; n <= max_threads; n = (n < max_threads && 2*n > max_threads) ? max_threads : 2*n)
+    {
+        cand = *t;  cand.n_threads = n;
+        if ((dt = time_sign(&b, &cand)) < best)
+        {
+            best = dt;  *t = cand;
+        }
+        if (n == max_threads)   break;
+    }
+#endif
+    // Sign chunk
+    for (c = 1; c < sizeof(sign_chunks)/sizeof(sign_chunks[0]); c++)
+    {
+        cand = *t;  cand.sign_chunk = sign_chunks[c];
+        if ((dt = time_sign(&b, &cand)) < best)
+        {
+            best = dt;  *t = cand;
+        }
+    }
+    // Dist chunk, with the row kernel at TUNE_DIST_L
+    best = time_dist(&b, t, TUNE_DIST_L);
+    for (c = 1; c < sizeof(dist_chunks)/sizeof(dist_chunks[0]); c++)
+    {
+        cand = *t;  cand.dist_chunk = dist_chunks[c];
+        if ((dt = time_dist(&b, &cand, TUNE_DIST_L)) < best)
+        {
+            best = dt;  *t = cand;
+        }
+    }
+    // Flat kernel: up to the first l (powers of two) where the row kernel wins
+    for (l = 1; l <= TUNE_DIST_L/2; l *= 2)
+    {
+        cand = *t;  cand.dot_flat_max_l = 0;
+        best = time_dist(&b, &cand, l);
+        cand.dot_flat_max_l = l;
+        if (time_dist(&b, &cand, l) >= best)    break;
+        *t = cand;
+    }
+    funshade_tuning_set(&saved);
+    free(b.k_j); free(b.z0); free(b.z1); free(b.o); free(b.D); free(b.d);
+}
+
+int funshade_tune_load(const char *path, funshade_tuning *t){
+    char line[256], host[TUNE_HOST_LEN];
+    unsigned long v;
+    int version = 0, fields = 0;
+    bool same_host = false;
+    funshade_tuning r = *funshade_tuning_get();
+    FILE *f = fopen(path, "r");
+    if (f == NULL)  return -1;
+    tune_host(host);
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "funshade-tune %d", &version) == 1)        continue;
+        if (strncmp(line, "host ", 5) == 0)                         same_host = (strcmp(line + 5, host) == 0);
+        else if (sscanf(line, "prg %lu", &v) == 1)                  { r.prg = (funshade_prg)v; fields++; }
+        else if (sscanf(line, "dot_flat_max_l %lu", &v) == 1)       { r.dot_flat_max_l = v; fields++; }
+        else if (sscanf(line, "n_threads %lu", &v) == 1)            { r.n_threads = v; fields++; }
+        else if (sscanf(line, "sign_chunk %lu", &v) == 1)           { r.sign_chunk = v; fields++; }
+        else if (sscanf(line, "dist_chunk %lu", &v) == 1)           { r.dist_chunk = v; fields++; }
+    }
+    fclose(f);
+    if (version != TUNE_VERSION || !same_host || fields != 5)   return -1;
+    *t = r;
+    return 0;
+}
+
+int funshade_tune_save(const char *path, const funshade_tuning *t){
+    char host[TUNE_HOST_LEN];
+    int err;
+    FILE *f = fopen(path, "w");
+    if (f == NULL)  return -1;
+    tune_host(host);
+    err = fprintf(f, "funshade-tune %d\nhost %s\nprg %lu\ndot_flat_max_l %lu\nn_threads %lu\n"
+        "sign_chunk %lu\ndist_chunk %lu\n", TUNE_VERSION, host, (unsigned long)t->prg,
+        (unsigned long)t->dot_flat_max_l, (unsigned long)t->n_threads,
+        (unsigned long)t->sign_chunk, (unsigned long)t->dist_chunk) < 0;
+    err |= (fclose(f) != 0);
+    return err ? -1 : 0;
+}
+
+int funshade_tune_init(const char *path){
+    char buf[512];
+    const char *home;
+    funshade_tuning t;
+    if (path == NULL)   path = getenv(TUNE_ENV);
+    if (path == NULL && (home = getenv("HOME")) != NULL)
+    {
+        sprintf(buf, "%.480s/.cache/funshade_tune", home);
+        path = buf;
+    }
+    if (path != NULL && funshade_tune_load(path, &t) == 0 && funshade_tuning_set(&t) == 0)
+    {
+        return 0;
+    }
+    funshade_tune_calibrate(0, &t);
+    funshade_tuning_set(&t);
+    return (path != NULL && funshade_tune_save(path, &t) == 0) ? 1 : -1;
+}
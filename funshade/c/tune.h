@@ -0,0 +1,55 @@
+// TUNE: Per-host calibration of the batch functions, cached on disk
+// -----------------------------------------------------------------------------
+// The best PRG backend, eval_dist kernel, OpenMP thread count and chunk sizes
+//  differ between CPU models, so instead of fixing them at compile time the
+//  first run benchmarks the candidates and stores the winners (a
+//  funshade_tuning, see fss.h) in a small text file:
+//
+//      funshade-tune 1
+//      host <cpu model>|<cpus>|<bits>|<backends>
+//      prg 1
+//      dot_flat_max_l 8
+//      n_threads 16
+//      sign_chunk 16
+//      dist_chunk 0
+//
+// Later runs on the same host load it back. A profile from another host (CPU
+//  model, CPU count, ring size or compiled backends) is ignored and replaced.
+
+#ifndef __TUNE_H__
+#define __TUNE_H__
+
+#include "fss.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------//
+//--------------------------------- PUBLIC -----------------------------------//
+//----------------------------------------------------------------------------//
+#define TUNE_VERSION        1
+#define TUNE_DEFAULT_K      512     // Keys (and rows) of the calibration batches
+#define TUNE_ENV            "FUNSHADE_TUNE_CACHE"
+
+/// @brief Benchmark the candidates on K keys/rows (0 for TUNE_DEFAULT_K) and
+///        return the fastest configuration in t. The active tuning is restored.
+void funshade_tune_calibrate(size_t K, funshade_tuning *t);
+
+/// @brief Read a profile. Returns -1 if missing, malformed or from another host.
+int funshade_tune_load(const char *path, funshade_tuning *t);
+
+/// @brief Write a profile for this host. Returns 0, or -1 on I/O error.
+int funshade_tune_save(const char *path, const funshade_tuning *t);
+
+/// @brief Apply the cached profile of this host, calibrating and saving it on
+///        the first run. With path NULL, $FUNSHADE_TUNE_CACHE is used, else
+///        $HOME/.cache/funshade_tune (the directory must exist).
+/// @return 0 if loaded from the cache, 1 if calibrated and saved, -1 if
+///         calibrated but not saved. The new tuning is active in all cases.
+int funshade_tune_init(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // __TUNE_H__
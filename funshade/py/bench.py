@@ -0,0 +1,177 @@
+"""Python-level benchmark of the Funshade wrappers.
+
+Times each wrapper (setup, share, eval_dist, eval_sign, eval_sign_collapse)
+against its C function timed without the Python layer (funshade.bench_c) over
+K/l sweeps, and the full two-party protocol of test_funshade.py. Reports the
+binding overhead (wrapper/C time), the peak RSS and writes CSVs next to the
+ones in experiments/.
+
+With --record, the online calls of the protocol runs are also logged with
+their sizes to a file. --replay plays such a file (e.g. recorded from
+production traffic with funshade.trace_enable(calls=True)) back at the given
+speed multipliers from several threads, and reports throughput, tail latency
+and the saturation point instead of running the sweeps.
+
+Usage:
+    python funshade/py/bench.py [--K 100 1000] [--l 128 512] [--reps 5] [--out DIR] [--record FILE]
+    python funshade/py/bench.py --replay FILE [--speeds 1 2 4 8] [--threads 4] [--out DIR]
+"""
+import argparse
+import csv
+import os
+import resource
+import sys
+import time
+
+import numpy as np
+import funshade
+
+MAX_EL = 2**12      # Fixed-point scale of the templates, as in test_funshade.py
+THETA = 0.4         # Matching threshold on the cosine similarity
+
+
+def peak_rss_kb():
+    """Peak resident set size of this process, in KiB."""
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    return rss // 1024 if sys.platform == 'darwin' else rss      # bytes on macOS
+
+
+def time_ns(fn, reps):
+    """Median wall time of reps calls of fn(), in ns."""
+    t = np.empty(reps, np.int64)
+    for r in range(reps):
+        t0 = time.perf_counter_ns()
+        fn()
+        t[r] = time.perf_counter_ns() - t0
+    return float(np.median(t))
+
+
+def templates(rng, K, l):
+    """K L2-normalized random templates of length l, in fixed point."""
+    t = rng.uniform(-1, 1, size=(K, l))
+    t /= np.linalg.norm(t, axis=1, keepdims=True)
+    return (t*MAX_EL).astype(funshade.DTYPE)
+
+
+def bench_wrappers(K, l, reps):
+    """Median wrapper and C time of each function of BENCH_FUNCTIONS, in ns."""
+    d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in0, r_in1, k0, k1 = funshade.setup(K, l, 0)
+    D_x = funshade.share(K, l, d_y0, d_x0)
+    z_hat = funshade.eval_dist(K, l, 0, r_in0, D_x, D_x, d_x0, d_y0, d_xy0)
+    # Same inputs as bench_c, so both sides do the same work
+    calls = {
+        'setup':              lambda: funshade.setup(K, l, 0),
+        'share':              lambda: funshade.share(K, l, d_y0, d_x0),
+        'eval_dist':          lambda: funshade.eval_dist(K, l, 0, r_in0, D_x, D_x, d_x0, d_y0, d_xy0),
+        'eval_sign':          lambda: funshade.eval_sign(K, 0, k0, z_hat, z_hat),
+        'eval_sign_collapse': lambda: funshade.eval_sign_collapse(K, 0, k0, z_hat, z_hat),
+    }
+    rows = []
+    for name in funshade.BENCH_FUNCTIONS:
+        t_py = time_ns(calls[name], reps)
+        t_c = float(np.median(funshade.bench_c(name, K, l, reps)))
+        rows.append({'function': name, 'K': K, 'l': l, 't_py_ns': round(t_py), 't_c_ns': round(t_c),
+                     'overhead': round(t_py/max(t_c, 1.0), 3), 'peak_rss_kb': peak_rss_kb()})
+    return rows
+
+
+def bench_protocol(K, l, reps, rng):
+    """Two-party protocol of test_funshade.py, per element times in ns.
+
+    Returns a row in the layout of experiments/funshade_timings_all.csv.
+    """
+    x = templates(rng, 1, l)
+    Y = templates(rng, K, l)
+    theta_fp = funshade.scale_threshold(THETA, MAX_EL)
+    t = {'t_setup': [], 't_share': [], 't_eval_sp': [], 't_eval_sign': []}
+    for _ in range(reps):
+        t0 = time.perf_counter_ns()
+        d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in0, r_in1, k0, k1 = funshade.setup(K, l, theta_fp, MAX_EL)
+        t1 = time.perf_counter_ns()
+        D_y = funshade.share(K, l, Y.flatten(), d_y0 + d_y1)
+        D_x = funshade.share(K, l, np.tile(x.flatten(), K), d_x0 + d_x1)
+        t2 = time.perf_counter_ns()
+        z_hat_0 = funshade.eval_dist(K, l, 0, r_in0, D_x, D_y, d_x0, d_y0, d_xy0)
+        z_hat_1 = funshade.eval_dist(K, l, 1, r_in1, D_x, D_y, d_x1, d_y1, d_xy1)
+        t3 = time.perf_counter_ns()
+        o = funshade.eval_sign(K, 0, k0, z_hat_0, z_hat_1) + funshade.eval_sign(K, 1, k1, z_hat_0, z_hat_1)
+        t4 = time.perf_counter_ns()
+        t['t_setup'].append(t1-t0);     t['t_share'].append(t2-t1)
+        t['t_eval_sp'].append(t3-t2);   t['t_eval_sign'].append(t4-t3)
+    z = Y.astype(np.int64) @ x.flatten().astype(np.int64)        # Fixed-point ground truth
+    assert np.array_equal(o, z >= theta_fp), \
+        "<Funshade error> protocol output mismatch for K={}, l={}".format(K, l)
+    # Each party runs its share of eval_dist and eval_sign: per party and element
+    row = {'l': l, 't_setup': np.median(t['t_setup'])/K, 't_share': np.median(t['t_share'])/(2*K),
+           't_eval_sp': np.median(t['t_eval_sp'])/(2*K), 't_eval_sign': np.median(t['t_eval_sign'])/(2*K)}
+    row = {k: round(v, 4) if k != 'l' else v for k, v in row.items()}
+    row.update({'n_bits': 8*funshade.DTYPE().itemsize, 'n_samples': K, 'peak_rss_kb': peak_rss_kb()})
+    return row
+
+
+def write_csv(path, rows):
+    with open(path, 'w', newline='') as f:
+        w = csv.DictWriter(f, fieldnames=list(rows[0].keys()))
+        w.writeheader()
+        w.writerows(rows)
+
+
+def replay(path, speeds, n_threads, out):
+    """Replay the calls of path and print/write one row per speed."""
+    reports, saturation = funshade.replay(path, speeds, n_threads)
+    print("Replay of {} calls from {} on {} thread(s):".format(reports[0]['n_calls'] if reports else 0,
+                                                               path, n_threads))
+    print("{:>8}{:>14}{:>14}{:>16}{:>12}{:>12}{:>12}".format(
+        'speed', 'offered/s', 'done/s', 'elements/s', 'p50 (ns)', 'p99 (ns)', 'p99.9 (ns)'))
+    for r in reports:
+        print("{speed:>8g}{offered:>14.0f}{throughput:>14.0f}{elem_rate:>16.0f}{p50:>12}{p99:>12}{p999:>12}".format(**r))
+    print("Saturation point: {}".format("x{:g}".format(saturation) if saturation else "below x{:g}".format(min(speeds))))
+    if reports:
+        os.makedirs(out, exist_ok=True)
+        write_csv(os.path.join(out, 'funshade_replay_py.csv'), reports)
+    return 0
+
+
+def main(argv=None):
+    p = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    p.add_argument('--K', type=int, nargs='+', default=[100, 1000], help='numbers of vectors')
+    p.add_argument('--l', type=int, nargs='+', default=[128, 512], help='vector lengths')
+    p.add_argument('--reps', type=int, default=5, help='timed calls per measurement')
+    p.add_argument('--out', default='.', help='directory of the CSV files')
+    p.add_argument('--record', metavar='FILE', help='log the online calls of the protocol runs to FILE')
+    p.add_argument('--replay', metavar='FILE', help='replay the calls of FILE instead of the sweeps')
+    p.add_argument('--speeds', type=float, nargs='+', default=[1, 2, 4, 8], help='replay speed multipliers')
+    p.add_argument('--threads', type=int, default=1, help='concurrent replay workers')
+    args = p.parse_args(argv)
+    rng = np.random.default_rng(seed=42)
+
+    print("Funshade backend: {}, ring of {} bits".format(funshade.backend(), 8*funshade.DTYPE().itemsize))
+    if args.replay:
+        return replay(args.replay, sorted(args.speeds), args.threads, args.out)
+    wrappers, protocol = [], []
+    print("{:<20}{:>7}{:>6}{:>14}{:>14}{:>10}{:>16}".format(
+        'function', 'K', 'l', 'python (ns)', 'C (ns)', 'ratio', 'peak RSS (KiB)'))
+    for K in sorted(args.K):
+        for l in sorted(args.l):
+            for r in bench_wrappers(K, l, args.reps):
+                print("{function:<20}{K:>7}{l:>6}{t_py_ns:>14}{t_c_ns:>14}{overhead:>10}{peak_rss_kb:>16}".format(**r))
+                wrappers.append(r)
+            if args.record:
+                funshade.trace_enable(calls=True)
+            protocol.append(bench_protocol(K, l, args.reps, rng))
+            funshade.trace_disable()
+    print("\nProtocol, ns per element and party:")
+    print("{:>7}{:>6}{:>12}{:>12}{:>12}{:>14}".format('K', 'l', 'setup', 'share', 'eval_dist', 'eval_sign'))
+    for r in protocol:
+        print("{n_samples:>7}{l:>6}{t_setup:>12}{t_share:>12}{t_eval_sp:>12}{t_eval_sign:>14}".format(**r))
+
+    if args.record:
+        print("Recorded {} calls to {}".format(funshade.trace_save_calls(args.record), args.record))
+    os.makedirs(args.out, exist_ok=True)
+    write_csv(os.path.join(args.out, 'funshade_bench_py.csv'), wrappers)
+    write_csv(os.path.join(args.out, 'funshade_timings_py.csv'), protocol)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
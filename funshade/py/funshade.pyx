@@ -1,31 +1,109 @@
+import asyncio
 import numpy as np
 cimport numpy as np
+cimport cython
 
-from libc.stdint cimport int64_t, int64_t, uint8_t
+from libc.stdint cimport int64_t, int64_t, int16_t, int8_t, uint8_t, uint16_t, uint32_t, uint64_t
+from libc.stdlib cimport calloc, free
 from libcpp cimport bool
 
+np.import_array()
+
 
 cdef extern from "fss.h" nogil:
     ctypedef int64_t R_t
     const size_t KEY_LEN
+    const size_t DPF_KEY_LEN
     const size_t SEED_LEN
+    size_t KEY_LEN_N(size_t n_bits)
+    const size_t MASTER_SEED_LEN
 
     ## FUNSHADE (batch evaluation)
     void funshade_setup_batch(size_t K, size_t l, R_t theta,
         R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[], R_t d_xy1[],
         R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+    void funshade_setup_batch_n(size_t K, size_t l, size_t n_bits, R_t theta,
+        R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[], R_t d_xy1[],
+        R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+    void funshade_setup_batch_derived(const uint8_t master[], size_t a, size_t b, size_t l, R_t theta,
+        R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[], R_t d_xy1[],
+        R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
     void funshade_share_batch(size_t K, size_t l, const R_t v[], const R_t d_v[],R_t D_v[])
+    ctypedef enum funshade_metric:
+        FUNSHADE_DOT, FUNSHADE_SQ_L2, FUNSHADE_COS
+    const int COS_FRAC_BITS
+    void funshade_setup_batch_metric(size_t K, size_t l, funshade_metric metric, bool below, R_t theta,
+        R_t d_x0[], R_t d_x1[], R_t d_y0[], R_t d_y1[], R_t d_xy0[], R_t d_xy1[],
+        R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+    void funshade_eval_dist_batch_metric(size_t K, size_t l, funshade_metric metric, bool below, R_t theta,
+        bool j, const R_t r_in_j[], const R_t D_x[], const R_t D_y[],
+        const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[], R_t z_hat_j[])
+    void funshade_setup_batch_db(size_t K, size_t l, funshade_metric metric, bool below, R_t theta,
+        const R_t d_y0[], const R_t d_y1[], R_t d_x0[], R_t d_x1[], R_t d_xy0[], R_t d_xy1[],
+        R_t r_in_0[],R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+    void funshade_refresh_gen(size_t K, size_t l, bool rotate, R_t d_y0[], R_t d_y1[],
+        R_t e[], R_t e_0[], R_t e_1[])
+    void funshade_refresh_batch(size_t K, size_t l, const R_t e[], const R_t e_j[], R_t D_y[], R_t d_yj[])
     void funshade_eval_dist_batch(size_t K, size_t l, bint j,
         const R_t r_in_j[], const R_t D_x[], const R_t D_y[],
         const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[], R_t z_hat[])
+    void funshade_setup_matrix(size_t M, size_t K, size_t l, R_t theta,
+        R_t A0[], R_t A1[], R_t B0[], R_t B1[], R_t C0[], R_t C1[],
+        R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+    void funshade_eval_dist_matrix(size_t M, size_t K, size_t l, bint j, const R_t r_in_j[],
+        const R_t D_X[], const R_t D_Y[], const R_t A_j[], const R_t B_j[], const R_t C_j[],
+        R_t z_hat_j[])
     void funshade_eval_sign_batch(size_t K, bint j, const uint8_t kj[],
         const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[])
     R_t funshade_eval_sign_batch_collapse(size_t K, bint j, const uint8_t kj[],
         const R_t z_hat_0[], const R_t z_hat_1[])
+    void funshade_eval_sign_batch_n(size_t K, size_t n_bits, bint j, const uint8_t kj[],
+        const R_t z_hat_0[], const R_t z_hat_1[], R_t o_j[])
+    R_t funshade_eval_sign_batch_collapse_n(size_t K, size_t n_bits, bint j, const uint8_t kj[],
+        const R_t z_hat_0[], const R_t z_hat_1[])
+    size_t funshade_sign_bits(size_t l, R_t max_el, bint normalized)
+    void funshade_share_broadcast_batch(size_t K, size_t l, const R_t x[], const R_t d_x[], R_t D_x[])
+    bint funshade_check_overflow(size_t l, R_t max_el, bint normalized)
+    void funshade_share_batch_i8(size_t K, size_t l, const int8_t v[], const R_t d_v[], R_t D_v[])
+    void funshade_share_batch_i16(size_t K, size_t l, const int16_t v[], const R_t d_v[], R_t D_v[])
+    int funshade_share_float_batch(size_t K, size_t l, const float v[], R_t max_el, bint normalize,
+        const R_t d_v[], R_t D_v[])
+    int funshade_share_f64_batch(size_t K, size_t l, const double v[], R_t max_el, bint normalize,
+        const R_t d_v[], R_t D_v[])
+    R_t funshade_scale_threshold(double theta, R_t max_el)
+
+    ## SESSION CONTEXT
+    ctypedef struct funshade_ctx:
+        pass
+    funshade_ctx *funshade_ctx_new(size_t K, size_t l, bint j)
+    void funshade_ctx_free(funshade_ctx *ctx)
+    void funshade_ctx_set_offline(funshade_ctx *ctx, const R_t r_in_j[],
+        const R_t d_xj[], const R_t d_yj[], const R_t d_xyj[], const uint8_t k_j[])
+    void funshade_ctx_set_db(funshade_ctx *ctx, const R_t D_y[])
+    R_t *funshade_ctx_D_x(funshade_ctx *ctx)
+    R_t *funshade_ctx_share(funshade_ctx *ctx, const R_t x[], const R_t d_x[])
+    R_t *funshade_ctx_eval_dist(funshade_ctx *ctx, const R_t D_x[])
+    R_t *funshade_ctx_eval_sign(funshade_ctx *ctx, const R_t z_hat_nj[])
+    R_t funshade_ctx_eval_sign_collapse(funshade_ctx *ctx, const R_t z_hat_nj[])
 
     ## FSS (batch evaulation)
+    void DCF_gen_batch(size_t K, const R_t alpha[], uint8_t k0[], uint8_t k1[])
+    void DCF_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[])
+    void IC_gen_batch(size_t K, const R_t p[], const R_t q[], R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+    void IC_eval_batch(size_t K, bool b, const R_t p[], const R_t q[], const uint8_t kb[], const R_t x_hat[], R_t ob[])
     void SIGN_gen_batch(size_t K, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[])
     void SIGN_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[])
+    void EQ_gen_batch(size_t K, R_t theta, R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+    void EQ_eval_batch(size_t K, bool b, const uint8_t kb[], const R_t x_hat[], R_t ob[])
+    size_t SPLINE_KEY_LEN(size_t m, size_t d)
+    size_t SPLINE_SIGMOID_M(size_t n_seg)
+    int SPLINE_check(size_t m, size_t d, const R_t brk[])
+    int SPLINE_gen_batch(size_t K, size_t m, size_t d, const R_t brk[], const R_t coef[],
+        R_t r_in_0[], R_t r_in_1[], uint8_t k0[], uint8_t k1[])
+    int SPLINE_eval_batch(size_t K, size_t m, size_t d, bool b, const R_t brk[], const uint8_t kb[],
+        const R_t x_hat[], R_t ob[])
+    void SPLINE_relu(R_t brk[], R_t coef[])
+    int SPLINE_sigmoid(size_t frac_bits, size_t n_seg, R_t brk[], R_t coef[])
 
     ## OUTSIDE The SCOPE of FUNSHADE  (batch evaluation)
     void funshade_setup_ss_batch(size_t K, size_t l, R_t theta,
@@ -36,6 +114,101 @@ cdef extern from "fss.h" nogil:
         const R_t r_in_j[], const R_t d[], const R_t e[],
         const R_t aj[], const R_t bj[], const R_t cj[], R_t z_hat_j[])
 
+cdef extern from "pool.h" nogil:
+    const size_t POOL_COALESCE_K
+    ctypedef enum funshade_pool_op:
+        POOL_OP_SETUP, POOL_OP_DIST, POOL_OP_SIGN, POOL_OP_SIGN_COLLAPSE
+    ctypedef struct funshade_job:
+        funshade_pool_op op
+        uint64_t id
+        size_t K, l
+        bint j
+        R_t theta
+        const R_t *r_in_j
+        const R_t *D_x
+        const R_t *D_y
+        const R_t *d_xj
+        const R_t *d_yj
+        const R_t *d_xyj
+        const uint8_t *k_j
+        const R_t *z_hat_0
+        const R_t *z_hat_1
+        R_t *out
+        R_t o_sum
+        R_t *setup[8]
+        uint8_t *k0
+        uint8_t *k1
+    ctypedef struct funshade_pool:
+        pass
+    funshade_pool *funshade_pool_new(size_t n_threads)
+    void funshade_pool_free(funshade_pool *pool)
+    int funshade_pool_submit(funshade_pool *pool, funshade_job *job)
+    int funshade_pool_fd(const funshade_pool *pool)
+    size_t funshade_pool_poll(funshade_pool *pool, funshade_job *done[], size_t max)
+    size_t funshade_pool_wait(funshade_pool *pool, funshade_job *done[], size_t max)
+
+cdef extern from "tune.h" nogil:
+    ctypedef struct funshade_tuning:
+        int prg
+        size_t dot_flat_max_l
+        size_t n_threads
+        size_t sign_chunk
+        size_t dist_chunk
+    const funshade_tuning *funshade_tuning_get()
+    int funshade_tune_init(const char *path)
+    const char *funshade_backend()
+
+cdef extern from "trace.h" nogil:
+    ctypedef enum funshade_stage:
+        FUNSHADE_N_STAGES
+    ctypedef struct funshade_trace_stats:
+        uint64_t count, min, max, p50, p90, p99, p999
+        double mean
+    int FUNSHADE_TRACE_HIST, FUNSHADE_TRACE_EVENTS, FUNSHADE_TRACE_CALLS
+    ctypedef struct funshade_trace_call:
+        uint64_t t
+        uint32_t dur, K, l
+        uint16_t stage, thread
+    size_t funshade_trace_calls_get(const funshade_trace_call **calls)
+    void funshade_trace_enable(int flags)
+    void funshade_trace_reset()
+    uint64_t funshade_trace_now()
+    void funshade_trace_record(funshade_stage stage, uint64_t t_begin, uint64_t t_end)
+    size_t funshade_trace_threads()
+    int funshade_trace_stats_get(funshade_stage stage, int thread, funshade_trace_stats *s)
+    int funshade_trace_dump_chrome(const char *path)
+    const char *funshade_trace_stage_name(funshade_stage stage)
+
+cdef extern from "replay.h" nogil:
+    ctypedef struct funshade_replay_report:
+        double speed
+        size_t n_calls
+        uint64_t elements
+        double duration, offered, throughput, elem_rate
+        uint64_t p50, p90, p99, p999, max
+    int funshade_replay_save(const char *path, const funshade_trace_call calls[], size_t n)
+    int funshade_replay_load(const char *path, funshade_trace_call **calls, size_t *n)
+    int funshade_replay_sweep(const funshade_trace_call calls[], size_t n, const double speeds[],
+        size_t n_speeds, size_t n_threads, funshade_replay_report reps[])
+
+cdef extern from "shm_chan.h" nogil:
+    const size_t CHAN_DEFAULT_CAPACITY
+    const size_t CHAN_BAD_MSG
+    ctypedef struct funshade_chan:
+        pass
+    funshade_chan *funshade_chan_create(const char *name, size_t capacity)
+    funshade_chan *funshade_chan_attach(int fd)
+    funshade_chan *funshade_chan_open(const char *name)
+    int funshade_chan_fd(const funshade_chan *ch)
+    size_t funshade_chan_max_msg(const funshade_chan *ch)
+    void *funshade_chan_reserve(funshade_chan *ch, size_t len)
+    void funshade_chan_commit(funshade_chan *ch)
+    int funshade_chan_send(funshade_chan *ch, const void *buf, size_t len)
+    const void *funshade_chan_recv(funshade_chan *ch, size_t *len, int timeout_ms)
+    void funshade_chan_release(funshade_chan *ch)
+    void funshade_chan_shutdown(funshade_chan *ch)
+    void funshade_chan_close(funshade_chan *ch)
+
 # build the corresponding numpy type for R_t (ring type)
 cdef R_t tmp = 42
 DTYPE = {
@@ -44,9 +217,17 @@ DTYPE = {
     (4, True): np.uint32, (4, False): np.int32, 
     (8, True): np.uint64, (8, False): np.int64, 
 }[(sizeof(tmp), (tmp>0)&(~tmp>=0))]
+cdef int DTYPE_NUM = np.dtype(DTYPE).num
+
+METRICS = ['dot', 'sq_l2', 'cos']     # Scores of eval_dist, as funshade_metric
+
+def cos_threshold(double cos_theta):
+    """Public threshold of the 'cos' metric for a cosine similarity cos_theta."""
+    return <R_t>round(cos_theta * (1 << COS_FRAC_BITS))
 
 #--------------------------------- FUNSHADE -----------------------------------#
-def setup(size_t K, size_t l, R_t theta):
+def setup(size_t K, size_t l, R_t theta, R_t max_el=0, bint normalized=True, size_t n_bits=0,
+          bytes seed=None, size_t offset=0, metric='dot', bint below=False, d_y=None):
     """Setup for the FunShade protocol.
     
     Generates the beaver triples, input masks and function keys.
@@ -55,11 +236,31 @@ def setup(size_t K, size_t l, R_t theta):
         K (int): Number of vectors.
         l (int): Number of elements per vector.
         theta (int): Upscaled threshold.
+        max_el (int, optional): Fixed-point scale of the vectors. If given, checks
+            that the dot products cannot overflow the ring.
+        normalized (bool): Vectors are L2-normalized before scaling by max_el.
+        n_bits (int, optional): Bit width of the sign gate (see sign_bits), for
+            shorter and faster keys. Defaults to the whole ring. The same n_bits
+            must be passed to eval_sign(_collapse).
+        seed (bytes, optional): 16-byte master seed. If given, the
+            material is derived from it for indices [offset, offset+K): the same
+            as the matching slice of any other derived setup with this seed, so
+            batches can be dealt in parts or regenerated. Full ring only.
+        offset (int, optional): First index of the derived batch.
+        metric (str, optional): Score of eval_dist, one of METRICS: 'dot' (<x,y>),
+            'sq_l2' (||x-y||^2) or 'cos' (rows of l-1 elements followed by their
+            rounded norm, l >= 2, theta from cos_threshold). Full ring only.
+            With max_el, the overflow check includes the 2^COS_FRAC_BITS scale.
+        below (bool, optional): Match when score <= theta instead of >=. The same
+            metric and below must be passed to eval_dist.
+        d_y (tuple, optional): masks (d_y0, d_y1) of a stored reference DB (see
+            refresh_gen). If given, only the material of x is drawn, against
+            them, and they are returned as d_y0, d_y1. Full ring only.
     
     Returns:
         d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1 (np.ndarray): beaver triples for x and y.
         r_in0, r_in1 (np.ndarray): input masks.
-        k0, k1 (np.ndarray): function keys.
+        k0, k1 (np.ndarray): function keys (K*key_len(n_bits) bytes).
     """
     cdef np.ndarray[R_t, ndim=1] d_x0  =\
                 np.empty((K*l), DTYPE), d_x1  = np.empty((K*l), DTYPE),\
@@ -67,12 +268,89 @@ def setup(size_t K, size_t l, R_t theta):
         d_xy0 = np.empty((K*l), DTYPE), d_xy1 = np.empty((K*l), DTYPE),\
         r_in0 = np.empty((K),   DTYPE), r_in1 = np.empty((K),   DTYPE)
         
-    cdef np.ndarray[uint8_t, ndim=1] k0 = np.empty((K*KEY_LEN), np.uint8), k1 = np.empty((K*KEY_LEN), np.uint8)
+    cdef np.ndarray[uint8_t, ndim=1] k0 = np.empty((K*key_len(n_bits)), np.uint8), k1 = np.empty((K*key_len(n_bits)), np.uint8)
+    assert metric!='cos' or l>=2, "<Funshade error> the 'cos' metric needs l >= 2 (elements and their norm)"
+    cdef R_t m_el = max_el
+    if metric=='cos':   # scores scaled by 2^COS_FRAC_BITS, as max_el^2 by 2^(2*COS_FRAC_BITS/2)
+        m_el = min(abs(<object>max_el) << (COS_FRAC_BITS//2), <R_t>1 << (4*sizeof(R_t)))
+    assert max_el==0 or funshade_check_overflow(l, m_el, normalized),\
+        "<Funshade error> max_el={} and l={} overflow the {}-bit ring".format(max_el, l, 8*sizeof(R_t))
+    assert max_el==0 or n_bits==0 or n_bits>=funshade_sign_bits(l, max_el, normalized),\
+        "<Funshade error> max_el={} and l={} need n_bits >= {}".format(max_el, l, funshade_sign_bits(l, max_el, normalized))
+    
+    assert seed is None or len(seed)==MASTER_SEED_LEN,\
+        "<Funshade error> seed must be of length {} (MASTER_SEED_LEN)".format(MASTER_SEED_LEN)
+    assert seed is None or n_bits==0, "<Funshade error> seed cannot be combined with n_bits"
+    assert (metric=='dot' and not below and d_y is None) or (seed is None and n_bits==0),\
+        "<Funshade error> metric, below and d_y cannot be combined with seed or n_bits"
     
-    funshade_setup_batch(K, l, theta,
+    if d_y is not None:
+        assert d_y[0].shape[0]==d_y[1].shape[0]==<Py_ssize_t>(K*l),\
+            "<Funshade error> d_y masks must be of length {} (K*l)".format(K*l)
+        d_y0, d_y1 = d_y
+        funshade_setup_batch_db(K, l, <funshade_metric><int>METRICS.index(metric), below, theta,
+           &d_y0[0], &d_y1[0], &d_x0[0], &d_x1[0], &d_xy0[0], &d_xy1[0], &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+    elif metric!='dot' or below:
+        funshade_setup_batch_metric(K, l, <funshade_metric><int>METRICS.index(metric), below, theta,
+           &d_x0[0], &d_x1[0], &d_y0[0], &d_y1[0], &d_xy0[0], &d_xy1[0], &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+    elif seed is not None:
+        funshade_setup_batch_derived(<const uint8_t*>seed, offset, offset+K, l, theta,
+           &d_x0[0], &d_x1[0], &d_y0[0], &d_y1[0], &d_xy0[0], &d_xy1[0], &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+    elif n_bits==0:
+        funshade_setup_batch(K, l, theta,
+           &d_x0[0], &d_x1[0], &d_y0[0], &d_y1[0], &d_xy0[0], &d_xy1[0], &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+    else:
+        funshade_setup_batch_n(K, l, n_bits, theta,
            &d_x0[0], &d_x1[0], &d_y0[0], &d_y1[0], &d_xy0[0], &d_xy1[0], &r_in0[0], &r_in1[0], &k0[0], &k1[0])
     return d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in0, r_in1, k0, k1
 
+def refresh_gen(size_t K, size_t l, R_t[::1] d_y0, R_t[::1] d_y1, bint rotate=False):
+    """Dealer side of a refresh of the masks of a stored reference DB.
+
+    Updates d_y0 and d_y1 in place. Party j applies (e, e_j) with refresh.
+
+    Args:
+        K (int): Number of vectors.
+        l (int): Number of elements per vector.
+        d_y0, d_y1 (np.ndarray): masks of the DB, as given to setup(d_y=).
+        rotate (bool): Also move the masks and D_y by a random e, sent to both
+            parties in the clear: this only changes D_y, and is no stronger
+            than the re-randomized split of a plain refresh.
+
+    Returns:
+        e (np.ndarray): delta of D_y, for both parties (None without rotation).
+        e0, e1 (np.ndarray): refresh of party 0 and 1.
+    """
+    assert d_y0.shape[0]==d_y1.shape[0]==<Py_ssize_t>(K*l),\
+        "<Funshade error> d_y masks must be of length {} (K*l)".format(K*l)
+    cdef np.ndarray[R_t, ndim=1] e = np.empty((K*l if rotate else 1), DTYPE),\
+        e0 = np.empty((K*l), DTYPE), e1 = np.empty((K*l), DTYPE)
+    funshade_refresh_gen(K, l, rotate, &d_y0[0], &d_y1[0], &e[0], &e0[0], &e1[0])
+    return (e if rotate else None), e0, e1
+
+def refresh(size_t K, size_t l, e, R_t[::1] e_j, R_t[::1] D_y, R_t[::1] d_y_j):
+    """Party side of a refresh (see refresh_gen): D_y += e (unless e is None)
+    and d_y_j += e_j, in place."""
+    cdef R_t[::1] e_v
+    assert e_j.shape[0]==D_y.shape[0]==d_y_j.shape[0]==<Py_ssize_t>(K*l),\
+        "<Funshade error> e_j, D_y and d_y_j must be of length {} (K*l)".format(K*l)
+    if e is None:
+        funshade_refresh_batch(K, l, NULL, &e_j[0], &D_y[0], &d_y_j[0])
+    else:
+        e_v = e
+        assert e_v.shape[0]==<Py_ssize_t>(K*l), "<Funshade error> e must be of length {} (K*l)".format(K*l)
+        funshade_refresh_batch(K, l, &e_v[0], &e_j[0], &D_y[0], &d_y_j[0])
+
+def sign_bits(size_t l, R_t max_el, bint normalized=True):
+    """Smallest bit width n_bits of the sign gate for dot products of l elements
+    bounded by max_el (see setup), or 0 if they overflow the ring."""
+    return funshade_sign_bits(l, max_el, normalized)
+
+def key_len(size_t n_bits=0):
+    """Bytes per function key of an n_bits sign gate (0: the whole ring)."""
+    assert n_bits <= 8*sizeof(R_t), "<Funshade error> n_bits must be at most {}".format(8*sizeof(R_t))
+    return KEY_LEN if n_bits==0 else KEY_LEN_N(n_bits)
+
 def share(size_t K, size_t l, R_t[::1] v, R_t[::1] d_v):
     """Generate Delta share of a vector v (Pi secret sharing)
     
@@ -92,8 +370,80 @@ def share(size_t K, size_t l, R_t[::1] v, R_t[::1] d_v):
     funshade_share_batch(K, l, &v[0], &d_v[0], &D_v[0])
     return D_v
 
+def share_quantized(size_t K, size_t l, v, R_t[::1] d_v):
+    """Generate Delta share of a quantized vector v stored as int8 or int16.
+
+    The masks d_v and the resulting Delta share are in the ring dtype (DTYPE).
+
+    Args:
+        K (int): Number of vectors.
+        l (int): Number of elements per vector.
+        v (np.ndarray): int8 or int16 vector to be shared.
+        d_v (np.ndarray): Beaver triple input shares for v.
+
+    Returns:
+        D_v (np.ndarray): Delta share of v.
+    """
+    cdef int8_t[::1] v8
+    cdef int16_t[::1] v16
+    assert v.shape[0]==d_v.shape[0]==<Py_ssize_t>(K*l),\
+        "<Funshade error> Input vector v and delta shares must be of length {} (K*l)".format(K*l)
+    cdef np.ndarray[R_t, ndim=1] D_v = np.empty((K*l), DTYPE)
+    if v.dtype == np.int8:
+        v8 = v
+        funshade_share_batch_i8(K, l, &v8[0], &d_v[0], &D_v[0])
+    elif v.dtype == np.int16:
+        v16 = v
+        funshade_share_batch_i16(K, l, &v16[0], &d_v[0], &D_v[0])
+    else:
+        raise TypeError("<Funshade error> quantized inputs must be int8 or int16, got {}".format(v.dtype))
+    return D_v
+
+def share_float(size_t K, size_t l, v, R_t[::1] d_v, R_t max_el, bint normalize=True):
+    """Quantize float vectors to fixed point and generate their Delta share, in
+    a single pass (no intermediate arrays).
+
+    Each row is L2-normalized (if normalize), scaled by max_el and rounded half
+    away from zero before D_v = d_v + v.
+
+    Args:
+        K (int): Number of vectors.
+        l (int): Number of elements per vector.
+        v (np.ndarray): float32 or float64 vectors, (K*l) or (K, l), C-contiguous.
+        d_v (np.ndarray): Beaver triple input shares for v.
+        max_el (int): Fixed-point scale.
+        normalize (bool): L2-normalize each vector first.
+
+    Returns:
+        D_v (np.ndarray): Delta share of the quantized v.
+    """
+    cdef float[::1] v32
+    cdef double[::1] v64
+    cdef int status
+    v = np.ascontiguousarray(v).reshape(-1)
+    assert v.shape[0]==d_v.shape[0]==<Py_ssize_t>(K*l),\
+        "<Funshade error> Input vector v and delta shares must be of length {} (K*l)".format(K*l)
+    cdef np.ndarray[R_t, ndim=1] D_v = np.empty((K*l), DTYPE)
+    if v.dtype == np.float32:
+        v32 = v
+        status = funshade_share_float_batch(K, l, &v32[0], max_el, normalize, &d_v[0], &D_v[0])
+    elif v.dtype == np.float64:
+        v64 = v
+        status = funshade_share_f64_batch(K, l, &v64[0], max_el, normalize, &d_v[0], &D_v[0])
+    else:
+        raise TypeError("<Funshade error> float inputs must be float32 or float64, got {}".format(v.dtype))
+    assert status == 0, "<Funshade error> max_el={} overflows the {}-bit ring or the inputs".format(
+        max_el, 8*sizeof(R_t))
+    return D_v
+
+def scale_threshold(double theta, R_t max_el):
+    """Upscale a similarity threshold like the dot product of two vectors
+    quantized by share_float: round(theta*max_el**2)."""
+    return funshade_scale_threshold(theta, max_el)
+
 def eval_dist(size_t K, size_t l, bint j, R_t[::1] r_in_j, R_t[::1] D_x, R_t[::1] D_y, 
-              R_t[::1] d_xj, R_t[::1] d_yj, R_t[::1] d_xyj):
+              R_t[::1] d_xj, R_t[::1] d_yj, R_t[::1] d_xyj, R_t[::1] out=None,
+              metric='dot', bint below=False, R_t theta=0):
     """Compute the distance function (scalar prod.) on the Delta shares of x and y.
 
     Args:
@@ -106,6 +456,9 @@ def eval_dist(size_t K, size_t l, bint j, R_t[::1] r_in_j, R_t[::1] D_x, R_t[::1
         d_xj (np.ndarray): Beaver triple input shares for x.
         d_yj (np.ndarray): Beaver triple input shares for y.
         d_xyj (np.ndarray): Beaver triple shares for products xy.
+        out (np.ndarray): Optional output buffer of length K (e.g. Channel.reserve).
+        metric, below (optional): as given to setup.
+        theta (int, optional): Threshold of the 'cos' metric (ignored otherwise).
     
     Returns:
         z_hat_j (np.ndarray): shares of the distance function evaluation result.
@@ -114,11 +467,70 @@ def eval_dist(size_t K, size_t l, bint j, R_t[::1] r_in_j, R_t[::1] D_x, R_t[::1
     assert D_x.shape[0]==D_y.shape[0]==d_xj.shape[0]==d_yj.shape[0]==d_xyj.shape[0]==<Py_ssize_t>(K*l),\
         "<Funshade error> All delta shares must be of length %d (K*l)".format(K*l)
     assert r_in_j.shape[0]==<Py_ssize_t>(K), "<Funshade error> All r_in masks must be of length %d (K)".format(K)
+    assert metric!='cos' or l>=2, "<Funshade error> the 'cos' metric needs l >= 2 (elements and their norm)"
+    cdef funshade_metric m = <funshade_metric><int>METRICS.index(metric)
+    if out is not None:
+        assert out.shape[0]==<Py_ssize_t>(K), "<Funshade error> out must be of length {} (K)".format(K)
+        funshade_eval_dist_batch_metric(K, l, m, below, theta, j, &r_in_j[0], &D_x[0], &D_y[0], &d_xj[0], &d_yj[0], &d_xyj[0], &out[0])
+        return out.base
     cdef np.ndarray[R_t, ndim=1] z_hat_j = np.empty((K), DTYPE)
-    funshade_eval_dist_batch(K, l, j, &r_in_j[0], &D_x[0], &D_y[0], &d_xj[0], &d_yj[0], &d_xyj[0], &z_hat_j[0])
+    funshade_eval_dist_batch_metric(K, l, m, below, theta, j, &r_in_j[0], &D_x[0], &D_y[0], &d_xj[0], &d_yj[0], &d_xyj[0], &z_hat_j[0])
     return z_hat_j
 
-def eval_sign(size_t K, bint j, uint8_t[::1] k_j, R_t[::1] z_hat_0, R_t[::1] z_hat_1):
+def setup_matrix(size_t M, size_t K, size_t l, R_t theta):
+    """Setup for matching M probes against K references (many-to-many).
+
+    Generates a matrix beaver triple (C = A*B^T) instead of one triple per pair,
+    so that probes and references are Delta-shared once each (see share).
+
+    Args:
+        M (int): Number of probes.
+        K (int): Number of references.
+        l (int): Number of elements per vector.
+        theta (int): Upscaled threshold.
+
+    Returns:
+        A0, A1 (np.ndarray): probe mask shares (M*l), D_X = share(M, l, X, A0+A1).
+        B0, B1 (np.ndarray): reference mask shares (K*l), D_Y = share(K, l, Y, B0+B1).
+        C0, C1 (np.ndarray): shares of A*B^T (M*K).
+        r_in0, r_in1 (np.ndarray): input masks (M*K).
+        k0, k1 (np.ndarray): function keys of the M*K comparisons.
+    """
+    cdef np.ndarray[R_t, ndim=1] A0 = np.empty((M*l), DTYPE), A1 = np.empty((M*l), DTYPE),\
+        B0 = np.empty((K*l), DTYPE), B1 = np.empty((K*l), DTYPE),\
+        C0 = np.empty((M*K), DTYPE), C1 = np.empty((M*K), DTYPE),\
+        r_in0 = np.empty((M*K), DTYPE), r_in1 = np.empty((M*K), DTYPE)
+    cdef np.ndarray[uint8_t, ndim=1] k0 = np.empty((M*K*KEY_LEN), np.uint8), k1 = np.empty((M*K*KEY_LEN), np.uint8)
+    funshade_setup_matrix(M, K, l, theta, &A0[0], &A1[0], &B0[0], &B1[0], &C0[0], &C1[0],
+                          &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+    return A0, A1, B0, B1, C0, C1, r_in0, r_in1, k0, k1
+
+def eval_dist_matrix(size_t M, size_t K, size_t l, bint j, R_t[::1] r_in_j, R_t[::1] D_X, R_t[::1] D_Y,
+                     R_t[::1] A_j, R_t[::1] B_j, R_t[::1] C_j):
+    """Compute the distance function of all M*K probe/reference pairs.
+
+    Args:
+        M, K, l (int): Number of probes, of references and of elements per vector.
+        j (bint): Party number (0 or 1).
+        r_in_j (np.ndarray): Input mask shares (M*K).
+        D_X, D_Y (np.ndarray): Delta shares of the probes (M*l) and references (K*l).
+        A_j, B_j, C_j (np.ndarray): Matrix beaver triple shares of setup_matrix.
+
+    Returns:
+        z_hat_j (np.ndarray): shares of the M*K scores, row-major by probe. Compare
+            them with eval_sign(M*K, ...).
+    """
+    assert D_X.shape[0]==A_j.shape[0]==<Py_ssize_t>(M*l), \
+        "<Funshade error> probe shares must be of length {} (M*l)".format(M*l)
+    assert D_Y.shape[0]==B_j.shape[0]==<Py_ssize_t>(K*l), \
+        "<Funshade error> reference shares must be of length {} (K*l)".format(K*l)
+    assert r_in_j.shape[0]==C_j.shape[0]==<Py_ssize_t>(M*K), \
+        "<Funshade error> r_in and C shares must be of length {} (M*K)".format(M*K)
+    cdef np.ndarray[R_t, ndim=1] z_hat_j = np.empty((M*K), DTYPE)
+    funshade_eval_dist_matrix(M, K, l, j, &r_in_j[0], &D_X[0], &D_Y[0], &A_j[0], &B_j[0], &C_j[0], &z_hat_j[0])
+    return z_hat_j
+
+def eval_sign(size_t K, bint j, uint8_t[::1] k_j, R_t[::1] z_hat_0, R_t[::1] z_hat_1, size_t n_bits=0):
     """Compute the sign function (with FSS) given the shares of a public value z_hat.
 
     Args:
@@ -127,19 +539,23 @@ def eval_sign(size_t K, bint j, uint8_t[::1] k_j, R_t[::1] z_hat_0, R_t[::1] z_h
         k_j (np.ndarray): Function key share.
         z_hat_0 (np.ndarray): Shares of z_hat from P0.
         z_hat_1 (np.ndarray): Shares of z_hat from P1.
+        n_bits (int, optional): Bit width of the keys, as in setup.
     
     Returns:
         o_j (np.ndarray): shares of the sign function evaluation result.
     """
     assert z_hat_0.shape[0]==z_hat_1.shape[0]==<Py_ssize_t>(K), \
         "<Funshade error> z_hat shares must be of length %d (K)".format(K)
-    assert k_j.shape[0]==<Py_ssize_t>(K*KEY_LEN), \
-        "<Funshade error> FSS keys k_j must be of length %d (K*KEY_LEN)".format(K*KEY_LEN)
+    assert k_j.shape[0]==<Py_ssize_t>(K*key_len(n_bits)), \
+        "<Funshade error> FSS keys k_j must be of length {} (K*key_len(n_bits))".format(K*key_len(n_bits))
     cdef np.ndarray[R_t, ndim=1] o_j = np.empty((K), DTYPE)
-    funshade_eval_sign_batch(K, j, &k_j[0], &z_hat_0[0], &z_hat_1[0], &o_j[0])
+    if n_bits==0:
+        funshade_eval_sign_batch(K, j, &k_j[0], &z_hat_0[0], &z_hat_1[0], &o_j[0])
+    else:
+        funshade_eval_sign_batch_n(K, n_bits, j, &k_j[0], &z_hat_0[0], &z_hat_1[0], &o_j[0])
     return o_j
 
-def eval_sign_collapse(size_t K, bint j, uint8_t[::1] k_j, R_t[::1] z_hat_0, R_t[::1] z_hat_1):
+def eval_sign_collapse(size_t K, bint j, uint8_t[::1] k_j, R_t[::1] z_hat_0, R_t[::1] z_hat_1, size_t n_bits=0):
     """Compute the sign function (with FSS) given the shares of a public value z_hat.
 
     Returns a single value (sum of results), using less memory.
@@ -150,15 +566,486 @@ def eval_sign_collapse(size_t K, bint j, uint8_t[::1] k_j, R_t[::1] z_hat_0, R_t
         k_j (np.ndarray): Function key share.
         z_hat_0 (np.ndarray): Shares of z_hat from P0.
         z_hat_1 (np.ndarray): Shares of z_hat from P1.
+        n_bits (int, optional): Bit width of the keys, as in setup.
     
     Returns:
         o_j (np.ndarray): shares of the sign function evaluation result.
     """
     assert z_hat_0.shape[0]==z_hat_1.shape[0]==<Py_ssize_t>(K), \
         "<Funshade error> z_hat shares must be of length %d (K)".format(K)
-    assert k_j.shape[0]==<Py_ssize_t>(K*KEY_LEN), \
-        "<Funshade error> FSS keys k_j must be of length %d (K*KEY_LEN)".format(K*KEY_LEN)
-    return funshade_eval_sign_batch_collapse(K, j, &k_j[0], &z_hat_0[0], &z_hat_1[0])
+    assert k_j.shape[0]==<Py_ssize_t>(K*key_len(n_bits)), \
+        "<Funshade error> FSS keys k_j must be of length {} (K*key_len(n_bits))".format(K*key_len(n_bits))
+    if n_bits==0:
+        return funshade_eval_sign_batch_collapse(K, j, &k_j[0], &z_hat_0[0], &z_hat_1[0])
+    return funshade_eval_sign_batch_collapse_n(K, n_bits, j, &k_j[0], &z_hat_0[0], &z_hat_1[0])
+
+#----------------------------------- TUNING -----------------------------------#
+def tune(path=None):
+    """Apply the tuning profile of this host, calibrating it on the first run.
+
+    Args:
+        path (str): Profile cache file. Defaults to $FUNSHADE_TUNE_CACHE, else
+            ~/.cache/funshade_tune.
+
+    Returns:
+        status (int): 0 if loaded, 1 if calibrated and saved, -1 if not saved.
+        profile (dict): The active tuning.
+    """
+    cdef bytes p = path.encode() if path is not None else None
+    cdef int status = funshade_tune_init(<const char*>p if p is not None else NULL)
+    cdef const funshade_tuning *t = funshade_tuning_get()
+    return status, {"prg": t.prg, "dot_flat_max_l": t.dot_flat_max_l, "n_threads": t.n_threads,
+                    "sign_chunk": t.sign_chunk, "dist_chunk": t.dist_chunk}
+
+def backend():
+    """Backends picked for this CPU at load time, e.g. 'prg=ni dist=avx2'."""
+    return funshade_backend()
+
+#---------------------------------- TRACING -----------------------------------#
+TRACE_STAGES = [funshade_trace_stage_name(<funshade_stage>i) for i in range(<int>FUNSHADE_N_STAGES)]
+
+def trace_enable(bint hist=True, bint events=False, bint calls=False):
+    """Time the online batch calls into per-stage latency histograms.
+
+    Args:
+        hist (bint): Record histograms (percentiles via trace_stats).
+        events (bint): Also keep the last calls of each thread for trace_dump_chrome.
+        calls (bint): Also log eval_dist, eval_sign and eval_sign_collapse calls
+            with their sizes, for trace_save_calls and replay.
+    """
+    funshade_trace_enable((FUNSHADE_TRACE_HIST if hist or events or calls else 0) |
+                          (FUNSHADE_TRACE_EVENTS if events else 0) |
+                          (FUNSHADE_TRACE_CALLS if calls else 0))
+
+def trace_disable():
+    """Stop tracing. Recorded data is kept until trace_reset."""
+    funshade_trace_enable(0)
+
+def trace_reset():
+    """Clear all histograms and events."""
+    funshade_trace_reset()
+
+def trace_now():
+    """Monotonic time in ns, the clock of trace_record."""
+    return funshade_trace_now()
+
+def trace_record(stage, uint64_t t_begin, uint64_t t_end):
+    """Record a stage timed by the caller, e.g. the "exchange" of z_hat with the peer.
+
+    Args:
+        stage (str): One of TRACE_STAGES.
+        t_begin, t_end (int): trace_now() at the start and end of the stage.
+    """
+    cdef int i = TRACE_STAGES.index(stage)
+    funshade_trace_record(<funshade_stage>i, t_begin, t_end)
+
+def trace_stats(int thread=-1):
+    """Latency statistics (ns) of each recorded stage.
+
+    Args:
+        thread (int): Thread id (0..n-1 in recording order), -1 for all threads.
+
+    Returns:
+        stats (dict): stage -> {"count", "min", "max", "mean", "p50", "p90", "p99", "p999"}.
+    """
+    cdef funshade_trace_stats st
+    cdef int i
+    stats = {}
+    for i in range(<int>FUNSHADE_N_STAGES):
+        if funshade_trace_stats_get(<funshade_stage>i, thread, &st) == 0:
+            stats[TRACE_STAGES[i]] = {"count": st.count, "min": st.min, "max": st.max, "mean": st.mean,
+                                      "p50": st.p50, "p90": st.p90, "p99": st.p99, "p999": st.p999}
+    return stats
+
+def trace_dump_chrome(path):
+    """Write the recorded events (trace_enable(events=True)) as Chrome trace JSON."""
+    assert funshade_trace_dump_chrome(path.encode()) == 0, \
+        "<Funshade error> could not write the trace to {}".format(path)
+
+def trace_save_calls(path):
+    """Save the calls logged with trace_enable(calls=True) for replay.
+
+    Returns:
+        n (int): Number of calls saved.
+    """
+    cdef const funshade_trace_call *calls
+    cdef size_t n = funshade_trace_calls_get(&calls)
+    assert funshade_replay_save(path.encode(), calls, n) == 0, \
+        "<Funshade error> could not write the calls to {}".format(path)
+    return n
+
+def replay(path, speeds=(1.0,), size_t n_threads=1):
+    """Replay saved calls (trace_save_calls) against the library, open loop.
+
+    Each call is released at its recorded time divided by the speed and run
+    by one of n_threads workers on synthetic inputs of the recorded sizes.
+
+    Args:
+        path (str): File of trace_save_calls.
+        speeds (list): Increasing speed multipliers (2: twice the recorded rate).
+        n_threads (int): Concurrent workers, like request threads.
+
+    Returns:
+        reports (list): One dict per speed, with "speed", "n_calls", "elements",
+            "duration" (s), "offered", "throughput" (calls/s), "elem_rate"
+            (elements/s) and latencies "p50", "p90", "p99", "p999", "max" (ns).
+        saturation (float): Fastest speed whose throughput keeps up with the
+            offered load, None if none does.
+    """
+    cdef funshade_trace_call *calls
+    cdef funshade_replay_report *reps
+    cdef size_t n, i, n_speeds
+    cdef np.ndarray[double, ndim=1] sp = np.ascontiguousarray(speeds, dtype=np.float64)
+    cdef int sat = -2
+    assert sp.shape[0] > 0 and np.all(sp > 0), "<Funshade error> speeds must be positive"
+    assert funshade_replay_load(path.encode(), &calls, &n) == 0, \
+        "<Funshade error> could not read the calls from {}".format(path)
+    n_speeds = sp.shape[0]
+    reps = <funshade_replay_report*>calloc(n_speeds, sizeof(funshade_replay_report))
+    if reps != NULL:
+        with nogil:
+            sat = funshade_replay_sweep(calls, n, &sp[0], n_speeds, n_threads, reps)
+    free(calls)
+    reports = [{"speed": reps[i].speed, "n_calls": reps[i].n_calls, "elements": reps[i].elements,
+                "duration": reps[i].duration, "offered": reps[i].offered, "throughput": reps[i].throughput,
+                "elem_rate": reps[i].elem_rate, "p50": reps[i].p50, "p90": reps[i].p90, "p99": reps[i].p99,
+                "p999": reps[i].p999, "max": reps[i].max} for i in range(n_speeds)] if sat >= -1 and n else []
+    free(reps)
+    assert sat >= -1, "<Funshade error> replay failed"
+    return reports, (float(sp[sat]) if sat >= 0 else None)
+
+#------------------------------ SESSION CONTEXT -------------------------------#
+cdef class Session:
+    """Reusable evaluation context of party j for K references of length l.
+
+    Binds the offline material and the Delta-shared reference DB once, and owns
+    the D_x, z_hat_j and o_j buffers so that repeated queries do not allocate.
+    Returned arrays are views into those buffers: they are overwritten by the
+    next call on the same Session (copy them to keep them).
+
+    Args:
+        K (int): Number of vectors.
+        l (int): Number of elements per vector.
+        j (bint): Party number (0 or 1).
+        r_in_j, d_xj, d_yj, d_xyj (np.ndarray): Offline material of party j.
+        k_j (np.ndarray): Function key share.
+        D_y (np.ndarray): Delta shares of the reference DB.
+    """
+    cdef funshade_ctx *ctx
+    cdef readonly size_t K, l
+    cdef readonly bint j
+    cdef object _material   # Keeps the borrowed arrays alive
+
+    def __cinit__(self, size_t K, size_t l, bint j, R_t[::1] r_in_j, R_t[::1] d_xj,
+                  R_t[::1] d_yj, R_t[::1] d_xyj, uint8_t[::1] k_j, R_t[::1] D_y):
+        assert d_xj.shape[0]==d_yj.shape[0]==d_xyj.shape[0]==D_y.shape[0]==<Py_ssize_t>(K*l),\
+            "<Funshade error> All delta shares must be of length {} (K*l)".format(K*l)
+        assert r_in_j.shape[0]==<Py_ssize_t>(K), "<Funshade error> All r_in masks must be of length {} (K)".format(K)
+        assert k_j.shape[0]==<Py_ssize_t>(K*KEY_LEN), \
+            "<Funshade error> FSS keys k_j must be of length {} (K*KEY_LEN)".format(K*KEY_LEN)
+        self.ctx = funshade_ctx_new(K, l, j)
+        if self.ctx is NULL:
+            raise MemoryError("<Funshade error> could not allocate the session arena")
+        self.K, self.l, self.j = K, l, j
+        self._material = (r_in_j, d_xj, d_yj, d_xyj, k_j, D_y)
+        funshade_ctx_set_offline(self.ctx, &r_in_j[0], &d_xj[0], &d_yj[0], &d_xyj[0], &k_j[0])
+        funshade_ctx_set_db(self.ctx, &D_y[0])
+
+    def __dealloc__(self):
+        funshade_ctx_free(self.ctx)
+
+    cdef np.ndarray _view(self, R_t *ptr, size_t n):
+        # numpy view on the arena, keeping this Session alive while it exists
+        cdef np.npy_intp dims = n
+        cdef np.ndarray arr = np.PyArray_SimpleNewFromData(1, &dims, DTYPE_NUM, <void*>ptr)
+        np.set_array_base(arr, self)
+        return arr
+
+    @property
+    def D_x(self):
+        """Session-owned D_x buffer (K*l), to receive the peer's Delta share of x."""
+        return self._view(funshade_ctx_D_x(self.ctx), self.K*self.l)
+
+    def share(self, R_t[::1] x, R_t[::1] d_x):
+        """Delta share of the live template x (length l) against d_x (length K*l)."""
+        assert x.shape[0]==<Py_ssize_t>self.l and d_x.shape[0]==<Py_ssize_t>(self.K*self.l),\
+            "<Funshade error> x must be of length {} (l) and d_x of length {} (K*l)".format(self.l, self.K*self.l)
+        return self._view(funshade_ctx_share(self.ctx, &x[0], &d_x[0]), self.K*self.l)
+
+    def eval_dist(self, R_t[::1] D_x=None):
+        """Shares z_hat_j of the distances, on D_x (the Session D_x if None)."""
+        cdef const R_t *D_x_ptr = NULL
+        if D_x is not None:
+            assert D_x.shape[0]==<Py_ssize_t>(self.K*self.l),\
+                "<Funshade error> D_x must be of length {} (K*l)".format(self.K*self.l)
+            D_x_ptr = &D_x[0]
+        return self._view(funshade_ctx_eval_dist(self.ctx, D_x_ptr), self.K)
+
+    def eval_sign(self, R_t[::1] z_hat_nj):
+        """Shares o_j of the sign, given the peer's z_hat_nj and the last eval_dist."""
+        assert z_hat_nj.shape[0]==<Py_ssize_t>self.K, "<Funshade error> z_hat shares must be of length {} (K)".format(self.K)
+        return self._view(funshade_ctx_eval_sign(self.ctx, &z_hat_nj[0]), self.K)
+
+    def eval_sign_collapse(self, R_t[::1] z_hat_nj):
+        """Sum of the shares o_j of the sign, given the peer's z_hat_nj."""
+        assert z_hat_nj.shape[0]==<Py_ssize_t>self.K, "<Funshade error> z_hat shares must be of length {} (K)".format(self.K)
+        return funshade_ctx_eval_sign_collapse(self.ctx, &z_hat_nj[0])
+
+#------------------------------- ASYNCIO POOL ---------------------------------#
+@cython.no_gc_clear     # _pending keeps alive the arrays the workers write into
+cdef class Pool:
+    """Awaitable setup/eval_dist/eval_sign/eval_sign_collapse on a native thread pool.
+
+    Jobs run on C worker threads without the GIL, and complete their asyncio
+    futures from the running event loop (through a file descriptor watched with
+    loop.add_reader), so no executor thread is blocked per request. Concurrent
+    small eval_sign(_collapse) requests of the same party are coalesced into one
+    batch evaluation (up to POOL_COALESCE_K keys).
+
+    Methods must be called from within a running event loop and return
+    awaitables with the same results as the blocking functions. close() (or
+    dropping the pool) finishes the queued jobs before releasing their arrays.
+
+    Args:
+        n_threads (int): Number of worker threads (0 for one per CPU).
+    """
+    cdef funshade_pool *pool
+    cdef object _loop
+    cdef dict _pending      # job address -> (future, result or None for o_sum, kept-alive arrays)
+
+    def __cinit__(self, size_t n_threads=0):
+        self.pool = funshade_pool_new(n_threads)
+        if self.pool is NULL:
+            raise MemoryError("<Funshade error> could not start the worker pool")
+        self._pending = {}
+        self._loop = None
+
+    def __dealloc__(self):
+        self.close()
+
+    def close(self):
+        """Finish the queued jobs, completing their futures, and stop the workers.
+
+        Idempotent; no job can be submitted afterwards.
+        """
+        cdef funshade_job *job
+        if self.pool is NULL:
+            return
+        if self._loop is not None:
+            self._loop.remove_reader(funshade_pool_fd(self.pool))
+            self._loop = None
+        funshade_pool_free(self.pool)       # Joins the workers: the kept arrays are no longer written
+        self.pool = NULL
+        for addr, (fut, result, keep) in self._pending.items():
+            job = <funshade_job*><size_t>addr
+            if not fut.done() and not fut.get_loop().is_closed():
+                fut.set_result(job.o_sum if result is None else result)
+            free(job)
+        self._pending.clear()
+
+    cdef object _submit(self, funshade_job *job, object result, object keep):
+        if self.pool is NULL:
+            free(job)
+            raise RuntimeError("<Funshade error> the worker pool is closed")
+        loop = asyncio.get_running_loop()
+        if self._loop is not loop:
+            if self._loop is not None:
+                self._loop.remove_reader(funshade_pool_fd(self.pool))
+            loop.add_reader(funshade_pool_fd(self.pool), self._drain)
+            self._loop = loop
+        fut = loop.create_future()
+        if funshade_pool_submit(self.pool, job) != 0:
+            free(job)
+            raise RuntimeError("<Funshade error> the worker pool is shutting down")
+        self._pending[<size_t>job] = (fut, result, keep)
+        return fut
+
+    def _drain(self):
+        cdef funshade_job *done[64]
+        cdef size_t n, i
+        n = funshade_pool_poll(self.pool, done, 64)
+        for i in range(n):
+            fut, result, keep = self._pending.pop(<size_t>done[i])
+            if not fut.cancelled():
+                fut.set_result(done[i].o_sum if result is None else result)
+            free(done[i])
+
+    cdef funshade_job *_job(self, funshade_pool_op op, size_t K, size_t l, bint j) except NULL:
+        cdef funshade_job *job = <funshade_job*>calloc(1, sizeof(funshade_job))
+        if job is NULL:
+            raise MemoryError()
+        job.op, job.K, job.l, job.j = op, K, l, j
+        return job
+
+    def setup(self, size_t K, size_t l, R_t theta):
+        """Awaitable funshade.setup (without the overflow check)."""
+        cdef np.ndarray[R_t, ndim=1] d_x0 = np.empty((K*l), DTYPE), d_x1 = np.empty((K*l), DTYPE),\
+            d_y0 = np.empty((K*l), DTYPE), d_y1 = np.empty((K*l), DTYPE),\
+            d_xy0 = np.empty((K*l), DTYPE), d_xy1 = np.empty((K*l), DTYPE),\
+            r_in0 = np.empty((K), DTYPE), r_in1 = np.empty((K), DTYPE)
+        cdef np.ndarray[uint8_t, ndim=1] k0 = np.empty((K*KEY_LEN), np.uint8), k1 = np.empty((K*KEY_LEN), np.uint8)
+        cdef funshade_job *job = self._job(POOL_OP_SETUP, K, l, 0)
+        job.theta = theta
+        job.setup[0], job.setup[1], job.setup[2], job.setup[3] = &d_x0[0], &d_x1[0], &d_y0[0], &d_y1[0]
+        job.setup[4], job.setup[5], job.setup[6], job.setup[7] = &d_xy0[0], &d_xy1[0], &r_in0[0], &r_in1[0]
+        job.k0, job.k1 = &k0[0], &k1[0]
+        res = (d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in0, r_in1, k0, k1)
+        return self._submit(job, res, None)
+
+    def eval_dist(self, size_t K, size_t l, bint j, R_t[::1] r_in_j, R_t[::1] D_x, R_t[::1] D_y,
+                  R_t[::1] d_xj, R_t[::1] d_yj, R_t[::1] d_xyj):
+        """Awaitable funshade.eval_dist."""
+        assert D_x.shape[0]==D_y.shape[0]==d_xj.shape[0]==d_yj.shape[0]==d_xyj.shape[0]==<Py_ssize_t>(K*l),\
+            "<Funshade error> All delta shares must be of length {} (K*l)".format(K*l)
+        assert r_in_j.shape[0]==<Py_ssize_t>(K), "<Funshade error> All r_in masks must be of length {} (K)".format(K)
+        cdef np.ndarray[R_t, ndim=1] z_hat_j = np.empty((K), DTYPE)
+        cdef funshade_job *job = self._job(POOL_OP_DIST, K, l, j)
+        job.r_in_j, job.D_x, job.D_y = &r_in_j[0], &D_x[0], &D_y[0]
+        job.d_xj, job.d_yj, job.d_xyj, job.out = &d_xj[0], &d_yj[0], &d_xyj[0], &z_hat_j[0]
+        return self._submit(job, z_hat_j, (r_in_j, D_x, D_y, d_xj, d_yj, d_xyj))
+
+    cdef object _sign(self, funshade_pool_op op, size_t K, bint j, uint8_t[::1] k_j,
+                      R_t[::1] z_hat_0, R_t[::1] z_hat_1):
+        assert z_hat_0.shape[0]==z_hat_1.shape[0]==<Py_ssize_t>(K), \
+            "<Funshade error> z_hat shares must be of length {} (K)".format(K)
+        assert k_j.shape[0]==<Py_ssize_t>(K*KEY_LEN), \
+            "<Funshade error> FSS keys k_j must be of length {} (K*KEY_LEN)".format(K*KEY_LEN)
+        cdef np.ndarray[R_t, ndim=1] o_j = np.empty((K if op==POOL_OP_SIGN else 1), DTYPE)
+        cdef funshade_job *job = self._job(op, K, 0, j)
+        job.k_j, job.z_hat_0, job.z_hat_1, job.out = &k_j[0], &z_hat_0[0], &z_hat_1[0], &o_j[0]
+        return self._submit(job, o_j if op==POOL_OP_SIGN else None, (k_j, z_hat_0, z_hat_1))
+
+    def eval_sign(self, size_t K, bint j, uint8_t[::1] k_j, R_t[::1] z_hat_0, R_t[::1] z_hat_1):
+        """Awaitable funshade.eval_sign."""
+        return self._sign(POOL_OP_SIGN, K, j, k_j, z_hat_0, z_hat_1)
+
+    def eval_sign_collapse(self, size_t K, bint j, uint8_t[::1] k_j, R_t[::1] z_hat_0, R_t[::1] z_hat_1):
+        """Awaitable funshade.eval_sign_collapse."""
+        return self._sign(POOL_OP_SIGN_COLLAPSE, K, j, k_j, z_hat_0, z_hat_1)
+
+#--------------------------- SHARED-MEMORY CHANNEL ----------------------------#
+cdef class _ChanMap:
+    """Owner of a channel mapping, shared by the Channel and its arrays."""
+    cdef funshade_chan *ch
+
+    def __dealloc__(self):
+        funshade_chan_close(self.ch)
+
+@cython.no_gc_clear     # close() needs ch, which _map frees
+cdef class Channel:
+    """Zero-copy channel to a co-located party, over shared memory.
+
+    Channel(name=None, capacity) creates side 0 (anonymous memfd if name is
+    None); the peer joins with Channel(fd=...) (the creator's fileno(), passed
+    on fork or over a Unix socket) or Channel(name, join=True).
+
+    reserve(n) returns a writable array inside the outgoing ring, e.g. the out
+    of eval_dist, published by commit(). recv() returns the next message in
+    place (to feed eval_sign directly), valid until release(). Both arrays are
+    views into the channel: they must not be used after release() or, for a
+    committed message, after the next reserve(). close() only ends the
+    exchange; the mapping lives until the last of these arrays is freed.
+
+    Args:
+        name (str): Name of the POSIX shm object, or None.
+        capacity (int): Bytes per direction.
+        fd (int): Join the channel of this file descriptor.
+        join (bool): Join the channel called name.
+    """
+    cdef funshade_chan *ch
+    cdef _ChanMap _map                  # base of the arrays returned
+
+    def __cinit__(self, name=None, size_t capacity=CHAN_DEFAULT_CAPACITY, fd=None, bint join=False):
+        cdef bytes name_b = None if name is None else name.encode()
+        cdef const char *c_name = NULL
+        assert name is not None or not join, "<Funshade error> join requires the channel name"
+        if name_b is not None:
+            c_name = name_b
+        if fd is not None:
+            self.ch = funshade_chan_attach(fd)
+        elif join:
+            self.ch = funshade_chan_open(c_name)
+        else:
+            self.ch = funshade_chan_create(c_name, capacity)
+        if self.ch is NULL:
+            raise OSError("<Funshade error> could not {} the channel".format("create" if fd is None and not join else "join"))
+        self._map = _ChanMap()
+        self._map.ch = self.ch
+
+    def __dealloc__(self):
+        self.close()
+
+    cdef funshade_chan *_ch(self) except NULL:
+        if self.ch is NULL:
+            raise ValueError("<Funshade error> the channel is closed")
+        return self.ch
+
+    cdef np.ndarray _view(self, const void *ptr, size_t n_bytes, dtype):
+        cdef object dt = np.dtype(dtype)
+        cdef np.npy_intp dims = n_bytes // dt.itemsize
+        cdef np.ndarray arr = np.PyArray_SimpleNewFromData(1, &dims, dt.num, <void*>ptr)
+        np.set_array_base(arr, self._map)
+        return arr
+
+    def fileno(self):
+        """File descriptor of the shared mapping, for the peer to join."""
+        return funshade_chan_fd(self._ch())
+
+    @property
+    def max_msg(self):
+        """Largest message, in bytes."""
+        return funshade_chan_max_msg(self._ch())
+
+    def reserve(self, size_t n, dtype=DTYPE):
+        """Writable array of n elements for the next message (waits for space)."""
+        cdef funshade_chan *ch = self._ch()
+        cdef size_t n_bytes = n*np.dtype(dtype).itemsize
+        cdef void *ptr
+        with nogil:
+            ptr = funshade_chan_reserve(ch, n_bytes)
+        if ptr is NULL:
+            raise BrokenPipeError("<Funshade error> message too large or peer closed")
+        return self._view(ptr, n_bytes, dtype)
+
+    def commit(self):
+        """Publish the reserved message."""
+        funshade_chan_commit(self._ch())
+
+    def send(self, arr):
+        """Copy arr as one message."""
+        cdef funshade_chan *ch = self._ch()
+        cdef const uint8_t[::1] buf = np.ascontiguousarray(arr).reshape(-1).view(np.uint8)
+        cdef const uint8_t *ptr = &buf[0] if buf.shape[0] else NULL
+        cdef int ret
+        with nogil:
+            ret = funshade_chan_send(ch, ptr, buf.shape[0])
+        if ret != 0:
+            raise BrokenPipeError("<Funshade error> message too large or peer closed")
+
+    def recv(self, dtype=DTYPE, int timeout=-1):
+        """Next message as an array, in place, or None on timeout (ms) or end."""
+        cdef funshade_chan *ch = self._ch()
+        cdef size_t n_bytes
+        cdef const void *ptr
+        with nogil:
+            ptr = funshade_chan_recv(ch, &n_bytes, timeout)
+        if ptr is NULL and n_bytes == CHAN_BAD_MSG:
+            raise OSError("<Funshade error> corrupt message from the peer")
+        return None if ptr is NULL else self._view(ptr, n_bytes, dtype)
+
+    def release(self):
+        """Give the space of the last received message back."""
+        funshade_chan_release(self._ch())
+
+    def close(self):
+        """Close this side: the peer's recv returns None once drained.
+
+        The rings are unmapped once no array from recv() or reserve() is alive.
+        """
+        if self.ch is not NULL:
+            funshade_chan_shutdown(self.ch)
+            self.ch = NULL
+            self._map = None
 
 #--------------------------------- FSS GATE -----------------------------------#
 def FssGenSign(size_t K, R_t theta):
@@ -199,6 +1086,196 @@ def FssEvalSign(size_t K, bool j, uint8_t[::1] k_j, R_t[::1] x_hat):
     SIGN_eval_batch(K, j, &k_j[0], &x_hat[0], &o_j[0])
     return o_j
 
+def FssGenDcf(size_t K, R_t[::1] alpha):
+    """FssGenDcf generates the function keys of K DCF gates, one per comparison point.
+
+    Args:
+        K (int): Number of gates.
+        alpha (np.ndarray): comparison points, one per gate.
+
+    Returns:
+        k0, k1 (np.ndarray): function keys.
+    """
+    assert alpha.shape[0]==<Py_ssize_t>(K), \
+        "<FssGenDcf error> alpha must be of length {} (K)".format(K)
+    cdef np.ndarray[uint8_t, ndim=1] k0 = np.empty((K*KEY_LEN), np.uint8), k1 = np.empty((K*KEY_LEN), np.uint8)
+    DCF_gen_batch(K, &alpha[0], &k0[0], &k1[0])
+    return k0, k1
+
+def FssEvalDcf(size_t K, bool j, uint8_t[::1] k_j, R_t[::1] x_hat):
+    """FssEvalDcf evaluates K DCF gates in semi-honest setting.
+
+    Args:
+        K (int): Number of input values.
+        j (bool): Party index (0 or 1)
+        k_j (np.ndarray): Function key shares of FssGenDcf.
+        x_hat (np.ndarray): public input values.
+
+    Returns:
+        o_j (np.ndarray): shares of (x_hat < alpha), unsigned comparison.
+    """
+    assert x_hat.shape[0]==<Py_ssize_t>(K), \
+        "<FssEvalDcf error> x_hat must be of length {} (K)".format(K)
+    assert k_j.shape[0]==<Py_ssize_t>(K*KEY_LEN), \
+        "<FssEvalDcf error> FSS keys k_j must be of length {} (K*KEY_LEN)".format(K*KEY_LEN)
+    cdef np.ndarray[R_t, ndim=1] o_j = np.empty((K), DTYPE)
+    DCF_eval_batch(K, j, &k_j[0], &x_hat[0], &o_j[0])
+    return o_j
+
+def FssGenIc(size_t K, R_t[::1] p, R_t[::1] q):
+    """FssGenIc generates the input masks and the function keys of K interval
+    containment gates, with bounds [p[k], q[k]] per element (e.g. age bands).
+
+    Args:
+        K (int): Number of input values.
+        p, q (np.ndarray): lower and upper bounds (inclusive, unsigned), one per input.
+
+    Returns:
+        r_in0, r_in1 (np.ndarray): shares of the input masks.
+        k0, k1 (np.ndarray): function keys.
+    """
+    assert p.shape[0]==<Py_ssize_t>(K) and q.shape[0]==<Py_ssize_t>(K), \
+        "<FssGenIc error> p and q must be of length {} (K)".format(K)
+    cdef np.ndarray[R_t, ndim=1] r_in0 = np.empty((K), DTYPE), r_in1 = np.empty((K), DTYPE)
+    cdef np.ndarray[uint8_t, ndim=1] k0 = np.empty((K*KEY_LEN), np.uint8), k1 = np.empty((K*KEY_LEN), np.uint8)
+    IC_gen_batch(K, &p[0], &q[0], &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+    return r_in0, r_in1, k0, k1
+
+def FssEvalIc(size_t K, bool j, R_t[::1] p, R_t[::1] q, uint8_t[::1] k_j, R_t[::1] x_hat):
+    """FssEvalIc evaluates K interval containment gates in semi-honest setting.
+
+    Args:
+        K (int): Number of input values.
+        j (bool): Party index (0 or 1)
+        p, q (np.ndarray): the bounds given to FssGenIc.
+        k_j (np.ndarray): Function key shares of FssGenIc.
+        x_hat (np.ndarray): masked input values (x + r_in0 + r_in1).
+
+    Returns:
+        o_j (np.ndarray): shares of (p <= x <= q).
+    """
+    assert x_hat.shape[0]==<Py_ssize_t>(K) and p.shape[0]==<Py_ssize_t>(K) and q.shape[0]==<Py_ssize_t>(K), \
+        "<FssEvalIc error> x_hat, p and q must be of length {} (K)".format(K)
+    assert k_j.shape[0]==<Py_ssize_t>(K*KEY_LEN), \
+        "<FssEvalIc error> FSS keys k_j must be of length {} (K*KEY_LEN)".format(K*KEY_LEN)
+    cdef np.ndarray[R_t, ndim=1] o_j = np.empty((K), DTYPE)
+    IC_eval_batch(K, j, &p[0], &q[0], &k_j[0], &x_hat[0], &o_j[0])
+    return o_j
+
+def FssGenEq(size_t K, R_t theta):
+    """FssGenEq generates the input masks and the DPF keys for 2PC equality tests (z == theta).
+
+    Args:
+        K (int): Number of input values.
+        theta (int): Value to compare with (e.g. an ID or tag).
+
+    Returns:
+        r_in0, r_in1 (np.ndarray): shares of the input masks.
+        k0, k1 (np.ndarray): function keys (K*DPF_KEY_LEN bytes, shorter than the sign keys).
+    """
+    cdef np.ndarray[R_t, ndim=1] r_in0 = np.empty((K), DTYPE), r_in1 = np.empty((K), DTYPE)
+    cdef np.ndarray[uint8_t, ndim=1] k0 = np.empty((K*DPF_KEY_LEN), np.uint8), k1 = np.empty((K*DPF_KEY_LEN), np.uint8)
+    EQ_gen_batch(K, theta, &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+    return r_in0, r_in1, k0, k1
+
+def FssEvalEq(size_t K, bool j, uint8_t[::1] k_j, R_t[::1] x_hat):
+    """FssEvalEq evaluates the equality gate in semi-honest setting.
+
+    Args:
+        K (int): Number of input values.
+        j (bool): Party index (0 or 1)
+        k_j (np.ndarray): Function key shares of FssGenEq.
+        x_hat (np.ndarray): masked input values.
+
+    Returns:
+        o_j (np.ndarray): shares of (z == theta).
+    """
+    assert x_hat.shape[0]==<Py_ssize_t>(K), \
+        "<FssEvalEq error> x_hat shares must be of length {} (K)".format(K)
+    assert k_j.shape[0]==<Py_ssize_t>(K*DPF_KEY_LEN), \
+        "<FssEvalEq error> FSS keys k_j must be of length {} (K*DPF_KEY_LEN)".format(K*DPF_KEY_LEN)
+    cdef np.ndarray[R_t, ndim=1] o_j = np.empty((K), DTYPE)
+    EQ_eval_batch(K, j, &k_j[0], &x_hat[0], &o_j[0])
+    return o_j
+
+def spline_relu():
+    """Spline of ReLU(x) = max(x, 0) for FssGenSpline/FssEvalSpline.
+
+    Returns:
+        brk, coef (np.ndarray): breakpoints and coefficients (degree 1).
+    """
+    cdef np.ndarray[R_t, ndim=1] brk = np.empty((2), DTYPE), coef = np.empty((4), DTYPE)
+    SPLINE_relu(&brk[0], &coef[0])
+    return brk, coef
+
+def spline_sigmoid(size_t frac_bits, size_t n_seg=8):
+    """Piecewise-linear spline of the sigmoid for FssGenSpline/FssEvalSpline.
+
+    Inputs have frac_bits fractional bits, outputs 2*frac_bits. The sigmoid is
+    interpolated on n_seg segments of [0, 8) and mirrored for negative inputs.
+
+    Returns:
+        brk, coef (np.ndarray): breakpoints and coefficients (degree 1).
+    """
+    cdef size_t m = SPLINE_SIGMOID_M(n_seg)
+    cdef np.ndarray[R_t, ndim=1] brk = np.empty((m), DTYPE), coef = np.empty((2*m), DTYPE)
+    assert n_seg > 0 and SPLINE_sigmoid(frac_bits, n_seg, &brk[0], &coef[0]) == 0, \
+        "<spline_sigmoid error> no sigmoid spline for frac_bits={}, n_seg={}".format(frac_bits, n_seg)
+    return brk, coef
+
+def spline_key_len(size_t m, size_t d):
+    """Bytes of a spline key with m pieces of degree d."""
+    return SPLINE_KEY_LEN(m, d)
+
+def FssGenSpline(size_t K, R_t[::1] brk, R_t[::1] coef):
+    """FssGenSpline generates the input masks and the function keys of K spline
+    gates, all evaluating the same piecewise polynomial f (e.g. an activation).
+
+    Args:
+        K (int): Number of input values.
+        brk (np.ndarray): m breakpoints, brk[0] = 0 and strictly increasing (unsigned).
+            Piece i covers [brk[i], brk[i+1]), the last one up to the ring size.
+        coef (np.ndarray): m*(d+1) coefficients, coef[i*(d+1)+k] of x^k in piece i.
+
+    Returns:
+        r_in0, r_in1 (np.ndarray): shares of the input masks.
+        k0, k1 (np.ndarray): function keys (K*spline_key_len(m, d) bytes).
+    """
+    cdef size_t m = brk.shape[0], d
+    assert m > 0 and coef.shape[0] % m == 0 and coef.shape[0] >= <Py_ssize_t>(m), \
+        "<FssGenSpline error> coef must hold (d+1) coefficients per breakpoint"
+    d = coef.shape[0]//m - 1
+    assert SPLINE_check(m, d, &brk[0]) == 0, "<FssGenSpline error> invalid spline (m={}, d={})".format(m, d)
+    cdef np.ndarray[R_t, ndim=1] r_in0 = np.empty((K), DTYPE), r_in1 = np.empty((K), DTYPE)
+    cdef np.ndarray[uint8_t, ndim=1] k0 = np.empty((K*SPLINE_KEY_LEN(m, d)), np.uint8), \
+                                     k1 = np.empty((K*SPLINE_KEY_LEN(m, d)), np.uint8)
+    SPLINE_gen_batch(K, m, d, &brk[0], &coef[0], &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+    return r_in0, r_in1, k0, k1
+
+def FssEvalSpline(size_t K, bool j, R_t[::1] brk, size_t d, uint8_t[::1] k_j, R_t[::1] x_hat):
+    """FssEvalSpline evaluates K spline gates in semi-honest setting.
+
+    Args:
+        K (int): Number of input values.
+        j (bool): Party index (0 or 1)
+        brk (np.ndarray): the breakpoints given to FssGenSpline.
+        d (int): degree of the pieces.
+        k_j (np.ndarray): Function key shares of FssGenSpline.
+        x_hat (np.ndarray): masked input values (x + r_in0 + r_in1).
+
+    Returns:
+        o_j (np.ndarray): shares of f(x).
+    """
+    cdef size_t m = brk.shape[0]
+    assert x_hat.shape[0]==<Py_ssize_t>(K), \
+        "<FssEvalSpline error> x_hat must be of length {} (K)".format(K)
+    assert SPLINE_check(m, d, &brk[0]) == 0, "<FssEvalSpline error> invalid spline (m={}, d={})".format(m, d)
+    assert k_j.shape[0]==<Py_ssize_t>(K*SPLINE_KEY_LEN(m, d)), \
+        "<FssEvalSpline error> FSS keys k_j must be of length {} (K*spline_key_len(m, d))".format(K*SPLINE_KEY_LEN(m, d))
+    cdef np.ndarray[R_t, ndim=1] o_j = np.empty((K), DTYPE)
+    SPLINE_eval_batch(K, m, d, j, &brk[0], &k_j[0], &x_hat[0], &o_j[0])
+    return o_j
+
 #...................... Outside the scope of Funshade .........................#
 def setup_ss(size_t K, size_t l, R_t theta):
     """Setup for the additive secret sharing.
@@ -268,3 +1345,54 @@ def eval_dist_ss(size_t K, size_t l, bint j, R_t[::1] r_in_j, R_t[::1] d, R_t[::
     cdef np.ndarray[R_t, ndim=1] z_hat_j = np.empty((K), DTYPE)
     funshade_eval_dist_ss_batch(K, l, j, &r_in_j[0], &d[0], &e[0], &aj[0], &bj[0], &cj[0], &z_hat_j[0])
     return z_hat_j
+
+#--------------------------------- BENCHMARK ----------------------------------#
+BENCH_FUNCTIONS = ['setup', 'share', 'eval_dist', 'eval_sign', 'eval_sign_collapse']
+
+def bench_c(fn, size_t K, size_t l, size_t reps=5):
+    """Time the C function behind a wrapper, without the Python layer.
+
+    Inputs are allocated and generated once; each of the reps calls is timed
+    in C with trace_now. The reference for the binding overhead of bench.py.
+
+    Args:
+        fn (str): Wrapper name, one of BENCH_FUNCTIONS.
+        K (int): Number of vectors.
+        l (int): Number of elements per vector.
+        reps (int): Number of timed calls.
+
+    Returns:
+        t (np.ndarray): Duration of each call, in ns.
+    """
+    assert fn in BENCH_FUNCTIONS, "<Funshade error> fn must be one of {}".format(BENCH_FUNCTIONS)
+    cdef int f = BENCH_FUNCTIONS.index(fn)
+    cdef np.ndarray[R_t, ndim=1] d_x0  =\
+                np.empty((K*l), DTYPE), d_x1  = np.empty((K*l), DTYPE),\
+        d_y0  = np.empty((K*l), DTYPE), d_y1  = np.empty((K*l), DTYPE),\
+        d_xy0 = np.empty((K*l), DTYPE), d_xy1 = np.empty((K*l), DTYPE),\
+        r_in0 = np.empty((K),   DTYPE), r_in1 = np.empty((K),   DTYPE),\
+        D_x   = np.empty((K*l), DTYPE), z_hat = np.empty((K),   DTYPE), o = np.empty((K), DTYPE)
+    cdef np.ndarray[uint8_t, ndim=1] k0 = np.empty((K*KEY_LEN), np.uint8), k1 = np.empty((K*KEY_LEN), np.uint8)
+    cdef np.ndarray[uint64_t, ndim=1] t = np.empty((reps), np.uint64)
+    cdef size_t r
+    cdef uint64_t t0
+    assert K > 0 and l > 0, "<Funshade error> K and l must be positive"
+    funshade_setup_batch(K, l, 0,
+        &d_x0[0], &d_x1[0], &d_y0[0], &d_y1[0], &d_xy0[0], &d_xy1[0], &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+    funshade_share_batch(K, l, &d_y0[0], &d_x0[0], &D_x[0])
+    funshade_eval_dist_batch(K, l, 0, &r_in0[0], &D_x[0], &D_x[0], &d_x0[0], &d_y0[0], &d_xy0[0], &z_hat[0])
+    for r in range(reps):
+        t0 = funshade_trace_now()
+        if f == 0:
+            funshade_setup_batch(K, l, 0,
+                &d_x0[0], &d_x1[0], &d_y0[0], &d_y1[0], &d_xy0[0], &d_xy1[0], &r_in0[0], &r_in1[0], &k0[0], &k1[0])
+        elif f == 1:
+            funshade_share_batch(K, l, &d_y0[0], &d_x0[0], &D_x[0])
+        elif f == 2:
+            funshade_eval_dist_batch(K, l, 0, &r_in0[0], &D_x[0], &D_x[0], &d_x0[0], &d_y0[0], &d_xy0[0], &z_hat[0])
+        elif f == 3:
+            funshade_eval_sign_batch(K, 0, &k0[0], &z_hat[0], &z_hat[0], &o[0])
+        else:
+            funshade_eval_sign_batch_collapse(K, 0, &k0[0], &z_hat[0], &z_hat[0])
+        t[r] = funshade_trace_now() - t0
+    return t
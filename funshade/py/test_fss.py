@@ -58,6 +58,45 @@ P1.o_j = funshade.FssEvalSign(K, P1.j, P1.k_j, P1.z_hat_j)
 # (5) Reconstruct the final result
 o = P0.o_j + P1.o_j
 
+#%%
+#==============================================================================#
+#                                  OTHER GATES                                 #
+#==============================================================================#
+# Range checks with one interval per element (e.g. age bands), and raw comparisons
+ages = rng.integers(0, 100, size=K, dtype=funshade.DTYPE)
+lo = rng.integers(0, 80, size=K, dtype=funshade.DTYPE)
+hi = lo + rng.integers(0, 20, size=K, dtype=funshade.DTYPE)
+r_in0, r_in1, k0, k1 = funshade.FssGenIc(K, lo, hi)
+ages_hat = ages + r_in0 + r_in1
+o_ic = funshade.FssEvalIc(K, 0, lo, hi, k0, ages_hat) + funshade.FssEvalIc(K, 1, lo, hi, k1, ages_hat)
+assert np.array_equal(o_ic, (lo <= ages) & (ages <= hi))
+k0, k1 = funshade.FssGenDcf(K, hi)
+o_dcf = funshade.FssEvalDcf(K, 0, k0, ages) + funshade.FssEvalDcf(K, 1, k1, ages)
+assert np.array_equal(o_dcf, ages < hi)
+
+# Exact match of secret-shared IDs with the DPF equality gate
+ids = rng.integers(0, 8, size=K, dtype=funshade.DTYPE)
+ids_0 = rng.integers(-2**20, 2**20, size=K, dtype=funshade.DTYPE)
+r_in0, r_in1, k0, k1 = funshade.FssGenEq(K, 3)
+ids_hat = (ids_0 + r_in0) + (ids - ids_0 + r_in1)
+o_eq = funshade.FssEvalEq(K, 0, k0, ids_hat) + funshade.FssEvalEq(K, 1, k1, ids_hat)
+assert np.array_equal(o_eq, ids == 3)
+
+# Activations on masked values with the spline gate: ReLU, and the sigmoid on
+#  8 fractional bits (output on 16) within 0.02 of the real one
+vals = rng.integers(-2**12, 2**12, size=K, dtype=funshade.DTYPE)
+brk, coef = funshade.spline_relu()
+r_in0, r_in1, k0, k1 = funshade.FssGenSpline(K, brk, coef)
+vals_hat = vals + r_in0 + r_in1
+o_relu = funshade.FssEvalSpline(K, 0, brk, 1, k0, vals_hat) + funshade.FssEvalSpline(K, 1, brk, 1, k1, vals_hat)
+assert np.array_equal(o_relu, np.maximum(vals, 0))
+brk, coef = funshade.spline_sigmoid(8)
+r_in0, r_in1, k0, k1 = funshade.FssGenSpline(K, brk, coef)
+assert k0.shape[0] == K*funshade.spline_key_len(brk.shape[0], 1)
+vals_hat = vals + r_in0 + r_in1
+o_sig = funshade.FssEvalSpline(K, 0, brk, 1, k0, vals_hat) + funshade.FssEvalSpline(K, 1, brk, 1, k1, vals_hat)
+assert np.max(np.abs(o_sig/2**16 - 1/(1+np.exp(-vals/2**8)))) < 0.02
+
 #%%
 #==============================================================================#
 #                              CHECK CORRECTNESS                               #
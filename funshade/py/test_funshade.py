@@ -45,7 +45,7 @@ Gate = party(1) # P1
 #                                 OFFLINE PHASE                                #
 #==============================================================================#
 # (1) Generate correlated randomness (Semi-Honest third party, TEE, 2PC interaction)
-d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in0, r_in1, k0, k1 = funshade.setup(K, l, theta_fp)
+d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in0, r_in1, k0, k1 = funshade.setup(K, l, theta_fp, max_el)
 
 # Distribute randomness to (P0, P1)
 BP.d_x_j  = d_x0;            Gate.d_x_j  = d_x1
@@ -57,6 +57,11 @@ BP.d_y    = d_y0 + d_y1;     Gate.d_x    = d_x0 + d_x1
 # (2) Get and secret share the reference DB (Y)
 BP.Y    = Y.flatten()                       # Biometric Provider (BP) receives reference DB (enrollment)
 BP.D_y = funshade.share(K, l, BP.Y, BP.d_y) # BP generates Delta share of Y
+assert np.array_equal(BP.D_y,                # Quantized templates share alike
+        funshade.share_quantized(K, l, BP.Y.astype(np.int16), BP.d_y))
+assert np.all(np.abs(BP.D_y -                 # Float templates quantized (rounded) and shared in one pass
+        funshade.share_float(K, l, Y_float.astype(np.float32), BP.d_y, max_el)) <= 1)
+assert theta_fp == funshade.scale_threshold(theta, max_el)
 Gate.D_y = BP.D_y                           # BP: Send(D_y) --> Gate   
 del BP.Y                                    # Delete the plaintext reference DB
 
@@ -86,6 +91,178 @@ Gate.o_j   = funshade.eval_sign(K, Gate.j, Gate.k_j, Gate.z_hat_j, Gate.z_hat_nj
 # (5) Reconstruct the final result
 o = BP.o_j + Gate.o_j
 
+# Same online phase with reusable sessions (no per-query output allocations)
+BP.sess   = funshade.Session(K, l, BP.j,   BP.r_in_j,   BP.d_x_j,   BP.d_y_j,   BP.d_xy_j,   BP.k_j,   BP.D_y)
+Gate.sess = funshade.Session(K, l, Gate.j, Gate.r_in_j, Gate.d_x_j, Gate.d_y_j, Gate.d_xy_j, Gate.k_j, Gate.D_y)
+BP.sess.D_x[:] = Gate.sess.share(x, Gate.d_x)                 # Gate: Send(D_x) --> BP
+assert np.array_equal(BP.sess.eval_dist(),   BP.z_hat_j)
+assert np.array_equal(Gate.sess.eval_dist(), Gate.z_hat_j)
+assert np.array_equal(BP.sess.eval_sign(Gate.z_hat_j) + Gate.sess.eval_sign(BP.z_hat_j), o)
+
+# Same online phase with awaitables on the native pool, as an event-loop server
+#  would run it: concurrent small eval_sign requests are coalesced in C.
+import asyncio
+async def online_async(pool: funshade.Pool, n_req: int = 10):
+    z_hat_0 = await pool.eval_dist(K, l, BP.j, BP.r_in_j, BP.D_x, BP.D_y, BP.d_x_j, BP.d_y_j, BP.d_xy_j)
+    z_hat_1 = await pool.eval_dist(K, l, Gate.j, Gate.r_in_j, Gate.D_x, Gate.D_y, Gate.d_x_j, Gate.d_y_j, Gate.d_xy_j)
+    KEY_LEN = BP.k_j.size // K
+    chunks = np.array_split(np.arange(K), n_req)
+    o_parts = await asyncio.gather(*[
+        pool.eval_sign(c.size, p.j, p.k_j[c[0]*KEY_LEN:(c[-1]+1)*KEY_LEN], z_hat_0[c], z_hat_1[c])
+        for p in (BP, Gate) for c in chunks])
+    o_sum = await pool.eval_sign_collapse(K, Gate.j, Gate.k_j, z_hat_0, z_hat_1)
+    return z_hat_0, z_hat_1, np.concatenate(o_parts[:n_req]) + np.concatenate(o_parts[n_req:]), o_sum
+pool = funshade.Pool(4)
+z_hat_0, z_hat_1, o_async, o_sum = asyncio.run(online_async(pool))
+assert np.array_equal(z_hat_0, BP.z_hat_j) and np.array_equal(z_hat_1, Gate.z_hat_j)
+assert np.array_equal(o_async, o) and o_sum == Gate.o_j.sum(dtype=funshade.DTYPE)
+pool.close()
+# Closing with jobs in flight finishes them first; closing again is a no-op
+async def close_in_flight(pool: funshade.Pool):
+    futs = [pool.eval_sign_collapse(K, Gate.j, Gate.k_j, BP.z_hat_j, Gate.z_hat_j) for _ in range(4)]
+    pool.close(); pool.close()
+    try:
+        pool.eval_sign_collapse(K, Gate.j, Gate.k_j, BP.z_hat_j, Gate.z_hat_j)
+    except RuntimeError:
+        pass
+    else:
+        raise AssertionError("submit after close")
+    return await asyncio.gather(*futs)
+assert all(o_c == o_sum for o_c in asyncio.run(close_in_flight(funshade.Pool(2))))
+
+# Host tuning (calibrated once, then loaded from the cache) leaves results unchanged
+import os, tempfile
+tune_path = os.path.join(tempfile.mkdtemp(), "funshade_tune")
+assert funshade.tune(tune_path)[0] == 1 and funshade.tune(tune_path)[0] == 0
+assert np.array_equal(funshade.eval_dist(K, l, BP.j, BP.r_in_j, BP.D_x, BP.D_y, BP.d_x_j, BP.d_y_j, BP.d_xy_j), BP.z_hat_j)
+assert np.array_equal(funshade.eval_sign(K, BP.j, BP.k_j, BP.z_hat_j, Gate.z_hat_j) +
+                      funshade.eval_sign(K, Gate.j, Gate.k_j, BP.z_hat_j, Gate.z_hat_j), o)
+os.remove(tune_path)
+assert funshade.backend().startswith("prg=")                       # ISA picked at load time
+
+# Latency tracing of the online stages, with the exchange timed by the caller
+funshade.trace_reset()
+funshade.trace_enable(events=True)
+BP.z_hat_j = funshade.eval_dist(K, l, BP.j, BP.r_in_j, BP.D_x, BP.D_y, BP.d_x_j, BP.d_y_j, BP.d_xy_j)
+t0 = funshade.trace_now()
+funshade.trace_record("exchange", t0, funshade.trace_now())
+funshade.eval_sign(K, BP.j, BP.k_j, BP.z_hat_j, Gate.z_hat_j)
+funshade.trace_disable()
+stats = funshade.trace_stats()
+assert set(stats) == {"eval_dist", "exchange", "eval_sign"} and stats["eval_sign"]["count"] == 1
+assert stats["eval_sign"]["min"] <= stats["eval_sign"]["p50"] <= stats["eval_sign"]["max"]
+trace_path = os.path.join(tempfile.mkdtemp(), "trace.json")
+funshade.trace_dump_chrome(trace_path)
+import json
+assert len(json.load(open(trace_path))["traceEvents"]) == 3
+os.remove(trace_path)
+funshade.trace_reset()
+
+# Calls logged with their sizes, saved and replayed from 2 threads at 1x and 100x
+funshade.trace_enable(calls=True)
+for Ks in (1, K//2, K):
+    funshade.eval_dist(Ks, l, BP.j, BP.r_in_j[:Ks], BP.D_x[:Ks*l], BP.D_y[:Ks*l], BP.d_x_j[:Ks*l], BP.d_y_j[:Ks*l], BP.d_xy_j[:Ks*l])
+    funshade.eval_sign_collapse(Ks, BP.j, BP.k_j[:Ks*funshade.key_len()], BP.z_hat_j[:Ks], Gate.z_hat_j[:Ks])
+funshade.trace_disable()
+calls_path = os.path.join(tempfile.mkdtemp(), "calls.bin")
+assert funshade.trace_save_calls(calls_path) == 6
+reports, saturation = funshade.replay(calls_path, [1, 100], n_threads=2)
+assert [r["n_calls"] for r in reports] == [6, 6] and reports[0]["elements"] == 2*(1 + K//2 + K)
+assert all(r["p50"] <= r["p99"] <= r["max"] for r in reports) and saturation in (None, 1.0, 100.0)
+os.remove(calls_path)
+funshade.trace_reset()
+
+# Many-to-many: M probes against the K references with one matrix triple
+M = 4
+X = Y[:M].flatten()
+A0, A1, B0, B1, C0, C1, r_in0, r_in1, k0, k1 = funshade.setup_matrix(M, K, l, theta_fp)
+D_X = funshade.share(M, l, X, A0 + A1)
+D_Y = funshade.share(K, l, Y.flatten(), B0 + B1)
+z_hat_0 = funshade.eval_dist_matrix(M, K, l, 0, r_in0, D_X, D_Y, A0, B0, C0)
+z_hat_1 = funshade.eval_dist_matrix(M, K, l, 1, r_in1, D_X, D_Y, A1, B1, C1)
+assert np.array_equal(z_hat_0 + z_hat_1 - r_in0 - r_in1, (Y[:M]@Y.T).flatten())
+o_mm = funshade.eval_sign(M*K, 0, k0, z_hat_0, z_hat_1) + funshade.eval_sign(M*K, 1, k1, z_hat_0, z_hat_1)
+assert np.array_equal(o_mm, ((Y[:M]@Y.T) >= theta_fp).flatten())
+
+# Sign gate on the bit width of the scores only: shorter keys, faster eval_sign
+n_bits = funshade.sign_bits(l, max_el)
+*_, r_in0, r_in1, k0, k1 = funshade.setup(K, l, theta_fp, max_el, n_bits=n_bits)
+assert k0.size == K*funshade.key_len(n_bits) < K*funshade.key_len()
+z_hat_0, z_hat_1 = x@Y.T + r_in0, r_in1
+assert np.array_equal(funshade.eval_sign(K, 0, k0, z_hat_0, z_hat_1, n_bits) +
+                      funshade.eval_sign(K, 1, k1, z_hat_0, z_hat_1, n_bits), o)
+
+# Material derived from a master seed: two halves dealt apart equal the whole batch
+seed = rng.bytes(16)
+full = funshade.setup(K, l, theta_fp, seed=seed)
+lo, hi = funshade.setup(K//2, l, theta_fp, seed=seed), funshade.setup(K-K//2, l, theta_fp, seed=seed, offset=K//2)
+assert all(np.array_equal(f, np.concatenate((a, b))) for f, a, b in zip(full, lo, hi))
+*_, r_in0, r_in1, k0, k1 = full
+z_hat_0, z_hat_1 = x@Y.T + r_in0, r_in1
+assert np.array_equal(funshade.eval_sign(K, 0, k0, z_hat_0, z_hat_1) + funshade.eval_sign(K, 1, k1, z_hat_0, z_hat_1), o)
+
+# Squared-L2 distance (match if <= theta) and cosine similarity on shared norms
+for metric, below in (('sq_l2', True), ('cos', False)):
+    if metric == 'cos':
+        Xm = np.hstack((x[None, :], np.rint(np.linalg.norm(x[None, :], axis=1, keepdims=True)))).astype(funshade.DTYPE)
+        Ym = np.hstack((Y, np.rint(np.linalg.norm(Y, axis=1, keepdims=True)))).astype(funshade.DTYPE)
+        th = funshade.cos_threshold(0.02)
+        score = (Y@x)*2**16 - th*Ym[:, -1]*Xm[0, -1]
+        expected = score >= 0
+    else:
+        Xm, Ym = x[None, :], Y
+        score = ((Y - x)**2).sum(axis=1)
+        th = int(np.median(score))
+        expected = score <= th
+    lm = Xm.shape[1]
+    d_x0, d_x1, d_y0, d_y1, d_xy0, d_xy1, r_in0, r_in1, k0, k1 = funshade.setup(K, lm, th, metric=metric, below=below)
+    D_x = funshade.share(K, lm, np.tile(Xm, (K, 1)).flatten(), d_x0 + d_x1)
+    D_y = funshade.share(K, lm, Ym.flatten(), d_y0 + d_y1)
+    z_hat_0 = funshade.eval_dist(K, lm, 0, r_in0, D_x, D_y, d_x0, d_y0, d_xy0, metric=metric, below=below, theta=th)
+    z_hat_1 = funshade.eval_dist(K, lm, 1, r_in1, D_x, D_y, d_x1, d_y1, d_xy1, metric=metric, below=below, theta=th)
+    o_m = funshade.eval_sign(K, 0, k0, z_hat_0, z_hat_1) + funshade.eval_sign(K, 1, k1, z_hat_0, z_hat_1)
+    assert np.array_equal(o_m, expected), metric
+
+# Reference DB kept across queries: masks refreshed in place (resharing, then
+#  rotation) and the material of the next query dealt against them, without Y
+db_y0, db_y1 = BP.d_y_j.copy(), Gate.d_y_j.copy()                  # dealer's copy of the masks
+D_y_j, d_y_j = [BP.D_y.copy(), Gate.D_y.copy()], [BP.d_y_j.copy(), Gate.d_y_j.copy()]
+for rotate in (False, True):
+    e, e0, e1 = funshade.refresh_gen(K, l, db_y0, db_y1, rotate)
+    for j, e_j in ((0, e0), (1, e1)):
+        funshade.refresh(K, l, e, e_j, D_y_j[j], d_y_j[j])
+    assert np.array_equal(D_y_j[0], D_y_j[1]) and np.array_equal(D_y_j[0], BP.D_y) != rotate
+    assert np.array_equal(d_y_j[0], db_y0) and np.array_equal(d_y_j[1], db_y1)
+    d_x0, d_x1, _, _, d_xy0, d_xy1, r_in0, r_in1, k0, k1 = funshade.setup(K, l, theta_fp, d_y=(db_y0, db_y1))
+    D_x = funshade.share(K, l, np.tile(x, K), d_x0 + d_x1)
+    z_hat_0 = funshade.eval_dist(K, l, 0, r_in0, D_x, D_y_j[0], d_x0, d_y_j[0], d_xy0)
+    z_hat_1 = funshade.eval_dist(K, l, 1, r_in1, D_x, D_y_j[1], d_x1, d_y_j[1], d_xy1)
+    assert np.array_equal(funshade.eval_sign(K, 0, k0, z_hat_0, z_hat_1) + funshade.eval_sign(K, 1, k1, z_hat_0, z_hat_1), o)
+
+# Exchange of z_hat over a shared-memory channel, without copies: each party
+#  computes z_hat_j into the channel and evaluates the peer's z_hat in place
+BP.chan   = funshade.Channel(capacity=8*K*funshade.DTYPE().itemsize)
+Gate.chan = funshade.Channel(fd=BP.chan.fileno())                 # co-located peer joins
+z_hat_chan = {}
+for p in (BP, Gate):
+    z_hat_chan[p.j] = funshade.eval_dist(K, l, p.j, p.r_in_j, p.D_x, p.D_y, p.d_x_j, p.d_y_j, p.d_xy_j,
+                                         out=p.chan.reserve(K))
+    p.chan.commit()
+z_hat_0, z_hat_1 = Gate.chan.recv(), BP.chan.recv()
+assert np.array_equal(z_hat_0, BP.z_hat_j) and np.array_equal(z_hat_1, Gate.z_hat_j)
+o_chan = funshade.eval_sign(K, BP.j, BP.k_j, z_hat_chan[BP.j], z_hat_1) + \
+         funshade.eval_sign(K, Gate.j, Gate.k_j, z_hat_0, z_hat_chan[Gate.j])
+assert np.array_equal(o_chan, o)
+Gate.chan.release(); BP.chan.release()
+assert BP.chan.recv(timeout=1) is None
+Gate.chan.close()
+assert BP.chan.recv() is None                                      # peer closed
+BP.chan.close()
+assert np.array_equal(z_hat_chan[BP.j], BP.z_hat_j)               # still mapped while viewed
+
+# The C timings of the benchmark (bench.py) run on the same functions
+assert all(funshade.bench_c(fn, 10, 8, 2).shape == (2,) for fn in funshade.BENCH_FUNCTIONS)
+
 #%%
 #==============================================================================#
 #                              CHECK CORRECTNESS                               #